@@ -173,15 +173,96 @@ send_init_command (CockpitTransport *transport,
   g_bytes_unref (bytes);
 }
 
-static GSubprocess *
-start_helper_process (const gchar * const  *argv,
+static gint64 startup_trace_start = 0;
+
+static void
+startup_trace (const gchar *phase)
+{
+  static gint64 last = 0;
+  gint64 now;
+
+  if (!startup_trace_start)
+    return;
+
+  now = g_get_monotonic_time ();
+  if (!last)
+    last = startup_trace_start;
+
+  g_printerr ("cockpit-bridge: startup: %-16s %8.3f ms (+%.3f ms)\n", phase,
+              (now - startup_trace_start) / 1000.0, (now - last) / 1000.0);
+  last = now;
+}
+
+/*
+ * The helper daemons are launched together and their addresses are
+ * read asynchronously, so that they start up while we do other work.
+ */
+typedef struct {
+  const gchar *socket_pattern;
+  const gchar *socket_envvar;
+  gchar *name;
+  GSubprocess *process;
+  GDataInputStream *stream;
+  gboolean pending;
+} HelperProcess;
+
+static void
+helper_process_failed (HelperProcess *helper)
+{
+  g_subprocess_force_exit (helper->process);
+  g_clear_object (&helper->process);
+}
+
+static void
+on_helper_read_line (GObject *source,
+                     GAsyncResult *result,
+                     gpointer user_data)
+{
+  HelperProcess *helper = user_data;
+  g_autoptr(GError) error = NULL;
+
+  helper->pending = FALSE;
+
+  /* get the first line of output to figure out the socket address */
+  g_autofree gchar *first_line = g_data_input_stream_read_line_finish (helper->stream, result, NULL, &error);
+  g_clear_object (&helper->stream);
+
+  if (!first_line)
+    {
+      g_warning ("couldn't read address from %s: %s", helper->name,
+                 error ? error->message : "unexpected end of output");
+      helper_process_failed (helper);
+      return;
+    }
+
+  g_autoptr(GRegex) regex = g_regex_new (helper->socket_pattern, G_REGEX_RAW, 0, &error);
+  g_assert_no_error (error);
+
+  g_autoptr(GMatchInfo) info = NULL;
+  if (!g_regex_match (regex, first_line, 0, &info))
+    {
+      g_warning ("output from %s didn't match expected pattern %s", helper->name, helper->socket_pattern);
+      helper_process_failed (helper);
+      return;
+    }
+
+  g_autofree gchar *socket_address = g_match_info_fetch (info, 1);
+  cockpit_setenv_check (helper->socket_envvar, socket_address, TRUE);
+
+  g_debug ("%s is ready", helper->name);
+  startup_trace (helper->name);
+}
+
+static void
+start_helper_process (HelperProcess *helper,
+                      const gchar * const  *argv,
                       const gchar          *socket_pattern,
                       const gchar          *socket_envvar)
 {
   {
     const gchar *env = g_getenv (socket_envvar);
     if (env && env[0])
-      return NULL;
+      return;
   }
 
   g_autoptr(GError) error = NULL;
@@ -197,50 +278,45 @@ start_helper_process (const gchar * const  *argv,
         g_debug ("couldn't start %s: %s", argv[0], error->message);
       else
         g_message ("couldn't start %s: %s", argv[0], error->message);
-      return NULL;
+      return;
     }
 
   g_debug ("launched %s: %s", argv[0], g_subprocess_get_identifier (process));
 
-  /* get the first line of output to figure out the socket address */
-  g_autoptr (GDataInputStream) stream = g_data_input_stream_new (g_subprocess_get_stdout_pipe (process));
-  g_autofree gchar *first_line = g_data_input_stream_read_line (stream, NULL, NULL, &error);
-  if (!first_line)
-    {
-      g_warning ("couldn't read address from %s: %s", argv[0], error->message);
-      g_subprocess_force_exit (process);
-      return NULL;
-    }
+  helper->name = g_strdup (argv[0]);
+  helper->socket_pattern = socket_pattern;
+  helper->socket_envvar = socket_envvar;
+  helper->process = g_steal_pointer (&process);
+  helper->stream = g_data_input_stream_new (g_subprocess_get_stdout_pipe (helper->process));
+  helper->pending = TRUE;
 
-  g_autoptr(GRegex) regex = g_regex_new (socket_pattern, G_REGEX_RAW, 0, &error);
-  g_assert_no_error (error);
-
-  g_autoptr(GMatchInfo) info = NULL;
-  if (!g_regex_match (regex, first_line, 0, &info))
-    {
-      g_warning ("output from %s didn't match expected pattern %s", argv[0], socket_pattern);
-      g_subprocess_force_exit (process);
-      return NULL;
-    }
+  g_data_input_stream_read_line_async (helper->stream, G_PRIORITY_DEFAULT, NULL,
+                                       on_helper_read_line, helper);
+}
 
-  g_autofree gchar *socket_address = g_match_info_fetch (info, 1);
-  cockpit_setenv_check (socket_envvar, socket_address, TRUE);
+static void
+stop_helper_process (HelperProcess *helper)
+{
+  g_assert (!helper->pending);
 
-  return g_steal_pointer (&process);
+  if (helper->process)
+    g_subprocess_send_signal (helper->process, SIGTERM);
+  g_clear_object (&helper->process);
+  g_free (helper->name);
 }
 
-static GSubprocess *
-start_dbus_daemon (void)
+static void
+start_dbus_daemon (HelperProcess *helper)
 {
   const char * const cmd[] = { "dbus-daemon", "--print-address", "--session", NULL };
-  return start_helper_process (cmd, "^(.*)$", "DBUS_SESSION_BUS_ADDRESS");
+  start_helper_process (helper, cmd, "^(.*)$", "DBUS_SESSION_BUS_ADDRESS");
 }
 
-static GSubprocess *
-start_ssh_agent (void)
+static void
+start_ssh_agent (HelperProcess *helper)
 {
   const char * const cmd[] = { "ssh-agent", "-s", "-D", NULL };
-  return start_helper_process (cmd, "SSH_AUTH_SOCK=([^;]*);", "SSH_AUTH_SOCK");
+  start_helper_process (helper, cmd, "SSH_AUTH_SOCK=([^;]*);", "SSH_AUTH_SOCK");
 }
 
 static gboolean
@@ -294,8 +370,6 @@ setup_router (CockpitTransport *transport,
 {
   CockpitRouter *router = NULL;
 
-  packages = cockpit_packages_new ();
-
   router = cockpit_router_new (transport, payload_types, NULL);
   add_router_channels (router);
 
@@ -319,6 +393,37 @@ call_update_router (gconstpointer user_data)
   update_router (data->router, data->privileged_peer);
 }
 
+/* Callbacks for cockpit_dbus_internal_defer() */
+static void
+defer_user_startup (gpointer data)
+{
+  cockpit_dbus_user_startup (data);
+}
+
+static void
+defer_process_startup (gpointer data)
+{
+  cockpit_dbus_process_startup ();
+}
+
+static void
+defer_machines_startup (gpointer data)
+{
+  cockpit_dbus_machines_startup ();
+}
+
+static void
+defer_config_startup (gpointer data)
+{
+  cockpit_dbus_config_startup ();
+}
+
+static void
+defer_login_messages_startup (gpointer data)
+{
+  cockpit_dbus_login_messages_startup ();
+}
+
 static int
 run_bridge (const gchar *interactive,
             gboolean privileged_peer)
@@ -330,8 +435,8 @@ run_bridge (const gchar *interactive,
   gboolean closed = FALSE;
   const gchar *directory;
   struct passwd *pwd;
-  g_autoptr (GSubprocess) dbus_daemon_process = NULL;
-  g_autoptr (GSubprocess) ssh_agent_process = NULL;
+  HelperProcess dbus_daemon = { NULL, };
+  HelperProcess ssh_agent = { NULL, };
   guint sig_term;
   guint sig_int;
   uid_t uid;
@@ -375,14 +480,27 @@ run_bridge (const gchar *interactive,
   /* Start daemons if necessary */
   if (!interactive && !privileged_peer)
     {
-      dbus_daemon_process = start_dbus_daemon ();
-      ssh_agent_process = start_ssh_agent ();
+      start_dbus_daemon (&dbus_daemon);
+      start_ssh_agent (&ssh_agent);
+      startup_trace ("helpers-launched");
     }
 
   sig_term = g_unix_signal_add (SIGTERM, on_signal_done, &terminated);
   sig_int = g_unix_signal_add (SIGINT, on_signal_done, &interrupted);
 
   cockpit_dbus_internal_startup (interactive != NULL);
+  startup_trace ("dbus-internal");
+
+  packages = cockpit_packages_new ();
+  startup_trace ("packages");
+
+  /*
+   * Anything we spawn later needs to see the addresses of the helpers in
+   * the environment. Wait for them before we start listening to our peer.
+   */
+  while (dbus_daemon.pending || ssh_agent.pending)
+    g_main_context_iteration (NULL, TRUE);
+  startup_trace ("helpers-ready");
 
   if (interactive)
     {
@@ -395,6 +513,7 @@ run_bridge (const gchar *interactive,
     }
 
   router = setup_router (transport, privileged_peer);
+  startup_trace ("router");
 
 #ifdef WITH_POLKIT
   gpointer polkit_agent = NULL;
@@ -408,23 +527,29 @@ run_bridge (const gchar *interactive,
   g_resources_register (cockpitassets_get_resource ());
   cockpit_web_failure_resource = "/org/cockpit-project/Cockpit/fail.html";
 
-  cockpit_dbus_user_startup (pwd);
-  cockpit_dbus_process_startup ();
-  cockpit_dbus_machines_startup ();
-  cockpit_dbus_config_startup ();
+  /* This consumes the memfd and its environment variable right away, so
+   * that nothing we spawn from here on inherits them */
+  cockpit_dbus_login_messages_read ();
+
+  /* These are only registered once a channel talks to the internal bus */
+  cockpit_dbus_internal_defer (defer_user_startup, pwd);
+  cockpit_dbus_internal_defer (defer_process_startup, NULL);
+  cockpit_dbus_internal_defer (defer_machines_startup, NULL);
+  cockpit_dbus_internal_defer (defer_config_startup, NULL);
+  cockpit_dbus_internal_defer (defer_login_messages_startup, NULL);
+
+  /* These emit signals as things change, so need to be around early */
   cockpit_packages_dbus_startup (packages);
-  cockpit_dbus_login_messages_startup ();
   cockpit_router_dbus_startup (router);
+  startup_trace ("dbus-services");
 
   call_update_router_data.router = router;
   call_update_router_data.privileged_peer = privileged_peer;
   cockpit_packages_on_change (packages, call_update_router, &call_update_router_data);
 
-  g_free (pwd);
-  pwd = NULL;
-
   g_signal_connect (transport, "closed", G_CALLBACK (on_closed_set_flag), &closed);
   send_init_command (transport, interactive ? TRUE : FALSE);
+  startup_trace ("init");
 
   while (!terminated && !closed && !interrupted)
     g_main_context_iteration (NULL, TRUE);
@@ -442,10 +567,11 @@ run_bridge (const gchar *interactive,
   cockpit_dbus_machines_cleanup ();
   cockpit_dbus_internal_cleanup ();
 
-  if (dbus_daemon_process)
-    g_subprocess_send_signal (dbus_daemon_process, SIGTERM);
-  if (ssh_agent_process)
-    g_subprocess_send_signal (ssh_agent_process, SIGTERM);
+  /* Deferred startup of the user object may have needed this */
+  g_free (pwd);
+
+  stop_helper_process (&dbus_daemon);
+  stop_helper_process (&ssh_agent);
 
   g_source_remove (sig_term);
   g_source_remove (sig_int);
@@ -475,6 +601,7 @@ print_rules (gboolean opt_privileged)
   CockpitRouter *router = NULL;
   CockpitTransport *transport = cockpit_interact_transport_new (0, 1, "--");
 
+  packages = cockpit_packages_new ();
   router = setup_router (transport, opt_privileged);
 
   cockpit_router_dump_rules (router);
@@ -522,12 +649,14 @@ main (int argc,
 {
   GOptionContext *context;
   GError *error = NULL;
+  gint64 started;
   int ret;
 
   static gboolean opt_packages = FALSE;
   static gboolean opt_rules = FALSE;
   static gboolean opt_privileged = FALSE;
   static gboolean opt_version = FALSE;
+  static gboolean opt_startup_trace = FALSE;
   static gchar *opt_interactive = NULL;
 
   static GOptionEntry entries[] = {
@@ -536,9 +665,12 @@ main (int argc,
     { "packages", 0, 0, G_OPTION_ARG_NONE, &opt_packages, "Show Cockpit package information", NULL },
     { "rules", 0, 0, G_OPTION_ARG_NONE, &opt_rules, "Show Cockpit bridge rules", NULL },
     { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Show Cockpit version information", NULL },
+    { "startup-trace", 0, 0, G_OPTION_ARG_NONE, &opt_startup_trace, "Log timings of startup phases", NULL },
     { NULL }
   };
 
+  started = g_get_monotonic_time ();
+
   signal (SIGPIPE, SIG_IGN);
 
   /* Debugging issues during testing */
@@ -648,6 +780,12 @@ main (int argc,
       return 2;
     }
 
+  if (opt_startup_trace)
+    {
+      startup_trace_start = started;
+      startup_trace ("options");
+    }
+
   ret = run_bridge (opt_interactive, opt_privileged);
 
   if (packages)
@@ -0,0 +1,53 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitchannelsamples.h"
+
+#include "common/cockpitchannelstats.h"
+
+/* Channel telemetry of this bridge, with the payload type as instance */
+
+static void
+sample_channel_stats (gpointer data,
+                      gpointer user_data)
+{
+  CockpitChannelStats *stats = data;
+  CockpitSamples *samples = user_data;
+  const gchar *instance = stats->payload;
+
+  cockpit_samples_sample (samples, "bridge.channel.opened", instance, stats->opened + stats->routed);
+  cockpit_samples_sample (samples, "bridge.channel.active", instance, stats->active);
+  cockpit_samples_sample (samples, "bridge.channel.failed", instance, stats->failed);
+  cockpit_samples_sample (samples, "bridge.channel.rx", instance, stats->bytes_in);
+  cockpit_samples_sample (samples, "bridge.channel.tx", instance, stats->bytes_out);
+  cockpit_samples_sample (samples, "bridge.channel.rx-frames", instance, stats->frames_in);
+  cockpit_samples_sample (samples, "bridge.channel.tx-frames", instance, stats->frames_out);
+  cockpit_samples_sample (samples, "bridge.channel.ready-p95", instance,
+                          cockpit_histogram_percentile (&stats->ready, 0.95) / 1000);
+  cockpit_samples_sample (samples, "bridge.channel.pressure", instance, stats->pressure.total / 1000);
+  cockpit_samples_sample (samples, "bridge.channel.throttled", instance, stats->throttled.total / 1000);
+}
+
+void
+cockpit_channel_samples (CockpitSamples *samples)
+{
+  cockpit_channel_stats_foreach (sample_channel_stats, samples);
+}
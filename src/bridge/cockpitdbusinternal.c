@@ -26,10 +26,54 @@ static GDBusConnection *the_server = NULL;
 static GDBusConnection *the_client = NULL;
 const gchar *the_name = NULL;
 
+typedef struct {
+  void (* startup) (gpointer user_data);
+  gpointer user_data;
+} DeferredStartup;
+
+static GQueue deferred = G_QUEUE_INIT;
+
+static void
+run_deferred_startup (void)
+{
+  DeferredStartup *def;
+
+  while ((def = g_queue_pop_head (&deferred)))
+    {
+      def->startup (def->user_data);
+      g_free (def);
+    }
+}
+
+/*
+ * Services on the internal bus are only registered once something
+ * actually wants to talk to them. Anything that does so gets the
+ * client connection from us, so that's where we run them.
+ */
+void
+cockpit_dbus_internal_defer (void (* startup) (gpointer user_data),
+                             gpointer user_data)
+{
+  DeferredStartup *def;
+
+  /* When on the session bus, other processes can see us at any time */
+  if (the_client == NULL || the_client == the_server)
+    {
+      startup (user_data);
+      return;
+    }
+
+  def = g_new0 (DeferredStartup, 1);
+  def->startup = startup;
+  def->user_data = user_data;
+  g_queue_push_tail (&deferred, def);
+}
+
 GDBusConnection *
 cockpit_dbus_internal_client (void)
 {
   g_return_val_if_fail (the_client != NULL, NULL);
+  run_deferred_startup ();
   return g_object_ref (the_client);
 }
 
@@ -121,6 +165,8 @@ cockpit_dbus_internal_startup (gboolean interact)
 void
 cockpit_dbus_internal_cleanup (void)
 {
+  g_queue_foreach (&deferred, (GFunc)g_free, NULL);
+  g_queue_clear (&deferred);
   g_clear_object (&the_client);
   g_clear_object (&the_server);
 }
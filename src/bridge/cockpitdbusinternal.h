@@ -35,6 +35,9 @@ void                  cockpit_dbus_internal_startup      (gboolean interact);
 
 void                  cockpit_dbus_internal_cleanup      (void);
 
+void                  cockpit_dbus_internal_defer        (void (* startup) (gpointer user_data),
+                                                          gpointer user_data);
+
 void                  cockpit_dbus_user_startup          (struct passwd *pwd);
 
 void                  cockpit_dbus_process_startup       (void);
@@ -45,6 +48,8 @@ void                  cockpit_dbus_machines_cleanup      (void);
 
 void                  cockpit_dbus_config_startup        (void);
 
+void cockpit_dbus_login_messages_read (void);
+
 void cockpit_dbus_login_messages_startup (void);
 
 G_END_DECLS
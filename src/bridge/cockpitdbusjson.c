@@ -1792,6 +1792,39 @@ build_dbus_match (CockpitDBusJson *self,
   return g_string_free (string, FALSE);
 }
 
+/*
+ * Called by the peer's CockpitDBusRules when a bus side match rule needs
+ * to be added. Rules that are covered by a broader one never get here.
+ */
+static void
+on_peer_add_match (const gchar *path,
+                   gboolean is_namespace,
+                   const gchar *interface,
+                   const gchar *signal,
+                   const gchar *arg0,
+                   gpointer user_data)
+{
+  CockpitDBusPeer *peer = user_data;
+  CockpitDBusJson *self = peer->dbus_json;
+  gchar *match;
+
+  match = build_dbus_match (self, peer->name,
+                            is_namespace ? NULL : path,
+                            is_namespace ? path : NULL,
+                            interface, signal, arg0);
+  g_dbus_connection_call (self->connection,
+                          "org.freedesktop.DBus",
+                          "/org/freedesktop/DBus",
+                          "org.freedesktop.DBus",
+                          "AddMatch",
+                          g_variant_new ("(s)", match),
+                          NULL, G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
+                          self->cancellable,
+                          on_add_match_ready,
+                          g_object_ref (self));
+  g_free (match);
+}
+
 static void
 handle_dbus_add_match (CockpitDBusJson *self,
                        JsonObject *object)
@@ -1804,7 +1837,6 @@ handle_dbus_add_match (CockpitDBusJson *self,
   const gchar *interface;
   const gchar *signal;
   const gchar *arg0;
-  gchar *match;
 
   node = json_object_get_member (object, "add-match");
   g_return_if_fail (node != NULL);
@@ -1812,28 +1844,12 @@ handle_dbus_add_match (CockpitDBusJson *self,
   if (!parse_json_rule (self, node, &name, &path, &path_namespace, &interface, &signal, &arg0))
     return;
 
+  /* The bus side match rules follow along via on_peer_add_match() */
   peer = ensure_peer (self, name);
-  if (cockpit_dbus_rules_add (peer->rules,
-                              path ? path : path_namespace,
-                              path_namespace ? TRUE : FALSE,
-                              interface, signal, arg0))
-    {
-      if (peer->name)
-        {
-          match = build_dbus_match (self, name, path, path_namespace, interface, signal, arg0);
-          g_dbus_connection_call (self->connection,
-                                  "org.freedesktop.DBus",
-                                  "/org/freedesktop/DBus",
-                                  "org.freedesktop.DBus",
-                                  "AddMatch",
-                                  g_variant_new ("(s)", match),
-                                  NULL, G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
-                                  self->cancellable,
-                                  on_add_match_ready,
-                                  g_object_ref (self));
-          g_free (match);
-        }
-    }
+  cockpit_dbus_rules_add (peer->rules,
+                          path ? path : path_namespace,
+                          path_namespace ? TRUE : FALSE,
+                          interface, signal, arg0);
 }
 
 static void
@@ -1861,6 +1877,35 @@ on_remove_match_ready (GObject *source,
   g_object_unref (self);
 }
 
+static void
+on_peer_remove_match (const gchar *path,
+                      gboolean is_namespace,
+                      const gchar *interface,
+                      const gchar *signal,
+                      const gchar *arg0,
+                      gpointer user_data)
+{
+  CockpitDBusPeer *peer = user_data;
+  CockpitDBusJson *self = peer->dbus_json;
+  gchar *match;
+
+  match = build_dbus_match (self, peer->name,
+                            is_namespace ? NULL : path,
+                            is_namespace ? path : NULL,
+                            interface, signal, arg0);
+  g_dbus_connection_call (self->connection,
+                          "org.freedesktop.DBus",
+                          "/org/freedesktop/DBus",
+                          "org.freedesktop.DBus",
+                          "RemoveMatch",
+                          g_variant_new ("(s)", match),
+                          NULL, G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
+                          NULL, /* don't cancel removes */
+                          on_remove_match_ready,
+                          g_object_ref (self));
+  g_free (match);
+}
+
 static void
 handle_dbus_remove_match (CockpitDBusJson *self,
                           JsonObject *object)
@@ -1873,7 +1918,6 @@ handle_dbus_remove_match (CockpitDBusJson *self,
   const gchar *interface;
   const gchar *signal;
   const gchar *arg0;
-  gchar *match;
 
   node = json_object_get_member (object, "remove-match");
   g_return_if_fail (node != NULL);
@@ -1882,27 +1926,10 @@ handle_dbus_remove_match (CockpitDBusJson *self,
     return;
 
   peer = ensure_peer (self, name);
-  if (cockpit_dbus_rules_remove (peer->rules,
-                                 path ? path : path_namespace,
-                                 path_namespace ? TRUE : FALSE,
-                                 interface, signal, arg0))
-    {
-      if (peer->name)
-        {
-          match = build_dbus_match (self, name, path, path_namespace, interface, signal, arg0);
-          g_dbus_connection_call (self->connection,
-                                  "org.freedesktop.DBus",
-                                  "/org/freedesktop/DBus",
-                                  "org.freedesktop.DBus",
-                                  "RemoveMatch",
-                                  g_variant_new ("(s)", match),
-                                  NULL, G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
-                                  NULL, /* don't cancel removes */
-                                  on_remove_match_ready,
-                                  g_object_ref (self));
-          g_free (match);
-        }
-    }
+  cockpit_dbus_rules_remove (peer->rules,
+                             path ? path : path_namespace,
+                             path_namespace ? TRUE : FALSE,
+                             interface, signal, arg0);
 }
 
 static void
@@ -2737,6 +2764,10 @@ ensure_peer (CockpitDBusJson *self,
       peer->update_sig = g_signal_connect (peer->cache, "update", G_CALLBACK (on_cache_update), peer);
       peer->rules = cockpit_dbus_rules_new ();
 
+      /* Without a name this is a peer to peer connection, no bus to tell */
+      if (peer->name)
+        cockpit_dbus_rules_set_match_funcs (peer->rules, on_peer_add_match, on_peer_remove_match, peer);
+
       peer->subscribe_id = g_dbus_connection_signal_subscribe (self->connection,
                                                                name,
                                                                NULL, /* interface */
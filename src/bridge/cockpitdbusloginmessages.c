@@ -67,23 +67,25 @@ login_messages_method_call (GDBusConnection       *connection,
 }
 
 void
-cockpit_dbus_login_messages_startup (void)
+cockpit_dbus_login_messages_read (void)
 {
-  static const GDBusInterfaceVTable vtable = {
-    .method_call = login_messages_method_call
-  };
-
   g_autoptr(GError) error = NULL;
 
   /* If we fail to read the messages, log the failure, but otherwise
    * continue to register the service.  We'll return '{}' in that case.
    */
   if (!cockpit_memfd_read_from_envvar (&login_messages, "COCKPIT_LOGIN_MESSAGES_MEMFD", &error))
-    {
-      g_warning ("Unable to read login messages data: %s", error->message);
-      g_clear_error (&error);
-    }
+    g_warning ("Unable to read login messages data: %s", error->message);
+}
 
+void
+cockpit_dbus_login_messages_startup (void)
+{
+  static const GDBusInterfaceVTable vtable = {
+    .method_call = login_messages_method_call
+  };
+
+  g_autoptr(GError) error = NULL;
   g_autoptr(GDBusConnection) connection = cockpit_dbus_internal_server ();
   g_return_if_fail (connection != NULL);
 
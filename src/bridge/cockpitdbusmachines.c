@@ -249,5 +249,5 @@ cockpit_dbus_machines_startup (void)
 void
 cockpit_dbus_machines_cleanup (void)
 {
-  g_object_unref (machines_monitor);
+  g_clear_object (&machines_monitor);
 }
@@ -33,8 +33,17 @@
  * client wanted to subscribe to, and which paths/interfaces a client
  * wanted to watch.
  *
- * We use several speed ups to quickly identify paths that are not matched
- * by the rules ... before then going into matching each rule in turn.
+ * The rules are indexed by path, and by path namespace. Matching looks up
+ * the path and each of its ancestors, and then only checks the handful of
+ * rules found there, rather than every rule in turn.
+ *
+ * When the caller sets match functions, the rules are also compiled into
+ * the smallest set of bus side match rules that cover them all: a rule
+ * that is already covered by a broader rule is not sent to the bus.
+ * That set is kept up to date as rules are added and removed, so that
+ * the bus doesn't wake us up for signals that nobody asked for. Only the
+ * rules that the added or removed rule can cover are looked at: those in
+ * its own path bucket, or for a namespace, the buckets below its path.
  *
  * An empty rule set forwards nothing. It has a fast bypass flag which
  * disables all the logic.
@@ -47,8 +56,14 @@ typedef struct {
   gchar *interface;
   gchar *member;
   gchar *arg0;
+  gboolean installed;
 } RuleData;
 
+typedef struct {
+  gsize len;
+  const gchar *data;
+} PathKey;
+
 static guint32
 rule_hash (gconstpointer data)
 {
@@ -68,7 +83,9 @@ rule_equal (gconstpointer one,
   const RuleData *r2 = two;
   return r1->is_namespace == r2->is_namespace &&
          g_str_equal (r1->path, r2->path) &&
-         g_strcmp0 (r1->interface, r2->interface) == 0;
+         g_strcmp0 (r1->interface, r2->interface) == 0 &&
+         g_strcmp0 (r1->member, r2->member) == 0 &&
+         g_strcmp0 (r1->arg0, r2->arg0) == 0;
 }
 
 static void
@@ -98,13 +115,53 @@ rule_free (gpointer data)
   g_slice_free (RuleData, rule);
 }
 
+/* Path keys can refer to the start of a longer path, without copying */
+static guint
+path_key_hash (gconstpointer data)
+{
+  const PathKey *key = data;
+  guint32 hash = 5381;
+  gsize i;
+
+  for (i = 0; i < key->len; i++)
+    hash = (hash << 5) + hash + (guchar)key->data[i];
+
+  return hash;
+}
+
+static gboolean
+path_key_equal (gconstpointer one,
+                gconstpointer two)
+{
+  const PathKey *k1 = one;
+  const PathKey *k2 = two;
+  return k1->len == k2->len && memcmp (k1->data, k2->data, k1->len) == 0;
+}
+
+static void
+path_key_free (gpointer data)
+{
+  PathKey *key = data;
+  g_free ((gchar *)key->data);
+  g_slice_free (PathKey, key);
+}
+
 struct _CockpitDBusRules {
   GHashTable *all;
+
+  /* PathKey -> GPtrArray of RuleData */
   GHashTable *paths;
-  GTree *path_namespaces;
-  gboolean all_paths;
+  GHashTable *path_namespaces;
+
+  /* Number of rules that check more than the path */
+  guint filtered;
+
   gboolean only_paths;
   gboolean nothing;
+
+  CockpitDBusRulesFunc add_match;
+  CockpitDBusRulesFunc remove_match;
+  gpointer match_data;
 };
 
 gchar *
@@ -115,29 +172,27 @@ cockpit_dbus_rules_to_string (CockpitDBusRules *rules)
   RuleData *rule;
 
   string = g_string_new ("[ ");
-  g_hash_table_iter_init (&iter, rules->all);
-  while (g_hash_table_iter_next (&iter, (gpointer *)&rule, NULL))
+  if (rules->all)
     {
-      rule_dump (rule, string);
-      g_string_append (string, ", ");
+      g_hash_table_iter_init (&iter, rules->all);
+      while (g_hash_table_iter_next (&iter, (gpointer *)&rule, NULL))
+        {
+          rule_dump (rule, string);
+          g_string_append (string, ", ");
+        }
     }
   g_string_append (string, "]");
 
   return g_string_free (string, FALSE);
 }
 
+/* The path has already been matched by the index */
 static gboolean
 rule_match (RuleData *rule,
-            const gchar *path,
             const gchar *interface,
             const gchar *member,
             const gchar *arg0)
 {
-  if (!g_str_equal (rule->path, path))
-    {
-      if (!rule->is_namespace || !cockpit_path_equal_or_ancestor (path, rule->path))
-        return FALSE;
-    }
   if (interface && rule->interface && strcmp (interface, rule->interface) != 0)
     return FALSE;
   if (member && rule->member && strcmp (member, rule->member) != 0)
@@ -150,6 +205,33 @@ rule_match (RuleData *rule,
   return TRUE;
 }
 
+static gboolean
+bucket_match (CockpitDBusRules *rules,
+              GHashTable *index,
+              PathKey *key,
+              const gchar *interface,
+              const gchar *member,
+              const gchar *arg0)
+{
+  GPtrArray *bucket;
+  guint i;
+
+  bucket = g_hash_table_lookup (index, key);
+  if (!bucket)
+    return FALSE;
+
+  if (rules->only_paths)
+    return TRUE;
+
+  for (i = 0; i < bucket->len; i++)
+    {
+      if (rule_match (bucket->pdata[i], interface, member, arg0))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 gboolean
 cockpit_dbus_rules_match (CockpitDBusRules *rules,
                           const gchar *path,
@@ -157,32 +239,35 @@ cockpit_dbus_rules_match (CockpitDBusRules *rules,
                           const gchar *member,
                           const gchar *arg0)
 {
-  GHashTableIter iter;
-  RuleData *rule;
+  PathKey key;
+  const gchar *pos;
 
   g_return_val_if_fail (path != NULL, FALSE);
 
   if (rules->nothing)
     return FALSE;
 
-  if (!rules->all_paths)
-    {
-      if (!cockpit_paths_contain_or_ancestor (rules->path_namespaces, path) &&
-          !g_hash_table_lookup (rules->paths, path))
-        return FALSE;
-    }
+  key.data = path;
+  key.len = strlen (path);
 
-  if (rules->only_paths)
+  if (bucket_match (rules, rules->paths, &key, interface, member, arg0))
     return TRUE;
 
-  g_hash_table_iter_init (&iter, rules->all);
-  while (g_hash_table_iter_next (&iter, (gpointer *)&rule, NULL))
+  if (g_hash_table_size (rules->path_namespaces) == 0)
+    return FALSE;
+
+  /* Try the path itself and then each of its ancestors */
+  for (;;)
     {
-      if (rule_match (rule, path, interface, member, arg0))
+      if (bucket_match (rules, rules->path_namespaces, &key, interface, member, arg0))
         return TRUE;
+      if (key.len <= 1)
+        return FALSE;
+      pos = memrchr (path, '/', key.len);
+      if (!pos)
+        return FALSE;
+      key.len = (path == pos) ? 1 : (pos - path);
     }
-
-  return FALSE;
 }
 
 CockpitDBusRules *
@@ -213,43 +298,316 @@ rule_lookup (CockpitDBusRules *rules,
   return g_hash_table_lookup (rules->all, &key);
 }
 
+/* Whether every message matched by @rule is also matched by @broader */
+static gboolean
+rule_covers (RuleData *broader,
+             RuleData *rule)
+{
+  if (broader == rule)
+    return FALSE;
+
+  if (broader->is_namespace)
+    {
+      if (!cockpit_path_equal_or_ancestor (rule->path, broader->path))
+        return FALSE;
+    }
+  else
+    {
+      if (rule->is_namespace || !g_str_equal (broader->path, rule->path))
+        return FALSE;
+    }
+
+  if (broader->interface && g_strcmp0 (broader->interface, rule->interface) != 0)
+    return FALSE;
+  if (broader->member && g_strcmp0 (broader->member, rule->member) != 0)
+    return FALSE;
+  if (broader->arg0 && g_strcmp0 (broader->arg0, rule->arg0) != 0)
+    return FALSE;
+
+  return TRUE;
+}
+
 static void
-recompile_rules (CockpitDBusRules *rules)
+call_match_func (CockpitDBusRules *rules,
+                 CockpitDBusRulesFunc func,
+                 RuleData *rule)
+{
+  func (rule->path, rule->is_namespace, rule->interface,
+        rule->member, rule->arg0, rules->match_data);
+}
+
+static gboolean
+bucket_covers (GPtrArray *bucket,
+               RuleData *rule)
+{
+  guint i;
+
+  if (bucket)
+    {
+      for (i = 0; i < bucket->len; i++)
+        {
+          if (rule_covers (bucket->pdata[i], rule))
+            return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/* Only rules at the same path, or namespaces at an ancestor, can cover a rule */
+static gboolean
+rule_is_covered (CockpitDBusRules *rules,
+                 RuleData *rule)
+{
+  PathKey key = { strlen (rule->path), rule->path };
+  const gchar *pos;
+
+  if (!rule->is_namespace && bucket_covers (g_hash_table_lookup (rules->paths, &key), rule))
+    return TRUE;
+
+  for (;;)
+    {
+      if (bucket_covers (g_hash_table_lookup (rules->path_namespaces, &key), rule))
+        return TRUE;
+      if (key.len <= 1)
+        return FALSE;
+      pos = memrchr (rule->path, '/', key.len);
+      if (!pos)
+        return FALSE;
+      key.len = (rule->path == pos) ? 1 : (pos - rule->path);
+    }
+}
+
+static void
+collect_bucket (GPtrArray *bucket,
+                RuleData *broader,
+                GPtrArray *covered)
+{
+  guint i;
+
+  if (bucket)
+    {
+      for (i = 0; i < bucket->len; i++)
+        {
+          if (rule_covers (broader, bucket->pdata[i]))
+            g_ptr_array_add (covered, bucket->pdata[i]);
+        }
+    }
+}
+
+static void
+collect_index (GHashTable *index,
+               RuleData *broader,
+               GPtrArray *covered)
 {
   GHashTableIter iter;
-  RuleData *rule;
+  GPtrArray *bucket;
+  PathKey *key;
 
-  if (rules->paths)
-    g_hash_table_remove_all (rules->paths);
+  g_hash_table_iter_init (&iter, index);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&key, (gpointer *)&bucket))
+    {
+      if (cockpit_path_equal_or_ancestor (key->data, broader->path))
+        collect_bucket (bucket, broader, covered);
+    }
+}
+
+/* All the rules that @broader covers */
+static GPtrArray *
+collect_covered (CockpitDBusRules *rules,
+                 RuleData *broader)
+{
+  PathKey key = { strlen (broader->path), broader->path };
+  GPtrArray *covered = g_ptr_array_new ();
+
+  if (broader->is_namespace)
+    {
+      collect_index (rules->paths, broader, covered);
+      collect_index (rules->path_namespaces, broader, covered);
+    }
   else
-    rules->paths = g_hash_table_new (g_str_hash, g_str_equal);
-  if (rules->path_namespaces)
-    g_tree_destroy (rules->path_namespaces);
-  rules->path_namespaces = cockpit_paths_new ();
+    collect_bucket (g_hash_table_lookup (rules->paths, &key), broader, covered);
 
-  rules->all_paths = FALSE;
-  rules->nothing = TRUE;
-  rules->only_paths = TRUE;
+  return covered;
+}
 
-  g_hash_table_iter_init (&iter, rules->all);
-  while (g_hash_table_iter_next (&iter, (gpointer *)&rule, NULL))
+static void
+call_match_funcs (CockpitDBusRules *rules,
+                  GPtrArray *added,
+                  GPtrArray *removed)
+{
+  guint i;
+
+  /*
+   * New matches are added before old ones are removed, so that no
+   * signals are lost while a broader rule replaces narrower ones.
+   */
+  for (i = 0; i < added->len; i++)
+    call_match_func (rules, rules->add_match, added->pdata[i]);
+  for (i = 0; i < removed->len; i++)
+    call_match_func (rules, rules->remove_match, removed->pdata[i]);
+}
+
+/*
+ * A new rule goes on the bus unless something covers it already, and
+ * takes the place of the rules on the bus that it covers. A rule that
+ * was covered before stays covered, so nothing else changes.
+ */
+static void
+update_matches_added (CockpitDBusRules *rules,
+                      RuleData *rule)
+{
+  GPtrArray *added;
+  GPtrArray *removed;
+  GPtrArray *covered;
+  RuleData *narrower;
+  guint i;
+
+  added = g_ptr_array_new ();
+  removed = g_ptr_array_new ();
+
+  rule->installed = !rule_is_covered (rules, rule);
+  if (rule->installed)
     {
-      rules->nothing = FALSE;
+      g_ptr_array_add (added, rule);
 
-      if (rule->is_namespace)
+      covered = collect_covered (rules, rule);
+      for (i = 0; i < covered->len; i++)
         {
-          if (g_str_equal (rule->path, "/"))
-            rules->all_paths = TRUE;
-          cockpit_paths_add (rules->path_namespaces, rule->path);
+          narrower = covered->pdata[i];
+          if (narrower->installed)
+            {
+              narrower->installed = FALSE;
+              g_ptr_array_add (removed, narrower);
+            }
         }
-      else
+      g_ptr_array_free (covered, TRUE);
+    }
+
+  call_match_funcs (rules, added, removed);
+
+  g_ptr_array_free (added, TRUE);
+  g_ptr_array_free (removed, TRUE);
+}
+
+/*
+ * The rules that a removed rule covered may need to go on the bus now.
+ * The removed rule must no longer be in the index.
+ */
+static void
+update_matches_removed (CockpitDBusRules *rules,
+                        RuleData *gone)
+{
+  GPtrArray *added;
+  GPtrArray *removed;
+  GPtrArray *covered;
+  RuleData *narrower;
+  guint i;
+
+  added = g_ptr_array_new ();
+  removed = g_ptr_array_new ();
+
+  if (gone->installed)
+    {
+      g_ptr_array_add (removed, gone);
+
+      covered = collect_covered (rules, gone);
+      for (i = 0; i < covered->len; i++)
         {
-          g_hash_table_add (rules->paths, rule->path);
+          narrower = covered->pdata[i];
+          if (!narrower->installed && !rule_is_covered (rules, narrower))
+            {
+              narrower->installed = TRUE;
+              g_ptr_array_add (added, narrower);
+            }
         }
+      g_ptr_array_free (covered, TRUE);
+    }
 
-      if (rule->interface || rule->member || rule->arg0)
-        rules->only_paths = FALSE;
+  call_match_funcs (rules, added, removed);
+
+  g_ptr_array_free (added, TRUE);
+  g_ptr_array_free (removed, TRUE);
+}
+
+static void
+index_rule (GHashTable *index,
+            RuleData *rule)
+{
+  PathKey lookup = { strlen (rule->path), rule->path };
+  GPtrArray *bucket;
+  PathKey *key;
+
+  bucket = g_hash_table_lookup (index, &lookup);
+  if (!bucket)
+    {
+      key = g_slice_new (PathKey);
+      key->len = lookup.len;
+      key->data = g_strdup (rule->path);
+      bucket = g_ptr_array_new ();
+      g_hash_table_insert (index, key, bucket);
     }
+
+  g_ptr_array_add (bucket, rule);
+}
+
+static void
+unindex_rule (GHashTable *index,
+              RuleData *rule)
+{
+  PathKey lookup = { strlen (rule->path), rule->path };
+  GPtrArray *bucket;
+
+  bucket = g_hash_table_lookup (index, &lookup);
+  g_return_if_fail (bucket != NULL);
+
+  g_ptr_array_remove_fast (bucket, rule);
+  if (bucket->len == 0)
+    g_hash_table_remove (index, &lookup);
+}
+
+static gboolean
+rule_is_filtered (RuleData *rule)
+{
+  return rule->interface || rule->member || rule->arg0;
+}
+
+static void
+compile_rule (CockpitDBusRules *rules,
+              RuleData *rule)
+{
+  if (!rules->paths)
+    {
+      rules->paths = g_hash_table_new_full (path_key_hash, path_key_equal,
+                                            path_key_free, (GDestroyNotify)g_ptr_array_unref);
+      rules->path_namespaces = g_hash_table_new_full (path_key_hash, path_key_equal,
+                                                      path_key_free, (GDestroyNotify)g_ptr_array_unref);
+    }
+
+  index_rule (rule->is_namespace ? rules->path_namespaces : rules->paths, rule);
+  if (rule_is_filtered (rule))
+    rules->filtered++;
+
+  rules->nothing = FALSE;
+  rules->only_paths = (rules->filtered == 0);
+
+  if (rules->add_match)
+    update_matches_added (rules, rule);
+}
+
+static void
+uncompile_rule (CockpitDBusRules *rules,
+                RuleData *gone)
+{
+  unindex_rule (gone->is_namespace ? rules->path_namespaces : rules->paths, gone);
+  if (rule_is_filtered (gone))
+    rules->filtered--;
+
+  rules->nothing = (g_hash_table_size (rules->all) == 0);
+  rules->only_paths = (rules->filtered == 0);
+
+  if (rules->add_match)
+    update_matches_removed (rules, gone);
 }
 
 gboolean
@@ -284,7 +642,7 @@ cockpit_dbus_rules_add (CockpitDBusRules *rules,
       rule->member = g_strdup (member);
       rule->arg0 = g_strdup (arg0);
       g_hash_table_add (rules->all, rule);
-      recompile_rules (rules);
+      compile_rule (rules, rule);
       return TRUE;
     }
   else
@@ -320,14 +678,55 @@ cockpit_dbus_rules_remove (CockpitDBusRules *rules,
   rule->refs--;
   if (rule->refs == 0)
     {
-      g_hash_table_remove (rules->all, rule);
-      recompile_rules (rules);
+      /* Keep it around until the bus has been told */
+      g_hash_table_steal (rules->all, rule);
+      uncompile_rule (rules, rule);
+      rule_free (rule);
       return TRUE;
     }
 
   return FALSE;
 }
 
+/**
+ * cockpit_dbus_rules_set_match_funcs:
+ * @rules: the rules
+ * @add_match: called when a match rule should be added to the bus
+ * @remove_match: called when a match rule should be removed from the bus
+ * @user_data: passed to the functions
+ *
+ * Keep a minimal set of bus side match rules in sync with these rules.
+ * Rules that are covered by a broader rule are not passed on. Any
+ * current rules are passed to @add_match right away.
+ */
+void
+cockpit_dbus_rules_set_match_funcs (CockpitDBusRules *rules,
+                                    CockpitDBusRulesFunc add_match,
+                                    CockpitDBusRulesFunc remove_match,
+                                    gpointer user_data)
+{
+  GHashTableIter iter;
+  RuleData *rule;
+
+  g_return_if_fail (add_match != NULL);
+  g_return_if_fail (remove_match != NULL);
+
+  rules->add_match = add_match;
+  rules->remove_match = remove_match;
+  rules->match_data = user_data;
+
+  if (rules->all)
+    {
+      g_hash_table_iter_init (&iter, rules->all);
+      while (g_hash_table_iter_next (&iter, (gpointer *)&rule, NULL))
+        {
+          rule->installed = !rule_is_covered (rules, rule);
+          if (rule->installed)
+            call_match_func (rules, rules->add_match, rule);
+        }
+    }
+}
+
 void
 cockpit_dbus_rules_free (CockpitDBusRules *rules)
 {
@@ -336,6 +735,6 @@ cockpit_dbus_rules_free (CockpitDBusRules *rules)
   if (rules->paths)
     g_hash_table_destroy (rules->paths);
   if (rules->path_namespaces)
-    g_tree_destroy (rules->path_namespaces);
+    g_hash_table_destroy (rules->path_namespaces);
   g_free (rules);
 }
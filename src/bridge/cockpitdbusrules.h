@@ -24,6 +24,13 @@
 
 typedef struct _CockpitDBusRules CockpitDBusRules;
 
+typedef void        (* CockpitDBusRulesFunc)       (const gchar *path,
+                                                    gboolean is_namespace,
+                                                    const gchar *interface,
+                                                    const gchar *member,
+                                                    const gchar *arg0,
+                                                    gpointer user_data);
+
 CockpitDBusRules *  cockpit_dbus_rules_new         (void);
 
 gboolean            cockpit_dbus_rules_match       (CockpitDBusRules *rules,
@@ -46,6 +53,11 @@ gboolean            cockpit_dbus_rules_remove      (CockpitDBusRules *rules,
                                                     const gchar *member,
                                                     const gchar *arg0);
 
+void                cockpit_dbus_rules_set_match_funcs (CockpitDBusRules *rules,
+                                                        CockpitDBusRulesFunc add_match,
+                                                        CockpitDBusRulesFunc remove_match,
+                                                        gpointer user_data);
+
 gchar *             cockpit_dbus_rules_to_string   (CockpitDBusRules *rules);
 
 void                cockpit_dbus_rules_free        (CockpitDBusRules *rules);
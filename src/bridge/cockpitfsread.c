@@ -21,9 +21,9 @@
 
 #include "cockpitfsread.h"
 
+#include "common/cockpitfileio.h"
 #include "common/cockpitflow.h"
 #include "common/cockpitjson.h"
-#include "common/cockpitpipe.h"
 
 #include <sys/wait.h>
 #include <sys/types.h>
@@ -39,6 +39,9 @@
  *
  * A #CockpitChannel that reads the content of a file.
  *
+ * The file is read off the main loop by a #CockpitFileIO, so that
+ * a slow disk doesn't hold up the other channels.
+ *
  * The payload type for this channel is 'fsread1'.
  */
 
@@ -50,11 +53,10 @@ typedef struct {
   gchar *start_tag;
   int fd;
 
-  CockpitPipe *pipe;
-  gboolean open;
+  CockpitFileIO *io;
   gboolean closing;
   guint sig_read;
-  guint sig_close;
+  guint sig_done;
 } CockpitFsread;
 
 typedef struct {
@@ -114,14 +116,11 @@ cockpit_fsread_close (CockpitChannel *channel,
 
   self->closing = TRUE;
 
-  /*
-   * If closed, call base class handler directly. Otherwise ask
-   * our pipe to close first, which will come back here.
-  */
-  if (self->open)
-    cockpit_pipe_close (self->pipe, problem);
-  else
-    COCKPIT_CHANNEL_CLASS (cockpit_fsread_parent_class)->close (channel, problem);
+  /* Stops any further reading, and closes the file */
+  if (self->io)
+    cockpit_file_io_close (self->io);
+
+  COCKPIT_CHANNEL_CLASS (cockpit_fsread_parent_class)->close (channel, problem);
 }
 
 static void
@@ -131,60 +130,59 @@ cockpit_fsread_init (CockpitFsread *self)
 }
 
 static void
-on_pipe_read (CockpitPipe *pipe,
-              GByteArray *data,
-              gboolean end_of_data,
-              gpointer user_data)
+on_io_read (CockpitFileIO *io,
+            GBytes *block,
+            gpointer user_data)
+{
+  CockpitChannel *channel = user_data;
+  cockpit_channel_send (channel, block, FALSE);
+}
+
+static void
+on_io_done (CockpitFileIO *io,
+            gint error,
+            const gchar *diagnostic,
+            gpointer user_data)
 {
   CockpitFsread *self = user_data;
   CockpitChannel *channel = user_data;
   const gchar *problem;
   JsonObject *options;
-  GBytes *message;
   gchar *tag;
 
-  if (data->len)
+  if (error)
     {
-      /* When array is reffed, this just clears byte array */
-      g_byte_array_ref (data);
-      message = g_byte_array_free_to_bytes (data);
-      cockpit_channel_send (channel, message, FALSE);
-      g_bytes_unref (message);
+      if (error == EPERM || error == EACCES)
+        {
+          g_debug ("%s: %s: %s", self->path, diagnostic, strerror (error));
+          cockpit_channel_close (channel, "access-denied");
+        }
+      else
+        {
+          cockpit_channel_fail (channel, "internal-error",
+                                "%s: %s: %s", self->path, diagnostic, strerror (error));
+        }
+      return;
     }
 
-  if (end_of_data)
-    {
-      cockpit_channel_control (channel, "done", NULL);
+  cockpit_channel_control (channel, "done", NULL);
 
-      problem = NULL;
-      if (self->fd >= 0 && self->start_tag)
+  problem = NULL;
+  if (self->fd >= 0 && self->start_tag)
+    {
+      tag = cockpit_get_file_tag_from_fd (self->fd);
+      if (g_strcmp0 (tag, self->start_tag) == 0)
         {
-          tag = cockpit_get_file_tag_from_fd (self->fd);
-          if (g_strcmp0 (tag, self->start_tag) == 0)
-            {
-              options = cockpit_channel_close_options (channel);
-              json_object_set_string_member (options, "tag", tag);
-            }
-          else
-            {
-              problem = "change-conflict";
-            }
-          g_free (tag);
+          options = cockpit_channel_close_options (channel);
+          json_object_set_string_member (options, "tag", tag);
         }
-
-      cockpit_channel_close (channel, problem);
+      else
+        {
+          problem = "change-conflict";
+        }
+      g_free (tag);
     }
-}
 
-static void
-on_pipe_close (CockpitPipe *pipe,
-               const gchar *problem,
-               gpointer user_data)
-{
-  CockpitFsread *self = COCKPIT_FSREAD (user_data);
-  CockpitChannel *channel = COCKPIT_CHANNEL (user_data);
-
-  self->open = FALSE;
   cockpit_channel_close (channel, problem);
 }
 
@@ -267,22 +265,20 @@ cockpit_fsread_prepare (CockpitChannel *channel)
     }
 
   /* This owns the file descriptor */
-  self->pipe = cockpit_pipe_new (self->path, fd, -1);
+  self->io = cockpit_file_io_new (self->path, fd);
   self->fd = fd;
   fd = -1;
 
   self->start_tag = cockpit_get_file_tag_from_fd (self->fd);
 
-  /* Let the channel throttle the pipe's input flow*/
-  cockpit_flow_throttle (COCKPIT_FLOW (self->pipe), COCKPIT_FLOW (self));
-
-  /* Let the pipe input the channel peer's output flow */
-  cockpit_flow_throttle (COCKPIT_FLOW (channel), COCKPIT_FLOW (self->pipe));
+  /* Let the channel throttle reading the file */
+  cockpit_flow_throttle (COCKPIT_FLOW (self->io), COCKPIT_FLOW (self));
 
-  self->sig_read = g_signal_connect (self->pipe, "read", G_CALLBACK (on_pipe_read), self);
-  self->sig_close = g_signal_connect (self->pipe, "close", G_CALLBACK (on_pipe_close), self);
+  self->sig_read = g_signal_connect (self->io, "read", G_CALLBACK (on_io_read), self);
+  self->sig_done = g_signal_connect (self->io, "done", G_CALLBACK (on_io_done), self);
 
   cockpit_channel_ready (channel, NULL);
+  cockpit_file_io_read (self->io);
 
 out:
   if (fd >= 0)
@@ -294,15 +290,14 @@ cockpit_fsread_dispose (GObject *object)
 {
   CockpitFsread *self = COCKPIT_FSREAD (object);
 
-  if (self->pipe)
+  if (self->io)
     {
-      if (self->open)
-        cockpit_pipe_close (self->pipe, "terminated");
+      cockpit_file_io_close (self->io);
       if (self->sig_read)
-        g_signal_handler_disconnect (self->pipe, self->sig_read);
-      if (self->sig_close)
-        g_signal_handler_disconnect (self->pipe, self->sig_close);
-      self->sig_read = self->sig_close = 0;
+        g_signal_handler_disconnect (self->io, self->sig_read);
+      if (self->sig_done)
+        g_signal_handler_disconnect (self->io, self->sig_done);
+      self->sig_read = self->sig_done = 0;
     }
 
   G_OBJECT_CLASS (cockpit_fsread_parent_class)->dispose (object);
@@ -314,7 +309,7 @@ cockpit_fsread_finalize (GObject *object)
   CockpitFsread *self = COCKPIT_FSREAD (object);
 
   g_free (self->start_tag);
-  g_clear_object (&self->pipe);
+  g_clear_object (&self->io);
 
   G_OBJECT_CLASS (cockpit_fsread_parent_class)->finalize (object);
 }
@@ -22,6 +22,8 @@
 #include "cockpitfsreplace.h"
 #include "cockpitfsread.h"
 
+#include "common/cockpitfileio.h"
+#include "common/cockpitflow.h"
 #include "common/cockpitjson.h"
 
 #include <sys/wait.h>
@@ -37,6 +39,10 @@
  *
  * A #CockpitChannel that writes/replaces the content of a file.
  *
+ * The content is written and synced off the main loop by a
+ * #CockpitFileIO. When the disk can't keep up, its back-pressure
+ * throttles the channel peer.
+ *
  * The payload type for this channel is 'fsreplace1'.
  */
 
@@ -46,10 +52,11 @@ typedef struct {
   CockpitChannel parent;
   const gchar *path;
   gchar *tmp_path;
-  int fd;
+  CockpitFileIO *io;
+  guint sig_done;
   gboolean got_content;
+  gboolean finishing;
   const gchar *expected_tag;
-  guint sig_close;
 } CockpitFsreplace;
 
 typedef struct {
@@ -82,73 +89,33 @@ cockpit_fsreplace_recv (CockpitChannel *channel,
                       GBytes *message)
 {
   CockpitFsreplace *self = COCKPIT_FSREPLACE (channel);
-  gsize size;
-  const char *data = g_bytes_get_data (message, &size);
 
   self->got_content = TRUE;
 
-  while (size > 0)
-    {
-      ssize_t n = write (self->fd, data, size);
-      if (n < 0)
-        {
-          if (errno == EINTR)
-            continue;
-
-          close_with_errno (self, "couldn't write", errno);
-          return;
-        }
-
-      g_return_if_fail (n > 0);
-      size -= n;
-      data += n;
-    }
+  /* Queued, and written in the background */
+  if (self->io)
+    cockpit_file_io_write (self->io, message);
 }
 
-static int
-xfsync (int fd)
-{
-  while (TRUE)
-    {
-      int res = fsync (fd);
-      if (res < 0 && errno == EINTR)
-        continue;
-
-      return res;
-    }
-}
-
-static int
-xclose (int fd)
-{
-  /* http://lkml.indiana.edu/hypermail/linux/kernel/0509.1/0877.html
-   */
-  int res = close (fd);
-  if (res < 0 && errno == EINTR)
-    return 0;
-  else
-    return res;
-}
-
-static gboolean
-cockpit_fsreplace_control (CockpitChannel *channel,
-                           const gchar *command,
-                           JsonObject *unused)
+static void
+on_io_done (CockpitFileIO *io,
+            gint error,
+            const gchar *diagnostic,
+            gpointer user_data)
 {
-  CockpitFsreplace *self = COCKPIT_FSREPLACE (channel);
+  CockpitFsreplace *self = COCKPIT_FSREPLACE (user_data);
+  CockpitChannel *channel = COCKPIT_CHANNEL (user_data);
   gchar *actual_tag = NULL;
   gchar *new_tag = NULL;
   JsonObject *options;
 
-  if (!g_str_equal (command, "done"))
-    return FALSE;
-
   g_object_ref (self);
+  self->finishing = FALSE;
 
   /* Commit the changes when there was no problem  */
-  if (xfsync (self->fd) < 0 || xclose (self->fd) < 0)
+  if (error)
     {
-      close_with_errno (self, "couldn't sync", errno);
+      close_with_errno (self, diagnostic, error);
       goto out;
     }
   else
@@ -191,8 +158,26 @@ cockpit_fsreplace_control (CockpitChannel *channel,
 out:
   g_free (new_tag);
   g_free (actual_tag);
-  self->fd = -1;
   g_object_unref (self);
+}
+
+static gboolean
+cockpit_fsreplace_control (CockpitChannel *channel,
+                           const gchar *command,
+                           JsonObject *unused)
+{
+  CockpitFsreplace *self = COCKPIT_FSREPLACE (channel);
+
+  if (!g_str_equal (command, "done"))
+    return FALSE;
+
+  /* Once everything is written, the file is synced, and then committed */
+  if (self->io && !self->finishing)
+    {
+      self->finishing = TRUE;
+      cockpit_file_io_finish (self->io);
+    }
+
   return TRUE;
 }
 
@@ -202,9 +187,13 @@ cockpit_fsreplace_close (CockpitChannel *channel,
 {
   CockpitFsreplace *self = COCKPIT_FSREPLACE (channel);
 
-  if (self->fd != -1)
-    close (self->fd);
-  self->fd = -1;
+  /* Closing without a problem after "done" waits until the file is committed */
+  if (!problem && self->finishing)
+    return;
+
+  self->finishing = FALSE;
+  if (self->io)
+    cockpit_file_io_close (self->io);
 
   /* Cleanup in case of problem */
   if (problem)
@@ -220,7 +209,6 @@ cockpit_fsreplace_close (CockpitChannel *channel,
 static void
 cockpit_fsreplace_init (CockpitFsreplace *self)
 {
-  self->fd = -1;
 }
 
 static void
@@ -229,6 +217,7 @@ cockpit_fsreplace_prepare (CockpitChannel *channel)
   CockpitFsreplace *self = COCKPIT_FSREPLACE (channel);
   JsonObject *options;
   gchar *actual_tag = NULL;
+  int fd = -1;
 
   COCKPIT_CHANNEL_CLASS (cockpit_fsreplace_parent_class)->prepare (channel);
 
@@ -267,28 +256,55 @@ cockpit_fsreplace_prepare (CockpitChannel *channel)
   for (int i = 1; i < 10000; i++)
     {
       self->tmp_path = g_strdup_printf ("%s.%d", self->path, i);
-      self->fd = open (self->tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
-      if (self->fd >= 0 || errno != EEXIST)
+      fd = open (self->tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+      if (fd >= 0 || errno != EEXIST)
         break;
       g_free (self->tmp_path);
       self->tmp_path = NULL;
     }
 
-  if (self->fd < 0)
-    close_with_errno (self, "couldn't open unique file", errno);
-  else
-    cockpit_channel_ready (channel, NULL);
+  if (fd < 0)
+    {
+      close_with_errno (self, "couldn't open unique file", errno);
+      goto out;
+    }
+
+  /* This owns the file descriptor */
+  self->io = cockpit_file_io_new (self->tmp_path, fd);
+  self->sig_done = g_signal_connect (self->io, "done", G_CALLBACK (on_io_done), self);
+
+  /* Let the disk throttle the channel peer's output flow */
+  cockpit_flow_throttle (COCKPIT_FLOW (channel), COCKPIT_FLOW (self->io));
+
+  cockpit_channel_ready (channel, NULL);
 
 out:
   g_free (actual_tag);
 }
 
+static void
+cockpit_fsreplace_dispose (GObject *object)
+{
+  CockpitFsreplace *self = COCKPIT_FSREPLACE (object);
+
+  if (self->io)
+    {
+      cockpit_file_io_close (self->io);
+      if (self->sig_done)
+        g_signal_handler_disconnect (self->io, self->sig_done);
+      self->sig_done = 0;
+    }
+
+  G_OBJECT_CLASS (cockpit_fsreplace_parent_class)->dispose (object);
+}
+
 static void
 cockpit_fsreplace_finalize (GObject *object)
 {
   CockpitFsreplace *self = COCKPIT_FSREPLACE (object);
 
   g_free (self->tmp_path);
+  g_clear_object (&self->io);
 
   G_OBJECT_CLASS (cockpit_fsreplace_parent_class)->finalize (object);
 }
@@ -299,6 +315,7 @@ cockpit_fsreplace_class_init (CockpitFsreplaceClass *klass)
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
   CockpitChannelClass *channel_class = COCKPIT_CHANNEL_CLASS (klass);
 
+  gobject_class->dispose = cockpit_fsreplace_dispose;
   gobject_class->finalize = cockpit_fsreplace_finalize;
 
   channel_class->prepare = cockpit_fsreplace_prepare;
@@ -32,6 +32,7 @@
 #include "cockpitmountsamples.h"
 #include "cockpitcgroupsamples.h"
 #include "cockpitdisksamples.h"
+#include "cockpitchannelsamples.h"
 
 #include "common/cockpitjson.h"
 
@@ -53,7 +54,8 @@ typedef enum {
   NETWORK_SAMPLER = 1 << 3,
   MOUNT_SAMPLER = 1 << 4,
   CGROUP_SAMPLER = 1 << 5,
-  DISK_SAMPLER = 1 << 6
+  DISK_SAMPLER = 1 << 6,
+  CHANNEL_SAMPLER = 1 << 7
 } SamplerSet;
 
 typedef struct {
@@ -92,6 +94,7 @@ static MetricDescription metric_descriptions[] = {
 
   { "mount.total", "bytes", "instant", TRUE, MOUNT_SAMPLER },
   { "mount.used",  "bytes", "instant", TRUE, MOUNT_SAMPLER },
+  { "mount.stale", "count", "instant", TRUE, MOUNT_SAMPLER },
 
   { "cgroup.memory.usage",    "bytes",    "instant", TRUE, CGROUP_SAMPLER },
   { "cgroup.memory.limit",    "bytes",    "instant", TRUE, CGROUP_SAMPLER },
@@ -100,6 +103,17 @@ static MetricDescription metric_descriptions[] = {
   { "cgroup.cpu.usage",       "millisec", "counter", TRUE, CGROUP_SAMPLER },
   { "cgroup.cpu.shares",      "count",    "instant", TRUE, CGROUP_SAMPLER },
 
+  { "bridge.channel.opened",    "count",    "counter", TRUE, CHANNEL_SAMPLER },
+  { "bridge.channel.active",    "count",    "instant", TRUE, CHANNEL_SAMPLER },
+  { "bridge.channel.failed",    "count",    "counter", TRUE, CHANNEL_SAMPLER },
+  { "bridge.channel.rx",        "bytes",    "counter", TRUE, CHANNEL_SAMPLER },
+  { "bridge.channel.tx",        "bytes",    "counter", TRUE, CHANNEL_SAMPLER },
+  { "bridge.channel.rx-frames", "count",    "counter", TRUE, CHANNEL_SAMPLER },
+  { "bridge.channel.tx-frames", "count",    "counter", TRUE, CHANNEL_SAMPLER },
+  { "bridge.channel.ready-p95", "millisec", "instant", TRUE, CHANNEL_SAMPLER },
+  { "bridge.channel.pressure",  "millisec", "counter", TRUE, CHANNEL_SAMPLER },
+  { "bridge.channel.throttled", "millisec", "counter", TRUE, CHANNEL_SAMPLER },
+
   { NULL }
 };
 
@@ -334,6 +348,8 @@ cockpit_internal_metrics_tick (CockpitMetrics *metrics,
     cockpit_cgroup_samples (COCKPIT_SAMPLES (self));
   if (self->samplers & DISK_SAMPLER)
     cockpit_disk_samples (COCKPIT_SAMPLES (self));
+  if (self->samplers & CHANNEL_SAMPLER)
+    cockpit_channel_samples (COCKPIT_SAMPLES (self));
 
   /* Check for disappeared instances
    */
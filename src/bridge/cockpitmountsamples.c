@@ -29,22 +29,180 @@
 #include <ctype.h>
 #include <sys/statvfs.h>
 
-void
-cockpit_mount_samples (CockpitSamples *samples)
+/*
+ * statvfs() on a network filesystem blocks for as long as the server
+ * doesn't answer, which for a hung NFS or CIFS mount can be minutes.
+ * So it's called from a small pool of worker threads, and each tick
+ * only waits a little while for results. Mounts that don't answer in
+ * time keep their last known values and are flagged as stale.
+ *
+ * A probe still running after MOUNT_PROBE_DEADLINE counts as timed
+ * out. After a few of those in a row the mount isn't probed anymore,
+ * until it disappears from /proc/mounts and shows up again. Only one
+ * probe per mount runs at a time, so a hung mount holds on to at most
+ * one worker. The pool gets an extra worker for each probe that is
+ * still running from an earlier tick, so that hung mounts don't keep
+ * the probes of other mounts waiting in the queue. Probes that wait
+ * in the queue don't count as timed out.
+ *
+ * Apart from the workers, this is only used from the main thread.
+ */
+
+/* How long each tick waits for the probes it started */
+#define MOUNT_PROBE_WAIT         (100 * 1000)
+
+#define MOUNT_PROBE_DEADLINE     (2 * G_USEC_PER_SEC)
+#define MOUNT_PROBE_MAX_TIMEOUTS 3
+#define MOUNT_PROBE_THREADS      4
+
+typedef struct {
+  gint refs;
+  gchar *dir;
+
+  /* Protected by probe_lock, workers write these */
+  gboolean busy;
+  gint64 running;
+  gboolean valid;
+  gint64 total;
+  gint64 used;
+
+  /* Only used from the main thread */
+  gint64 started;
+  gboolean timed_out;
+  guint timeouts;
+  gboolean seen;
+} MountProbe;
+
+static GMutex probe_lock;
+static GCond probe_cond;
+static GThreadPool *probe_pool = NULL;
+static guint probes_running = 0;
+static GHashTable *probes = NULL;
+
+static const gchar *mounts_path = "/proc/mounts";
+static CockpitStatvfsFunc probe_statvfs = statvfs;
+
+static void
+mount_probe_unref (gpointer data)
+{
+  MountProbe *probe = data;
+
+  if (g_atomic_int_dec_and_test (&probe->refs))
+    {
+      g_free (probe->dir);
+      g_free (probe);
+    }
+}
+
+static void
+probe_mount (gpointer data,
+             gpointer user_data)
+{
+  MountProbe *probe = data;
+  struct statvfs buf;
+  gboolean valid;
+
+  g_mutex_lock (&probe_lock);
+  probe->running = g_get_monotonic_time ();
+  probes_running++;
+  g_mutex_unlock (&probe_lock);
+
+  valid = (probe_statvfs (probe->dir, &buf) >= 0);
+
+  g_mutex_lock (&probe_lock);
+  probe->valid = valid;
+  if (valid)
+    {
+      // We explicitly store the fragment size as 64 bits so that
+      // computations with it don't overflow on 32 bit
+      // architectures.
+
+      gint64 frsize = buf.f_frsize;
+      probe->total = frsize * buf.f_blocks;
+      probe->used = probe->total - frsize * buf.f_bfree;
+    }
+  probe->busy = FALSE;
+  probe->running = 0;
+  probes_running--;
+  g_cond_broadcast (&probe_cond);
+  g_mutex_unlock (&probe_lock);
+
+  mount_probe_unref (probe);
+}
+
+static void
+start_probe (MountProbe *probe,
+             gint64 now)
+{
+  GError *error = NULL;
+
+  if (!probe_pool)
+    {
+      probe_pool = g_thread_pool_new (probe_mount, NULL, MOUNT_PROBE_THREADS, FALSE, &error);
+      g_assert_no_error (error);
+    }
+
+  probe->busy = TRUE;
+  probe->started = now;
+  probe->timed_out = FALSE;
+  g_atomic_int_inc (&probe->refs);
+  g_thread_pool_push (probe_pool, probe, NULL);
+}
+
+static void
+update_probe (MountProbe *probe,
+              gint64 now)
+{
+  if (probe->busy)
+    {
+      if (!probe->timed_out && probe->running && now - probe->running > MOUNT_PROBE_DEADLINE)
+        {
+          probe->timed_out = TRUE;
+          probe->timeouts++;
+          if (probe->timeouts == MOUNT_PROBE_MAX_TIMEOUTS)
+            g_message ("%s: mount not responding, no longer checking its size", probe->dir);
+          else
+            g_debug ("%s: mount not responding", probe->dir);
+        }
+    }
+  else if (probe->timeouts < MOUNT_PROBE_MAX_TIMEOUTS)
+    {
+      if (probe->started && !probe->timed_out)
+        probe->timeouts = 0;
+      start_probe (probe, now);
+    }
+}
+
+static gboolean
+probes_started_busy (gint64 now)
+{
+  GHashTableIter iter;
+  MountProbe *probe;
+
+  g_hash_table_iter_init (&iter, probes);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&probe))
+    {
+      if (probe->busy && probe->started == now)
+        return TRUE;
+    }
+  return FALSE;
+}
+
+static void
+scan_mounts (void)
 {
   gchar *contents = NULL;
   GError *error = NULL;
   gchar **lines = NULL;
+  MountProbe *probe;
   gchar *line;
   gchar *esc_dir, *dir;
-  struct statvfs buf;
-  gint64 total;
   gsize len;
   guint n;
 
-  if (!g_file_get_contents ("/proc/mounts", &contents, &len, &error))
+  if (!g_file_get_contents (mounts_path, &contents, &len, &error))
     {
-      g_message ("error loading contents /proc/mounts: %s", error->message);
+      g_message ("error loading contents %s: %s", mounts_path, error->message);
       g_error_free (error);
       goto out;
     }
@@ -73,22 +231,104 @@ cockpit_mount_samples (CockpitSamples *samples)
 
       dir = g_strcompress (esc_dir);
 
-      if (statvfs (dir, &buf) >= 0)
+      probe = g_hash_table_lookup (probes, dir);
+      if (probe)
         {
-          // We explicitly store the fragment size as 64 bits so that
-          // computations with it don't overflow on 32 bit
-          // architectures.
-
-          gint64 frsize = buf.f_frsize;
-          total = frsize * buf.f_blocks;
-          cockpit_samples_sample (samples, "mount.total", dir, total);
-          cockpit_samples_sample (samples, "mount.used", dir, total - frsize * buf.f_bfree);
+          g_free (dir);
         }
-
-      g_free (dir);
+      else
+        {
+          probe = g_new0 (MountProbe, 1);
+          probe->refs = 1;
+          probe->dir = dir;
+          g_hash_table_insert (probes, probe->dir, probe);
+        }
+      probe->seen = TRUE;
     }
 
  out:
   g_strfreev (lines);
   g_free (contents);
 }
+
+void
+cockpit_mount_samples (CockpitSamples *samples)
+{
+  GHashTableIter iter;
+  MountProbe *probe;
+  guint hung;
+  gint64 now;
+
+  if (!probes)
+    probes = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, mount_probe_unref);
+
+  scan_mounts ();
+
+  now = g_get_monotonic_time ();
+  g_mutex_lock (&probe_lock);
+
+  /* Still running from an earlier tick, even for mounts that went away */
+  hung = probes_running;
+
+  /* Forget mounts that went away, and probe the rest */
+  g_hash_table_iter_init (&iter, probes);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&probe))
+    {
+      if (!probe->seen)
+        {
+          g_hash_table_iter_remove (&iter);
+          continue;
+        }
+
+      probe->seen = FALSE;
+      update_probe (probe, now);
+    }
+
+  /* Queued probes get workers of their own instead of waiting behind hung ones */
+  if (probe_pool)
+    g_thread_pool_set_max_threads (probe_pool, MOUNT_PROBE_THREADS + hung, NULL);
+
+  /* Usually the answers are there right away */
+  while (probes_started_busy (now))
+    {
+      if (!g_cond_wait_until (&probe_cond, &probe_lock, now + MOUNT_PROBE_WAIT))
+        break;
+    }
+
+  g_hash_table_iter_init (&iter, probes);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&probe))
+    {
+      if (probe->valid)
+        {
+          cockpit_samples_sample (samples, "mount.total", probe->dir, probe->total);
+          cockpit_samples_sample (samples, "mount.used", probe->dir, probe->used);
+        }
+      cockpit_samples_sample (samples, "mount.stale", probe->dir,
+                              probe->busy || probe->timeouts >= MOUNT_PROBE_MAX_TIMEOUTS);
+    }
+
+  g_mutex_unlock (&probe_lock);
+}
+
+/**
+ * cockpit_mount_samples_mock:
+ * @mounts: (nullable): file to read mounts from instead of /proc/mounts
+ * @func: (nullable): called instead of statvfs()
+ *
+ * Forget about all mounts and probe them with @func from now on.
+ * Used by tests.
+ */
+void
+cockpit_mount_samples_mock (const gchar *mounts,
+                            CockpitStatvfsFunc func)
+{
+  static gchar *mock_path = NULL;
+
+  if (probes)
+    g_hash_table_remove_all (probes);
+
+  g_free (mock_path);
+  mock_path = g_strdup (mounts);
+  mounts_path = mock_path ? mock_path : "/proc/mounts";
+  probe_statvfs = func ? func : statvfs;
+}
@@ -22,10 +22,18 @@
 
 #include "cockpitsamples.h"
 
+#include <sys/statvfs.h>
+
 G_BEGIN_DECLS
 
+typedef int  (* CockpitStatvfsFunc)           (const char *path,
+                                               struct statvfs *buf);
+
 void            cockpit_mount_samples         (CockpitSamples *samples);
 
+void            cockpit_mount_samples_mock    (const gchar *mounts,
+                                               CockpitStatvfsFunc func);
+
 
 G_END_DECLS
 
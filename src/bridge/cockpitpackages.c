@@ -40,6 +40,7 @@
 #include <glib.h>
 #include <glib/gi18n.h>
 
+#include <sys/stat.h>
 #include <string.h>
 
 /* Overridable from tests */
@@ -99,6 +100,12 @@ static CockpitPackages *packages_singleton = NULL;
    In order to detect whether a package has changed or not, the bridge
    also keeps track of per-package checksums.  These never appear in
    the API.
+
+   Reloading only reads and checksums the packages whose files have
+   changed.  Each package remembers a signature of the inode, size and
+   times of its manifest and files, and as long as that signature is
+   the same, the package is taken over as is, together with the file
+   checksums that it contributes to the bundle checksum.
 */
 
 struct _CockpitPackages {
@@ -107,6 +114,7 @@ struct _CockpitPackages {
   gchar *checksum;
   gchar *bundle_checksum;
   JsonObject *json;
+  GBytes *manifests;
   gchar *locale;
 
   gboolean dbus_inited;
@@ -124,6 +132,13 @@ struct _CockpitPackage {
   gchar *content_security_policy;
   gchar *own_checksum;
   gchar *bundle_checksum;
+
+  /* For reloading without reading the package again */
+  gchar *path;
+  gboolean system;
+  gchar *signature;
+  GBytes *sums;
+  GBytes *manifest_bytes;
 };
 
 /*
@@ -135,8 +150,7 @@ struct _CockpitPackage {
  * on different machines.
  */
 
-static gboolean   package_walk_directory   (GChecksum *own_checksum,
-                                            GChecksum *bundle_checksum,
+static gboolean   package_walk_directory   (GByteArray *sums,
                                             GHashTable *paths,
                                             const gchar *root,
                                             const gchar *directory);
@@ -156,6 +170,12 @@ cockpit_package_free (gpointer data)
   g_free (package->unavailable);
   g_free (package->own_checksum);
   g_free (package->bundle_checksum);
+  g_free (package->path);
+  g_free (package->signature);
+  if (package->sums)
+    g_bytes_unref (package->sums);
+  if (package->manifest_bytes)
+    g_bytes_unref (package->manifest_bytes);
   g_free (package);
 }
 
@@ -183,8 +203,7 @@ validate_path (const gchar *name)
 }
 
 static gboolean
-package_walk_file (GChecksum *own_checksum,
-                   GChecksum *bundle_checksum,
+package_walk_file (GByteArray *sums,
                    GHashTable *paths,
                    const gchar *root,
                    const gchar *filename)
@@ -207,7 +226,7 @@ package_walk_file (GChecksum *own_checksum,
   path = g_build_filename (root, filename, NULL);
   if (g_file_test (path, G_FILE_TEST_IS_DIR))
     {
-      ret = package_walk_directory (own_checksum, bundle_checksum, paths, root, filename);
+      ret = package_walk_directory (sums, paths, root, filename);
       goto out;
     }
 
@@ -219,25 +238,19 @@ package_walk_file (GChecksum *own_checksum,
       goto out;
     }
 
-  if (own_checksum && bundle_checksum)
+  if (sums)
     {
       bytes = g_mapped_file_get_bytes (mapped);
       string = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
       g_bytes_unref (bytes);
 
       /*
-       * Place file name and hex checksum into the checksums,
+       * Place file name and hex checksum into what gets checksummed,
        * include the null terminators so these values
        * cannot be accidentally have a boundary discrepancy.
        */
-      g_checksum_update (own_checksum, (const guchar *)filename,
-                         strlen (filename) + 1);
-      g_checksum_update (own_checksum, (const guchar *)string,
-                         strlen (string) + 1);
-      g_checksum_update (bundle_checksum, (const guchar *)filename,
-                         strlen (filename) + 1);
-      g_checksum_update (bundle_checksum, (const guchar *)string,
-                         strlen (string) + 1);
+      g_byte_array_append (sums, (const guchar *)filename, strlen (filename) + 1);
+      g_byte_array_append (sums, (const guchar *)string, strlen (string) + 1);
     }
 
   if (paths)
@@ -301,8 +314,7 @@ directory_filenames (const char *directory)
 }
 
 static gboolean
-package_walk_directory (GChecksum *own_checksum,
-                        GChecksum *bundle_checksum,
+package_walk_directory (GByteArray *sums,
                         GHashTable *paths,
                         const gchar *root,
                         const gchar *directory)
@@ -325,7 +337,7 @@ package_walk_directory (GChecksum *own_checksum,
         filename = g_build_filename (directory, names[i], NULL);
       else
         filename = g_strdup (names[i]);
-      ret = package_walk_file (own_checksum, bundle_checksum, paths, root, filename);
+      ret = package_walk_file (sums, paths, root, filename);
       g_free (filename);
       if (!ret)
         goto out;
@@ -337,6 +349,74 @@ out:
   return ret;
 }
 
+static void
+signature_add_file (GChecksum *signature,
+                    const gchar *root,
+                    const gchar *filename)
+{
+  struct stat buf;
+  gchar *path;
+  gchar *line;
+
+  path = g_build_filename (root, filename, NULL);
+  if (stat (path, &buf) < 0)
+    {
+      line = g_strdup_printf ("%s:-", filename ? filename : "");
+      buf.st_mode = 0;
+    }
+  else
+    line = g_strdup_printf ("%s:%lu:%lld:%lld.%ld:%lld.%ld", filename ? filename : "",
+                            (unsigned long)buf.st_ino, (long long int)buf.st_size,
+                            (long long int)buf.st_mtim.tv_sec, (long int)buf.st_mtim.tv_nsec,
+                            (long long int)buf.st_ctim.tv_sec, (long int)buf.st_ctim.tv_nsec);
+  g_checksum_update (signature, (const guchar *)line, strlen (line) + 1);
+  g_free (line);
+
+  if (S_ISDIR (buf.st_mode))
+    {
+      GPtrArray *names = g_ptr_array_new_with_free_func (g_free);
+      const gchar *name;
+      GDir *dir;
+      guint i;
+
+      dir = g_dir_open (path, 0, NULL);
+      while (dir && (name = g_dir_read_name (dir)) != NULL)
+        g_ptr_array_add (names, filename ? g_build_filename (filename, name, NULL) : g_strdup (name));
+      if (dir)
+        g_dir_close (dir);
+
+      g_ptr_array_sort (names, compare_filenames);
+      for (i = 0; i < names->len; i++)
+        signature_add_file (signature, root, names->pdata[i]);
+      g_ptr_array_free (names, TRUE);
+    }
+
+  g_free (path);
+}
+
+/*
+ * A package changed when the inode, size or times of its manifest
+ * or any of its files changed. This only needs stat(), and doesn't
+ * read anything.
+ */
+static gchar *
+package_signature (const gchar *path,
+                   const gchar *directory)
+{
+  GChecksum *checksum;
+  gchar *signature;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  signature_add_file (checksum, path, "manifest.json");
+  signature_add_file (checksum, path, "override.json");
+  if (directory)
+    signature_add_file (checksum, directory, NULL);
+  signature = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  return signature;
+}
+
 static JsonObject *
 read_json_file (const gchar *directory,
                 const gchar *name,
@@ -582,9 +662,39 @@ calc_package_directory (JsonObject *manifest,
     }
 }
 
+static CockpitPackage *
+reuse_package (GHashTable *listing,
+               GHashTable *old_listing,
+               GHashTable *old_paths,
+               CockpitPackage *package,
+               GChecksum *bundle_checksum)
+{
+  CockpitPackage *existing;
+
+  /* In case the package is already present */
+  existing = g_hash_table_lookup (listing, package->name);
+  if (existing && compar_manifest_priority (package->manifest, existing->manifest, package->name) <= 0)
+    return NULL;
+
+  /* The same files as last time go into the bundle checksum */
+  if (bundle_checksum)
+    {
+      g_checksum_update (bundle_checksum, g_bytes_get_data (package->sums, NULL),
+                         g_bytes_get_size (package->sums));
+    }
+
+  g_hash_table_remove (old_paths, package->path);
+  g_hash_table_steal (old_listing, package->name);
+  g_hash_table_replace (listing, package->name, package);
+  g_debug ("%s: unchanged package at %s", package->name, package->directory);
+
+  return package;
+}
+
 static CockpitPackage *
 maybe_add_package (GHashTable *listing,
                    GHashTable *old_listing,
+                   GHashTable *old_paths,
                    const gchar *parent,
                    const gchar *name,
                    GChecksum *bundle_checksum,
@@ -593,13 +703,28 @@ maybe_add_package (GHashTable *listing,
   CockpitPackage *package = NULL;
   gchar *path = NULL;
   gchar *directory = NULL;
+  gchar *signature = NULL;
   JsonObject *manifest = NULL;
-  GChecksum *own_checksum = NULL;
+  GByteArray *sums = NULL;
   GHashTable *paths = NULL;
   CockpitPackage *old_package;
+  gboolean ret;
 
   path = g_build_filename (parent, name, NULL);
 
+  /* When nothing changed in the package since last time, use it as is */
+  old_package = old_paths ? g_hash_table_lookup (old_paths, path) : NULL;
+  if (old_package && old_package->system == system &&
+      (old_package->sums != NULL) == (bundle_checksum != NULL))
+    {
+      signature = package_signature (path, old_package->directory);
+      if (g_str_equal (signature, old_package->signature))
+        {
+          package = reuse_package (listing, old_listing, old_paths, old_package, bundle_checksum);
+          goto out;
+        }
+    }
+
   manifest = read_package_manifest (path, name);
   if (!manifest)
     goto out;
@@ -626,24 +751,40 @@ maybe_add_package (GHashTable *listing,
 
   directory = calc_package_directory (manifest, name, path);
 
+  /* Before reading any of the files, so we notice when they change */
+  g_free (signature);
+  signature = package_signature (path, directory);
+
   if (system)
     paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
   if (bundle_checksum)
-    own_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    sums = g_byte_array_new ();
 
-  if (bundle_checksum || paths)
+  if (sums || paths)
     {
-      if (!package_walk_directory (bundle_checksum, own_checksum, paths, directory, NULL))
+      ret = package_walk_directory (sums, paths, directory, NULL);
+      if (sums)
+        g_checksum_update (bundle_checksum, sums->data, sums->len);
+      if (!ret)
         goto out;
     }
 
   package = cockpit_package_new (name);
   package->directory = directory;
   directory = NULL;
+  package->path = path;
+  path = NULL;
+  package->signature = signature;
+  signature = NULL;
+  package->system = system;
 
-  if (own_checksum)
-    package->own_checksum = g_strdup (g_checksum_get_string (own_checksum));
+  if (sums)
+    {
+      package->own_checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256, sums->data, sums->len);
+      package->sums = g_byte_array_free_to_bytes (sums);
+      sums = NULL;
+    }
 
   // Keep the old bundle_checksum for this package if none of its
   // files has changed.
@@ -674,20 +815,22 @@ maybe_add_package (GHashTable *listing,
 
 out:
   g_free (directory);
+  g_free (signature);
   g_free (path);
   if (manifest)
     json_object_unref (manifest);
   if (paths)
     g_hash_table_unref (paths);
-  if (own_checksum)
-    g_checksum_free (own_checksum);
+  if (sums)
+    g_byte_array_unref (sums);
   return package;
 }
 
 static gboolean
 build_package_listing (GHashTable *listing,
                        GChecksum *checksum,
-                       GHashTable *old_listing)
+                       GHashTable *old_listing,
+                       GHashTable *old_paths)
 {
   const gchar *const *directories;
   gchar *directory = NULL;
@@ -703,7 +846,7 @@ build_package_listing (GHashTable *listing,
       for (j = 0; packages[j] != NULL; j++)
         {
           /* If any user packages installed, no checksum */
-          if (maybe_add_package (listing, old_listing, directory, packages[j], checksum, FALSE))
+          if (maybe_add_package (listing, old_listing, old_paths, directory, packages[j], checksum, FALSE))
             checksum = NULL;
         }
       g_strfreev (packages);
@@ -723,7 +866,7 @@ build_package_listing (GHashTable *listing,
         {
           packages = directory_filenames (directory);
           for (j = 0; packages && packages[j] != NULL; j++)
-            maybe_add_package (listing, old_listing, directory, packages[j], checksum, TRUE);
+            maybe_add_package (listing, old_listing, old_paths, directory, packages[j], checksum, TRUE);
           g_strfreev (packages);
         }
       g_free (directory);
@@ -732,31 +875,100 @@ build_package_listing (GHashTable *listing,
   return checksum != NULL;
 }
 
+/*
+ * The serialized manifests for manifests.json and the D-Bus property.
+ * Each package keeps its part of it, and it only gets serialized again
+ * when the package changed.
+ */
+static GBytes *
+build_manifests (CockpitPackages *packages)
+{
+  CockpitPackage *package;
+  GByteArray *buffer;
+  GList *names, *l;
+  gboolean first = TRUE;
+
+  buffer = g_byte_array_new ();
+  g_byte_array_append (buffer, (const guchar *)"{", 1);
+
+  /* Package names and checksums never need escaping */
+  if (packages->checksum)
+    {
+      g_byte_array_append (buffer, (const guchar *)"\".checksum\":\"", 13);
+      g_byte_array_append (buffer, (const guchar *)packages->checksum, strlen (packages->checksum));
+      g_byte_array_append (buffer, (const guchar *)"\"", 1);
+      first = FALSE;
+    }
+
+  names = g_hash_table_get_keys (packages->listing);
+  names = g_list_sort (names, (GCompareFunc)strcmp);
+  for (l = names; l != NULL; l = g_list_next (l))
+    {
+      package = g_hash_table_lookup (packages->listing, l->data);
+      if (!package->manifest)
+        continue;
+
+      if (!package->manifest_bytes)
+        package->manifest_bytes = cockpit_json_write_bytes (package->manifest);
+
+      if (!first)
+        g_byte_array_append (buffer, (const guchar *)",", 1);
+      first = FALSE;
+
+      g_byte_array_append (buffer, (const guchar *)"\"", 1);
+      g_byte_array_append (buffer, (const guchar *)package->name, strlen (package->name));
+      g_byte_array_append (buffer, (const guchar *)"\":", 2);
+      g_byte_array_append (buffer, g_bytes_get_data (package->manifest_bytes, NULL),
+                           g_bytes_get_size (package->manifest_bytes));
+    }
+  g_list_free (names);
+
+  g_byte_array_append (buffer, (const guchar *)"}", 1);
+  return g_byte_array_free_to_bytes (buffer);
+}
+
 static void
 build_packages (CockpitPackages *packages)
 {
   GHashTable *old_listing;
+  GHashTable *old_paths = NULL;
   JsonObject *root = NULL;
   CockpitPackage *package;
+  GHashTableIter iter;
   GChecksum *checksum;
   GList *names, *l;
   const gchar *name;
+  const gchar *previous;
 
   old_listing = packages->listing;
 
+  /* Packages that were read before, by the path they were read from */
+  if (old_listing)
+    {
+      old_paths = g_hash_table_new (g_str_hash, g_str_equal);
+      g_hash_table_iter_init (&iter, old_listing);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&package))
+        {
+          if (package->path)
+            g_hash_table_insert (old_paths, package->path, package);
+        }
+    }
+
   packages->listing = g_hash_table_new_full (g_str_hash, g_str_equal,
                                              NULL, cockpit_package_free);
   g_free (packages->bundle_checksum);
   packages->bundle_checksum = NULL;
 
   checksum = g_checksum_new (G_CHECKSUM_SHA256);
-  if (build_package_listing (packages->listing, checksum, old_listing))
+  if (build_package_listing (packages->listing, checksum, old_listing, old_paths))
     {
       packages->bundle_checksum = g_strdup (g_checksum_get_string (checksum));
       if (!packages->checksum)
         packages->checksum = g_strdup (packages->bundle_checksum);
     }
   g_checksum_free (checksum);
+  if (old_paths)
+    g_hash_table_unref (old_paths);
   if (old_listing)
     g_hash_table_unref (old_listing);
 
@@ -777,11 +989,20 @@ build_packages (CockpitPackages *packages)
         if (!package->bundle_checksum)
           package->bundle_checksum = g_strdup (packages->bundle_checksum);
         if (package->bundle_checksum)
-          json_object_set_string_member (package->manifest, ".checksum", package->bundle_checksum);
+          {
+            if (!cockpit_json_get_string (package->manifest, ".checksum", NULL, &previous) ||
+                g_strcmp0 (previous, package->bundle_checksum) != 0)
+              g_clear_pointer (&package->manifest_bytes, g_bytes_unref);
+            json_object_set_string_member (package->manifest, ".checksum", package->bundle_checksum);
+          }
       }
     }
 
   g_list_free (names);
+
+  if (packages->manifests)
+    g_bytes_unref (packages->manifests);
+  packages->manifests = build_manifests (packages);
 }
 
 gchar *
@@ -889,12 +1110,13 @@ handle_package_manifests_js (CockpitWebServer *server,
   GBytes *suffix;
 
   prefix = g_bytes_new_static (template, strlen (template));
-  content = cockpit_json_write_bytes (packages->json);
+  content = g_bytes_ref (packages->manifests);
   suffix = g_bytes_new_static ("));", 3);
 
   out_headers = cockpit_web_server_new_table ();
 
   set_manifest_headers (response, packages, out_headers);
+  cockpit_web_response_set_compress (response, headers);
   cockpit_web_response_content (response, out_headers, prefix, content, suffix, NULL);
 
   g_hash_table_unref (out_headers);
@@ -916,9 +1138,10 @@ handle_package_manifests_json (CockpitWebServer *server,
 
   out_headers = cockpit_web_server_new_table ();
 
-  content = cockpit_json_write_bytes (packages->json);
+  content = g_bytes_ref (packages->manifests);
 
   set_manifest_headers (response, packages, out_headers);
+  cockpit_web_response_set_compress (response, headers);
   cockpit_web_response_content (response, out_headers, content, NULL);
 
   g_hash_table_unref (out_headers);
@@ -1162,6 +1385,9 @@ handle_packages (CockpitWebServer *server,
     accept = "*";
   encodings = cockpit_web_server_parse_accept_list (accept, NULL);
 
+  /* Anything without a pre-compressed variant gets compressed on the fly */
+  cockpit_web_response_set_compress (response, headers);
+
   package_content (packages, response, name, path, languages[0],
                    (const gchar **)encodings, origin, out_headers);
 
@@ -1390,7 +1616,21 @@ static void packages_emit_changed (CockpitPackages *packages);
 void
 cockpit_packages_reload (CockpitPackages *packages)
 {
+  GBytes *previous;
+  gboolean changed;
+
+  previous = g_bytes_ref (packages->manifests);
   build_packages (packages);
+  changed = !g_bytes_equal (previous, packages->manifests);
+  g_bytes_unref (previous);
+
+  /* Nobody needs to know when all the packages are the same */
+  if (!changed)
+    {
+      g_debug ("packages unchanged after reload");
+      return;
+    }
+
   if (packages->on_change_callback)
     packages->on_change_callback (packages->on_change_callback_data);
   packages_emit_changed (packages);
@@ -1407,6 +1647,8 @@ cockpit_packages_free (CockpitPackages *packages)
 
   if (packages->json)
     json_object_unref (packages->json);
+  if (packages->manifests)
+    g_bytes_unref (packages->manifests);
   g_free (packages->bundle_checksum);
   g_free (packages->checksum);
   if (packages->listing)
@@ -1502,10 +1744,9 @@ cockpit_packages_dump (void)
 static GVariant *
 packages_get_manifests (CockpitPackages *packages)
 {
-  GBytes *content = cockpit_json_write_bytes (packages->json);
-  GVariant *manifests = g_variant_new ("s", g_bytes_get_data (content, NULL));
-  g_bytes_unref (content);
-  return manifests;
+  gsize length;
+  const gchar *data = g_bytes_get_data (packages->manifests, &length);
+  return g_variant_new_take_string (g_strndup (data, length));
 }
 
 static void
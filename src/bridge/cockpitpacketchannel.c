@@ -42,6 +42,9 @@
  * Support for dgram sockets should also fit in here rather well, but is
  * not implemented at the current time.
  *
+ * Packets are read and written in batches with recvmmsg() and sendmmsg(),
+ * so that a busy socket doesn't cost a system call for every packet.
+ *
  * The payload type for this channel is 'stream'.
  */
 
@@ -53,6 +56,12 @@
 /* Several megabytes is when we start to consider queue full enough */
 #define QUEUE_PRESSURE   (128UL * DEF_PACKET_SIZE)
 
+/* Most packets to read or write with one system call */
+#define MAX_BATCH        64
+
+/* Size of the buffer that packets are read into */
+#define SLAB_SIZE        (1024UL * 1024UL)
+
 enum {
     CREATED = 0,
     CONNECTING,
@@ -70,6 +79,7 @@ typedef struct {
   int fd;
   GSource *in_source;
   gboolean in_done;
+  guchar *in_slab;
   GSource *out_source;
   GQueue *out_queue;
   gboolean out_done;
@@ -158,14 +168,32 @@ dispatch_input (gint fd,
                 gpointer user_data)
 {
   CockpitPacketChannel *self = (CockpitPacketChannel *)user_data;
-  GByteArray *buffer;
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iovs[MAX_BATCH];
   GBytes *message;
-  gssize ret = 0;
+  gint batch;
+  gint ret = 0;
+  gint i;
   int errn;
 
   g_return_val_if_fail (self->in_source, FALSE);
 
-  buffer = g_byte_array_new ();
+  /*
+   * Read as many packets as fit in the slab with one call. Each of
+   * them is copied out at its actual size, so the slab is reused.
+   */
+  batch = CLAMP (SLAB_SIZE / self->max_size, 1, MAX_BATCH);
+  if (!self->in_slab)
+    self->in_slab = g_malloc (SLAB_SIZE);
+
+  memset (msgs, 0, sizeof (msgs[0]) * batch);
+  for (i = 0; i < batch; i++)
+    {
+      iovs[i].iov_base = self->in_slab + i * self->max_size;
+      iovs[i].iov_len = self->max_size;
+      msgs[i].msg_hdr.msg_iov = iovs + i;
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
   /*
    * Enable clean shutdown by not reading when we just get
@@ -174,16 +202,14 @@ dispatch_input (gint fd,
    */
   if (cond != G_IO_HUP)
     {
-      g_byte_array_set_size (buffer, self->max_size);
       g_debug ("%s: reading input %x", self->name, cond);
-      ret = recv (self->fd, buffer->data, buffer->len, 0);
+      ret = recvmmsg (self->fd, msgs, batch, MSG_DONTWAIT, NULL);
 
       errn = errno;
       if (ret < 0)
         {
           if (errn == EAGAIN || errn == EINTR)
             {
-              g_byte_array_free (buffer, TRUE);
               return TRUE;
             }
           else if (errn == ECONNRESET)
@@ -193,31 +219,42 @@ dispatch_input (gint fd,
             }
           else
             {
-              g_byte_array_free (buffer, TRUE);
               close_with_errno (self, "couldn't read", errn);
               return FALSE;
             }
         }
+    }
+
+  g_object_ref (self);
 
-      g_byte_array_set_size (buffer, ret);
+  for (i = 0; i < ret && self->state < CLOSED; i++)
+    {
+      /* An empty packet is the end of input */
+      if (msgs[i].msg_len == 0)
+        {
+          ret = 0;
+          break;
+        }
+
+      message = g_bytes_new (iovs[i].iov_base, msgs[i].msg_len);
+      cockpit_channel_send (COCKPIT_CHANNEL (self), message, FALSE);
+      g_bytes_unref (message);
     }
 
-  if (ret == 0)
+  if (ret == 0 && self->state < CLOSED)
     {
       g_debug ("%s: end of input", self->name);
       cockpit_channel_control (COCKPIT_CHANNEL (self), "done", NULL);
       self->in_done = TRUE;
-      stop_input (self);
-    }
+      if (self->in_source)
+        stop_input (self);
 
-  g_object_ref (self);
-
-  message = g_byte_array_free_to_bytes (buffer);
-  cockpit_channel_send (COCKPIT_CHANNEL (self), message, FALSE);
-  g_bytes_unref (message);
+      message = g_bytes_new_static ("", 0);
+      cockpit_channel_send (COCKPIT_CHANNEL (self), message, FALSE);
+      g_bytes_unref (message);
 
-  if (self->in_done)
-    close_maybe (self);
+      close_maybe (self);
+    }
 
   g_object_unref (self);
   return TRUE;
@@ -258,9 +295,13 @@ dispatch_output (gint fd,
                  gpointer user_data)
 {
   CockpitPacketChannel *self = (CockpitPacketChannel *)user_data;
-  gconstpointer data;
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iovs[MAX_BATCH];
   gsize before, size;
-  gssize ret;
+  GList *l;
+  gint batch;
+  gint ret;
+  gint i;
 
   /* A non-blocking connect is processed here */
   if (self->state == CONNECTING && !dispatch_connect (self))
@@ -272,8 +313,17 @@ dispatch_output (gint fd,
 
   while (self->out_queue->head)
     {
-      data = g_bytes_get_data (self->out_queue->head->data, &size);
-      ret = send (self->fd, data, size, 0);
+      /* Send as many queued packets as we can with one call */
+      memset (msgs, 0, sizeof (msgs));
+      for (l = self->out_queue->head, batch = 0; l && batch < MAX_BATCH; l = l->next, batch++)
+        {
+          iovs[batch].iov_base = (gpointer)g_bytes_get_data (l->data, &size);
+          iovs[batch].iov_len = size;
+          msgs[batch].msg_hdr.msg_iov = iovs + batch;
+          msgs[batch].msg_hdr.msg_iovlen = 1;
+        }
+
+      ret = sendmmsg (self->fd, msgs, batch, 0);
 
       if (ret < 0)
         {
@@ -287,12 +337,18 @@ dispatch_output (gint fd,
               return FALSE;
             }
         }
-      else
+
+      for (i = 0; i < ret; i++)
         {
+          size = iovs[i].iov_len;
           g_bytes_unref (g_queue_pop_head (self->out_queue));
           g_assert (size <= self->out_queued);
           self->out_queued -= size;
         }
+
+      /* The socket is full */
+      if (ret < batch)
+        break;
     }
 
   /*
@@ -620,6 +676,7 @@ cockpit_packet_channel_finalize (GObject *object)
   g_assert (!self->in_source);
   g_assert (!self->out_source);
   g_queue_free (self->out_queue);
+  g_free (self->in_slab);
   g_free (self->name);
 
   if (self->context)
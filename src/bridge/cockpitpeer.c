@@ -172,10 +172,17 @@ on_other_recv (CockpitTransport *transport,
               gpointer user_data)
 {
   CockpitPeer *self = user_data;
+  GBytes *frame;
 
+  /*
+   * Channel data is relayed unchanged, so pass on the frame as it came
+   * from the peer bridge, rather than build it again. Control messages
+   * are looked at and perhaps rewritten in on_other_control().
+   */
   if (channel)
     {
-      cockpit_transport_send (self->transport, channel, payload);
+      frame = cockpit_pipe_transport_peek_frame (COCKPIT_PIPE_TRANSPORT (transport));
+      cockpit_transport_send_frame (self->transport, channel, payload, frame);
       return TRUE;
     }
 
@@ -26,6 +26,7 @@
 #include "cockpitdbusinternal.h"
 
 #include "common/cockpitchannel.h"
+#include "common/cockpitchannelstats.h"
 #include "common/cockpitjson.h"
 #include "common/cockpittransport.h"
 #include "common/cockpitpipe.h"
@@ -153,7 +154,14 @@ router_rule_compile (RouterRule *rule,
 
       /* A glob style string pattern */
       if (JSON_NODE_HOLDS_VALUE (node) && json_node_get_value_type (node) == G_TYPE_STRING)
-        match->glob = g_pattern_spec_new (json_node_get_string (node));
+        {
+          match->glob = g_pattern_spec_new (json_node_get_string (node));
+
+          /* Payloads we route get their own stats, others count as "other" */
+          if (g_str_equal (match->name, "payload") &&
+              !strpbrk (json_node_get_string (node), "*?"))
+            cockpit_channel_stats_register (json_node_get_string (node));
+        }
 
       /* A null matches anything */
       if (!JSON_NODE_HOLDS_NULL (node))
@@ -505,6 +513,16 @@ process_open_channel (CockpitRouter *self,
   return TRUE;
 }
 
+static CockpitChannelStats *
+lookup_channel_stats (JsonObject *options)
+{
+  const gchar *payload;
+
+  if (!cockpit_json_get_string (options, "payload", NULL, &payload))
+    payload = NULL;
+  return cockpit_channel_stats_get (payload);
+}
+
 static gboolean
 process_open_peer (CockpitRouter *self,
                    const gchar *channel,
@@ -513,7 +531,12 @@ process_open_peer (CockpitRouter *self,
                    gpointer user_data)
 {
   CockpitPeer *peer = user_data;
-  return cockpit_peer_handle (peer, channel, options, data);
+
+  if (!cockpit_peer_handle (peer, channel, options, data))
+    return FALSE;
+
+  lookup_channel_stats (options)->routed++;
+  return TRUE;
 }
 
 static GBytes *
@@ -554,7 +577,11 @@ process_open_dynamic_peer (CockpitRouter *self,
       g_hash_table_insert (dp->peers, json_object_ref (config), peer);
     }
 
-  return cockpit_peer_handle (peer, channel, options, data);
+  if (!cockpit_peer_handle (peer, channel, options, data))
+    return FALSE;
+
+  lookup_channel_stats (options)->routed++;
+  return TRUE;
 }
 
 static gboolean
@@ -573,6 +600,8 @@ process_open_not_supported (CockpitRouter *self,
   else
     g_debug ("%s: bridge doesn't support channel: %s", channel, payload);
 
+  lookup_channel_stats (options)->refused++;
+
   /* This creates a temporary channel that closes with not-supported */
   create_channel (self, channel, options, COCKPIT_TYPE_CHANNEL);
   return TRUE;
@@ -580,12 +609,14 @@ process_open_not_supported (CockpitRouter *self,
 
 static void
 process_open_access_denied (CockpitRouter *self,
-                            const gchar *channel)
+                            const gchar *channel,
+                            JsonObject *options)
 {
   GBytes *control = cockpit_transport_build_control ("command", "close",
                                                      "channel", channel,
                                                      "problem", "access-denied",
                                                      NULL);
+  lookup_channel_stats (options)->refused++;
   cockpit_transport_send (self->transport, NULL, control);
   g_bytes_unref (control);
 }
@@ -627,7 +658,7 @@ process_open_superuser (CockpitRouter *self,
     return FALSE;
 
   if (self->superuser_rule == NULL)
-    process_open_access_denied (self, channel);
+    process_open_access_denied (self, channel, options);
   else
     {
       GBytes *new_payload = cockpit_json_write_bytes (options);
@@ -1520,6 +1551,98 @@ static GDBusInterfaceInfo superuser_interface = {
   NULL  /* annotations */
 };
 
+/* Channel telemetry */
+
+static GVariant *
+build_histogram (CockpitHistogram *histogram)
+{
+  GVariantBuilder buckets;
+  guint i;
+
+  g_variant_builder_init (&buckets, G_VARIANT_TYPE ("at"));
+  for (i = 0; i < COCKPIT_CHANNEL_STATS_BUCKETS; i++)
+    g_variant_builder_add (&buckets, "t", histogram->buckets[i]);
+
+  return g_variant_new ("(ttat)", histogram->count, histogram->total, &buckets);
+}
+
+static void
+build_channel_stats (gpointer data,
+                     gpointer user_data)
+{
+  CockpitChannelStats *stats = data;
+  GVariantBuilder *builder = user_data;
+  GVariantBuilder bob;
+
+  g_variant_builder_init (&bob, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&bob, "{sv}", "opened", g_variant_new_uint64 (stats->opened));
+  g_variant_builder_add (&bob, "{sv}", "active", g_variant_new_uint64 (stats->active));
+  g_variant_builder_add (&bob, "{sv}", "failed", g_variant_new_uint64 (stats->failed));
+  g_variant_builder_add (&bob, "{sv}", "routed", g_variant_new_uint64 (stats->routed));
+  g_variant_builder_add (&bob, "{sv}", "refused", g_variant_new_uint64 (stats->refused));
+  g_variant_builder_add (&bob, "{sv}", "frames-in", g_variant_new_uint64 (stats->frames_in));
+  g_variant_builder_add (&bob, "{sv}", "bytes-in", g_variant_new_uint64 (stats->bytes_in));
+  g_variant_builder_add (&bob, "{sv}", "frames-out", g_variant_new_uint64 (stats->frames_out));
+  g_variant_builder_add (&bob, "{sv}", "bytes-out", g_variant_new_uint64 (stats->bytes_out));
+  g_variant_builder_add (&bob, "{sv}", "ready", build_histogram (&stats->ready));
+  g_variant_builder_add (&bob, "{sv}", "pressure", build_histogram (&stats->pressure));
+  g_variant_builder_add (&bob, "{sv}", "throttled", build_histogram (&stats->throttled));
+
+  g_variant_builder_add (builder, "{sa{sv}}", stats->payload, &bob);
+}
+
+static void
+telemetry_method_call (GDBusConnection *connection,
+                       const gchar *sender,
+                       const gchar *object_path,
+                       const gchar *interface_name,
+                       const gchar *method_name,
+                       GVariant *parameters,
+                       GDBusMethodInvocation *invocation,
+                       gpointer user_data)
+{
+  GVariantBuilder bob;
+
+  if (g_str_equal (method_name, "GetChannels"))
+    {
+      g_variant_builder_init (&bob, G_VARIANT_TYPE ("a{sa{sv}}"));
+      cockpit_channel_stats_foreach (build_channel_stats, &bob);
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(a{sa{sv}})", &bob));
+    }
+  else
+    g_return_if_reached ();
+}
+
+static GDBusInterfaceVTable telemetry_vtable = {
+  .method_call = telemetry_method_call,
+};
+
+static GDBusArgInfo telemetry_channels_arg = {
+  -1, "channels", "a{sa{sv}}", NULL
+};
+
+static GDBusArgInfo *telemetry_get_channels_out_args[] = {
+  &telemetry_channels_arg,
+  NULL
+};
+
+static GDBusMethodInfo telemetry_get_channels_method = {
+  -1, "GetChannels", NULL, telemetry_get_channels_out_args, NULL
+};
+
+static GDBusMethodInfo *telemetry_methods[] = {
+  &telemetry_get_channels_method,
+  NULL
+};
+
+static GDBusInterfaceInfo telemetry_interface = {
+  -1, "cockpit.Telemetry",
+  telemetry_methods,
+  NULL, /* signals */
+  NULL, /* properties */
+  NULL  /* annotations */
+};
+
 void
 cockpit_router_dbus_startup (CockpitRouter *router)
 {
@@ -1532,15 +1655,23 @@ cockpit_router_dbus_startup (CockpitRouter *router)
   g_dbus_connection_register_object (connection, "/superuser", &superuser_interface,
                                      &superuser_vtable, router, NULL, &error);
 
-  g_object_unref (connection);
-
   router->superuser_dbus_inited = TRUE;
 
   if (error != NULL)
     {
       g_critical ("couldn't register DBus cockpit.Superuser object: %s", error->message);
+      g_clear_error (&error);
+    }
+
+  g_dbus_connection_register_object (connection, "/telemetry", &telemetry_interface,
+                                     &telemetry_vtable, NULL, NULL, &error);
+
+  g_object_unref (connection);
+
+  if (error != NULL)
+    {
+      g_critical ("couldn't register DBus cockpit.Telemetry object: %s", error->message);
       g_error_free (error);
-      return;
     }
 }
 
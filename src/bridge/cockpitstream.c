@@ -21,6 +21,7 @@
 
 #include "cockpitstream.h"
 
+#include "common/cockpitfdwatch.h"
 #include "common/cockpitflow.h"
 #include "common/cockpitjson.h"
 
@@ -58,6 +59,11 @@ struct _CockpitStreamPrivate {
 
   GIOStream *io;
 
+  /* For plain sockets we watch the fd directly, otherwise use sources */
+  gint fd;
+  CockpitFdWatch *out_watch;
+  CockpitFdWatch *in_watch;
+
   GSource *out_source;
   GQueue *out_queue;
   gsize out_queued;
@@ -94,26 +100,53 @@ cockpit_stream_init (CockpitStream *self)
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, COCKPIT_TYPE_STREAM, CockpitStreamPrivate);
   self->priv->in_buffer = g_byte_array_new ();
   self->priv->out_queue = g_queue_new ();
+  self->priv->fd = -1;
 
   self->priv->context = g_main_context_ref_thread_default ();
 }
 
+static gboolean
+output_active (CockpitStream *self)
+{
+  return self->priv->out_source != NULL || cockpit_fd_watch_is_active (self->priv->out_watch);
+}
+
+static gboolean
+input_active (CockpitStream *self)
+{
+  return self->priv->in_source != NULL || cockpit_fd_watch_is_active (self->priv->in_watch);
+}
+
 static void
 stop_output (CockpitStream *self)
 {
-  g_assert (self->priv->out_source != NULL);
-  g_source_destroy (self->priv->out_source);
-  g_source_unref (self->priv->out_source);
-  self->priv->out_source = NULL;
+  g_assert (output_active (self));
+  if (self->priv->out_watch)
+    {
+      cockpit_fd_watch_stop (self->priv->out_watch);
+    }
+  else
+    {
+      g_source_destroy (self->priv->out_source);
+      g_source_unref (self->priv->out_source);
+      self->priv->out_source = NULL;
+    }
 }
 
 static void
 stop_input (CockpitStream *self)
 {
-  g_assert (self->priv->in_source != NULL);
-  g_source_destroy (self->priv->in_source);
-  g_source_unref (self->priv->in_source);
-  self->priv->in_source = NULL;
+  g_assert (input_active (self));
+  if (self->priv->in_watch)
+    {
+      cockpit_fd_watch_stop (self->priv->in_watch);
+    }
+  else
+    {
+      g_source_destroy (self->priv->in_source);
+      g_source_unref (self->priv->in_source);
+      self->priv->in_source = NULL;
+    }
 }
 
 static void
@@ -144,11 +177,17 @@ close_immediately (CockpitStream *self,
            self->priv->problem ? ": " : "",
            self->priv->problem ? self->priv->problem : "");
 
-  if (self->priv->in_source)
+  if (input_active (self))
     stop_input (self);
-  if (self->priv->out_source)
+  if (output_active (self))
     stop_output (self);
 
+  /* Before the socket gets closed */
+  cockpit_fd_watch_free (self->priv->in_watch);
+  self->priv->in_watch = NULL;
+  cockpit_fd_watch_free (self->priv->out_watch);
+  self->priv->out_watch = NULL;
+
   if (self->priv->io)
     {
       io = self->priv->io;
@@ -316,7 +355,7 @@ dispatch_input (GPollableInputStream *is,
 
   for (;;)
     {
-      g_return_val_if_fail (self->priv->in_source, FALSE);
+      g_return_val_if_fail (input_active (self), FALSE);
       len = self->priv->in_buffer->len;
 
       g_byte_array_set_size (self->priv->in_buffer, len + 1024);
@@ -378,7 +417,7 @@ dispatch_output (GPollableOutputStream *os,
   GBytes *popped;
   gssize ret;
 
-  g_return_val_if_fail (self->priv->out_source, FALSE);
+  g_return_val_if_fail (output_active (self), FALSE);
   while (self->priv->out_queue->head)
     {
       data = g_bytes_get_data (self->priv->out_queue->head->data, &len);
@@ -441,18 +480,49 @@ dispatch_output (GPollableOutputStream *os,
   return TRUE;
 }
 
+static gboolean
+dispatch_input_fd (gint fd,
+                   GIOCondition cond,
+                   gpointer user_data)
+{
+  CockpitStream *self = (CockpitStream *)user_data;
+  GInputStream *is = g_io_stream_get_input_stream (self->priv->io);
+  return dispatch_input (G_POLLABLE_INPUT_STREAM (is), self);
+}
+
+static gboolean
+dispatch_output_fd (gint fd,
+                    GIOCondition cond,
+                    gpointer user_data)
+{
+  CockpitStream *self = (CockpitStream *)user_data;
+  GOutputStream *os = g_io_stream_get_output_stream (self->priv->io);
+  return dispatch_output (G_POLLABLE_OUTPUT_STREAM (os), self);
+}
+
 static void
 start_output (CockpitStream *self)
 {
   GOutputStream *os;
 
-  g_assert (self->priv->out_source == NULL);
+  g_assert (!output_active (self));
 
   if (self->priv->connecting || self->priv->out_closed || self->priv->closed)
     return;
 
   g_assert (self->priv->io);
 
+  if (self->priv->fd >= 0)
+    {
+      if (!self->priv->out_watch)
+        {
+          self->priv->out_watch = cockpit_fd_watch_new (self->priv->context, self->priv->fd, G_IO_OUT,
+                                                        "stream-output", dispatch_output_fd, self);
+        }
+      cockpit_fd_watch_start (self->priv->out_watch);
+      return;
+    }
+
   os = g_io_stream_get_output_stream (self->priv->io);
   self->priv->out_source = g_pollable_output_stream_create_source (G_POLLABLE_OUTPUT_STREAM (os), NULL);
   g_source_set_name (self->priv->out_source, "stream-output");
@@ -465,10 +535,21 @@ start_input (CockpitStream *self)
 {
   GInputStream *is;
 
-  g_assert (self->priv->in_source == NULL);
+  g_assert (!input_active (self));
   g_assert (!self->priv->connecting);
   g_assert (self->priv->io != NULL);
 
+  if (self->priv->fd >= 0)
+    {
+      if (!self->priv->in_watch)
+        {
+          self->priv->in_watch = cockpit_fd_watch_new (self->priv->context, self->priv->fd, G_IO_IN,
+                                                       "stream-input", dispatch_input_fd, self);
+        }
+      cockpit_fd_watch_start (self->priv->in_watch);
+      return;
+    }
+
   is = g_io_stream_get_input_stream (self->priv->io);
   self->priv->in_source = g_pollable_input_stream_create_source (G_POLLABLE_INPUT_STREAM (is), NULL);
   g_source_set_name (self->priv->in_source, "stream-input");
@@ -482,7 +563,7 @@ initialize_io (CockpitStream *self)
   GInputStream *is;
   GOutputStream *os;
 
-  g_return_if_fail (self->priv->in_source == NULL);
+  g_return_if_fail (!input_active (self));
 
   is = g_io_stream_get_input_stream (self->priv->io);
   os = g_io_stream_get_output_stream (self->priv->io);
@@ -503,6 +584,13 @@ initialize_io (CockpitStream *self)
       self->priv->connecting = NULL;
     }
 
+  /*
+   * Plain sockets are ready when their fd is. Other streams, like TLS,
+   * may have data buffered, so need their own sources.
+   */
+  if (G_IS_SOCKET_CONNECTION (self->priv->io) && !G_IS_TCP_WRAPPER_CONNECTION (self->priv->io))
+    self->priv->fd = g_socket_get_fd (g_socket_connection_get_socket (G_SOCKET_CONNECTION (self->priv->io)));
+
   start_input (self);
 
   start_output (self);
@@ -599,6 +687,8 @@ cockpit_stream_finalize (GObject *object)
   g_assert (self->priv->closed);
   g_assert (!self->priv->in_source);
   g_assert (!self->priv->out_source);
+  g_assert (!self->priv->in_watch);
+  g_assert (!self->priv->out_watch);
 
   g_byte_array_unref (self->priv->in_buffer);
   g_queue_free (self->priv->out_queue);
@@ -743,7 +833,7 @@ cockpit_stream_write (CockpitStream *self,
   if (before < QUEUE_PRESSURE && self->priv->out_queued >= QUEUE_PRESSURE)
     cockpit_flow_emit_pressure (COCKPIT_FLOW (self), TRUE);
 
-  if (!self->priv->out_source && !self->priv->out_closed)
+  if (!output_active (self) && !self->priv->out_closed)
     {
       start_output (self);
     }
@@ -906,7 +996,7 @@ on_throttle_pressure (GObject *object,
   CockpitStream *self = COCKPIT_STREAM (user_data);
   if (throttle)
     {
-      if (self->priv->in_source != NULL)
+      if (input_active (self))
         {
           g_debug ("%s: applying back pressure in stream", self->priv->name);
           stop_input (self);
@@ -914,7 +1004,7 @@ on_throttle_pressure (GObject *object,
     }
   else
     {
-      if (self->priv->in_source == NULL && self->priv->io && !self->priv->connecting)
+      if (!input_active (self) && self->priv->io && !self->priv->connecting)
         {
           g_debug ("%s: relieving back pressure in stream", self->priv->name);
           start_input (self);
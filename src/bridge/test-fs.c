@@ -19,6 +19,7 @@
 
 #include "config.h"
 
+#include "cockpitechochannel.h"
 #include "cockpitfsread.h"
 #include "cockpitfsreplace.h"
 #include "cockpitfswatch.h"
@@ -725,6 +726,125 @@ test_write_expect_tag_fail (TestCase *tc,
   g_free (tag);
 }
 
+typedef struct {
+  TestCase *tc;
+  gint64 due;
+  gint64 worst;
+  gint probes;
+} EchoProbe;
+
+#define PROBE_INTERVAL 10
+
+static gboolean
+on_echo_probe (gpointer user_data)
+{
+  EchoProbe *probe = user_data;
+  GBytes *message;
+  GBytes *reply;
+  gint64 now;
+
+  /* Data sent on another channel should come right back */
+  message = g_bytes_new_static ("probe", 5);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (probe->tc->transport), "echo", message);
+  reply = mock_transport_pop_channel (probe->tc->transport, "echo");
+  g_assert (reply != NULL);
+  g_assert (g_bytes_equal (reply, message));
+  g_bytes_unref (message);
+
+  now = g_get_monotonic_time ();
+  probe->worst = MAX (probe->worst, now - probe->due);
+  probe->due = now + PROBE_INTERVAL * 1000;
+  probe->probes++;
+  return TRUE;
+}
+
+static void
+send_ping (TestCase *tc,
+           gint sequence)
+{
+  gchar *message;
+  GBytes *bytes;
+
+  message = g_strdup_printf ("{ \"command\": \"ping\", \"channel\": \"1234\", \"sequence\": %d }", sequence);
+  bytes = g_bytes_new_take (message, strlen (message));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), NULL, bytes);
+  g_bytes_unref (bytes);
+}
+
+static void
+test_write_large (TestCase *tc,
+                  gconstpointer unused)
+{
+  CockpitChannel *echo;
+  JsonObject *options;
+  JsonObject *control;
+  EchoProbe probe = { tc, };
+  GBytes *block;
+  const gsize block_size = 1024 * 1024;
+  gint window = 8;
+  gint blocks;
+  gint pongs = 0;
+  gint i;
+  guint timeout;
+  struct stat buf;
+
+  blocks = g_test_slow () ? 1024 : 64;
+  if (g_test_slow ())
+    alarm (TIMEOUT * 10);
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "payload", "echo");
+  echo = g_object_new (COCKPIT_TYPE_ECHO_CHANNEL,
+                       "transport", tc->transport,
+                       "id", "echo",
+                       "options", options,
+                       NULL);
+  json_object_unref (options);
+  cockpit_channel_prepare (echo);
+
+  setup_fsreplace_channel (tc, tc->test_path, NULL);
+
+  probe.due = g_get_monotonic_time () + PROBE_INTERVAL * 1000;
+  timeout = g_timeout_add (PROBE_INTERVAL, on_echo_probe, &probe);
+
+  /* Send like a peer would, with a ping after each block and a window of pings in flight */
+  block = g_bytes_new_take (g_malloc0 (block_size), block_size);
+  for (i = 0; i < blocks; i++)
+    {
+      cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "1234", block);
+      send_ping (tc, i);
+
+      while (i - pongs >= window)
+        {
+          control = mock_transport_pop_control (tc->transport);
+          if (!control)
+            g_main_context_iteration (NULL, TRUE);
+          else if (g_strcmp0 (json_object_get_string_member (control, "command"), "pong") == 0)
+            pongs++;
+        }
+    }
+  g_bytes_unref (block);
+
+  /* The done message waits for the file to be synced */
+  send_done (tc);
+  close_channel (tc, NULL);
+  wait_channel_closed (tc);
+
+  g_source_remove (timeout);
+
+  g_assert (stat (tc->test_path, &buf) >= 0);
+  g_assert_cmpint (buf.st_size, ==, (goffset)blocks * block_size);
+
+  if (g_test_perf ())
+    g_test_minimized_result (probe.worst / 1000.0, "worst echo latency: %.1f ms", probe.worst / 1000.0);
+
+  /* The main loop was never stuck on the disk */
+  g_assert_cmpint (probe.worst, <, G_USEC_PER_SEC / 2);
+
+  cockpit_channel_close (echo, NULL);
+  g_object_unref (echo);
+}
+
 static void
 test_watch_simple (TestCase *tc,
                    gconstpointer unused)
@@ -1030,6 +1150,8 @@ main (int argc,
               setup, test_write_expect_tag, teardown);
   g_test_add ("/fsreplace/expect-tag-fail", TestCase, NULL,
               setup, test_write_expect_tag_fail, teardown);
+  g_test_add ("/fsreplace/large", TestCase, NULL,
+              setup, test_write_large, teardown);
 
   g_test_add ("/fswatch/simple", TestCase, NULL,
               setup, test_watch_simple, teardown);
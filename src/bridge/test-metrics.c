@@ -23,11 +23,16 @@
 #include "cockpitmetrics.h"
 
 #include "cockpitinternalmetrics.h"
+#include "cockpitmountsamples.h"
 
+#include "common/cockpitchannelstats.h"
 #include "common/cockpittest.h"
 #include "common/cockpitjson.h"
 #include "common/mock-transport.h"
 
+#include <glib/gstdio.h>
+
+#include <string.h>
 #include <unistd.h>
 
 typedef struct {
@@ -850,6 +855,237 @@ test_cpu_cores (void)
   g_object_unref (transport);
 }
 
+static void
+test_bridge_channels (void)
+{
+  MockTransport *transport = mock_transport_new ();
+  CockpitChannel *channel;
+
+  JsonObject *options = json_obj ("{ 'payload': 'metrics1', "
+                                  "  'metrics': [ { 'name': 'bridge.channel.active' }, "
+                                  "               { 'name': 'bridge.channel.opened', 'derive': 'rate' } ], "
+                                  "  'interval': 1000"
+                                  "}");
+  GBytes *msg;
+  JsonObject *res, *description;
+  JsonArray *metrics, *instances, *all, *active;
+  JsonArray *samples;
+  GError *error = NULL;
+  gint index = -1;
+  guint i;
+
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+
+  /* As the router does for the payloads it handles */
+  cockpit_channel_stats_register ("metrics1");
+
+  channel = g_object_new (cockpit_internal_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+
+  cockpit_channel_prepare (channel);
+
+  /* receive meta information */
+  while ((msg = mock_transport_pop_channel (transport, "1234")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  res = cockpit_json_parse_bytes (msg, &error);
+  g_assert_no_error (error);
+  g_assert (res != NULL);
+
+  metrics = json_object_get_array_member (res, "metrics");
+  g_assert_cmpint (json_array_get_length (metrics), ==, 2);
+  description = json_array_get_object_element (metrics, 0);
+  g_assert_cmpstr (json_object_get_string_member (description, "name"), ==, "bridge.channel.active");
+  g_assert_cmpstr (json_object_get_string_member (description, "units"), ==, "count");
+
+  /* This channel itself is a metrics1 channel, so that instance is there */
+  instances = json_object_get_array_member (description, "instances");
+  for (i = 0; i < json_array_get_length (instances); i++)
+    {
+      if (g_str_equal (json_array_get_string_element (instances, i), "metrics1"))
+        index = i;
+    }
+  g_assert_cmpint (index, >=, 0);
+
+  samples = recv_array (transport);
+  g_assert_cmpint (json_array_get_length (samples), ==, 1);
+  all = json_array_get_array_element (samples, 0);
+  g_assert_cmpint (json_array_get_length (all), ==, 2);
+  active = json_array_get_array_element (all, 0);
+  g_assert_cmpint (json_array_get_int_element (active, index), >=, 1);
+
+  json_array_unref (samples);
+
+  json_object_unref (res);
+  g_object_unref (channel);
+  json_object_unref (options);
+  g_object_unref (transport);
+}
+
+static GMutex hung_mutex;
+static GCond hung_cond;
+static gboolean hung_released;
+
+static int
+mock_statvfs (const char *path,
+              struct statvfs *buf)
+{
+  /* Like an NFS server that has gone away */
+  if (g_str_has_prefix (path, "/hung"))
+    {
+      g_mutex_lock (&hung_mutex);
+      while (!hung_released)
+        g_cond_wait (&hung_cond, &hung_mutex);
+      g_mutex_unlock (&hung_mutex);
+    }
+
+  memset (buf, 0, sizeof (struct statvfs));
+  buf->f_frsize = 1024;
+  buf->f_blocks = 100;
+  buf->f_bfree = 40;
+  return 0;
+}
+
+static gboolean
+on_tick_count (gpointer user_data)
+{
+  guint *ticks = user_data;
+  (*ticks)++;
+  return TRUE;
+}
+
+static gint
+find_instance (JsonObject *meta,
+               guint metric,
+               const gchar *instance)
+{
+  JsonArray *instances;
+  JsonObject *description;
+  guint i;
+
+  description = json_array_get_object_element (json_object_get_array_member (meta, "metrics"), metric);
+  instances = json_object_get_array_member (description, "instances");
+  for (i = 0; instances && i < json_array_get_length (instances); i++)
+    {
+      if (g_str_equal (json_array_get_string_element (instances, i), instance))
+        return i;
+    }
+  return -1;
+}
+
+static void
+test_mount_hung (void)
+{
+  MockTransport *transport = mock_transport_new ();
+  CockpitChannel *channel;
+  JsonObject *options = json_obj ("{ 'metrics': [ { 'name': 'mount.total' }, "
+                                  "               { 'name': 'mount.stale' } ], "
+                                  "  'interval': 100"
+                                  "}");
+  /* More hung mounts than there are workers to begin with */
+  const gchar *mounts = "/dev/hung1 /hung1 nfs rw 0 0\n"
+                        "/dev/hung2 /hung2 nfs rw 0 0\n"
+                        "/dev/hung3 /hung3 nfs rw 0 0\n"
+                        "/dev/hung4 /hung4 nfs rw 0 0\n"
+                        "/dev/hung5 /hung5 nfs rw 0 0\n"
+                        "/dev/good /good ext4 rw 0 0\n";
+  JsonObject *meta = NULL;
+  JsonArray *samples = NULL;
+  JsonArray *all, *values;
+  GError *error = NULL;
+  gchar *path;
+  guint received = 0;
+  guint ticks = 0;
+  guint tick;
+  gint64 start;
+  gchar *hung;
+  gint i;
+  GBytes *msg;
+  JsonNode *node;
+  gint fd;
+
+  fd = g_file_open_tmp ("test-mounts.XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  close (fd);
+  g_file_set_contents (path, mounts, -1, &error);
+  g_assert_no_error (error);
+
+  hung_released = FALSE;
+  cockpit_mount_samples_mock (path, mock_statvfs);
+
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+  tick = g_timeout_add (10, on_tick_count, &ticks);
+
+  channel = g_object_new (cockpit_internal_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+
+  cockpit_channel_prepare (channel);
+
+  /* Samples keep coming, and the main loop keeps running, while /hung* hang */
+  start = g_get_monotonic_time ();
+  while (received < 5)
+    {
+      msg = recv_bytes (transport);
+      node = cockpit_json_parse (g_bytes_get_data (msg, NULL), g_bytes_get_size (msg), &error);
+      g_assert_no_error (error);
+      if (JSON_NODE_HOLDS_OBJECT (node))
+        {
+          if (meta)
+            json_object_unref (meta);
+          meta = json_node_dup_object (node);
+          g_clear_pointer (&samples, json_array_unref);
+        }
+      else
+        {
+          /* The first data after meta information has all the values */
+          if (!samples)
+            samples = json_node_dup_array (node);
+          received++;
+        }
+      json_node_free (node);
+    }
+
+  g_assert_cmpint (g_get_monotonic_time () - start, <, 2 * G_USEC_PER_SEC);
+  g_assert_cmpuint (ticks, >, 5);
+
+  /* The good mount has its size, the hung ones are stale with none */
+  g_assert (meta != NULL && samples != NULL);
+  all = json_array_get_array_element (samples, 0);
+  g_assert_cmpint (find_instance (meta, 0, "/good"), >=, 0);
+  values = json_array_get_array_element (all, 0);
+  g_assert_cmpint (json_array_get_int_element (values, find_instance (meta, 0, "/good")), ==, 100 * 1024);
+  values = json_array_get_array_element (all, 1);
+  g_assert_cmpint (json_array_get_int_element (values, find_instance (meta, 1, "/good")), ==, 0);
+  for (i = 1; i <= 5; i++)
+    {
+      hung = g_strdup_printf ("/hung%d", i);
+      g_assert_cmpint (find_instance (meta, 0, hung), ==, -1);
+      g_assert_cmpint (json_array_get_int_element (values, find_instance (meta, 1, hung)), ==, 1);
+      g_free (hung);
+    }
+
+  g_mutex_lock (&hung_mutex);
+  hung_released = TRUE;
+  g_cond_broadcast (&hung_cond);
+  g_mutex_unlock (&hung_mutex);
+
+  json_object_unref (meta);
+  json_array_unref (samples);
+  g_source_remove (tick);
+  g_object_unref (channel);
+  json_object_unref (options);
+  g_object_unref (transport);
+
+  cockpit_mount_samples_mock (NULL, NULL);
+  g_unlink (path);
+  g_free (path);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -879,6 +1115,8 @@ main (int argc,
   g_test_add_func ("/metrics/cgroup-memory", test_cgroup);
 
   g_test_add_func ("/metrics/cpu-cores", test_cpu_cores);
+  g_test_add_func ("/metrics/bridge-channels", test_bridge_channels);
+  g_test_add_func ("/metrics/mount-hung", test_mount_hung);
 
   return g_test_run ();
 }
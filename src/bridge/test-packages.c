@@ -1165,6 +1165,168 @@ test_reload_updated (TestCase *tc,
   teardown_reload_packages (datadir);
 }
 
+#define INCREMENTAL_PACKAGES 200
+
+static void
+write_package (const gchar *datadir,
+               guint number,
+               const gchar *description)
+{
+  GError *error = NULL;
+  gchar *directory;
+  gchar *filename;
+  gchar *manifest;
+
+  directory = g_strdup_printf ("%s/cockpit/package-%03u", datadir, number);
+  g_assert (g_mkdir_with_parents (directory, 0755) == 0);
+
+  manifest = g_strdup_printf ("{ \"description\": \"%s\" }", description);
+  filename = g_build_filename (directory, "manifest.json", NULL);
+  g_file_set_contents (filename, manifest, -1, &error);
+  g_assert_no_error (error);
+  g_free (filename);
+
+  filename = g_build_filename (directory, "index.html", NULL);
+  g_file_set_contents (filename, description, -1, &error);
+  g_assert_no_error (error);
+  g_free (filename);
+
+  g_free (manifest);
+  g_free (directory);
+}
+
+static GHashTable *
+snapshot_manifests (CockpitPackages *packages)
+{
+  GHashTable *snapshot;
+  JsonObject *json;
+  GList *names, *l;
+
+  snapshot = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)json_object_unref);
+  json = cockpit_packages_peek_json (packages);
+  names = json_object_get_members (json);
+  for (l = names; l != NULL; l = g_list_next (l))
+    {
+      if (g_str_equal (l->data, ".checksum"))
+        continue;
+      g_hash_table_insert (snapshot, g_strdup (l->data),
+                           json_object_ref (json_object_get_object_member (json, l->data)));
+    }
+  g_list_free (names);
+
+  return snapshot;
+}
+
+/*
+ * Packages which were not read again keep the very same manifest.
+ * Returns the new snapshot.
+ */
+static GHashTable *
+assert_rescanned (CockpitPackages *packages,
+                  GHashTable *snapshot,
+                  const gchar *changed)
+{
+  GHashTable *current;
+  GHashTableIter iter;
+  const gchar *name;
+  JsonObject *manifest;
+  guint rescanned = 0;
+
+  current = snapshot_manifests (packages);
+
+  g_hash_table_iter_init (&iter, current);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&name, (gpointer *)&manifest))
+    {
+      if (g_hash_table_lookup (snapshot, name) != manifest)
+        {
+          g_assert_cmpstr (name, ==, changed);
+          rescanned++;
+        }
+    }
+
+  g_assert_cmpuint (rescanned, ==, changed && g_hash_table_contains (current, changed) ? 1 : 0);
+
+  g_hash_table_unref (snapshot);
+  return current;
+}
+
+static void
+on_packages_changed (gconstpointer user_data)
+{
+  gint *changes = (gint *)user_data;
+  (*changes)++;
+}
+
+static void
+test_reload_incremental (void)
+{
+  const gchar *datadirs[] = { NULL, NULL };
+  CockpitPackages *packages;
+  GHashTable *snapshot;
+  GError *error = NULL;
+  JsonObject *json;
+  JsonObject *manifest;
+  gchar *datadir;
+  gint changes = 0;
+  guint i;
+
+  datadir = g_dir_make_tmp ("test-cockpit-packages.XXXXXX", &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < INCREMENTAL_PACKAGES; i++)
+    write_package (datadir, i, "original");
+
+  datadirs[0] = datadir;
+  cockpit_bridge_data_dirs = datadirs;
+  packages = cockpit_packages_new ();
+  cockpit_packages_on_change (packages, on_packages_changed, &changes);
+
+  snapshot = snapshot_manifests (packages);
+  g_assert_cmpuint (g_hash_table_size (snapshot), ==, INCREMENTAL_PACKAGES);
+
+  /* Nothing changed: no package is read again, and nobody is told */
+  cockpit_packages_reload (packages);
+  snapshot = assert_rescanned (packages, snapshot, NULL);
+  g_assert_cmpint (changes, ==, 0);
+
+  /* Modify one package */
+  write_package (datadir, 17, "modified");
+  cockpit_packages_reload (packages);
+  snapshot = assert_rescanned (packages, snapshot, "package-017");
+  g_assert_cmpint (changes, ==, 1);
+
+  json = cockpit_packages_peek_json (packages);
+  g_assert (cockpit_json_get_object (json, "package-017", NULL, &manifest));
+  g_assert_cmpstr (json_object_get_string_member (manifest, "description"), ==, "modified");
+  g_assert_cmpstr (json_object_get_string_member (manifest, ".checksum"), !=,
+                   cockpit_packages_get_checksum (packages));
+
+  /* Add one package */
+  write_package (datadir, INCREMENTAL_PACKAGES, "added");
+  cockpit_packages_reload (packages);
+  snapshot = assert_rescanned (packages, snapshot, "package-200");
+  g_assert_cmpint (changes, ==, 2);
+  g_assert_cmpuint (g_hash_table_size (snapshot), ==, INCREMENTAL_PACKAGES + 1);
+
+  /* Remove one package */
+  systemf ("rm -rf '%s/cockpit/package-042'", datadir);
+  cockpit_packages_reload (packages);
+  snapshot = assert_rescanned (packages, snapshot, NULL);
+  g_assert_cmpint (changes, ==, 3);
+  g_assert_cmpuint (g_hash_table_size (snapshot), ==, INCREMENTAL_PACKAGES);
+  g_assert (!g_hash_table_contains (snapshot, "package-042"));
+
+  g_hash_table_unref (snapshot);
+  cockpit_packages_on_change (packages, NULL, NULL);
+  cockpit_packages_free (packages);
+  cockpit_bridge_data_dirs = NULL;
+
+  systemf ("rm -rf '%s'", datadir);
+  g_free (datadir);
+
+  cockpit_assert_expected ();
+}
+
 static const Fixture fixture_csp_strip = {
   .path = "/strip/test.html",
   .datadirs = { SRCDIR "/src/bridge/mock-resource/csp", NULL },
@@ -1279,6 +1441,7 @@ main (int argc,
               setup_basic, test_reload_removed, teardown_basic);
   g_test_add ("/packages/reload/updated", TestCase, &fixture_reload,
               setup_basic, test_reload_updated, teardown_basic);
+  g_test_add_func ("/packages/reload/incremental", test_reload_incremental);
 
   g_test_add ("/packages/csp/strip", TestCase, &fixture_csp_strip,
               setup, test_csp_strip, teardown);
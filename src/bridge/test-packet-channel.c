@@ -541,6 +541,99 @@ test_recv_valid_batched (TestCase *tc,
   g_bytes_unref (received);
 }
 
+#define STRESS_PACKETS 500000
+#define STRESS_SIZE    64
+
+static void
+test_stress (TestCase *tc,
+             gconstpointer unused)
+{
+  GError *error = NULL;
+  gchar buffer[STRESS_SIZE];
+  GBytes *payload;
+  GBytes *sent;
+  gint64 start;
+  gdouble in_rate, out_rate;
+  guint wakeups = 0;
+  guint received = 0;
+  guint written = 0;
+  gssize ret;
+  gint i;
+
+  /* Wait until the socket has opened */
+  while (tc->conn_sock == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Don't echo, the test reads and writes the other end itself */
+  g_source_destroy (tc->conn_source);
+  g_source_unref (tc->conn_source);
+  tc->conn_source = NULL;
+  g_socket_set_blocking (tc->conn_sock, FALSE);
+
+  memset (buffer, 'x', sizeof (buffer));
+
+  /* Packets from the socket to the channel */
+  start = g_get_monotonic_time ();
+  while (received < STRESS_PACKETS)
+    {
+      while (written < STRESS_PACKETS)
+        {
+          ret = g_socket_send (tc->conn_sock, buffer, sizeof (buffer), NULL, &error);
+          if (ret < 0)
+            {
+              g_assert_error (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+              g_clear_error (&error);
+              break;
+            }
+          g_assert_cmpint (ret, ==, sizeof (buffer));
+          written++;
+        }
+
+      g_main_context_iteration (NULL, TRUE);
+      wakeups++;
+
+      while ((sent = mock_transport_pop_channel (tc->transport, "548")) != NULL)
+        {
+          g_assert_cmpuint (g_bytes_get_size (sent), ==, STRESS_SIZE);
+          received++;
+        }
+    }
+  in_rate = STRESS_PACKETS / ((g_get_monotonic_time () - start) / (gdouble)G_USEC_PER_SEC);
+
+  /* Several packets should have been read for each wakeup */
+  g_assert_cmpuint (received / wakeups, >=, 4);
+
+  /* Packets from the channel to the socket */
+  start = g_get_monotonic_time ();
+  payload = g_bytes_new (buffer, sizeof (buffer));
+  for (i = 0; i < STRESS_PACKETS; i++)
+    cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "548", payload);
+  g_bytes_unref (payload);
+
+  received = 0;
+  while (received < STRESS_PACKETS)
+    {
+      ret = g_socket_receive (tc->conn_sock, buffer, sizeof (buffer), NULL, &error);
+      if (ret < 0)
+        {
+          g_assert_error (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+          g_clear_error (&error);
+          g_main_context_iteration (NULL, TRUE);
+          continue;
+        }
+      g_assert_cmpint (ret, ==, STRESS_SIZE);
+      received++;
+    }
+  out_rate = STRESS_PACKETS / ((g_get_monotonic_time () - start) / (gdouble)G_USEC_PER_SEC);
+
+  if (g_test_perf ())
+    {
+      g_test_message ("packets per wakeup: %.1f", STRESS_PACKETS / (gdouble)wakeups);
+      g_test_maximized_result (in_rate, "received %.0f packets/s", in_rate);
+      g_test_maximized_result (out_rate, "sent %.0f packets/s", out_rate);
+    }
+}
+
 static void
 test_fail_not_found (void)
 {
@@ -637,6 +730,8 @@ main (int argc,
               setup_channel, test_recv_invalid, teardown);
   g_test_add ("/packet-channel/valid-recv-batched", TestCase, NULL,
               setup_channel, test_recv_valid_batched, teardown);
+  g_test_add ("/packet-channel/stress", TestCase, NULL,
+              setup_channel, test_stress, teardown);
 
   g_test_add_func ("/packet-channel/fail/not-found", test_fail_not_found);
   g_test_add_func ("/packet-channel/fail/access-denied", test_fail_access_denied);
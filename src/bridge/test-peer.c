@@ -288,6 +288,37 @@ test_simple (TestCase *tc,
   g_assert (tc->channel == NULL);
 }
 
+static void
+test_frozen_overflow (TestCase *tc,
+                      gconstpointer unused)
+{
+  JsonObject *control;
+  GBytes *block;
+  gint i;
+
+  cockpit_expect_message ("a: too much data queued while channel is frozen");
+
+  tc->peer = mock_peer_simple_new (tc->transport, "upper");
+
+  /* All of this arrives before the peer bridge is ready */
+  emit_string (tc, NULL, "{\"command\": \"open\", \"channel\": \"a\", \"payload\": \"upper\"}");
+  block = g_bytes_new_take (g_strnfill (1024 * 1024, 'x'), 1024 * 1024);
+  for (i = 0; i < 20; i++)
+    cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "a", block);
+  g_bytes_unref (block);
+
+  while ((control = mock_transport_pop_control (tc->transport)) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_assert_json_eq (control, "{\"command\":\"ready\",\"channel\":\"a\"}");
+
+  /* The peer bridge got the close for the overflowed channel and replies */
+  while ((control = mock_transport_pop_control (tc->transport)) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_assert_json_eq (control, "{\"command\":\"close\",\"channel\":\"a\",\"problem\":\"internal-error\"}");
+
+  g_assert (mock_transport_pop_channel (tc->transport, "a") == NULL);
+}
+
 static void
 test_serial (TestCase *tc,
              gconstpointer unused)
@@ -354,6 +385,60 @@ test_parallel (TestCase *tc,
   g_assert (tc->channel == NULL);
 }
 
+static void
+test_relay (TestCase *tc,
+            gconstpointer unused)
+{
+  static gchar block[64 * 1024];
+  GByteArray *received;
+  GBytes *sent;
+  guint count = 0;
+  gint64 start;
+  gsize total;
+  gsize i;
+
+  tc->peer = mock_peer_simple_new (tc->transport, "upper");
+
+  emit_string (tc, NULL, "{\"command\": \"open\", \"channel\": \"a\", \"payload\": \"upper\"}");
+
+  for (i = 0; i < sizeof (block); i++)
+    block[i] = 'a' + (i % 26);
+  sent = g_bytes_new_static (block, sizeof (block));
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < 256; i++)
+    cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "a", sent);
+  g_bytes_unref (sent);
+
+  total = 0;
+  received = g_byte_array_new ();
+  while (total < 256 * sizeof (block))
+    {
+      g_main_context_iteration (NULL, TRUE);
+      while ((sent = mock_transport_pop_channel (tc->transport, "a")) != NULL)
+        {
+          g_byte_array_append (received, g_bytes_get_data (sent, NULL), g_bytes_get_size (sent));
+          total += g_bytes_get_size (sent);
+          count++;
+        }
+    }
+
+  if (g_test_perf ())
+    {
+      g_test_maximized_result (total / ((g_get_monotonic_time () - start) / (gdouble)G_USEC_PER_SEC) / (1024 * 1024),
+                               "relayed through peer at %.1f MiB/s",
+                               total / ((g_get_monotonic_time () - start) / (gdouble)G_USEC_PER_SEC) / (1024 * 1024));
+    }
+
+  /* Every message came through as a frame, and the mock checked each one */
+  g_assert_cmpuint (received->len, ==, 256 * sizeof (block));
+  g_assert_cmpuint (mock_transport_count_frames (tc->transport), ==, count);
+  for (i = 0; i < received->len; i++)
+    g_assert_cmpint (received->data[i], ==, 'A' + (i % sizeof (block)) % 26);
+
+  g_byte_array_free (received, TRUE);
+}
+
 static void
 test_init_problem (TestCase *tc,
                    gconstpointer unused)
@@ -596,10 +681,14 @@ main (int argc,
 
   g_test_add ("/peer/simple", TestCase, NULL,
               setup, test_simple, teardown);
+  g_test_add ("/peer/frozen-overflow", TestCase, NULL,
+              setup, test_frozen_overflow, teardown);
   g_test_add ("/peer/serial", TestCase, NULL,
               setup, test_serial, teardown);
   g_test_add ("/peer/parallel", TestCase, NULL,
               setup, test_parallel, teardown);
+  g_test_add ("/peer/relay", TestCase, NULL,
+              setup, test_relay, teardown);
   g_test_add ("/peer/not-supported", TestCase, NULL,
               setup, test_not_supported, teardown);
   g_test_add ("/peer/fail-problem", TestCase, NULL,
@@ -42,6 +42,31 @@ setup (TestCase *tc,
   tc->connection = cockpit_dbus_internal_client();
 }
 
+static void
+on_deferred_startup (gpointer user_data)
+{
+  gboolean *started = user_data;
+  cockpit_dbus_process_startup ();
+  *started = TRUE;
+}
+
+static void
+setup_deferred (TestCase *tc,
+                gconstpointer unused)
+{
+  gboolean started = FALSE;
+
+  cockpit_dbus_internal_startup (FALSE);
+
+  cockpit_dbus_internal_defer (on_deferred_startup, &started);
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_false (started);
+
+  /* Only once someone wants to talk to the services */
+  tc->connection = cockpit_dbus_internal_client();
+  g_assert_true (started);
+}
+
 static void
 teardown (TestCase *tc,
           gconstpointer unused)
@@ -149,6 +174,8 @@ main (int argc,
 
   g_test_add ("/process/get-properties", TestCase, NULL,
               setup, test_get_properties, teardown);
+  g_test_add ("/process/deferred-startup", TestCase, NULL,
+              setup_deferred, test_get_properties, teardown);
 
   return g_test_run ();
 }
@@ -253,6 +253,187 @@ test_add_ref_remove (TestCase *test,
   g_assert (cockpit_dbus_rules_remove (test->rules, "/booo", FALSE, NULL, NULL, NULL) == FALSE);
 }
 
+static void
+test_member_arg0 (TestCase *test,
+                  gconstpointer fixture)
+{
+  /* Rules only differing in member or arg0 are distinct */
+  g_assert (cockpit_dbus_rules_add (test->rules, "/path", FALSE, NULL, "One", NULL) == TRUE);
+  g_assert (cockpit_dbus_rules_add (test->rules, "/path", FALSE, NULL, "Two", NULL) == TRUE);
+  g_assert (cockpit_dbus_rules_add (test->rules, "/path", FALSE, NULL, "Two", "arg") == TRUE);
+
+  g_assert (cockpit_dbus_rules_match (test->rules, "/path", NULL, "One", NULL) == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/path", NULL, "Two", NULL) == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/path", NULL, "Three", NULL) == FALSE);
+
+  g_assert (cockpit_dbus_rules_remove (test->rules, "/path", FALSE, NULL, "Two", NULL) == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/path", NULL, "Two", NULL) == FALSE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/path", NULL, "Two", "arg") == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/path", NULL, "One", NULL) == TRUE);
+}
+
+static void
+on_match_changed (const gchar *path,
+                  gboolean is_namespace,
+                  const gchar *interface,
+                  const gchar *member,
+                  const gchar *arg0,
+                  gpointer user_data,
+                  const gchar *prefix)
+{
+  GString *string = user_data;
+  g_string_append_printf (string, "%s%s%s %s %s %s\n", prefix, path, is_namespace ? "*" : "",
+                          interface ? interface : "-", member ? member : "-", arg0 ? arg0 : "-");
+}
+
+static void
+on_add_match (const gchar *path,
+              gboolean is_namespace,
+              const gchar *interface,
+              const gchar *member,
+              const gchar *arg0,
+              gpointer user_data)
+{
+  on_match_changed (path, is_namespace, interface, member, arg0, user_data, "+");
+}
+
+static void
+on_remove_match (const gchar *path,
+                 gboolean is_namespace,
+                 const gchar *interface,
+                 const gchar *member,
+                 const gchar *arg0,
+                 gpointer user_data)
+{
+  on_match_changed (path, is_namespace, interface, member, arg0, user_data, "-");
+}
+
+static void
+assert_matches (GString *string,
+                const gchar *expected)
+{
+  g_assert_cmpstr (string->str, ==, expected);
+  g_string_set_size (string, 0);
+}
+
+static void
+test_bus_matches (TestCase *test,
+                  gconstpointer fixture)
+{
+  GString *string = g_string_new ("");
+
+  cockpit_dbus_rules_add (test->rules, "/existing", FALSE, NULL, NULL, NULL);
+  cockpit_dbus_rules_set_match_funcs (test->rules, on_add_match, on_remove_match, string);
+  assert_matches (string, "+/existing - - -\n");
+
+  cockpit_dbus_rules_add (test->rules, "/org", TRUE, "org.Iface", NULL, NULL);
+  assert_matches (string, "+/org* org.Iface - -\n");
+
+  /* Covered by the namespace rule, nothing goes to the bus */
+  cockpit_dbus_rules_add (test->rules, "/org/sub", FALSE, "org.Iface", "Signal", NULL);
+  cockpit_dbus_rules_add (test->rules, "/org/sub", TRUE, "org.Iface", NULL, "arg");
+  assert_matches (string, "");
+
+  /* Not covered, as the interface differs */
+  cockpit_dbus_rules_add (test->rules, "/org/sub", FALSE, "org.Other", NULL, NULL);
+  assert_matches (string, "+/org/sub org.Other - -\n");
+
+  /* A broader rule replaces the others, added before they're removed */
+  cockpit_dbus_rules_add (test->rules, "/org", TRUE, NULL, NULL, NULL);
+  g_assert (g_str_has_prefix (string->str, "+/org* - - -\n"));
+  g_assert (strstr (string->str, "-/org* org.Iface - -\n"));
+  g_assert (strstr (string->str, "-/org/sub org.Other - -\n"));
+  g_string_set_size (string, 0);
+
+  /* A reference doesn't change anything */
+  cockpit_dbus_rules_add (test->rules, "/org", TRUE, NULL, NULL, NULL);
+  cockpit_dbus_rules_remove (test->rules, "/org", TRUE, NULL, NULL, NULL);
+  assert_matches (string, "");
+
+  /* Removing it brings back the narrower ones */
+  cockpit_dbus_rules_remove (test->rules, "/org", TRUE, NULL, NULL, NULL);
+  g_assert (strstr (string->str, "+/org* org.Iface - -\n"));
+  g_assert (strstr (string->str, "+/org/sub org.Other - -\n"));
+  g_assert (g_str_has_suffix (string->str, "-/org* - - -\n"));
+  g_string_set_size (string, 0);
+
+  cockpit_dbus_rules_remove (test->rules, "/org", TRUE, "org.Iface", NULL, NULL);
+  g_assert (strstr (string->str, "+/org/sub org.Iface Signal -\n"));
+  g_assert (strstr (string->str, "+/org/sub* org.Iface - arg\n"));
+  g_assert (g_str_has_suffix (string->str, "-/org* org.Iface - -\n"));
+  g_string_set_size (string, 0);
+
+  /* Userspace matching still works as before */
+  g_assert (cockpit_dbus_rules_match (test->rules, "/org/sub", "org.Iface", "Signal", NULL) == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/org/sub/deep", "org.Iface", "Signal", "arg") == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/org/sub/deep", "org.Iface", "Signal", "other") == FALSE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/org", "org.Iface", "Signal", NULL) == FALSE);
+
+  g_string_free (string, TRUE);
+}
+
+static void
+on_count_match (const gchar *path,
+                gboolean is_namespace,
+                const gchar *interface,
+                const gchar *member,
+                const gchar *arg0,
+                gpointer user_data)
+{
+  gint *count = user_data;
+  (*count)++;
+}
+
+static void
+test_bus_matches_many (TestCase *test,
+                       gconstpointer fixture)
+{
+  const gint n_rules = 20000;
+  gint changes = 0;
+  gchar *path;
+  gdouble elapsed;
+  gint i;
+
+  cockpit_dbus_rules_set_match_funcs (test->rules, on_count_match, on_count_match, &changes);
+
+  g_test_timer_start ();
+
+  /* Each of these is only compared against the rules at its own path */
+  for (i = 0; i < n_rules; i++)
+    {
+      path = g_strdup_printf ("/many/%d", i);
+      cockpit_dbus_rules_add (test->rules, path, FALSE, "org.Iface", NULL, NULL);
+      cockpit_dbus_rules_add (test->rules, path, FALSE, "org.Iface", "Signal", NULL);
+      g_free (path);
+    }
+
+  for (i = 0; i < n_rules; i++)
+    {
+      path = g_strdup_printf ("/many/%d", i);
+      cockpit_dbus_rules_remove (test->rules, path, FALSE, "org.Iface", NULL, NULL);
+      g_free (path);
+    }
+
+  elapsed = g_test_timer_elapsed ();
+  if (g_test_perf ())
+    g_test_minimized_result (elapsed, "%d rules added, %d removed in %.3f s", n_rules * 2, n_rules, elapsed);
+
+  /* Each broad rule was added and removed, and each narrow one added */
+  g_assert_cmpint (changes, ==, n_rules * 3);
+
+  /* This replaces all the narrow rules on the bus */
+  changes = 0;
+  cockpit_dbus_rules_add (test->rules, "/many", TRUE, NULL, NULL, NULL);
+  g_assert_cmpint (changes, ==, n_rules + 1);
+
+  changes = 0;
+  cockpit_dbus_rules_remove (test->rules, "/many", TRUE, NULL, NULL, NULL);
+  g_assert_cmpint (changes, ==, n_rules + 1);
+
+  g_assert (cockpit_dbus_rules_match (test->rules, "/many/7", "org.Iface", "Signal", NULL) == TRUE);
+  g_assert (cockpit_dbus_rules_match (test->rules, "/many/7", "org.Iface", "Other", NULL) == FALSE);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -273,6 +454,12 @@ main (int argc,
               setup, test_null_path, teardown);
   g_test_add ("/rules/add-ref-remove", TestCase, empty_rules,
               setup, test_add_ref_remove, teardown);
+  g_test_add ("/rules/member-arg0", TestCase, empty_rules,
+              setup, test_member_arg0, teardown);
+  g_test_add ("/rules/bus-matches", TestCase, empty_rules,
+              setup, test_bus_matches, teardown);
+  g_test_add ("/rules/bus-matches-many", TestCase, empty_rules,
+              setup, test_bus_matches_many, teardown);
 
   return g_test_run ();
 }
@@ -21,6 +21,8 @@
 
 #include "cockpitchannel.h"
 
+#include "common/cockpitchannelstats.h"
+#include "common/cockpitconf.h"
 #include "common/cockpitflow.h"
 #include "common/cockpitjson.h"
 #include "common/cockpitunicode.h"
@@ -63,14 +65,33 @@
  *  - It can optionally control another flow, by emitting a "pressure" signal
  *    when its peer receiving data does not respond to "ping" messages within
  *    a given window.
+ *
+ * The window is tuned to the link, much like TCP autotuning does: the time
+ * until each "pong" arrives gives the round trip time, and the window is
+ * set to twice the data acknowledged per round trip. A window that's too
+ * small gets filled up each round trip, and so it doubles. Once the link is
+ * the limit, it settles at twice the bandwidth-delay product. The shortest
+ * round trip seen is used, so that data queued along the way doesn't count.
  */
 
 /* Every 16K Send a ping */
 #define  CHANNEL_FLOW_PING        (16L * 1024L)
 
-/* Allow up to 1MB of data to be sent without ack */
+/* Allow up to 2MB of data to be sent without ack, until we know better */
 #define  CHANNEL_FLOW_WINDOW       (2L * 1024L * 1024L)
 
+/* The default bounds of the window, in kilobytes in cockpit.conf */
+#define  CHANNEL_FLOW_WINDOW_MIN   (256L * 1024L)
+#define  CHANNEL_FLOW_WINDOW_MAX   (16L * 1024L * 1024L)
+
+/* How long the shortest round trip is trusted for */
+#define  CHANNEL_FLOW_RTT_EXPIRY   (10L * G_USEC_PER_SEC)
+
+typedef struct {
+    gint64 sequence;
+    gint64 sent;
+} FlowPing;
+
 typedef struct {
     gulong recv_sig;
     gulong close_sig;
@@ -106,18 +127,38 @@ typedef struct {
     JsonObject *close_options;
 
     /* Buffer for incomplete unicode bytes */
-    GBytes *out_buffer;
+    guint8 out_tail[3];
+    gsize out_tail_len;
     gint buffer_timeout;
 
     /* The number of bytes sent, and current flow control window */
     gint64 out_sequence;
     gint64 out_window;
+    gboolean out_pressure;
+
+    /* Measuring the link, to tune the size of the window */
+    GQueue *out_pings;
+    gint64 out_acked;
+    gint64 flow_window;
+    gint64 flow_rtt;
+    gint64 flow_rtt_since;
+    gint64 flow_rate_sequence;
+    gint64 flow_rate_since;
 
     /* Another object giving back-pressure on received data */
     gboolean flow_control;
     CockpitFlow *pressure;
     gulong pressure_sig;
     GQueue *throttled;
+
+    /* Share of the transport when other channels are sending */
+    CockpitPriority priority;
+
+    /* Telemetry for this payload type */
+    CockpitChannelStats *stats;
+    gint64 open_time;
+    gint64 pressure_since;
+    gint64 throttled_since;
 } CockpitChannelPrivate;
 
 enum {
@@ -136,6 +177,12 @@ G_DEFINE_TYPE_WITH_CODE (CockpitChannel, cockpit_channel, G_TYPE_OBJECT,
                          G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_FLOW, cockpit_channel_flow_iface_init)
                          G_ADD_PRIVATE (CockpitChannel));
 
+static void
+flow_ping_free (gpointer data)
+{
+  g_slice_free (FlowPing, data);
+}
+
 static gboolean
 on_idle_prepare (gpointer data)
 {
@@ -154,7 +201,9 @@ cockpit_channel_init (CockpitChannel *self)
   CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
 
   priv->out_sequence = 0;
-  priv->out_window = CHANNEL_FLOW_WINDOW;
+  priv->flow_window = CLAMP (CHANNEL_FLOW_WINDOW, cockpit_channel_flow_window_min (),
+                             cockpit_channel_flow_window_max ());
+  priv->out_window = priv->flow_window;
 }
 
 static void
@@ -188,6 +237,9 @@ on_transport_recv (CockpitTransport *transport,
   if (g_strcmp0 (channel_id, priv->id) != 0)
     return FALSE;
 
+  priv->stats->frames_in++;
+  priv->stats->bytes_in += g_bytes_get_size (data);
+
   process_recv (self, data);
   return TRUE;
 }
@@ -210,18 +262,133 @@ process_ping (CockpitChannel *self,
       g_debug ("%s: replying to ping with pong", priv->id);
       json_object_set_string_member (ping, "command", "pong");
       payload = cockpit_json_write_bytes (ping);
-      cockpit_transport_send (priv->transport, NULL, payload);
+      cockpit_transport_send_control (priv->transport, priv->id, payload);
       g_bytes_unref (payload);
       return TRUE;
     }
 }
 
+static void
+end_pressure (CockpitChannel *self)
+{
+  CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
+
+  if (priv->pressure_since)
+    {
+      cockpit_histogram_add (&priv->stats->pressure, g_get_monotonic_time () - priv->pressure_since);
+      priv->pressure_since = 0;
+    }
+}
+
+static void
+end_throttled (CockpitChannel *self)
+{
+  CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
+
+  if (priv->throttled_since)
+    {
+      cockpit_histogram_add (&priv->stats->throttled, g_get_monotonic_time () - priv->throttled_since);
+      priv->throttled_since = 0;
+    }
+}
+
+static gint64
+lookup_flow_window (const gchar *field,
+                    gint64 default_value)
+{
+  /* In kilobytes, between 16K and 1G */
+  return (gint64)cockpit_conf_uint ("Channel", field, default_value / 1024,
+                                    1024 * 1024, CHANNEL_FLOW_PING / 1024) * 1024;
+}
+
+/**
+ * cockpit_channel_flow_window_min:
+ *
+ * The smallest flow control window a channel will tune itself down
+ * to. Set with the "FlowWindowMin" option in the "Channel" section
+ * of cockpit.conf, in kilobytes.
+ *
+ * Returns: the size in bytes
+ */
+gint64
+cockpit_channel_flow_window_min (void)
+{
+  static gint64 window_min = 0;
+
+  if (window_min == 0)
+    window_min = lookup_flow_window ("FlowWindowMin", CHANNEL_FLOW_WINDOW_MIN);
+  return window_min;
+}
+
+/**
+ * cockpit_channel_flow_window_max:
+ *
+ * The largest flow control window a channel will tune itself up
+ * to. Set with the "FlowWindowMax" option in the "Channel" section
+ * of cockpit.conf, in kilobytes.
+ *
+ * Returns: the size in bytes
+ */
+gint64
+cockpit_channel_flow_window_max (void)
+{
+  static gint64 window_max = 0;
+
+  if (window_max == 0)
+    {
+      window_max = lookup_flow_window ("FlowWindowMax", CHANNEL_FLOW_WINDOW_MAX);
+      window_max = MAX (window_max, cockpit_channel_flow_window_min ());
+    }
+  return window_max;
+}
+
+static void
+tune_flow_window (CockpitChannel *self,
+                  gint64 sequence,
+                  gint64 sent)
+{
+  CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
+  gint64 now = g_get_monotonic_time ();
+  gint64 elapsed;
+  gint64 rtt;
+
+  rtt = MAX (now - sent, 1);
+  if (!priv->flow_rtt || rtt <= priv->flow_rtt || now - priv->flow_rtt_since > CHANNEL_FLOW_RTT_EXPIRY)
+    {
+      priv->flow_rtt = rtt;
+      priv->flow_rtt_since = now;
+    }
+
+  if (!priv->flow_rate_since)
+    {
+      priv->flow_rate_since = now;
+      priv->flow_rate_sequence = sequence;
+      return;
+    }
+
+  /* Measure how much got acknowledged over at least a round trip */
+  elapsed = now - priv->flow_rate_since;
+  if (elapsed < priv->flow_rtt)
+    return;
+
+  priv->flow_window = (sequence - priv->flow_rate_sequence) * priv->flow_rtt / elapsed * 2;
+  priv->flow_window = CLAMP (priv->flow_window, cockpit_channel_flow_window_min (),
+                             cockpit_channel_flow_window_max ());
+  priv->flow_rate_since = now;
+  priv->flow_rate_sequence = sequence;
+
+  g_debug ("%s: round trip %" G_GINT64_FORMAT " usec, window now %" G_GINT64_FORMAT,
+           priv->id, priv->flow_rtt, priv->flow_window);
+}
+
 static void
 process_pong (CockpitChannel *self,
               JsonObject *pong)
 {
   CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
+  FlowPing *ping;
   gint64 sequence;
+  gint64 sent = 0;
 
   if (!priv->flow_control)
     return;
@@ -233,23 +400,41 @@ process_pong (CockpitChannel *self,
     }
 
   g_debug ("%s: received pong with sequence: %" G_GINT64_FORMAT, priv->id, sequence);
-  if (sequence > priv->out_window + (CHANNEL_FLOW_WINDOW * 10))
+  if (sequence > priv->out_window + (cockpit_channel_flow_window_max () * 10))
     {
       g_message ("%s: received a flow control ack with a suspiciously large sequence: %" G_GINT64_FORMAT,
                  priv->id, sequence);
     }
 
-  if (sequence >= priv->out_window)
+  if (sequence <= priv->out_acked)
+    return;
+
+  /* Up to this point has been confirmed received */
+  priv->out_acked = sequence;
+
+  /* Find when we sent the matching ping */
+  while (priv->out_pings && !g_queue_is_empty (priv->out_pings))
     {
-      /* Up to this point has been confirmed received */
-      priv->out_window = sequence + CHANNEL_FLOW_WINDOW;
+      ping = g_queue_peek_head (priv->out_pings);
+      if (ping->sequence > sequence)
+        break;
+      if (ping->sequence == sequence)
+        sent = ping->sent;
+      flow_ping_free (g_queue_pop_head (priv->out_pings));
+    }
 
-      /* If our sent bytes are within the window, no longer under pressure */
-      if (priv->out_sequence <= priv->out_window)
-        {
-          g_debug ("%s: got acknowledge of enough data, relieving back pressure", priv->id);
-          cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
-        }
+  if (sent)
+    tune_flow_window (self, sequence, sent);
+
+  priv->out_window = sequence + priv->flow_window;
+
+  /* If our sent bytes are within the window, no longer under pressure */
+  if (priv->out_pressure && priv->out_sequence <= priv->out_window)
+    {
+      g_debug ("%s: got acknowledge of enough data, relieving back pressure", priv->id);
+      priv->out_pressure = FALSE;
+      end_pressure (self);
+      cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
     }
 }
 
@@ -335,9 +520,10 @@ cockpit_channel_actual_send (CockpitChannel *self,
   GBytes *validated = NULL;
   guint64 out_sequence;
   JsonObject *ping;
+  FlowPing *sent;
   gsize size;
 
-  g_return_if_fail (priv->out_buffer == NULL);
+  g_return_if_fail (priv->out_tail_len == 0);
   g_return_if_fail (priv->buffer_timeout == 0);
 
   if (!trust_is_utf8)
@@ -348,6 +534,9 @@ cockpit_channel_actual_send (CockpitChannel *self,
 
   cockpit_transport_send (priv->transport, priv->id, payload);
 
+  priv->stats->frames_out++;
+  priv->stats->bytes_out += g_bytes_get_size (payload);
+
   /* A wraparound of our gint64 size? */
   if (priv->flow_control)
     {
@@ -360,7 +549,7 @@ cockpit_channel_actual_send (CockpitChannel *self,
 
       /* If we've sent more than the window, we just got under pressure;
        * do an edge trigger instead of level trigger to avoid ping/signal loops */
-      trigger_pressure = (priv->out_sequence <= priv->out_window) && (out_sequence > priv->out_window);
+      trigger_pressure = !priv->out_pressure && (out_sequence > priv->out_window);
 
       /* Every CHANNEL_FLOW_PING bytes we send a ping; also when applying back
        * pressure as there is otherwise nothing more to send and generate pings for */
@@ -368,9 +557,18 @@ cockpit_channel_actual_send (CockpitChannel *self,
         {
           ping = json_object_new ();
           json_object_set_int_member (ping, "sequence", out_sequence);
+          json_object_set_int_member (ping, "window", priv->flow_window);
           cockpit_channel_control (self, "ping", ping);
           g_debug ("%s: sending ping with sequence: %" G_GINT64_FORMAT, priv->id, out_sequence);
           json_object_unref (ping);
+
+          /* Remember when, to measure the round trip */
+          sent = g_slice_new (FlowPing);
+          sent->sequence = out_sequence;
+          sent->sent = g_get_monotonic_time ();
+          if (!priv->out_pings)
+            priv->out_pings = g_queue_new ();
+          g_queue_push_tail (priv->out_pings, sent);
         }
 
       priv->out_sequence = out_sequence;
@@ -379,6 +577,8 @@ cockpit_channel_actual_send (CockpitChannel *self,
         {
           g_debug ("%s: sent too much data without acknowledgement, emitting back pressure until %"
                    G_GINT64_FORMAT, priv->id, priv->out_window);
+          priv->out_pressure = TRUE;
+          priv->pressure_since = g_get_monotonic_time ();
           cockpit_flow_emit_pressure (COCKPIT_FLOW (self), TRUE);
         }
     }
@@ -394,11 +594,10 @@ flush_buffer (gpointer user_data)
   CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
   GBytes *payload;
 
-  if (priv->out_buffer)
+  if (priv->out_tail_len)
    {
-      payload = g_bytes_ref (priv->out_buffer);
-      g_bytes_unref (priv->out_buffer);
-      priv->out_buffer = NULL;
+      payload = g_bytes_new (priv->out_tail, priv->out_tail_len);
+      priv->out_tail_len = 0;
       if (priv->buffer_timeout)
           g_source_remove(priv->buffer_timeout);
       priv->buffer_timeout = 0;
@@ -415,12 +614,26 @@ cockpit_channel_constructed (GObject *object)
 {
   CockpitChannel *self = COCKPIT_CHANNEL (object);
   CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
+  const gchar *payload;
 
   G_OBJECT_CLASS (cockpit_channel_parent_class)->constructed (object);
 
   g_return_if_fail (priv->id != NULL);
   g_return_if_fail (priv->transport != NULL);
 
+  if (!priv->open_options || !cockpit_json_get_string (priv->open_options, "payload", NULL, &payload))
+    payload = NULL;
+  priv->stats = cockpit_channel_stats_get (payload);
+  priv->stats->opened++;
+  priv->stats->active++;
+  priv->open_time = g_get_monotonic_time ();
+
+  priv->priority = COCKPIT_PRIORITY_NORMAL;
+  if (priv->open_options)
+    priv->priority = cockpit_transport_parse_priority (priv->open_options);
+  if (priv->priority != COCKPIT_PRIORITY_NORMAL)
+    cockpit_transport_set_priority (priv->transport, priv->id, priv->priority);
+
   priv->capabilities = NULL;
   priv->recv_sig = g_signal_connect (priv->transport, "recv",
                                            G_CALLBACK (on_transport_recv), self);
@@ -622,15 +835,16 @@ cockpit_channel_dispose (GObject *object)
     g_source_remove(priv->buffer_timeout);
   priv->buffer_timeout = 0;
 
-  if (priv->out_buffer)
-    g_bytes_unref (priv->out_buffer);
-  priv->out_buffer = NULL;
+  priv->out_tail_len = 0;
 
   cockpit_flow_throttle (COCKPIT_FLOW (self), NULL);
   g_assert (priv->pressure == NULL);
   if (priv->throttled)
     g_queue_free_full (priv->throttled, (GDestroyNotify)json_object_unref);
   priv->throttled = NULL;
+  if (priv->out_pings)
+    g_queue_free_full (priv->out_pings, flow_ping_free);
+  priv->out_pings = NULL;
 
   G_OBJECT_CLASS (cockpit_channel_parent_class)->dispose (object);
 }
@@ -641,6 +855,9 @@ cockpit_channel_finalize (GObject *object)
   CockpitChannel *self = COCKPIT_CHANNEL (object);
   CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
 
+  if (priv->stats)
+    priv->stats->active--;
+
   g_object_unref (priv->transport);
   if (priv->open_options)
     json_object_unref (priv->open_options);
@@ -666,6 +883,11 @@ cockpit_channel_real_close (CockpitChannel *self,
 
   priv->sent_close = TRUE;
 
+  end_pressure (self);
+  end_throttled (self);
+  if (problem)
+    priv->stats->failed++;
+
   if (!priv->transport_closed)
     {
       flush_buffer (self);
@@ -688,8 +910,12 @@ cockpit_channel_real_close (CockpitChannel *self,
       message = cockpit_json_write_bytes (object);
       json_object_unref (object);
 
-      cockpit_transport_send (priv->transport, NULL, message);
+      cockpit_transport_send_control (priv->transport, priv->id, message);
       g_bytes_unref (message);
+
+      /* After the "close" message, which goes along with our data */
+      if (priv->priority != COCKPIT_PRIORITY_NORMAL)
+        cockpit_transport_set_priority (priv->transport, priv->id, COCKPIT_PRIORITY_NORMAL);
     }
 
   g_signal_emit (self, cockpit_channel_sig_closed, 0, problem);
@@ -871,6 +1097,12 @@ cockpit_channel_ready (CockpitChannel *self,
 
   g_object_ref (self);
 
+  if (priv->open_time)
+    {
+      cockpit_histogram_add (&priv->stats->ready, g_get_monotonic_time () - priv->open_time);
+      priv->open_time = 0;
+    }
+
   cockpit_transport_thaw (priv->transport, priv->id);
   cockpit_channel_control (self, "ready", message);
 
@@ -896,36 +1128,55 @@ cockpit_channel_send (CockpitChannel *self,
   CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
   const guint8 *data;
   gsize length;
+  gsize incomplete = 0;
   GBytes *send_data = payload;
+  GBytes *head;
   GByteArray *combined;
 
   if (priv->buffer_timeout)
     g_source_remove(priv->buffer_timeout);
   priv->buffer_timeout = 0;
 
-  if (priv->out_buffer)
-    {
-      combined = g_bytes_unref_to_array (priv->out_buffer);
-      priv->out_buffer = NULL;
+  data = g_bytes_get_data (payload, &length);
 
-      data = g_bytes_get_data (payload, &length);
+  if (priv->out_tail_len)
+    {
+      combined = g_byte_array_sized_new (priv->out_tail_len + length);
+      g_byte_array_append (combined, priv->out_tail, priv->out_tail_len);
       g_byte_array_append (combined, data, length);
+      priv->out_tail_len = 0;
+
       send_data = g_byte_array_free_to_bytes (combined);
+      data = g_bytes_get_data (send_data, &length);
 
       trust_is_utf8 = FALSE;
     }
 
+  /*
+   * Validate once here, so we don't need to do it again when sending.
+   * Only invalid data gets copied to be repaired.
+   */
   if (!trust_is_utf8 && !priv->binary_ok)
+    trust_is_utf8 = cockpit_unicode_validate (data, length, &incomplete);
+
+  /* Hold back an incomplete character until the rest of it arrives */
+  if (incomplete > 0)
     {
-      if (cockpit_unicode_has_incomplete_ending (send_data))
+      if (length > incomplete)
         {
-          priv->out_buffer = g_bytes_ref (send_data);
-          priv->buffer_timeout = g_timeout_add (500, flush_buffer, self);
+          head = g_bytes_new_from_bytes (send_data, 0, length - incomplete);
+          cockpit_channel_actual_send (self, head, trust_is_utf8);
+          g_bytes_unref (head);
         }
-    }
 
-  if (!priv->buffer_timeout)
-    cockpit_channel_actual_send (self, send_data, trust_is_utf8);
+      memcpy (priv->out_tail, data + length - incomplete, incomplete);
+      priv->out_tail_len = incomplete;
+      priv->buffer_timeout = g_timeout_add (500, flush_buffer, self);
+    }
+  else
+    {
+      cockpit_channel_actual_send (self, send_data, trust_is_utf8);
+    }
 
   if (send_data != payload)
     g_bytes_unref (send_data);
@@ -965,6 +1216,23 @@ cockpit_channel_get_transport (CockpitChannel *self)
   return priv->transport;
 }
 
+/**
+ * cockpit_channel_get_flow_window:
+ * @self: a channel
+ *
+ * Get the current size of the flow control window, which is tuned
+ * to the link as "pong" messages arrive.
+ *
+ * Returns: the size in bytes
+ */
+gint64
+cockpit_channel_get_flow_window (CockpitChannel *self)
+{
+  CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
+  g_return_val_if_fail (COCKPIT_IS_CHANNEL (self), 0);
+  return priv->flow_window;
+}
+
 /**
  * cockpit_channel_close_options
  * @self: a channel
@@ -1069,6 +1337,9 @@ cockpit_channel_control (CockpitChannel *self,
     {
       g_return_if_fail (priv->sent_done == FALSE);
       priv->sent_done = TRUE;
+
+      /* Anything held back has to go out before the EOF */
+      flush_buffer (self);
     }
 
   /* If closing save the close options
@@ -1104,7 +1375,7 @@ cockpit_channel_control (CockpitChannel *self,
   message = cockpit_json_write_bytes (object);
   json_object_unref (object);
 
-  cockpit_transport_send (priv->transport, NULL, message);
+  cockpit_transport_send_control (priv->transport, priv->id, message);
   g_bytes_unref (message);
 
 out:
@@ -1125,9 +1396,12 @@ on_throttle_pressure (GObject *object,
     {
       if (!priv->throttled)
         priv->throttled = g_queue_new ();
+      if (!priv->throttled_since)
+        priv->throttled_since = g_get_monotonic_time ();
     }
   else
     {
+      end_throttled (self);
       throttled = priv->throttled;
       priv->throttled = NULL;
       while (throttled)
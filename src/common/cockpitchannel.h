@@ -68,6 +68,12 @@ const gchar *       cockpit_channel_get_id            (CockpitChannel *self);
 
 CockpitTransport *  cockpit_channel_get_transport     (CockpitChannel *self);
 
+gint64              cockpit_channel_get_flow_window   (CockpitChannel *self);
+
+gint64              cockpit_channel_flow_window_min   (void);
+
+gint64              cockpit_channel_flow_window_max   (void);
+
 /* Used by implementations */
 
 void                cockpit_channel_control           (CockpitChannel *self,
@@ -0,0 +1,202 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitchannelstats.h"
+
+#include <string.h>
+
+/*
+ * Telemetry about channels, kept per payload type for the life of the
+ * process. Channels look up their entry once when created and then just
+ * bump plain counters, so this is cheap enough to leave on all the time.
+ * Entries are never freed, which keeps those pointers valid.
+ *
+ * Only payload types that were registered get an entry of their own.
+ * The payload in an "open" message comes from the caller, so all other
+ * ones share a single "other" entry, and can't grow the table.
+ *
+ * Like the rest of the bridge, this is only used from the main thread.
+ */
+
+static GHashTable *channel_stats = NULL;
+
+/**
+ * cockpit_channel_stats_register:
+ * @payload: a payload type that this process handles or routes
+ *
+ * Give @payload an entry of its own. Registering the same payload
+ * again returns the same entry.
+ *
+ * Returns: (transfer none): the stats for @payload
+ */
+CockpitChannelStats *
+cockpit_channel_stats_register (const gchar *payload)
+{
+  CockpitChannelStats *stats;
+
+  g_return_val_if_fail (payload != NULL, NULL);
+
+  if (!channel_stats)
+    channel_stats = g_hash_table_new (g_str_hash, g_str_equal);
+
+  stats = g_hash_table_lookup (channel_stats, payload);
+  if (!stats)
+    {
+      stats = g_new0 (CockpitChannelStats, 1);
+      stats->payload = g_strdup (payload);
+      g_hash_table_insert (channel_stats, stats->payload, stats);
+    }
+
+  return stats;
+}
+
+/**
+ * cockpit_channel_stats_get:
+ * @payload: (nullable): the payload type of a channel
+ *
+ * Returns: (transfer none): the stats for @payload if it was
+ *          registered, or else the shared "other" stats
+ */
+CockpitChannelStats *
+cockpit_channel_stats_get (const gchar *payload)
+{
+  CockpitChannelStats *stats = NULL;
+
+  if (payload && channel_stats)
+    stats = g_hash_table_lookup (channel_stats, payload);
+  if (!stats)
+    stats = cockpit_channel_stats_register ("other");
+
+  return stats;
+}
+
+static gint
+compare_payload (gconstpointer a,
+                 gconstpointer b)
+{
+  const CockpitChannelStats *sa = a;
+  const CockpitChannelStats *sb = b;
+  return strcmp (sa->payload, sb->payload);
+}
+
+/**
+ * cockpit_channel_stats_foreach:
+ * @func: called with each CockpitChannelStats
+ * @user_data: passed to @func
+ *
+ * Visit the stats for every payload type seen so far, sorted
+ * by payload.
+ */
+void
+cockpit_channel_stats_foreach (GFunc func,
+                               gpointer user_data)
+{
+  GList *values;
+
+  if (!channel_stats)
+    return;
+
+  values = g_list_sort (g_hash_table_get_values (channel_stats), compare_payload);
+  g_list_foreach (values, func, user_data);
+  g_list_free (values);
+}
+
+/**
+ * cockpit_channel_stats_reset:
+ *
+ * Zero all counters apart from the number of active channels. The
+ * entries stay, so pointers held by open channels remain valid.
+ * Used by tests.
+ */
+void
+cockpit_channel_stats_reset (void)
+{
+  GHashTableIter iter;
+  CockpitChannelStats *stats;
+  gchar *payload;
+  guint64 active;
+
+  if (!channel_stats)
+    return;
+
+  g_hash_table_iter_init (&iter, channel_stats);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&stats))
+    {
+      payload = stats->payload;
+      active = stats->active;
+      memset (stats, 0, sizeof (CockpitChannelStats));
+      stats->payload = payload;
+      stats->active = active;
+    }
+}
+
+void
+cockpit_histogram_add (CockpitHistogram *histogram,
+                       gint64 usec)
+{
+  guint bucket;
+
+  if (usec < 0)
+    usec = 0;
+
+  bucket = g_bit_storage ((gulong)usec);
+  if (usec == 0)
+    bucket = 0;
+  if (bucket >= COCKPIT_CHANNEL_STATS_BUCKETS)
+    bucket = COCKPIT_CHANNEL_STATS_BUCKETS - 1;
+
+  histogram->count++;
+  histogram->total += usec;
+  histogram->buckets[bucket]++;
+}
+
+/**
+ * cockpit_histogram_percentile:
+ * @histogram: the histogram
+ * @percentile: between 0 and 1
+ *
+ * Returns: the upper bound in microseconds of the bucket that
+ *          contains the given percentile, or zero if empty
+ */
+guint64
+cockpit_histogram_percentile (CockpitHistogram *histogram,
+                              gdouble percentile)
+{
+  guint64 seen = 0;
+  guint64 want;
+  guint i;
+
+  if (histogram->count == 0)
+    return 0;
+
+  want = (guint64)(percentile * histogram->count + 0.5);
+  if (want < 1)
+    want = 1;
+
+  for (i = 0; i < COCKPIT_CHANNEL_STATS_BUCKETS - 1; i++)
+    {
+      seen += histogram->buckets[i];
+      if (seen >= want)
+        return G_GUINT64_CONSTANT (1) << i;
+    }
+
+  return G_GUINT64_CONSTANT (1) << i;
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_CHANNEL_STATS_H__
+#define __COCKPIT_CHANNEL_STATS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Bucket N counts durations below 2^N microseconds, the last one the rest */
+#define COCKPIT_CHANNEL_STATS_BUCKETS 26
+
+typedef struct {
+  guint64 count;
+  guint64 total;
+  guint64 buckets[COCKPIT_CHANNEL_STATS_BUCKETS];
+} CockpitHistogram;
+
+typedef struct {
+  gchar *payload;
+
+  /* Channels handled in this process */
+  guint64 opened;
+  guint64 active;
+  guint64 failed;
+
+  /* Channels the router handed to a peer bridge, or refused */
+  guint64 routed;
+  guint64 refused;
+
+  guint64 frames_in;
+  guint64 bytes_in;
+  guint64 frames_out;
+  guint64 bytes_out;
+
+  /* Time from open until ready */
+  CockpitHistogram ready;
+
+  /* Time spent with too much unacknowledged data sent */
+  CockpitHistogram pressure;
+
+  /* Time spent throttled by another flow, like a pipe or websocket */
+  CockpitHistogram throttled;
+} CockpitChannelStats;
+
+CockpitChannelStats *   cockpit_channel_stats_register      (const gchar *payload);
+
+CockpitChannelStats *   cockpit_channel_stats_get           (const gchar *payload);
+
+void                    cockpit_channel_stats_foreach       (GFunc func,
+                                                             gpointer user_data);
+
+void                    cockpit_channel_stats_reset         (void);
+
+void                    cockpit_histogram_add               (CockpitHistogram *histogram,
+                                                             gint64 usec);
+
+guint64                 cockpit_histogram_percentile        (CockpitHistogram *histogram,
+                                                             gdouble percentile);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_CHANNEL_STATS_H__ */
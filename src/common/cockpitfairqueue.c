@@ -0,0 +1,242 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include "cockpitfairqueue.h"
+
+/*
+ * A queue of outgoing blocks, split into lanes, usually one per
+ * channel. Lanes are drained with deficit round robin: each round
+ * a lane may send a quantum of bytes proportional to its weight.
+ *
+ * The lane only changes at a block marked as a boundary, so a frame
+ * queued as several blocks is never interleaved with another. All
+ * the blocks of a frame should be pushed together.
+ *
+ * Blocks are allowed to overdraw a lane, rather than waiting until
+ * enough quantum has built up. The debt is paid off in the following
+ * rounds, so the share each lane gets stays the same, and a large
+ * block is never held back. A lane only exists while it has blocks
+ * queued.
+ */
+
+#define QUANTUM 4096
+
+typedef struct {
+  gpointer item;
+  gsize size;
+  gboolean boundary;
+} Block;
+
+typedef struct {
+  gchar *name;
+  guint weight;
+  gssize deficit;
+  gboolean serving;
+  GQueue blocks;
+} Lane;
+
+struct _CockpitFairQueue {
+  GDestroyNotify destroy;
+  GHashTable *lanes;
+  GQueue round;
+};
+
+static void
+lane_free (CockpitFairQueue *queue,
+           Lane *lane)
+{
+  Block *block;
+
+  while ((block = g_queue_pop_head (&lane->blocks)))
+    {
+      if (queue->destroy)
+        (queue->destroy) (block->item);
+      g_slice_free (Block, block);
+    }
+
+  g_free (lane->name);
+  g_slice_free (Lane, lane);
+}
+
+/**
+ * cockpit_fair_queue_new:
+ * @destroy: called to free items still queued, or NULL
+ *
+ * Returns: (transfer full): a new empty queue
+ */
+CockpitFairQueue *
+cockpit_fair_queue_new (GDestroyNotify destroy)
+{
+  CockpitFairQueue *queue = g_new0 (CockpitFairQueue, 1);
+  queue->destroy = destroy;
+  queue->lanes = g_hash_table_new (g_str_hash, g_str_equal);
+  g_queue_init (&queue->round);
+  return queue;
+}
+
+void
+cockpit_fair_queue_clear (CockpitFairQueue *queue)
+{
+  Lane *lane;
+
+  g_return_if_fail (queue != NULL);
+
+  g_hash_table_remove_all (queue->lanes);
+  while ((lane = g_queue_pop_head (&queue->round)))
+    lane_free (queue, lane);
+}
+
+void
+cockpit_fair_queue_free (CockpitFairQueue *queue)
+{
+  if (!queue)
+    return;
+
+  cockpit_fair_queue_clear (queue);
+  g_hash_table_destroy (queue->lanes);
+  g_free (queue);
+}
+
+/**
+ * cockpit_fair_queue_push:
+ * @queue: the queue
+ * @lane: the lane to queue in, or NULL for the default
+ * @weight: relative share of the lane, at least 1
+ * @item: the item to queue
+ * @size: the size of @item in bytes
+ * @boundary: whether another lane may go after this item
+ *
+ * Queue @item at the end of @lane. The @weight replaces any
+ * weight that the lane had before.
+ */
+void
+cockpit_fair_queue_push (CockpitFairQueue *queue,
+                         const gchar *lane,
+                         guint weight,
+                         gpointer item,
+                         gsize size,
+                         gboolean boundary)
+{
+  Block *block;
+  Lane *ln;
+
+  g_return_if_fail (queue != NULL);
+
+  if (!lane)
+    lane = "";
+
+  ln = g_hash_table_lookup (queue->lanes, lane);
+  if (!ln)
+    {
+      ln = g_slice_new0 (Lane);
+      ln->name = g_strdup (lane);
+      g_queue_init (&ln->blocks);
+      g_hash_table_insert (queue->lanes, ln->name, ln);
+      g_queue_push_tail (&queue->round, ln);
+    }
+
+  ln->weight = MAX (weight, 1);
+
+  block = g_slice_new (Block);
+  block->item = item;
+  block->size = size;
+  block->boundary = boundary;
+  g_queue_push_tail (&ln->blocks, block);
+}
+
+/**
+ * cockpit_fair_queue_pop:
+ * @queue: the queue
+ * @size: (out) (optional): location for the size of the item
+ *
+ * Take the next item to send, or NULL if the queue is empty.
+ *
+ * Returns: (transfer full): the item
+ */
+gpointer
+cockpit_fair_queue_pop (CockpitFairQueue *queue,
+                        gsize *size)
+{
+  gpointer item;
+  Block *block;
+  Lane *lane;
+
+  g_return_val_if_fail (queue != NULL, NULL);
+
+  for (;;)
+    {
+      lane = g_queue_peek_head (&queue->round);
+      if (!lane)
+        return NULL;
+
+      if (lane->serving)
+        break;
+
+      lane->deficit += QUANTUM * (gssize)lane->weight;
+
+      /* Still paying off a large block, skip a turn */
+      if (lane->deficit <= 0 && queue->round.length > 1)
+        {
+          g_queue_pop_head (&queue->round);
+          g_queue_push_tail (&queue->round, lane);
+          continue;
+        }
+
+      lane->serving = TRUE;
+      break;
+    }
+
+  block = g_queue_pop_head (&lane->blocks);
+  lane->deficit -= block->size;
+
+  if (g_queue_is_empty (&lane->blocks))
+    {
+      g_queue_pop_head (&queue->round);
+      g_hash_table_remove (queue->lanes, lane->name);
+      lane_free (queue, lane);
+    }
+  else if (block->boundary && lane->deficit <= 0)
+    {
+      /* Used up its quantum, move on to the next lane */
+      lane->serving = FALSE;
+      g_queue_pop_head (&queue->round);
+      g_queue_push_tail (&queue->round, lane);
+
+      /* No debt is owed to lanes that weren't waiting */
+      if (queue->round.length == 1)
+        lane->deficit = 0;
+    }
+
+  item = block->item;
+  if (size)
+    *size = block->size;
+  g_slice_free (Block, block);
+
+  return item;
+}
+
+gboolean
+cockpit_fair_queue_is_empty (CockpitFairQueue *queue)
+{
+  g_return_val_if_fail (queue != NULL, TRUE);
+  return g_queue_is_empty (&queue->round);
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __COCKPIT_FAIR_QUEUE_H__
+#define __COCKPIT_FAIR_QUEUE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Share of the outgoing data a channel gets when several are busy */
+typedef enum {
+  COCKPIT_PRIORITY_LOW = 1,
+  COCKPIT_PRIORITY_NORMAL = 4,
+  COCKPIT_PRIORITY_HIGH = 16,
+} CockpitPriority;
+
+/* The weight of data pushed without a lane */
+#define COCKPIT_FAIR_QUEUE_DEFAULT_WEIGHT COCKPIT_PRIORITY_NORMAL
+
+typedef struct _CockpitFairQueue CockpitFairQueue;
+
+CockpitFairQueue *  cockpit_fair_queue_new        (GDestroyNotify destroy);
+
+void                cockpit_fair_queue_free       (CockpitFairQueue *queue);
+
+void                cockpit_fair_queue_push       (CockpitFairQueue *queue,
+                                                   const gchar *lane,
+                                                   guint weight,
+                                                   gpointer item,
+                                                   gsize size,
+                                                   gboolean boundary);
+
+gpointer            cockpit_fair_queue_pop        (CockpitFairQueue *queue,
+                                                   gsize *size);
+
+gboolean            cockpit_fair_queue_is_empty   (CockpitFairQueue *queue);
+
+void                cockpit_fair_queue_clear      (CockpitFairQueue *queue);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_FAIR_QUEUE_H__ */
@@ -0,0 +1,501 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitfdwatch.h"
+
+#include <sys/epoll.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+/*
+ * A CockpitFdWatch calls back when a file descriptor becomes readable
+ * or writable, much like a GUnixFDSource. But instead of a GSource that
+ * has to be created and destroyed each time the caller stops and starts
+ * watching, all watches in a main context share an epoll instance. GLib
+ * only polls that, and the file descriptors stay registered with it for
+ * as long as the watches exist. Stopping and starting just changes which
+ * events we're interested in.
+ *
+ * Set $COCKPIT_NO_EPOLL to use a GUnixFDSource per watch instead.
+ */
+
+#define MAX_EVENTS 64
+
+typedef struct {
+  GSource source;
+  gint epfd;
+  gpointer tag;
+  GHashTable *entries;
+  guint32 serial;
+} EpollSource;
+
+/* A file descriptor registered with epoll, with at most one watch each way */
+typedef struct {
+  gint fd;
+  guint32 serial;
+  guint32 events;
+  CockpitFdWatch *in;
+  CockpitFdWatch *out;
+} FdEntry;
+
+struct _CockpitFdWatch {
+  gint fd;
+  GIOCondition condition;
+  GUnixFDSourceFunc func;
+  gpointer user_data;
+  gboolean active;
+
+  /* When sharing an epoll instance */
+  EpollSource *epoll;
+
+  /* Otherwise, a source of our own while active */
+  GMainContext *context;
+  gchar *name;
+  GSource *source;
+
+  /* Set while dispatching, so we can tell if freed meanwhile */
+  gboolean *freed;
+};
+
+G_LOCK_DEFINE_STATIC (epoll_sources);
+static GHashTable *epoll_sources = NULL;
+
+static void
+dispatch_watch (CockpitFdWatch *watch,
+                GIOCondition cond)
+{
+  gboolean freed = FALSE;
+  gboolean ret;
+
+  watch->freed = &freed;
+  ret = (watch->func) (watch->fd, cond, watch->user_data);
+  if (freed)
+    return;
+  watch->freed = NULL;
+
+  /* Like a GSource, returning FALSE stops the watch */
+  if (!ret)
+    cockpit_fd_watch_stop (watch);
+}
+
+static FdEntry *
+lookup_entry (EpollSource *epoll,
+              guint64 data)
+{
+  FdEntry *entry;
+
+  entry = g_hash_table_lookup (epoll->entries, GINT_TO_POINTER ((gint)(data & G_MAXUINT32)));
+
+  /* The fd may have been unregistered, and maybe reused, by an earlier callback */
+  if (entry && entry->serial != (guint32)(data >> 32))
+    return NULL;
+
+  return entry;
+}
+
+static gboolean
+epoll_source_dispatch (GSource *source,
+                       GSourceFunc callback,
+                       gpointer user_data)
+{
+  EpollSource *epoll = (EpollSource *)source;
+  struct epoll_event events[MAX_EVENTS];
+  const GIOCondition in = G_IO_IN | G_IO_HUP | G_IO_ERR;
+  const GIOCondition out = G_IO_OUT | G_IO_HUP | G_IO_ERR;
+  GIOCondition cond;
+  FdEntry *entry;
+  gint i, n;
+
+  n = epoll_wait (epoll->epfd, events, MAX_EVENTS, 0);
+  if (n < 0)
+    {
+      if (errno != EINTR)
+        g_warning ("couldn't wait for epoll events: %s", g_strerror (errno));
+      return G_SOURCE_CONTINUE;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      cond = 0;
+      if (events[i].events & EPOLLIN)
+        cond |= G_IO_IN;
+      if (events[i].events & EPOLLOUT)
+        cond |= G_IO_OUT;
+      if (events[i].events & EPOLLHUP)
+        cond |= G_IO_HUP;
+      if (events[i].events & EPOLLERR)
+        cond |= G_IO_ERR;
+
+      entry = lookup_entry (epoll, events[i].data.u64);
+      if (entry && entry->in && entry->in->active && (cond & in))
+        dispatch_watch (entry->in, cond & in);
+
+      entry = lookup_entry (epoll, events[i].data.u64);
+      if (entry && entry->out && entry->out->active && (cond & out))
+        dispatch_watch (entry->out, cond & out);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+epoll_source_finalize (GSource *source)
+{
+  EpollSource *epoll = (EpollSource *)source;
+
+  g_hash_table_destroy (epoll->entries);
+  close (epoll->epfd);
+}
+
+static GSourceFuncs epoll_source_funcs = {
+  .dispatch = epoll_source_dispatch,
+  .finalize = epoll_source_finalize,
+};
+
+static EpollSource *
+epoll_source_get (GMainContext *context)
+{
+  EpollSource *epoll;
+  gint epfd;
+
+  G_LOCK (epoll_sources);
+
+  if (!epoll_sources)
+    epoll_sources = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  epoll = g_hash_table_lookup (epoll_sources, context);
+  if (!epoll)
+    {
+      epfd = epoll_create1 (EPOLL_CLOEXEC);
+      if (epfd < 0)
+        {
+          g_message ("couldn't create epoll instance: %s", g_strerror (errno));
+        }
+      else
+        {
+          epoll = (EpollSource *)g_source_new (&epoll_source_funcs, sizeof (EpollSource));
+          epoll->epfd = epfd;
+          epoll->entries = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+          epoll->tag = g_source_add_unix_fd ((GSource *)epoll, epfd, G_IO_IN);
+          g_source_set_name ((GSource *)epoll, "fd-watch");
+          g_source_attach ((GSource *)epoll, context);
+          g_hash_table_insert (epoll_sources, context, epoll);
+        }
+    }
+
+  G_UNLOCK (epoll_sources);
+
+  return epoll;
+}
+
+static void
+epoll_source_release (EpollSource *epoll)
+{
+  GMainContext *context;
+
+  /* Still in use? */
+  if (g_hash_table_size (epoll->entries) > 0)
+    return;
+
+  context = g_source_get_context ((GSource *)epoll);
+
+  G_LOCK (epoll_sources);
+  if (g_hash_table_lookup (epoll_sources, context) == epoll)
+    g_hash_table_remove (epoll_sources, context);
+  G_UNLOCK (epoll_sources);
+
+  g_source_destroy ((GSource *)epoll);
+  g_source_unref ((GSource *)epoll);
+}
+
+static void
+update_entry (EpollSource *epoll,
+              FdEntry *entry)
+{
+  struct epoll_event ev = { 0, };
+  guint32 events = 0;
+
+  if (entry->in && entry->in->active)
+    events |= EPOLLIN;
+  if (entry->out && entry->out->active)
+    events |= EPOLLOUT;
+
+  /*
+   * Hangups and errors are always reported, even when asking for
+   * nothing. Make them one-shot so that an idle fd can't spin.
+   */
+  if (events == 0)
+    events = EPOLLONESHOT;
+
+  if (events == entry->events)
+    return;
+
+  ev.events = events;
+  ev.data.u64 = ((guint64)entry->serial << 32) | (guint32)entry->fd;
+  if (epoll_ctl (epoll->epfd, EPOLL_CTL_MOD, entry->fd, &ev) < 0)
+    g_warning ("couldn't change events for fd %d: %s", entry->fd, g_strerror (errno));
+  else
+    entry->events = events;
+}
+
+static gboolean
+register_watch (CockpitFdWatch *watch)
+{
+  struct epoll_event ev = { 0, };
+  CockpitFdWatch **slot;
+  EpollSource *epoll;
+  FdEntry *entry;
+
+  epoll = epoll_source_get (watch->context);
+  if (!epoll)
+    return FALSE;
+
+  entry = g_hash_table_lookup (epoll->entries, GINT_TO_POINTER (watch->fd));
+  if (!entry)
+    {
+      entry = g_new0 (FdEntry, 1);
+      entry->fd = watch->fd;
+      entry->serial = ++epoll->serial;
+      entry->events = EPOLLONESHOT;
+
+      ev.events = entry->events;
+      ev.data.u64 = ((guint64)entry->serial << 32) | (guint32)entry->fd;
+
+      /* Regular files can't be used with epoll, but are always ready anyway */
+      if (epoll_ctl (epoll->epfd, EPOLL_CTL_ADD, entry->fd, &ev) < 0)
+        {
+          if (errno != EPERM)
+            g_message ("couldn't watch fd %d: %s", entry->fd, g_strerror (errno));
+          g_free (entry);
+          epoll_source_release (epoll);
+          return FALSE;
+        }
+
+      g_hash_table_insert (epoll->entries, GINT_TO_POINTER (entry->fd), entry);
+    }
+
+  slot = watch->condition == G_IO_IN ? &entry->in : &entry->out;
+  if (*slot)
+    return FALSE;
+
+  *slot = watch;
+  watch->epoll = (EpollSource *)g_source_ref ((GSource *)epoll);
+  return TRUE;
+}
+
+static void
+unregister_watch (CockpitFdWatch *watch)
+{
+  EpollSource *epoll = watch->epoll;
+  FdEntry *entry;
+
+  entry = g_hash_table_lookup (epoll->entries, GINT_TO_POINTER (watch->fd));
+  g_assert (entry != NULL);
+
+  if (entry->in == watch)
+    entry->in = NULL;
+  if (entry->out == watch)
+    entry->out = NULL;
+
+  if (entry->in || entry->out)
+    {
+      update_entry (epoll, entry);
+    }
+  else
+    {
+      /* The fd may have already been closed, in which case it's gone anyway */
+      if (epoll_ctl (epoll->epfd, EPOLL_CTL_DEL, entry->fd, NULL) < 0 &&
+          errno != EBADF && errno != ENOENT)
+        g_message ("couldn't stop watching fd %d: %s", entry->fd, g_strerror (errno));
+      g_hash_table_remove (epoll->entries, GINT_TO_POINTER (watch->fd));
+      epoll_source_release (epoll);
+    }
+
+  watch->epoll = NULL;
+  g_source_unref ((GSource *)epoll);
+}
+
+static gboolean
+on_source_dispatch (gint fd,
+                    GIOCondition cond,
+                    gpointer user_data)
+{
+  dispatch_watch (user_data, cond);
+  return G_SOURCE_CONTINUE;
+}
+
+/**
+ * cockpit_fd_watch_new:
+ * @context: main context to dispatch in, or NULL for the thread default
+ * @fd: the file descriptor to watch
+ * @condition: either G_IO_IN or G_IO_OUT
+ * @name: a name for debugging
+ * @func: called when @fd is ready
+ * @user_data: data for @func
+ *
+ * Create a watch for @fd. It's not active until cockpit_fd_watch_start()
+ * is called. There can be one watch each for reading and writing on the
+ * same file descriptor.
+ *
+ * As with a GUnixFDSource, @func may return FALSE to stop the watch.
+ *
+ * The watch must be freed before @fd is closed.
+ *
+ * Returns: (transfer full): the new watch
+ */
+CockpitFdWatch *
+cockpit_fd_watch_new (GMainContext *context,
+                      gint fd,
+                      GIOCondition condition,
+                      const gchar *name,
+                      GUnixFDSourceFunc func,
+                      gpointer user_data)
+{
+  CockpitFdWatch *watch;
+
+  g_return_val_if_fail (fd >= 0, NULL);
+  g_return_val_if_fail (condition == G_IO_IN || condition == G_IO_OUT, NULL);
+  g_return_val_if_fail (func != NULL, NULL);
+
+  watch = g_new0 (CockpitFdWatch, 1);
+  watch->fd = fd;
+  watch->condition = condition;
+  watch->func = func;
+  watch->user_data = user_data;
+  watch->name = g_strdup (name);
+
+  if (context)
+    watch->context = g_main_context_ref (context);
+  else
+    watch->context = g_main_context_ref_thread_default ();
+
+  if (!g_getenv ("COCKPIT_NO_EPOLL"))
+    register_watch (watch);
+
+  return watch;
+}
+
+/**
+ * cockpit_fd_watch_start:
+ * @watch: the watch
+ *
+ * Start calling back when the file descriptor is ready.
+ */
+void
+cockpit_fd_watch_start (CockpitFdWatch *watch)
+{
+  FdEntry *entry;
+
+  g_return_if_fail (watch != NULL);
+
+  if (watch->active)
+    return;
+
+  watch->active = TRUE;
+
+  if (watch->epoll)
+    {
+      entry = g_hash_table_lookup (watch->epoll->entries, GINT_TO_POINTER (watch->fd));
+      update_entry (watch->epoll, entry);
+    }
+  else
+    {
+      watch->source = g_unix_fd_source_new (watch->fd, watch->condition);
+      if (watch->name)
+        g_source_set_name (watch->source, watch->name);
+      g_source_set_callback (watch->source, (GSourceFunc)on_source_dispatch, watch, NULL);
+      g_source_attach (watch->source, watch->context);
+    }
+}
+
+/**
+ * cockpit_fd_watch_stop:
+ * @watch: the watch
+ *
+ * Stop calling back, until started again.
+ */
+void
+cockpit_fd_watch_stop (CockpitFdWatch *watch)
+{
+  FdEntry *entry;
+
+  g_return_if_fail (watch != NULL);
+
+  if (!watch->active)
+    return;
+
+  watch->active = FALSE;
+
+  if (watch->epoll)
+    {
+      entry = g_hash_table_lookup (watch->epoll->entries, GINT_TO_POINTER (watch->fd));
+      update_entry (watch->epoll, entry);
+    }
+  else
+    {
+      g_source_destroy (watch->source);
+      g_source_unref (watch->source);
+      watch->source = NULL;
+    }
+}
+
+/**
+ * cockpit_fd_watch_is_active:
+ * @watch: the watch, or NULL
+ *
+ * Returns: whether the watch is started
+ */
+gboolean
+cockpit_fd_watch_is_active (CockpitFdWatch *watch)
+{
+  return watch && watch->active;
+}
+
+/**
+ * cockpit_fd_watch_free:
+ * @watch: the watch, or NULL
+ *
+ * Stop and free the watch. This may be called from its own callback.
+ */
+void
+cockpit_fd_watch_free (CockpitFdWatch *watch)
+{
+  if (!watch)
+    return;
+
+  if (watch->freed)
+    *(watch->freed) = TRUE;
+
+  if (watch->epoll)
+    {
+      watch->active = FALSE;
+      unregister_watch (watch);
+    }
+  else
+    {
+      cockpit_fd_watch_stop (watch);
+    }
+
+  g_main_context_unref (watch->context);
+  g_free (watch->name);
+  g_free (watch);
+}
@@ -0,0 +1,47 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_FD_WATCH_H__
+#define __COCKPIT_FD_WATCH_H__
+
+#include <glib.h>
+#include <glib-unix.h>
+
+G_BEGIN_DECLS
+
+typedef struct _CockpitFdWatch CockpitFdWatch;
+
+CockpitFdWatch *    cockpit_fd_watch_new            (GMainContext *context,
+                                                     gint fd,
+                                                     GIOCondition condition,
+                                                     const gchar *name,
+                                                     GUnixFDSourceFunc func,
+                                                     gpointer user_data);
+
+void                cockpit_fd_watch_start          (CockpitFdWatch *watch);
+
+void                cockpit_fd_watch_stop           (CockpitFdWatch *watch);
+
+gboolean            cockpit_fd_watch_is_active      (CockpitFdWatch *watch);
+
+void                cockpit_fd_watch_free           (CockpitFdWatch *watch);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_FD_WATCH_H__ */
@@ -0,0 +1,590 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include "cockpitfileio.h"
+
+#include "cockpitflow.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * CockpitFileIO:
+ *
+ * Reads or writes a regular file without blocking the main loop. A slow
+ * disk, a cold page cache, or an fsync() that takes seconds would
+ * otherwise stall every other channel in the process.
+ *
+ * The actual read(), write() and fsync() calls happen on a small pool
+ * of worker threads, one at a time for each file so that they stay in
+ * order. Results come back on the main context of the thread that
+ * created the object.
+ *
+ *  - When reading, the next block is already being read while the
+ *    previous one is handed out in the "read" signal. Its input can be
+ *    throttled with cockpit_flow_throttle().
+ *  - Writes are queued, and it emits a "pressure" signal when too much
+ *    is waiting to be written, so that its input can be slowed down
+ *    rather than buffered.
+ *  - The "done" signal is emitted once at the end of the file, after
+ *    cockpit_file_io_finish() has synced the written data, or on the
+ *    first error.
+ */
+
+#define READ_SIZE         (128 * 1024)
+
+/* Give back-pressure once this much is waiting to be written */
+#define WRITE_BEHIND_MAX  (4 * 1024 * 1024)
+
+#define WORKER_THREADS    4
+
+typedef enum {
+  OP_READ,
+  OP_WRITE,
+  OP_FINISH,
+} FileOpType;
+
+typedef struct {
+  CockpitFileIO *self;
+  FileOpType type;
+  gint fd;
+  GBytes *data;
+  gint error;
+} FileOp;
+
+struct _CockpitFileIO {
+  GObject parent_instance;
+  gchar *name;
+  gint fd;
+  GMainContext *context;
+
+  /* Writes, and then the finish, in order */
+  GQueue *queue;
+  gsize queued;
+  gboolean pressured;
+
+  gboolean in_flight;
+  gboolean reading;
+  gboolean done;
+  gboolean closed;
+
+  /* Pressure which throttles reading */
+  CockpitFlow *pressure;
+  gulong pressure_sig;
+  gboolean throttled;
+};
+
+enum {
+  READ,
+  DONE,
+  NUM_SIGNALS
+};
+
+static guint signals[NUM_SIGNALS];
+
+static void     cockpit_file_io_flow_iface_init    (CockpitFlowInterface *iface);
+
+static void     cockpit_file_io_throttle           (CockpitFlow *flow,
+                                                    CockpitFlow *controlling);
+
+G_DEFINE_TYPE_WITH_CODE (CockpitFileIO, cockpit_file_io, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_FLOW, cockpit_file_io_flow_iface_init));
+
+static FileOp *
+file_op_new (CockpitFileIO *self,
+             FileOpType type,
+             GBytes *data)
+{
+  FileOp *op = g_slice_new0 (FileOp);
+  op->self = self;
+  op->type = type;
+  op->fd = -1;
+  if (data)
+    op->data = g_bytes_ref (data);
+  return op;
+}
+
+static void
+file_op_free (gpointer data)
+{
+  FileOp *op = data;
+  if (op->data)
+    g_bytes_unref (op->data);
+  g_slice_free (FileOp, op);
+}
+
+static GBytes *
+read_block (gint fd,
+            gint *error)
+{
+  gchar *buffer;
+  gssize ret;
+
+  buffer = g_malloc (READ_SIZE);
+  do
+    ret = read (fd, buffer, READ_SIZE);
+  while (ret < 0 && errno == EINTR);
+
+  if (ret < 0)
+    {
+      *error = errno;
+      g_free (buffer);
+      return NULL;
+    }
+
+  return g_bytes_new_take (g_realloc (buffer, ret), ret);
+}
+
+static gint
+write_all (gint fd,
+           GBytes *data)
+{
+  const gchar *buffer;
+  gsize length;
+  gssize ret;
+
+  buffer = g_bytes_get_data (data, &length);
+  while (length > 0)
+    {
+      ret = write (fd, buffer, length);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return errno;
+        }
+
+      buffer += ret;
+      length -= ret;
+    }
+
+  return 0;
+}
+
+static gint
+sync_and_close (gint fd)
+{
+  gint error = 0;
+
+  while (fsync (fd) < 0)
+    {
+      if (errno != EINTR)
+        {
+          error = errno;
+          break;
+        }
+    }
+
+  /* http://lkml.indiana.edu/hypermail/linux/kernel/0509.1/0877.html */
+  if (close (fd) < 0 && errno != EINTR && error == 0)
+    error = errno;
+
+  return error;
+}
+
+static gboolean complete_op (gpointer user_data);
+
+static void
+run_op (gpointer data,
+        gpointer unused)
+{
+  FileOp *op = data;
+
+  switch (op->type)
+    {
+    case OP_READ:
+      op->data = read_block (op->fd, &op->error);
+      break;
+    case OP_WRITE:
+      op->error = write_all (op->fd, op->data);
+      break;
+    case OP_FINISH:
+      op->error = sync_and_close (op->fd);
+      break;
+    }
+
+  g_main_context_invoke (op->self->context, complete_op, op);
+}
+
+static void
+submit_next (CockpitFileIO *self)
+{
+  static GThreadPool *pool = NULL;
+  GError *error = NULL;
+  FileOp *op;
+
+  if (self->in_flight || self->done || self->closed)
+    return;
+
+  op = g_queue_pop_head (self->queue);
+  if (!op && self->reading && !self->throttled)
+    op = file_op_new (self, OP_READ, NULL);
+  if (!op)
+    return;
+
+  if (!pool)
+    {
+      pool = g_thread_pool_new (run_op, NULL, WORKER_THREADS, FALSE, &error);
+      g_assert_no_error (error);
+    }
+
+  /* Stays alive until the operation completes */
+  op->fd = self->fd;
+  g_object_ref (self);
+  self->in_flight = TRUE;
+  g_thread_pool_push (pool, op, NULL);
+}
+
+static void
+clear_queue (CockpitFileIO *self)
+{
+  g_queue_foreach (self->queue, (GFunc)file_op_free, NULL);
+  g_queue_clear (self->queue);
+  self->queued = 0;
+}
+
+static void
+emit_done (CockpitFileIO *self,
+           gint error,
+           const gchar *diagnostic)
+{
+  if (self->done)
+    return;
+
+  self->done = TRUE;
+  self->reading = FALSE;
+  clear_queue (self);
+
+  if (error)
+    g_debug ("%s: %s: %s", self->name, diagnostic, g_strerror (error));
+  else
+    g_debug ("%s: done", self->name);
+
+  g_signal_emit (self, signals[DONE], 0, error, diagnostic);
+}
+
+static gboolean
+complete_op (gpointer user_data)
+{
+  FileOp *op = user_data;
+  CockpitFileIO *self = op->self;
+
+  self->in_flight = FALSE;
+
+  /* The worker closed the file */
+  if (op->type == OP_FINISH)
+    self->fd = -1;
+
+  if (self->closed)
+    {
+      if (self->fd >= 0)
+        close (self->fd);
+      self->fd = -1;
+    }
+  else if (op->type == OP_READ)
+    {
+      if (op->error)
+        {
+          emit_done (self, op->error, "couldn't read");
+        }
+      else if (g_bytes_get_size (op->data) == 0)
+        {
+          emit_done (self, 0, NULL);
+        }
+      else
+        {
+          /* Read ahead while this block gets sent */
+          submit_next (self);
+          g_signal_emit (self, signals[READ], 0, op->data);
+        }
+    }
+  else if (op->type == OP_WRITE)
+    {
+      self->queued -= MIN (self->queued, g_bytes_get_size (op->data));
+      if (op->error)
+        {
+          emit_done (self, op->error, "couldn't write");
+        }
+      else if (self->pressured && self->queued < WRITE_BEHIND_MAX / 2)
+        {
+          g_debug ("%s: have %" G_GSIZE_FORMAT " bytes queued, releasing pressure", self->name, self->queued);
+          self->pressured = FALSE;
+          cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
+        }
+    }
+  else if (op->type == OP_FINISH)
+    {
+      emit_done (self, op->error, op->error ? "couldn't sync" : NULL);
+    }
+
+  submit_next (self);
+
+  file_op_free (op);
+  g_object_unref (self);
+  return FALSE;
+}
+
+static void
+cockpit_file_io_init (CockpitFileIO *self)
+{
+  self->fd = -1;
+  self->queue = g_queue_new ();
+  self->context = g_main_context_ref_thread_default ();
+}
+
+static void
+cockpit_file_io_dispose (GObject *object)
+{
+  CockpitFileIO *self = COCKPIT_FILE_IO (object);
+
+  cockpit_file_io_close (self);
+
+  G_OBJECT_CLASS (cockpit_file_io_parent_class)->dispose (object);
+}
+
+static void
+cockpit_file_io_finalize (GObject *object)
+{
+  CockpitFileIO *self = COCKPIT_FILE_IO (object);
+
+  g_assert (!self->in_flight);
+  if (self->fd >= 0)
+    close (self->fd);
+
+  clear_queue (self);
+  g_queue_free (self->queue);
+  g_main_context_unref (self->context);
+  g_free (self->name);
+
+  G_OBJECT_CLASS (cockpit_file_io_parent_class)->finalize (object);
+}
+
+static void
+cockpit_file_io_class_init (CockpitFileIOClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->dispose = cockpit_file_io_dispose;
+  gobject_class->finalize = cockpit_file_io_finalize;
+
+  /**
+   * CockpitFileIO::read:
+   * @block: the data read
+   *
+   * Emitted for each block read from the file, in order.
+   */
+  signals[READ] = g_signal_new ("read", COCKPIT_TYPE_FILE_IO, G_SIGNAL_RUN_LAST,
+                                0, NULL, NULL, g_cclosure_marshal_VOID__BOXED,
+                                G_TYPE_NONE, 1, G_TYPE_BYTES);
+
+  /**
+   * CockpitFileIO::done:
+   * @error: an errno value, or zero
+   * @diagnostic: what failed, or %NULL
+   *
+   * Emitted once, at the end of the file when reading, after
+   * cockpit_file_io_finish() completed when writing, or when an
+   * operation failed.
+   */
+  signals[DONE] = g_signal_new ("done", COCKPIT_TYPE_FILE_IO, G_SIGNAL_RUN_LAST,
+                                0, NULL, NULL, g_cclosure_marshal_generic,
+                                G_TYPE_NONE, 2, G_TYPE_INT, G_TYPE_STRING);
+}
+
+static void
+on_throttle_pressure (GObject *object,
+                      gboolean throttle,
+                      gpointer user_data)
+{
+  CockpitFileIO *self = COCKPIT_FILE_IO (user_data);
+
+  if (throttle && !self->throttled)
+    {
+      g_debug ("%s: applying back pressure in file", self->name);
+      self->throttled = TRUE;
+    }
+  else if (!throttle && self->throttled)
+    {
+      g_debug ("%s: relieving back pressure in file", self->name);
+      self->throttled = FALSE;
+      submit_next (self);
+    }
+}
+
+static void
+cockpit_file_io_throttle (CockpitFlow *flow,
+                          CockpitFlow *controlling)
+{
+  CockpitFileIO *self = COCKPIT_FILE_IO (flow);
+
+  if (self->pressure)
+    {
+      g_signal_handler_disconnect (self->pressure, self->pressure_sig);
+      g_object_remove_weak_pointer (G_OBJECT (self->pressure), (gpointer *)&self->pressure);
+      self->pressure = NULL;
+    }
+
+  if (controlling)
+    {
+      self->pressure = controlling;
+      g_object_add_weak_pointer (G_OBJECT (self->pressure), (gpointer *)&self->pressure);
+      self->pressure_sig = g_signal_connect (controlling, "pressure", G_CALLBACK (on_throttle_pressure), self);
+    }
+}
+
+static void
+cockpit_file_io_flow_iface_init (CockpitFlowInterface *iface)
+{
+  iface->throttle = cockpit_file_io_throttle;
+}
+
+/**
+ * cockpit_file_io_new:
+ * @name: a name for debug messages
+ * @fd: the file descriptor, which is now owned
+ *
+ * Returns: (transfer full): the new object
+ */
+CockpitFileIO *
+cockpit_file_io_new (const gchar *name,
+                     gint fd)
+{
+  CockpitFileIO *self;
+
+  g_return_val_if_fail (fd >= 0, NULL);
+
+  self = g_object_new (COCKPIT_TYPE_FILE_IO, NULL);
+  self->name = g_strdup (name);
+  self->fd = fd;
+  return self;
+}
+
+/**
+ * cockpit_file_io_read:
+ * @self: the file
+ *
+ * Start reading the file until its end, emitting the "read" signal
+ * for each block and then "done".
+ */
+void
+cockpit_file_io_read (CockpitFileIO *self)
+{
+  g_return_if_fail (COCKPIT_IS_FILE_IO (self));
+  g_return_if_fail (!self->reading && !self->done);
+
+  self->reading = TRUE;
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise (self->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  submit_next (self);
+}
+
+/**
+ * cockpit_file_io_write:
+ * @self: the file
+ * @data: the data to write
+ *
+ * Queue @data to be written to the file. Emits "pressure" when too
+ * much is waiting to be written.
+ */
+void
+cockpit_file_io_write (CockpitFileIO *self,
+                       GBytes *data)
+{
+  g_return_if_fail (COCKPIT_IS_FILE_IO (self));
+
+  if (self->done || self->closed)
+    return;
+
+  g_queue_push_tail (self->queue, file_op_new (self, OP_WRITE, data));
+  self->queued += g_bytes_get_size (data);
+
+  if (!self->pressured && self->queued >= WRITE_BEHIND_MAX)
+    {
+      g_debug ("%s: have %" G_GSIZE_FORMAT " bytes queued, emitting pressure", self->name, self->queued);
+      self->pressured = TRUE;
+      cockpit_flow_emit_pressure (COCKPIT_FLOW (self), TRUE);
+    }
+
+  submit_next (self);
+}
+
+/**
+ * cockpit_file_io_finish:
+ * @self: the file
+ *
+ * Once everything queued is written, sync the file to disk and close
+ * it, and then emit "done".
+ */
+void
+cockpit_file_io_finish (CockpitFileIO *self)
+{
+  g_return_if_fail (COCKPIT_IS_FILE_IO (self));
+
+  if (self->done || self->closed)
+    return;
+
+  g_queue_push_tail (self->queue, file_op_new (self, OP_FINISH, NULL));
+  submit_next (self);
+}
+
+/**
+ * cockpit_file_io_close:
+ * @self: the file
+ *
+ * Stop reading or writing, and close the file as soon as no operation
+ * is running on it anymore. Nothing more is emitted after this.
+ */
+void
+cockpit_file_io_close (CockpitFileIO *self)
+{
+  g_return_if_fail (COCKPIT_IS_FILE_IO (self));
+
+  if (self->closed)
+    return;
+
+  self->closed = TRUE;
+  self->reading = FALSE;
+  clear_queue (self);
+  cockpit_file_io_throttle (COCKPIT_FLOW (self), NULL);
+
+  if (!self->in_flight && self->fd >= 0)
+    {
+      close (self->fd);
+      self->fd = -1;
+    }
+}
+
+/**
+ * cockpit_file_io_get_queued:
+ * @self: the file
+ *
+ * Returns: the number of bytes waiting to be written
+ */
+gsize
+cockpit_file_io_get_queued (CockpitFileIO *self)
+{
+  g_return_val_if_fail (COCKPIT_IS_FILE_IO (self), 0);
+  return self->queued;
+}
@@ -0,0 +1,47 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __COCKPIT_FILE_IO_H__
+#define __COCKPIT_FILE_IO_H__
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define COCKPIT_TYPE_FILE_IO         (cockpit_file_io_get_type ())
+G_DECLARE_FINAL_TYPE(CockpitFileIO, cockpit_file_io, COCKPIT, FILE_IO, GObject)
+
+CockpitFileIO *    cockpit_file_io_new          (const gchar *name,
+                                                 gint fd);
+
+void               cockpit_file_io_read         (CockpitFileIO *self);
+
+void               cockpit_file_io_write        (CockpitFileIO *self,
+                                                 GBytes *data);
+
+void               cockpit_file_io_finish       (CockpitFileIO *self);
+
+void               cockpit_file_io_close        (CockpitFileIO *self);
+
+gsize              cockpit_file_io_get_queued   (CockpitFileIO *self);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_FILE_IO_H__ */
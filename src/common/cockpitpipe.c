@@ -22,7 +22,10 @@
 #include "cockpitpipe.h"
 
 #include "cockpitcloserange.h"
+#include "cockpitfairqueue.h"
+#include "cockpitfdwatch.h"
 #include "cockpitflow.h"
+#include "cockpitspawn.h"
 #include "cockpitunicode.h"
 
 #include <glib-unix.h>
@@ -40,10 +43,6 @@
 #include <string.h>
 #include <unistd.h>
 
-#ifdef __linux
-#include <sys/prctl.h>
-#endif
-
 /**
  * CockpitPipe:
  *
@@ -92,19 +91,20 @@ typedef struct {
 
   int out_fd;
   gboolean out_done;
-  GSource *out_source;
+  CockpitFdWatch *out_watch;
   GQueue *out_queue;
+  CockpitFairQueue *out_lanes;
   gsize out_queued;
   gsize out_partial;
 
   int in_fd;
   gboolean in_done;
-  GSource *in_source;
+  CockpitFdWatch *in_watch;
   GByteArray *in_buffer;
 
   int err_fd;
   gboolean err_done;
-  GSource *err_source;
+  CockpitFdWatch *err_watch;
   GByteArray *err_buffer;
   gboolean err_forward_to_log;
 
@@ -155,6 +155,7 @@ cockpit_pipe_init (CockpitPipe *self)
   priv->in_buffer = g_byte_array_new ();
   priv->in_fd = -1;
   priv->out_queue = g_queue_new ();
+  priv->out_lanes = cockpit_fair_queue_new ((GDestroyNotify)g_bytes_unref);
   priv->out_fd = -1;
   priv->err_fd = -1;
   priv->status = -1;
@@ -167,10 +168,8 @@ stop_output (CockpitPipe *self)
 {
   CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
 
-  g_assert (priv->out_source != NULL);
-  g_source_destroy (priv->out_source);
-  g_source_unref (priv->out_source);
-  priv->out_source = NULL;
+  g_assert (cockpit_fd_watch_is_active (priv->out_watch));
+  cockpit_fd_watch_stop (priv->out_watch);
 }
 
 static void
@@ -178,10 +177,8 @@ stop_input (CockpitPipe *self)
 {
   CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
 
-  g_assert (priv->in_source != NULL);
-  g_source_destroy (priv->in_source);
-  g_source_unref (priv->in_source);
-  priv->in_source = NULL;
+  g_assert (cockpit_fd_watch_is_active (priv->in_watch));
+  cockpit_fd_watch_stop (priv->in_watch);
 }
 
 static void
@@ -189,10 +186,8 @@ stop_error (CockpitPipe *self)
 {
   CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
 
-  g_assert (priv->err_source != NULL);
-  g_source_destroy (priv->err_source);
-  g_source_unref (priv->err_source);
-  priv->err_source = NULL;
+  g_assert (cockpit_fd_watch_is_active (priv->err_watch));
+  cockpit_fd_watch_stop (priv->err_watch);
 }
 
 static void
@@ -216,14 +211,15 @@ close_immediately (CockpitPipe *self,
            priv->problem ? ": " : "",
            priv->problem ? priv->problem : "");
 
-  if (priv->in_source)
-    stop_input (self);
+  /* The watches have to go before the fds are closed */
+  cockpit_fd_watch_free (priv->in_watch);
+  priv->in_watch = NULL;
   priv->in_done = TRUE;
-  if (priv->out_source)
-    stop_output (self);
+  cockpit_fd_watch_free (priv->out_watch);
+  priv->out_watch = NULL;
   priv->out_done = TRUE;
-  if (priv->err_source)
-    stop_error (self);
+  cockpit_fd_watch_free (priv->err_watch);
+  priv->err_watch = NULL;
   priv->err_done = TRUE;
 
   if (priv->in_fd != -1)
@@ -319,7 +315,7 @@ dispatch_input (gint fd,
   gsize len;
   int errn;
 
-  g_return_val_if_fail (priv->in_source, FALSE);
+  g_return_val_if_fail (cockpit_fd_watch_is_active (priv->in_watch), FALSE);
   len = priv->in_buffer->len;
 
   /*
@@ -397,7 +393,7 @@ dispatch_error (gint fd,
   gssize ret = 0;
   gsize len;
 
-  g_return_val_if_fail (priv->err_source, FALSE);
+  g_return_val_if_fail (cockpit_fd_watch_is_active (priv->err_watch), FALSE);
   len = priv->err_buffer->len;
 
   /*
@@ -461,7 +457,7 @@ drain_error (CockpitPipe *self)
 {
   CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
 
-  while (priv->err_source && fd_readable (priv->err_fd))
+  while (cockpit_fd_watch_is_active (priv->err_watch) && fd_readable (priv->err_fd))
     dispatch_error (priv->err_fd, G_IO_IN, self);
 }
 
@@ -482,19 +478,20 @@ close_output (CockpitPipe *self)
           if (errno == ENOTSOCK)
             {
               g_debug ("%s: not a socket, closing entirely", priv->name);
-              close (priv->out_fd);
+              cockpit_fd_watch_free (priv->out_watch);
+              priv->out_watch = NULL;
 
               if (priv->in_fd == priv->out_fd)
                 {
                   priv->in_done = TRUE;
                   priv->in_fd = -1;
-                  if (priv->in_source)
-                    {
-                      g_debug ("%s: and closing input because same fd", priv->name);
-                      stop_input (self);
-                    }
+                  if (cockpit_fd_watch_is_active (priv->in_watch))
+                    g_debug ("%s: and closing input because same fd", priv->name);
+                  cockpit_fd_watch_free (priv->in_watch);
+                  priv->in_watch = NULL;
                 }
 
+              close (priv->out_fd);
               priv->out_fd = -1;
             }
           else
@@ -589,10 +586,19 @@ dispatch_output (gint fd,
   if (priv->connecting && !dispatch_connect (self))
     return TRUE;
 
-  g_return_val_if_fail (priv->out_source, FALSE);
+  g_return_val_if_fail (cockpit_fd_watch_is_active (priv->out_watch), FALSE);
 
   before = priv->out_queued;
 
+  /*
+   * Blocks move from the lanes to the output queue in their fair order,
+   * but only as many as we write at once, so that data queued later in
+   * another lane doesn't have to wait behind them.
+   */
+  while (priv->out_queue->length < G_N_ELEMENTS (iov) &&
+         (popped = cockpit_fair_queue_pop (priv->out_lanes, NULL)) != NULL)
+    g_queue_push_tail (priv->out_queue, popped);
+
   /* Note we fall through when nothing to write */
   partial = priv->out_partial;
   for (l = priv->out_queue->head, i = 0;
@@ -666,7 +672,7 @@ dispatch_output (gint fd,
       cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
     }
 
-  if (priv->out_queue->head)
+  if (priv->out_queue->head || !cockpit_fair_queue_is_empty (priv->out_lanes))
     return TRUE;
 
   g_debug ("%s: output queue empty", priv->name);
@@ -687,11 +693,13 @@ start_output (CockpitPipe *self)
 {
   CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
 
-  g_assert (priv->out_source == NULL);
-  priv->out_source = g_unix_fd_source_new (priv->out_fd, G_IO_OUT);
-  g_source_set_name (priv->out_source, "pipe-output");
-  g_source_set_callback (priv->out_source, (GSourceFunc)dispatch_output, self, NULL);
-  g_source_attach (priv->out_source, priv->context);
+  g_assert (!cockpit_fd_watch_is_active (priv->out_watch));
+  if (!priv->out_watch)
+    {
+      priv->out_watch = cockpit_fd_watch_new (priv->context, priv->out_fd, G_IO_OUT,
+                                              "pipe-output", dispatch_output, self);
+    }
+  cockpit_fd_watch_start (priv->out_watch);
 }
 
 static void
@@ -699,11 +707,31 @@ start_input (CockpitPipe *self)
 {
   CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
 
-  g_assert (priv->in_source == NULL);
-  priv->in_source = g_unix_fd_source_new (priv->in_fd, G_IO_IN);
-  g_source_set_name (priv->in_source, "pipe-input");
-  g_source_set_callback (priv->in_source, (GSourceFunc)dispatch_input, self, NULL);
-  g_source_attach (priv->in_source, priv->context);
+  g_assert (!cockpit_fd_watch_is_active (priv->in_watch));
+  if (!priv->in_watch)
+    {
+      priv->in_watch = cockpit_fd_watch_new (priv->context, priv->in_fd, G_IO_IN,
+                                             "pipe-input", dispatch_input, self);
+    }
+  cockpit_fd_watch_start (priv->in_watch);
+}
+
+static void
+watch_child (CockpitPipe *self,
+             gint pidfd)
+{
+  CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
+
+  priv->is_process = TRUE;
+
+  /* We may need this watch to outlast this process ... */
+  priv->watch_arg = g_new0 (CockpitPipe *, 1);
+  *(priv->watch_arg) = self;
+
+  priv->child = cockpit_child_source_new (priv->pid, pidfd);
+  g_source_set_callback (priv->child, (GSourceFunc)on_child_reap,
+                         priv->watch_arg, g_free);
+  g_source_attach (priv->child, priv->context);
 }
 
 static void
@@ -759,10 +787,9 @@ cockpit_pipe_constructed (GObject *object)
         }
 
       priv->err_buffer = g_byte_array_new ();
-      priv->err_source = g_unix_fd_source_new (priv->err_fd, G_IO_IN);
-      g_source_set_name (priv->err_source, "pipe-error");
-      g_source_set_callback (priv->err_source, (GSourceFunc)dispatch_error, self, NULL);
-      g_source_attach (priv->err_source, priv->context);
+      priv->err_watch = cockpit_fd_watch_new (priv->context, priv->err_fd, G_IO_IN,
+                                              "pipe-error", dispatch_error, self);
+      cockpit_fd_watch_start (priv->err_watch);
     }
   else
     {
@@ -770,18 +797,7 @@ cockpit_pipe_constructed (GObject *object)
     }
 
   if (priv->pid)
-    {
-      priv->is_process = TRUE;
-
-      /* We may need this watch to outlast this process ... */
-      priv->watch_arg = g_new0 (CockpitPipe *, 1);
-      *(priv->watch_arg) = self;
-
-      priv->child = g_child_watch_source_new (priv->pid);
-      g_source_set_callback (priv->child, (GSourceFunc)on_child_reap,
-                             priv->watch_arg, g_free);
-      g_source_attach (priv->child, priv->context);
-    }
+    watch_child (self, -1);
 }
 
 static void
@@ -876,6 +892,7 @@ cockpit_pipe_dispose (GObject *object)
 
   while (priv->out_queue->head)
     g_bytes_unref (g_queue_pop_head (priv->out_queue));
+  cockpit_fair_queue_clear (priv->out_lanes);
   priv->out_queued = 0;
 
   G_OBJECT_CLASS (cockpit_pipe_parent_class)->dispose (object);
@@ -888,8 +905,8 @@ cockpit_pipe_finalize (GObject *object)
   CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
 
   g_assert (priv->closed);
-  g_assert (!priv->in_source);
-  g_assert (!priv->out_source);
+  g_assert (!priv->in_watch);
+  g_assert (!priv->out_watch);
 
   /* Release our reference on watch handler */
   if (priv->child)
@@ -906,6 +923,7 @@ cockpit_pipe_finalize (GObject *object)
   if (priv->err_buffer)
     g_byte_array_unref (priv->err_buffer);
   g_queue_free (priv->out_queue);
+  cockpit_fair_queue_free (priv->out_lanes);
   g_free (priv->problem);
   g_free (priv->name);
 
@@ -1046,6 +1064,35 @@ _cockpit_pipe_write (CockpitPipe *self,
                     GBytes *data,
                     const gchar *caller,
                     int line)
+{
+  _cockpit_pipe_write_lane (self, NULL, COCKPIT_FAIR_QUEUE_DEFAULT_WEIGHT, data, TRUE, caller, line);
+}
+
+/**
+ * cockpit_pipe_write_lane:
+ * @self: the pipe
+ * @lane: the lane to queue in, or NULL
+ * @weight: the share of output for the lane
+ * @data: the data to write
+ * @boundary: whether data from other lanes may follow @data
+ *
+ * Like cockpit_pipe_write(), but queue @data in a lane. When more
+ * than one lane has data queued, they are written in turn, each
+ * getting a share of the output according to its @weight. Data
+ * within a lane is written in order.
+ *
+ * Data from another lane is never written in the middle of blocks
+ * queued with @boundary set to FALSE. Those should be followed
+ * by the rest of the frame right away.
+ */
+void
+_cockpit_pipe_write_lane (CockpitPipe *self,
+                          const gchar *lane,
+                          guint weight,
+                          GBytes *data,
+                          gboolean boundary,
+                          const gchar *caller,
+                          int line)
 {
   CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
   gsize size, before;
@@ -1084,7 +1131,7 @@ _cockpit_pipe_write (CockpitPipe *self,
   before = priv->out_queued;
   g_return_if_fail (G_MAXSIZE - size > priv->out_queued);
   priv->out_queued += size;
-  g_queue_push_tail (priv->out_queue, g_bytes_ref (data));
+  cockpit_fair_queue_push (priv->out_lanes, lane, weight, g_bytes_ref (data), size, boundary);
 
   /*
    * If we have too much data queued, and are controlling another flow
@@ -1096,7 +1143,7 @@ _cockpit_pipe_write (CockpitPipe *self,
       cockpit_flow_emit_pressure (COCKPIT_FLOW (self), TRUE);
     }
 
-  if (!priv->out_source && priv->out_fd >= 0)
+  if (!cockpit_fd_watch_is_active (priv->out_watch) && priv->out_fd >= 0)
     {
       start_output (self);
     }
@@ -1132,7 +1179,7 @@ cockpit_pipe_close (CockpitPipe *self,
 
   if (problem)
       close_immediately (self, problem);
-  else if (g_queue_is_empty (priv->out_queue))
+  else if (g_queue_is_empty (priv->out_queue) && cockpit_fair_queue_is_empty (priv->out_lanes))
     close_output (self);
   else
     g_debug ("%s: pipe closing when output queue empty", priv->name);
@@ -1236,48 +1283,6 @@ cockpit_pipe_connect (const gchar *name,
   return pipe;
 }
 
-static GSpawnFlags
-calculate_spawn_flags (const gchar **env,
-                       CockpitPipeFlags pflags)
-{
-  GSpawnFlags flags = G_SPAWN_DO_NOT_REAP_CHILD;
-  gboolean path_flag = FALSE;
-
-  for (; env && env[0]; env++)
-    {
-      if (g_str_has_prefix (env[0], "PATH="))
-        {
-          flags |= G_SPAWN_SEARCH_PATH_FROM_ENVP;
-          path_flag = TRUE;
-          break;
-        }
-    }
-
-  if (!path_flag)
-    flags |= G_SPAWN_SEARCH_PATH;
-
-  if (pflags & COCKPIT_PIPE_STDERR_TO_NULL)
-    flags |= G_SPAWN_STDERR_TO_DEV_NULL;
-
-  return flags;
-}
-
-static void
-spawn_setup (gpointer data)
-{
-  CockpitPipeFlags flags = GPOINTER_TO_INT (data);
-
-  /* Send this signal to all direct child processes, when bridge dies */
-#ifdef __linux
-  prctl (PR_SET_PDEATHSIG, SIGHUP);
-#endif
-
-  if (flags & COCKPIT_PIPE_STDERR_TO_STDOUT) {
-    int r = dup2 (1, 2);
-    g_assert (r == 2); /* that should really never fail */
-  }
-}
-
 /**
  * cockpit_pipe_spawn:
  * @argv: null terminated string array of command arguments
@@ -1311,17 +1316,21 @@ cockpit_pipe_spawn (const gchar **argv,
   int session_stderr = -1;
   GError *error = NULL;
   const gchar *problem = NULL;
+  CockpitSpawnFlags spawn_flags = COCKPIT_SPAWN_DEFAULT;
   int *with_stderr = NULL;
   gchar *name;
   GPid pid = 0;
+  gint pidfd = -1;
 
   if (flags & COCKPIT_PIPE_STDERR_TO_MEMORY)
     with_stderr = &session_stderr;
+  if (flags & COCKPIT_PIPE_STDERR_TO_STDOUT)
+    spawn_flags |= COCKPIT_SPAWN_STDERR_TO_STDOUT;
+  if (flags & COCKPIT_PIPE_STDERR_TO_NULL)
+    spawn_flags |= COCKPIT_SPAWN_STDERR_TO_NULL;
 
-  g_spawn_async_with_pipes (directory, (gchar **)argv, (gchar **)env,
-                            calculate_spawn_flags (env, flags),
-                            spawn_setup, GINT_TO_POINTER (flags),
-                            &pid, &session_stdin, &session_stdout, with_stderr, &error);
+  cockpit_spawn_async (directory, argv, env, spawn_flags, &pid, &pidfd,
+                       &session_stdin, &session_stdout, with_stderr, &error);
 
   name = g_path_get_basename (argv[0]);
   if (name == NULL)
@@ -1332,11 +1341,15 @@ cockpit_pipe_spawn (const gchar **argv,
                        "in-fd", session_stdout,
                        "out-fd", session_stdin,
                        "err-fd", session_stderr,
-                       "pid", pid,
                        NULL);
 
   priv = cockpit_pipe_get_instance_private (pipe);
 
+  /* Reaped through the pidfd when we have one */
+  priv->pid = pid;
+  if (pid)
+    watch_child (pipe, pidfd);
+
   /* Regardless of whether spawn succeeded or not */
   priv->is_process = TRUE;
 
@@ -1534,6 +1547,23 @@ cockpit_pipe_get_buffer (CockpitPipe *self)
   return priv->in_buffer;
 }
 
+/**
+ * @self: a pipe
+ *
+ * Get the amount of data written to the pipe that it hasn't
+ * been able to send yet.
+ *
+ * Returns: the number of bytes queued
+ */
+gsize
+cockpit_pipe_get_queued (CockpitPipe *self)
+{
+  CockpitPipePrivate *priv = cockpit_pipe_get_instance_private (self);
+
+  g_return_val_if_fail (COCKPIT_IS_PIPE (self), 0);
+  return priv->out_queued;
+}
+
 GByteArray *
 cockpit_pipe_get_stderr (CockpitPipe *self)
 {
@@ -1813,7 +1843,7 @@ on_throttle_pressure (GObject *object,
 
   if (throttle)
     {
-      if (priv->in_source != NULL)
+      if (cockpit_fd_watch_is_active (priv->in_watch))
         {
           g_debug ("%s: applying back pressure in pipe", priv->name);
           stop_input (self);
@@ -1821,7 +1851,7 @@ on_throttle_pressure (GObject *object,
     }
   else
     {
-      if (priv->in_source == NULL && !priv->in_done)
+      if (!cockpit_fd_watch_is_active (priv->in_watch) && !priv->in_done)
         {
           g_debug ("%s: relieving back pressure in pipe", priv->name);
           start_input (self);
@@ -76,6 +76,16 @@ void               _cockpit_pipe_write        (CockpitPipe *self,
                                               const gchar *caller,
                                               gint line);
 
+#define cockpit_pipe_write_lane(s, l, w, d, b) (_cockpit_pipe_write_lane (s, l, w, d, b, G_STRFUNC, __LINE__))
+
+void               _cockpit_pipe_write_lane   (CockpitPipe *self,
+                                              const gchar *lane,
+                                              guint weight,
+                                              GBytes *data,
+                                              gboolean boundary,
+                                              const gchar *caller,
+                                              gint line);
+
 void               cockpit_pipe_close        (CockpitPipe *self,
                                               const gchar *problem);
 
@@ -85,6 +95,8 @@ const gchar *      cockpit_pipe_get_name     (CockpitPipe *self);
 
 GByteArray *       cockpit_pipe_get_buffer   (CockpitPipe *self);
 
+gsize              cockpit_pipe_get_queued   (CockpitPipe *self);
+
 GByteArray *       cockpit_pipe_get_stderr   (CockpitPipe *self);
 
 gchar *            cockpit_pipe_take_stderr_as_utf8 (CockpitPipe *self);
@@ -50,6 +50,12 @@ struct _CockpitPipeTransport {
   gboolean closed;
   gulong read_sig;
   gulong close_sig;
+
+  /* Channels with other than normal priority, each sent in its own lane */
+  GHashTable *priorities;
+
+  /* The frame of the message being received, while "recv" is emitted */
+  GBytes *frame;
 };
 
 enum {
@@ -211,16 +217,57 @@ cockpit_pipe_transport_finalize (GObject *object)
 
   g_free (self->name);
   g_clear_object (&self->pipe);
+  if (self->priorities)
+    g_hash_table_destroy (self->priorities);
 
   G_OBJECT_CLASS (cockpit_pipe_transport_parent_class)->finalize (object);
 }
 
+static const gchar *
+lookup_lane (CockpitPipeTransport *self,
+             const gchar *channel,
+             CockpitPriority *priority)
+{
+  const gchar *lane = NULL;
+  gpointer value;
+
+  *priority = COCKPIT_PRIORITY_NORMAL;
+
+  if (!channel || !self->priorities)
+    return NULL;
+
+  if (g_hash_table_lookup_extended (self->priorities, channel, (gpointer *)&lane, &value))
+    *priority = GPOINTER_TO_INT (value);
+  return lane;
+}
+
 static void
-cockpit_pipe_transport_send (CockpitTransport *transport,
-                             const gchar *channel_id,
-                             GBytes *payload)
+cockpit_pipe_transport_set_priority (CockpitTransport *transport,
+                                     const gchar *channel_id,
+                                     CockpitPriority priority)
 {
   CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
+
+  if (priority == COCKPIT_PRIORITY_NORMAL)
+    {
+      if (self->priorities)
+        g_hash_table_remove (self->priorities, channel_id);
+      return;
+    }
+
+  if (!self->priorities)
+    self->priorities = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_hash_table_replace (self->priorities, g_strdup (channel_id), GINT_TO_POINTER (priority));
+}
+
+static void
+send_in_lane (CockpitPipeTransport *self,
+              const gchar *channel_id,
+              const gchar *lane_channel,
+              GBytes *payload)
+{
+  CockpitPriority priority;
+  const gchar *lane;
   GBytes *prefix;
   gchar *prefix_str;
   gsize payload_len;
@@ -240,13 +287,55 @@ cockpit_pipe_transport_send (CockpitTransport *transport,
                                 channel_id ? channel_id : "");
   prefix = g_bytes_new_take (prefix_str, strlen (prefix_str));
 
-  cockpit_pipe_write (self->pipe, prefix);
-  cockpit_pipe_write (self->pipe, payload);
+  /* The lane is owned by the priorities table, valid until we return */
+  lane = lookup_lane (self, lane_channel, &priority);
+  cockpit_pipe_write_lane (self->pipe, lane, priority, prefix, FALSE);
+  cockpit_pipe_write_lane (self->pipe, lane, priority, payload, TRUE);
   g_bytes_unref (prefix);
 
   g_debug ("%s: queued %" G_GSIZE_FORMAT " byte payload", self->name, payload_len);
 }
 
+static void
+cockpit_pipe_transport_send (CockpitTransport *transport,
+                             const gchar *channel_id,
+                             GBytes *payload)
+{
+  send_in_lane (COCKPIT_PIPE_TRANSPORT (transport), channel_id, channel_id, payload);
+}
+
+/* Control messages about a channel need to stay in order with its data */
+static void
+cockpit_pipe_transport_send_control (CockpitTransport *transport,
+                                     const gchar *channel_id,
+                                     GBytes *payload)
+{
+  send_in_lane (COCKPIT_PIPE_TRANSPORT (transport), NULL, channel_id, payload);
+}
+
+static void
+cockpit_pipe_transport_send_frame (CockpitTransport *transport,
+                                   const gchar *channel_id,
+                                   GBytes *payload,
+                                   GBytes *frame)
+{
+  CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
+  CockpitPriority priority;
+  const gchar *lane;
+
+  if (self->closed)
+    {
+      g_debug ("dropping message on closed transport");
+      return;
+    }
+
+  /* Same framing on both sides, so it goes out exactly as it came in */
+  lane = lookup_lane (self, channel_id, &priority);
+  cockpit_pipe_write_lane (self->pipe, lane, priority, frame, TRUE);
+
+  g_debug ("%s: queued %" G_GSIZE_FORMAT " byte frame", self->name, g_bytes_get_size (frame));
+}
+
 static void
 cockpit_pipe_transport_close (CockpitTransport *transport,
                               const gchar *problem)
@@ -262,7 +351,10 @@ cockpit_pipe_transport_class_init (CockpitPipeTransportClass *klass)
   CockpitTransportClass *transport_class = COCKPIT_TRANSPORT_CLASS (klass);
 
   transport_class->send = cockpit_pipe_transport_send;
+  transport_class->send_frame = cockpit_pipe_transport_send_frame;
+  transport_class->send_control = cockpit_pipe_transport_send_control;
   transport_class->close = cockpit_pipe_transport_close;
+  transport_class->set_priority = cockpit_pipe_transport_set_priority;
 
   gobject_class->constructed = cockpit_pipe_transport_constructed;
   gobject_class->get_property = cockpit_pipe_transport_get_property;
@@ -326,6 +418,24 @@ cockpit_pipe_transport_get_pipe (CockpitPipeTransport *self)
   return self->pipe;
 }
 
+/**
+ * cockpit_pipe_transport_peek_frame:
+ * @self: a pipe transport
+ *
+ * While the #CockpitTransport::recv signal is being emitted for a
+ * message read from the pipe, this is the whole frame it came in,
+ * including the length and channel prefix. This can be passed on to
+ * cockpit_transport_send_frame() when relaying the message unchanged.
+ *
+ * Returns: (transfer none): the frame or %NULL
+ */
+GBytes *
+cockpit_pipe_transport_peek_frame (CockpitPipeTransport *self)
+{
+  g_return_val_if_fail (COCKPIT_IS_PIPE_TRANSPORT (self), NULL);
+  return self->frame;
+}
+
 /**
  * cockpit_transport_read_from_pipe:
  *
@@ -368,13 +478,16 @@ cockpit_transport_read_from_pipe (CockpitTransport *self,
           break;
         }
 
-      g_autoptr(GBytes) message = cockpit_pipe_consume (input, i, size, 0);
+      g_autoptr(GBytes) frame = cockpit_pipe_consume (input, 0, i + size, 0);
+      g_autoptr(GBytes) message = g_bytes_new_from_bytes (frame, i, size);
       g_autofree gchar *channel = NULL;
       g_autoptr(GBytes) payload = cockpit_transport_parse_frame (message, &channel);
       if (payload)
         {
           g_debug ("%s: received a %d byte payload", logname, (int)size);
+          COCKPIT_PIPE_TRANSPORT (self)->frame = frame;
           cockpit_transport_emit_recv (self, channel, payload);
+          COCKPIT_PIPE_TRANSPORT (self)->frame = NULL;
         }
     }
 
@@ -38,6 +38,8 @@ CockpitTransport * cockpit_pipe_transport_new_fds    (const gchar *name,
 
 CockpitPipe *      cockpit_pipe_transport_get_pipe   (CockpitPipeTransport *self);
 
+GBytes *           cockpit_pipe_transport_peek_frame (CockpitPipeTransport *self);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_PIPE_TRANSPORT_H__ */
@@ -0,0 +1,693 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitspawn.h"
+
+#include <glib-unix.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux
+#include <sys/prctl.h>
+#endif
+
+/*
+ * Spawning a child process from a bridge with a large address space
+ * used to be dominated by fork() copying its page tables. GLib can use
+ * posix_spawn() instead, but not when there's a child setup function,
+ * and we need one for PR_SET_PDEATHSIG.
+ *
+ * So on Linux we clone() with CLONE_VM | CLONE_VFORK ourselves, which is
+ * also how posix_spawn() works. The child borrows our memory until it
+ * calls exec, so it must not allocate, take locks or run our signal
+ * handlers. Everything it needs is prepared here beforehand. With
+ * CLONE_PIDFD we also get a pidfd to reap the child with, rather than
+ * relying on SIGCHLD.
+ *
+ * Set $COCKPIT_NO_VFORK to use g_spawn_async_with_pipes() instead.
+ */
+
+#if defined(__linux) && defined(CLONE_VM) && defined(CLONE_VFORK)
+#define WITH_CLONE_SPAWN 1
+#endif
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+
+#define CHILD_STACK_SIZE (128 * 1024)
+
+enum {
+  STAGE_NONE = 0,
+  STAGE_DUP,
+  STAGE_CHDIR,
+  STAGE_EXEC,
+};
+
+typedef struct {
+  const gchar *directory;
+  gchar **candidates;
+  gchar **argv;
+  gchar **sh_argv;
+  gchar **envp;
+  gint fds[3];
+  gboolean stderr_to_stdout;
+  pid_t parent;
+  sigset_t mask;
+
+  /* Written by the child when it fails */
+  volatile gint stage;
+  volatile gint errn;
+} ChildArgs;
+
+static void
+set_spawn_error (GError **error,
+                 gint stage,
+                 gint errn,
+                 const gchar *program,
+                 const gchar *directory)
+{
+  GSpawnError code;
+
+  if (stage == STAGE_CHDIR)
+    {
+      g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_CHDIR,
+                   "Failed to change to directory “%s”: %s", directory, g_strerror (errn));
+      return;
+    }
+
+  switch (errn)
+    {
+    case EACCES:
+      code = G_SPAWN_ERROR_ACCES;
+      break;
+    case EPERM:
+      code = G_SPAWN_ERROR_PERM;
+      break;
+    case E2BIG:
+      code = G_SPAWN_ERROR_TOO_BIG;
+      break;
+    case ENOEXEC:
+      code = G_SPAWN_ERROR_NOEXEC;
+      break;
+    case ENAMETOOLONG:
+      code = G_SPAWN_ERROR_NAMETOOLONG;
+      break;
+    case ENOENT:
+      code = G_SPAWN_ERROR_NOENT;
+      break;
+    case ENOMEM:
+      code = G_SPAWN_ERROR_NOMEM;
+      break;
+    case ENOTDIR:
+      code = G_SPAWN_ERROR_NOTDIR;
+      break;
+    case ELOOP:
+      code = G_SPAWN_ERROR_LOOP;
+      break;
+    case ETXTBSY:
+      code = G_SPAWN_ERROR_TXTBUSY;
+      break;
+    case EIO:
+      code = G_SPAWN_ERROR_IO;
+      break;
+    case ENFILE:
+      code = G_SPAWN_ERROR_NFILE;
+      break;
+    case EMFILE:
+      code = G_SPAWN_ERROR_MFILE;
+      break;
+    case EINVAL:
+      code = G_SPAWN_ERROR_INVAL;
+      break;
+    case EISDIR:
+      code = G_SPAWN_ERROR_ISDIR;
+      break;
+    case ELIBBAD:
+      code = G_SPAWN_ERROR_LIBBAD;
+      break;
+    default:
+      code = G_SPAWN_ERROR_FAILED;
+      break;
+    }
+
+  g_set_error (error, G_SPAWN_ERROR, code,
+               "Failed to execute child process “%s” (%s)", program, g_strerror (errn));
+}
+
+#ifdef WITH_CLONE_SPAWN
+
+struct linux_dirent64 {
+  guint64 d_ino;
+  gint64 d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* Only async-signal-safe calls and no allocation from here ... */
+
+static void G_GNUC_NORETURN
+child_fail (ChildArgs *args,
+            gint stage)
+{
+  args->errn = errno;
+  args->stage = stage;
+  _exit (127);
+}
+
+static gboolean
+child_continue_path (gint errn)
+{
+  return errn == ENOENT || errn == ENOTDIR || errn == ESTALE ||
+         errn == ENODEV || errn == ETIMEDOUT || errn == EACCES;
+}
+
+static void
+child_close_fds (gint from)
+{
+  union {
+    struct linux_dirent64 de;
+    gchar buffer[4096];
+  } u;
+  struct linux_dirent64 *de;
+  struct rlimit rl;
+  glong n, off;
+  gint dfd, fd;
+  const gchar *p;
+
+#ifdef SYS_close_range
+  if (syscall (SYS_close_range, from, ~0U, 0) == 0)
+    return;
+#endif
+
+  /* Mark them close-on-exec, rather than closing while reading the directory */
+  dfd = open ("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd >= 0)
+    {
+      while ((n = syscall (SYS_getdents64, dfd, u.buffer, sizeof (u.buffer))) > 0)
+        {
+          for (off = 0; off < n; off += de->d_reclen)
+            {
+              de = (struct linux_dirent64 *)(u.buffer + off);
+              fd = 0;
+              for (p = de->d_name; *p >= '0' && *p <= '9'; p++)
+                fd = fd * 10 + (*p - '0');
+              if (*p == '\0' && p != de->d_name && fd >= from && fd != dfd)
+                fcntl (fd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+      close (dfd);
+      return;
+    }
+
+  if (getrlimit (RLIMIT_NOFILE, &rl) < 0 || rl.rlim_max == RLIM_INFINITY)
+    rl.rlim_max = 4096;
+  for (fd = from; fd < (gint)rl.rlim_max; fd++)
+    close (fd);
+}
+
+static int
+child_main (void *data)
+{
+  ChildArgs *args = data;
+  struct sigaction sa;
+  gboolean eacces = FALSE;
+  gint errn = ENOENT;
+  gint i, sig;
+
+  /* We share memory with the parent, so its signal handlers must not run here */
+  for (sig = 1; sig < NSIG; sig++)
+    {
+      if (sigaction (sig, NULL, &sa) == 0 &&
+          sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL)
+        {
+          memset (&sa, 0, sizeof (sa));
+          sa.sa_handler = SIG_DFL;
+          sigaction (sig, &sa, NULL);
+        }
+    }
+
+  /* Send this signal to all direct child processes, when bridge dies */
+  prctl (PR_SET_PDEATHSIG, SIGHUP);
+  if (getppid () != args->parent)
+    _exit (127);
+
+  /* These are all above 2, so nothing gets clobbered */
+  for (i = 0; i < 3; i++)
+    {
+      if (args->fds[i] >= 0 && dup2 (args->fds[i], i) < 0)
+        child_fail (args, STAGE_DUP);
+    }
+
+  if (args->stderr_to_stdout && dup2 (1, 2) < 0)
+    child_fail (args, STAGE_DUP);
+
+  child_close_fds (3);
+
+  if (args->directory && chdir (args->directory) < 0)
+    child_fail (args, STAGE_CHDIR);
+
+  sigprocmask (SIG_SETMASK, &args->mask, NULL);
+
+  /* Like execvpe(), but with the path search already prepared */
+  for (i = 0; args->candidates[i] != NULL; i++)
+    {
+      execve (args->candidates[i], args->argv, args->envp);
+      errn = errno;
+
+      /* A script without a #! line */
+      if (errn == ENOEXEC)
+        {
+          args->sh_argv[1] = args->candidates[i];
+          execve (args->sh_argv[0], args->sh_argv, args->envp);
+          break;
+        }
+
+      if (errn == EACCES)
+        eacces = TRUE;
+      else if (!child_continue_path (errn))
+        break;
+    }
+
+  if (eacces && child_continue_path (errn))
+    errn = EACCES;
+
+  errno = errn;
+  child_fail (args, STAGE_EXEC);
+}
+
+/* ... to here */
+
+static gchar **
+build_candidates (const gchar *program,
+                  const gchar **env)
+{
+  GPtrArray *candidates;
+  const gchar *path = NULL;
+  gchar **dirs;
+  gint i;
+
+  candidates = g_ptr_array_new ();
+
+  if (strchr (program, '/'))
+    {
+      g_ptr_array_add (candidates, g_strdup (program));
+    }
+  else
+    {
+      if (env)
+        path = g_environ_getenv ((gchar **)env, "PATH");
+      if (!path)
+        path = g_getenv ("PATH");
+      if (!path)
+        path = "/bin:/usr/bin";
+
+      dirs = g_strsplit (path, ":", -1);
+      for (i = 0; dirs[i] != NULL; i++)
+        g_ptr_array_add (candidates, g_build_filename (dirs[i][0] ? dirs[i] : ".", program, NULL));
+      g_strfreev (dirs);
+    }
+
+  g_ptr_array_add (candidates, NULL);
+  return (gchar **)g_ptr_array_free (candidates, FALSE);
+}
+
+static gint
+raise_fd (gint fd)
+{
+  gint high;
+
+  /* Keep 0, 1 and 2 free for the child to dup2() onto */
+  if (fd < 0 || fd > 2)
+    return fd;
+
+  high = fcntl (fd, F_DUPFD_CLOEXEC, 3);
+  close (fd);
+  return high;
+}
+
+static gboolean
+make_pipe (gint fds[2])
+{
+  if (!g_unix_open_pipe (fds, FD_CLOEXEC, NULL))
+    return FALSE;
+
+  fds[0] = raise_fd (fds[0]);
+  fds[1] = raise_fd (fds[1]);
+  return fds[0] >= 0 && fds[1] >= 0;
+}
+
+static void
+close_pipe (gint fds[2])
+{
+  if (fds[0] >= 0)
+    close (fds[0]);
+  if (fds[1] >= 0)
+    close (fds[1]);
+  fds[0] = fds[1] = -1;
+}
+
+/* Returns -1 with errno set when clone() isn't available to us */
+static gint
+spawn_clone (const gchar *directory,
+             const gchar **argv,
+             const gchar **env,
+             CockpitSpawnFlags flags,
+             GPid *child_pid,
+             gint *child_pidfd,
+             gint *standard_input,
+             gint *standard_output,
+             gint *standard_error,
+             GError **error)
+{
+  ChildArgs args = { 0, };
+  gint in_fds[2] = { -1, -1 };
+  gint out_fds[2] = { -1, -1 };
+  gint err_fds[2] = { -1, -1 };
+  gint null_fd = -1;
+  gint pidfd = -1;
+  gint ret = FALSE;
+  gpointer stack;
+  sigset_t all;
+  pid_t pid;
+  gint errn;
+  gint argc;
+
+  stack = mmap (NULL, CHILD_STACK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED)
+    return -1;
+
+  if ((standard_input && !make_pipe (in_fds)) ||
+      (standard_output && !make_pipe (out_fds)) ||
+      (standard_error && !make_pipe (err_fds)))
+    {
+      errn = errno;
+      g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                   "Failed to create pipe for communicating with child process (%s)", g_strerror (errn));
+      goto out;
+    }
+
+  if (!standard_error && (flags & COCKPIT_SPAWN_STDERR_TO_NULL))
+    {
+      null_fd = raise_fd (open ("/dev/null", O_WRONLY | O_CLOEXEC));
+      if (null_fd < 0)
+        {
+          errn = errno;
+          g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                       "Failed to open /dev/null (%s)", g_strerror (errn));
+          goto out;
+        }
+    }
+
+  args.directory = directory;
+  args.candidates = build_candidates (argv[0], env);
+  args.argv = (gchar **)argv;
+  args.envp = env ? (gchar **)env : environ;
+  args.fds[0] = in_fds[0];
+  args.fds[1] = out_fds[1];
+  args.fds[2] = standard_error ? err_fds[1] : null_fd;
+  args.stderr_to_stdout = (flags & COCKPIT_SPAWN_STDERR_TO_STDOUT) ? TRUE : FALSE;
+  args.parent = getpid ();
+
+  argc = g_strv_length ((gchar **)argv);
+  args.sh_argv = g_new0 (gchar *, argc + 2);
+  args.sh_argv[0] = "/bin/sh";
+  memcpy (args.sh_argv + 2, argv + 1, sizeof (gchar *) * argc);
+
+  /* The child unblocks these once it has no more signal handlers */
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &args.mask);
+
+  pid = clone (child_main, (gchar *)stack + CHILD_STACK_SIZE,
+               CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD, &args, &pidfd);
+  if (pid < 0 && errno == EINVAL)
+    {
+      pidfd = -1;
+      pid = clone (child_main, (gchar *)stack + CHILD_STACK_SIZE,
+                   CLONE_VM | CLONE_VFORK | SIGCHLD, &args, NULL);
+    }
+  errn = errno;
+
+  pthread_sigmask (SIG_SETMASK, &args.mask, NULL);
+
+  if (pid < 0)
+    {
+      g_debug ("couldn't clone for spawning: %s", g_strerror (errn));
+      ret = -1;
+      goto out;
+    }
+
+  /* The child has either exec'd or exited by the time we get here */
+  if (args.stage != STAGE_NONE)
+    {
+      while (waitpid (pid, NULL, 0) < 0 && errno == EINTR);
+      if (pidfd >= 0)
+        close (pidfd);
+      set_spawn_error (error, args.stage, args.errn, argv[0], directory);
+      goto out;
+    }
+
+  *child_pid = pid;
+  if (child_pidfd)
+    *child_pidfd = pidfd;
+  else if (pidfd >= 0)
+    close (pidfd);
+
+  if (standard_input)
+    {
+      *standard_input = in_fds[1];
+      in_fds[1] = -1;
+    }
+  if (standard_output)
+    {
+      *standard_output = out_fds[0];
+      out_fds[0] = -1;
+    }
+  if (standard_error)
+    {
+      *standard_error = err_fds[0];
+      err_fds[0] = -1;
+    }
+
+  ret = TRUE;
+
+out:
+  close_pipe (in_fds);
+  close_pipe (out_fds);
+  close_pipe (err_fds);
+  if (null_fd >= 0)
+    close (null_fd);
+  g_strfreev (args.candidates);
+  g_free (args.sh_argv);
+  munmap (stack, CHILD_STACK_SIZE);
+  if (ret < 0)
+    errno = errn;
+  return ret;
+}
+
+#endif /* WITH_CLONE_SPAWN */
+
+static void
+spawn_setup (gpointer data)
+{
+  CockpitSpawnFlags flags = GPOINTER_TO_INT (data);
+
+  /* Send this signal to all direct child processes, when bridge dies */
+#ifdef __linux
+  prctl (PR_SET_PDEATHSIG, SIGHUP);
+#endif
+
+  if (flags & COCKPIT_SPAWN_STDERR_TO_STDOUT) {
+    int r = dup2 (1, 2);
+    g_assert (r == 2); /* that should really never fail */
+  }
+}
+
+static GSpawnFlags
+calculate_spawn_flags (const gchar **env,
+                       CockpitSpawnFlags flags)
+{
+  GSpawnFlags spawn_flags = G_SPAWN_DO_NOT_REAP_CHILD;
+  gboolean path_flag = FALSE;
+
+  for (; env && env[0]; env++)
+    {
+      if (g_str_has_prefix (env[0], "PATH="))
+        {
+          spawn_flags |= G_SPAWN_SEARCH_PATH_FROM_ENVP;
+          path_flag = TRUE;
+          break;
+        }
+    }
+
+  if (!path_flag)
+    spawn_flags |= G_SPAWN_SEARCH_PATH;
+
+  if (flags & COCKPIT_SPAWN_STDERR_TO_NULL)
+    spawn_flags |= G_SPAWN_STDERR_TO_DEV_NULL;
+
+  return spawn_flags;
+}
+
+/**
+ * cockpit_spawn_async:
+ * @directory: optional working directory of child process
+ * @argv: null terminated string array of command arguments
+ * @env: optional null terminated string array of child environment
+ * @flags: flags pertaining to stderr
+ * @child_pid: location to place the child pid
+ * @child_pidfd: optional location for a pidfd of the child, or -1
+ * @standard_input: optional location for the child's stdin pipe
+ * @standard_output: optional location for the child's stdout pipe
+ * @standard_error: optional location for the child's stderr pipe
+ * @error: location to place an error
+ *
+ * Like g_spawn_async_with_pipes() with G_SPAWN_DO_NOT_REAP_CHILD, and
+ * searching $PATH from @env if it's set there. The child gets SIGHUP
+ * when the calling thread exits.
+ *
+ * Returns: whether the child was started
+ */
+gboolean
+cockpit_spawn_async (const gchar *directory,
+                     const gchar **argv,
+                     const gchar **env,
+                     CockpitSpawnFlags flags,
+                     GPid *child_pid,
+                     gint *child_pidfd,
+                     gint *standard_input,
+                     gint *standard_output,
+                     gint *standard_error,
+                     GError **error)
+{
+  g_return_val_if_fail (argv != NULL && argv[0] != NULL, FALSE);
+  g_return_val_if_fail (child_pid != NULL, FALSE);
+
+  if (child_pidfd)
+    *child_pidfd = -1;
+
+#ifdef WITH_CLONE_SPAWN
+  if (!g_getenv ("COCKPIT_NO_VFORK"))
+    {
+      gint ret = spawn_clone (directory, argv, env, flags, child_pid, child_pidfd,
+                              standard_input, standard_output, standard_error, error);
+      if (ret >= 0)
+        return ret;
+    }
+#endif
+
+  return g_spawn_async_with_pipes (directory, (gchar **)argv, (gchar **)env,
+                                   calculate_spawn_flags (env, flags),
+                                   spawn_setup, GINT_TO_POINTER (flags),
+                                   child_pid, standard_input, standard_output, standard_error, error);
+}
+
+typedef struct {
+  GSource source;
+  GPid pid;
+  gint pidfd;
+} ChildSource;
+
+static gboolean
+child_source_dispatch (GSource *source,
+                       GSourceFunc callback,
+                       gpointer user_data)
+{
+  ChildSource *cs = (ChildSource *)source;
+  gint status = 0;
+  pid_t ret;
+
+  do
+    ret = waitpid (cs->pid, &status, WNOHANG);
+  while (ret < 0 && errno == EINTR);
+
+  /* Not exited yet */
+  if (ret == 0)
+    return G_SOURCE_CONTINUE;
+
+  if (ret < 0)
+    g_message ("couldn't wait for child process %d: %s", (int)cs->pid, g_strerror (errno));
+
+  if (callback)
+    ((GChildWatchFunc)callback) (cs->pid, status, user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+child_source_finalize (GSource *source)
+{
+  ChildSource *cs = (ChildSource *)source;
+  close (cs->pidfd);
+}
+
+static GSourceFuncs child_source_funcs = {
+  .dispatch = child_source_dispatch,
+  .finalize = child_source_finalize,
+};
+
+/**
+ * cockpit_child_source_new:
+ * @pid: a child process that hasn't been reaped
+ * @pidfd: a pidfd for the child, or -1
+ *
+ * Create a source that reaps the child process when it exits, and
+ * calls a #GChildWatchFunc set with g_source_set_callback(). This
+ * uses the pidfd, which the source takes ownership of, or opens one
+ * itself. Without pidfd support this is a g_child_watch_source_new().
+ *
+ * Returns: (transfer full): the new source
+ */
+GSource *
+cockpit_child_source_new (GPid pid,
+                          gint pidfd)
+{
+  ChildSource *cs;
+
+#ifdef SYS_pidfd_open
+  if (pidfd < 0)
+    pidfd = syscall (SYS_pidfd_open, pid, 0);
+#endif
+
+  if (pidfd < 0)
+    return g_child_watch_source_new (pid);
+
+  cs = (ChildSource *)g_source_new (&child_source_funcs, sizeof (ChildSource));
+  cs->pid = pid;
+  cs->pidfd = pidfd;
+  g_source_add_unix_fd ((GSource *)cs, pidfd, G_IO_IN);
+  g_source_set_name ((GSource *)cs, "child-pidfd");
+
+  return (GSource *)cs;
+}
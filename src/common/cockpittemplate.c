@@ -25,11 +25,65 @@
 
 #include <glib.h>
 
+#include <errno.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #define VARCHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._-"
 
-static gchar *
+/* Don't keep more than this many parsed files around */
+#define CACHE_MAXIMUM 64
+
+typedef enum {
+  SEGMENT_LITERAL,
+  SEGMENT_VARIABLE,
+} SegmentType;
+
+/*
+ * A template is parsed into literal slices of the input and variable
+ * references. For a variable, the slice covers the whole reference
+ * with its markers, which is output when the variable is not known.
+ */
+typedef struct {
+  SegmentType type;
+  gsize offset;
+  gsize length;
+  gchar *name;
+} Segment;
+
+struct _CockpitTemplate {
+  gint refs;
+  GBytes *input;
+  GArray *segments;
+};
+
+typedef struct {
+  CockpitTemplate *template;
+  dev_t dev;
+  ino_t ino;
+  goffset size;
+  gint64 mtime;
+  gint64 ctime;
+} CacheEntry;
+
+/* Like the rest of the web server, only used from the main thread */
+static GHashTable *template_cache;
+
+static gboolean
+valid_name (const gchar *name,
+            const gchar *end)
+{
+  if (name == end)
+    return FALSE;
+  for (; name != end; name++)
+    {
+      if (*name == '\0' || !strchr (VARCHARS, *name))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+static const gchar *
 find_variable (const gchar *start_marker,
                const gchar *end_marker,
                const gchar *data,
@@ -37,6 +91,8 @@ find_variable (const gchar *start_marker,
                const gchar **before,
                const gchar **after)
 {
+  gsize start_len = strlen (start_marker);
+  gsize end_len = strlen (end_marker);
   const gchar *a;
   const gchar *b;
   const gchar *c;
@@ -45,18 +101,18 @@ find_variable (const gchar *start_marker,
   for (;;)
     {
       /* Look for start_marker to end_marker */
-      a = memmem (data, strlen(data), start_marker, strlen (start_marker));
+      a = memmem (data, end - data, start_marker, start_len);
       if (a == NULL)
         return NULL;
 
-      data = a + strlen (start_marker);
+      data = a + start_len;
       b = data;
 
-      c = memmem (data, strlen(data), end_marker, strlen (end_marker));
+      c = memmem (data, end - data, end_marker, end_len);
       if (c == NULL)
         return NULL;
 
-      data = c + strlen (end_marker);
+      data = c + end_len;
       d = data;
 
       /*
@@ -67,96 +123,280 @@ find_variable (const gchar *start_marker,
        *
        * Check that the name makes sense.
        */
-      if (b != c && b + strspn (b, VARCHARS) == c)
+      if (valid_name (b, c))
         break;
     }
 
-  if (before)
-    *before = a;
-  if (after)
-    *after = d;
-  return g_strndup (b, c - b);
+  *before = a;
+  *after = d;
+  return b;
 }
 
-GList *
-cockpit_template_expand (GBytes *input,
-                         const gchar *start_marker,
-                         const gchar *end_marker,
-                         CockpitTemplateFunc func,
-                         gpointer user_data)
+static void
+add_segment (CockpitTemplate *self,
+             SegmentType type,
+             const gchar *data,
+             gsize length,
+             gchar *name)
 {
-  GList *output = NULL;
+  Segment segment = { type, data - (const gchar *)g_bytes_get_data (self->input, NULL), length, name };
+
+  if (length > 0)
+    g_array_append_val (self->segments, segment);
+}
+
+static void
+clear_segment (gpointer data)
+{
+  Segment *segment = data;
+  g_free (segment->name);
+}
+
+/**
+ * cockpit_template_new:
+ * @input: the template text
+ * @start_marker: marker for the start of a variable
+ * @end_marker: marker for the end of a variable
+ *
+ * Parse @input into literal text and variable references, so that
+ * it can be expanded again and again with cockpit_template_render()
+ * without looking at the text each time. A start marker preceded
+ * by a backslash is not treated as a variable.
+ *
+ * Returns: (transfer full): the parsed template
+ */
+CockpitTemplate *
+cockpit_template_new (GBytes *input,
+                      const gchar *start_marker,
+                      const gchar *end_marker)
+{
+  CockpitTemplate *self;
   const gchar *data;
   const gchar *end;
   const gchar *before;
   const gchar *after;
-  GBytes *bytes;
-  gchar *name;
-  gboolean escaped;
-  gint before_len;
+  const gchar *name;
+  gsize end_len;
+  gsize before_len;
 
-  g_return_val_if_fail (func != NULL, NULL);
+  g_return_val_if_fail (input != NULL, NULL);
+  g_return_val_if_fail (start_marker != NULL && start_marker[0], NULL);
+  g_return_val_if_fail (end_marker != NULL && end_marker[0], NULL);
+
+  self = g_new0 (CockpitTemplate, 1);
+  self->refs = 1;
+  self->input = g_bytes_ref (input);
+  self->segments = g_array_new (FALSE, FALSE, sizeof (Segment));
+  g_array_set_clear_func (self->segments, clear_segment);
 
   data = g_bytes_get_data (input, NULL);
   end = data + g_bytes_get_size (input);
+  end_len = strlen (end_marker);
 
-  for (;;)
+  while (data != end)
     {
-      escaped = FALSE;
       name = find_variable (start_marker, end_marker, data, end, &before, &after);
       if (name == NULL)
         break;
 
-      if (before != data)
+      g_assert (before >= data);
+      before_len = before - data;
+
+      /* Check if the char before the match is the escape char '\' */
+      if (before_len > 0 && data[before_len - 1] == '\\')
         {
-          g_assert (before > data);
-
-          /* Check if the char before the match is the escape char '/' */
-          before_len = before - data;
-          if (data[before_len - 1] == '\\')
-            {
-              escaped = TRUE;
-              before_len--;
-            }
-
-          bytes = g_bytes_new_with_free_func (data, before_len,
-                                              (GDestroyNotify)g_bytes_unref,
-                                              g_bytes_ref (input));
-          output = g_list_prepend (output, bytes);
+          add_segment (self, SEGMENT_LITERAL, data, before_len - 1, NULL);
+          add_segment (self, SEGMENT_LITERAL, before, after - before, NULL);
         }
-
-      if (!escaped)
-        bytes = (func) (name, user_data);
       else
-        bytes = NULL; // Set bytes to null so it's treated as skipped
-      g_free (name);
-
-      if (!bytes)
         {
-          g_assert (after > before);
-          bytes = g_bytes_new_with_free_func (before, after - before,
-                                              (GDestroyNotify)g_bytes_unref,
-                                              g_bytes_ref (input));
+          add_segment (self, SEGMENT_LITERAL, data, before_len, NULL);
+          add_segment (self, SEGMENT_VARIABLE, before, after - before,
+                       g_strndup (name, (after - end_len) - name));
         }
+
+      g_assert (after <= end);
+      data = after;
+    }
+
+  add_segment (self, SEGMENT_LITERAL, data, end - data, NULL);
+  return self;
+}
+
+CockpitTemplate *
+cockpit_template_ref (CockpitTemplate *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+  g_atomic_int_inc (&self->refs);
+  return self;
+}
+
+void
+cockpit_template_unref (CockpitTemplate *self)
+{
+  g_return_if_fail (self != NULL);
+
+  if (g_atomic_int_dec_and_test (&self->refs))
+    {
+      g_array_free (self->segments, TRUE);
+      g_bytes_unref (self->input);
+      g_free (self);
+    }
+}
+
+/**
+ * cockpit_template_render:
+ * @self: a parsed template
+ * @func: called to look up each variable
+ * @user_data: passed to @func
+ *
+ * Expand the variables in the template. Where @func returns %NULL
+ * the variable reference is left as it is.
+ *
+ * Returns: (transfer full): a list of GBytes, to be sent one after
+ *          the other. The literal parts point into the input.
+ */
+GList *
+cockpit_template_render (CockpitTemplate *self,
+                         CockpitTemplateFunc func,
+                         gpointer user_data)
+{
+  GList *output = NULL;
+  Segment *segment;
+  GBytes *bytes;
+  guint i;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (func != NULL, NULL);
+
+  for (i = 0; i < self->segments->len; i++)
+    {
+      segment = &g_array_index (self->segments, Segment, i);
+
+      bytes = NULL;
+      if (segment->type == SEGMENT_VARIABLE)
+        bytes = (func) (segment->name, user_data);
+      if (!bytes)
+        bytes = g_bytes_new_from_bytes (self->input, segment->offset, segment->length);
+
       if (g_bytes_get_size (bytes) > 0)
         output = g_list_prepend (output, bytes);
       else
         g_bytes_unref (bytes);
+    }
 
-      g_assert (after <= end);
-      data = after;
+  return g_list_reverse (output);
+}
+
+static void
+cache_entry_free (gpointer data)
+{
+  CacheEntry *entry = data;
+  cockpit_template_unref (entry->template);
+  g_free (entry);
+}
+
+/**
+ * cockpit_template_load:
+ * @filename: the file to load
+ * @start_marker: marker for the start of a variable
+ * @end_marker: marker for the end of a variable
+ * @error: location for a G_FILE_ERROR
+ *
+ * Load and parse a template file. Parsed files are cached, and
+ * only loaded again when the file changes on disk.
+ *
+ * Returns: (transfer full): the parsed template, or %NULL on error
+ */
+CockpitTemplate *
+cockpit_template_load (const gchar *filename,
+                       const gchar *start_marker,
+                       const gchar *end_marker,
+                       GError **error)
+{
+  CacheEntry *entry;
+  GBytes *input;
+  gchar *contents;
+  gchar *key;
+  gsize length;
+  struct stat st;
+  int errsv;
+
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  if (stat (filename, &st) < 0)
+    {
+      errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to open file “%s”: %s", filename, g_strerror (errsv));
+      return NULL;
     }
 
-  if (data != end)
+  if (S_ISDIR (st.st_mode))
     {
-      g_assert (end > data);
-      bytes = g_bytes_new_with_free_func (data, end - data,
-                                          (GDestroyNotify)g_bytes_unref,
-                                          g_bytes_ref (input));
-      output = g_list_prepend (output, bytes);
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_ISDIR,
+                   "Failed to open file “%s”: %s", filename, g_strerror (EISDIR));
+      return NULL;
     }
 
-  return g_list_reverse (output);
+  if (!template_cache)
+    template_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, cache_entry_free);
+
+  key = g_strdup_printf ("%s\n%s\n%s", start_marker, end_marker, filename);
+  entry = g_hash_table_lookup (template_cache, key);
+
+  /* A changed or replaced file, or changed permissions, all show up here */
+  if (entry && entry->dev == st.st_dev && entry->ino == st.st_ino &&
+      entry->size == st.st_size &&
+      entry->mtime == st.st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000) + st.st_mtim.tv_nsec &&
+      entry->ctime == st.st_ctim.tv_sec * G_GINT64_CONSTANT (1000000000) + st.st_ctim.tv_nsec)
+    {
+      g_free (key);
+      return cockpit_template_ref (entry->template);
+    }
+
+  if (!g_file_get_contents (filename, &contents, &length, error))
+    {
+      g_hash_table_remove (template_cache, key);
+      g_free (key);
+      return NULL;
+    }
+
+  if (g_hash_table_size (template_cache) >= CACHE_MAXIMUM)
+    g_hash_table_remove_all (template_cache);
+
+  input = g_bytes_new_take (contents, length);
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->template = cockpit_template_new (input, start_marker, end_marker);
+  entry->dev = st.st_dev;
+  entry->ino = st.st_ino;
+  entry->size = st.st_size;
+  entry->mtime = st.st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000) + st.st_mtim.tv_nsec;
+  entry->ctime = st.st_ctim.tv_sec * G_GINT64_CONSTANT (1000000000) + st.st_ctim.tv_nsec;
+  g_hash_table_replace (template_cache, key, entry);
+
+  g_bytes_unref (input);
+  return cockpit_template_ref (entry->template);
+}
+
+GList *
+cockpit_template_expand (GBytes *input,
+                         const gchar *start_marker,
+                         const gchar *end_marker,
+                         CockpitTemplateFunc func,
+                         gpointer user_data)
+{
+  CockpitTemplate *template;
+  GList *output;
+
+  g_return_val_if_fail (func != NULL, NULL);
+
+  template = cockpit_template_new (input, start_marker, end_marker);
+  output = cockpit_template_render (template, func, user_data);
+  cockpit_template_unref (template);
+
+  return output;
 }
 
 typedef struct
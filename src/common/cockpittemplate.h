@@ -23,9 +23,28 @@
 #include <glib.h>
 #include <json-glib/json-glib.h>
 
+typedef struct _CockpitTemplate CockpitTemplate;
+
 typedef GBytes * (* CockpitTemplateFunc)          (const gchar *variable,
                                                    gpointer user_data);
 
+CockpitTemplate * cockpit_template_new            (GBytes *input,
+                                                   const gchar *start_marker,
+                                                   const gchar *end_marker);
+
+CockpitTemplate * cockpit_template_load           (const gchar *filename,
+                                                   const gchar *start_marker,
+                                                   const gchar *end_marker,
+                                                   GError **error);
+
+CockpitTemplate * cockpit_template_ref            (CockpitTemplate *self);
+
+void              cockpit_template_unref          (CockpitTemplate *self);
+
+GList *           cockpit_template_render         (CockpitTemplate *self,
+                                                   CockpitTemplateFunc func,
+                                                   gpointer user_data);
+
 GList *           cockpit_template_expand         (GBytes *input,
                                                    const gchar *start_marker,
                                                    const gchar *end_marker,
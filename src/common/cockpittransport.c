@@ -26,12 +26,20 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Don't buffer more than this for a channel while it's frozen */
+#define FROZEN_CHANNEL_MAX (16 * 1024 * 1024)
+
 typedef struct {
-    gconstpointer channel;
     JsonObject *control;
     GBytes *data;
 } FrozenMessage;
 
+typedef struct {
+    GQueue messages;
+    gsize size;
+    gboolean overflowed;
+} FrozenChannel;
+
 static void
 frozen_message_free (gpointer data)
 {
@@ -43,6 +51,33 @@ frozen_message_free (gpointer data)
   g_slice_free (FrozenMessage, frozen);
 }
 
+static void
+frozen_channel_drop_data (FrozenChannel *frozen)
+{
+  FrozenMessage *message;
+  GList *l, *next;
+
+  for (l = frozen->messages.head; l != NULL; l = next)
+    {
+      next = l->next;
+      message = l->data;
+      if (!message->control)
+        {
+          g_queue_delete_link (&frozen->messages, l);
+          frozen_message_free (message);
+        }
+    }
+}
+
+static void
+frozen_channel_free (gpointer data)
+{
+  FrozenChannel *frozen = data;
+  g_queue_foreach (&frozen->messages, (GFunc)frozen_message_free, NULL);
+  g_queue_clear (&frozen->messages);
+  g_slice_free (FrozenChannel, frozen);
+}
+
 enum {
   RECV,
   CONTROL,
@@ -54,7 +89,6 @@ static guint signals[NUM_SIGNALS];
 
 typedef struct {
   GHashTable *freeze;
-  GQueue *frozen;
 } CockpitTransportPrivate;
 
 G_DEFINE_ABSTRACT_TYPE_WITH_CODE (CockpitTransport, cockpit_transport, G_TYPE_OBJECT,
@@ -82,27 +116,39 @@ maybe_freeze_message (CockpitTransport *self,
                       GBytes *data)
 {
   CockpitTransportPrivate *priv = cockpit_transport_get_instance_private (self);
-  FrozenMessage *frozen = NULL;
+  FrozenChannel *frozen = NULL;
+  FrozenMessage *message;
 
   if (priv->freeze && channel)
+    frozen = g_hash_table_lookup (priv->freeze, channel);
+  if (!frozen)
+    return FALSE;
+
+  /*
+   * Once too much was queued, the channel will be closed on thaw. Only
+   * control messages are kept then, so that "open" still gets through.
+   */
+  if (!control)
     {
-      /* Note that we dig out the real value for the channel */
-      channel = g_hash_table_lookup (priv->freeze, channel);
-      if (channel)
+      if (frozen->overflowed)
+        return TRUE;
+
+      frozen->size += g_bytes_get_size (data);
+      if (frozen->size > FROZEN_CHANNEL_MAX)
         {
-          frozen = g_slice_new0 (FrozenMessage);
-          frozen->channel = channel; /* owned by hashtable */
-          frozen->data = g_bytes_ref (data);
-          if (control)
-            frozen->control = json_object_ref (control);
-          if (!priv->frozen)
-            priv->frozen = g_queue_new ();
-          g_queue_push_tail (priv->frozen, frozen);
+          g_message ("%s: too much data queued while channel is frozen", channel);
+          frozen_channel_drop_data (frozen);
+          frozen->overflowed = TRUE;
           return TRUE;
         }
     }
 
-  return FALSE;
+  message = g_slice_new0 (FrozenMessage);
+  message->data = g_bytes_ref (data);
+  if (control)
+    message->control = json_object_ref (control);
+  g_queue_push_tail (&frozen->messages, message);
+  return TRUE;
 }
 
 static gboolean
@@ -171,8 +217,6 @@ cockpit_transport_finalize (GObject *object)
 
   if (priv->freeze)
     g_hash_table_destroy (priv->freeze);
-  if (priv->frozen)
-    g_queue_free_full (priv->frozen, frozen_message_free);
 
   G_OBJECT_CLASS (cockpit_transport_parent_class)->finalize (object);
 }
@@ -225,6 +269,62 @@ cockpit_transport_send (CockpitTransport *transport,
   klass->send (transport, channel, data);
 }
 
+/**
+ * cockpit_transport_send_frame:
+ * @transport: the transport
+ * @channel: the channel, or %NULL for control messages
+ * @data: the payload
+ * @frame: (nullable): the same message with its length and channel prefix
+ *
+ * Send a message that was received framed, usually from another
+ * #CockpitPipeTransport. Transports that put messages on the wire
+ * in that same format can send @frame as is, without building it
+ * again. Otherwise this is the same as cockpit_transport_send().
+ */
+void
+cockpit_transport_send_frame (CockpitTransport *transport,
+                              const gchar *channel,
+                              GBytes *data,
+                              GBytes *frame)
+{
+  CockpitTransportClass *klass;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
+
+  klass = COCKPIT_TRANSPORT_GET_CLASS (transport);
+  if (frame && klass->send_frame)
+    klass->send_frame (transport, channel, data, frame);
+  else
+    cockpit_transport_send (transport, channel, data);
+}
+
+/**
+ * cockpit_transport_send_control:
+ * @transport: the transport
+ * @channel: the channel the control message is about
+ * @data: the control message
+ *
+ * Send a control message that concerns @channel, such as its
+ * "close". Transports that prioritize channels use @channel to keep
+ * the message in order with the data of the channel. Otherwise this
+ * is the same as cockpit_transport_send() with a %NULL channel.
+ */
+void
+cockpit_transport_send_control (CockpitTransport *transport,
+                                const gchar *channel,
+                                GBytes *data)
+{
+  CockpitTransportClass *klass;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
+
+  klass = COCKPIT_TRANSPORT_GET_CLASS (transport);
+  if (channel && klass->send_control)
+    klass->send_control (transport, channel, data);
+  else
+    cockpit_transport_send (transport, NULL, data);
+}
+
 void
 cockpit_transport_close (CockpitTransport *transport,
                          const gchar *problem)
@@ -238,6 +338,84 @@ cockpit_transport_close (CockpitTransport *transport,
   klass->close (transport, problem);
 }
 
+/**
+ * cockpit_transport_set_priority:
+ * @transport: the transport
+ * @channel: the channel
+ * @priority: the priority
+ *
+ * Change the share of outgoing data that @channel gets when
+ * other channels have data queued as well. Channels start out
+ * with %COCKPIT_PRIORITY_NORMAL, and should be set back to that
+ * once closed. Transports that don't queue data ignore this.
+ */
+void
+cockpit_transport_set_priority (CockpitTransport *transport,
+                                const gchar *channel,
+                                CockpitPriority priority)
+{
+  CockpitTransportClass *klass;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
+  g_return_if_fail (channel != NULL);
+
+  klass = COCKPIT_TRANSPORT_GET_CLASS (transport);
+  if (klass->set_priority)
+    klass->set_priority (transport, channel, priority);
+}
+
+/**
+ * cockpit_transport_parse_priority:
+ * @options: the options of an "open" control message
+ *
+ * Figure out the priority of a channel from its "priority" option,
+ * which is one of "high", "normal" or "low". When not present, the
+ * default depends on the payload: an interactive terminal is high,
+ * bulk transfers are low.
+ *
+ * Returns: the priority of the channel
+ */
+CockpitPriority
+cockpit_transport_parse_priority (JsonObject *options)
+{
+  const gchar *priority = NULL;
+  const gchar *payload = NULL;
+  gboolean pty = FALSE;
+
+  if (!cockpit_json_get_string (options, "priority", NULL, &priority))
+    {
+      g_message ("invalid \"priority\" option");
+      priority = NULL;
+    }
+
+  if (priority)
+    {
+      if (g_str_equal (priority, "high"))
+        return COCKPIT_PRIORITY_HIGH;
+      else if (g_str_equal (priority, "low"))
+        return COCKPIT_PRIORITY_LOW;
+      else if (!g_str_equal (priority, "normal"))
+        g_message ("unknown \"priority\" option: %s", priority);
+      return COCKPIT_PRIORITY_NORMAL;
+    }
+
+  if (!cockpit_json_get_string (options, "payload", NULL, &payload) || !payload)
+    return COCKPIT_PRIORITY_NORMAL;
+
+  if (g_str_equal (payload, "stream"))
+    {
+      if (cockpit_json_get_bool (options, "pty", FALSE, &pty) && pty)
+        return COCKPIT_PRIORITY_HIGH;
+    }
+  else if (g_str_equal (payload, "fsread1") ||
+           g_str_equal (payload, "metrics1"))
+    {
+      return COCKPIT_PRIORITY_LOW;
+    }
+
+  return COCKPIT_PRIORITY_NORMAL;
+}
+
 void
 cockpit_transport_emit_recv (CockpitTransport *transport,
                              const gchar *channel,
@@ -294,8 +472,9 @@ cockpit_transport_freeze (CockpitTransport *self,
   g_return_if_fail (channel != NULL);
 
   if (!priv->freeze)
-    priv->freeze = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  g_hash_table_add (priv->freeze, g_strdup (channel));
+    priv->freeze = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, frozen_channel_free);
+  if (!g_hash_table_contains (priv->freeze, channel))
+    g_hash_table_insert (priv->freeze, g_strdup (channel), g_slice_new0 (FrozenChannel));
 }
 
 void
@@ -303,43 +482,56 @@ cockpit_transport_thaw (CockpitTransport *self,
                         const gchar *channel)
 {
   CockpitTransportPrivate *priv = cockpit_transport_get_instance_private (self);
-  FrozenMessage *frozen;
+  FrozenChannel *frozen = NULL;
+  FrozenMessage *message;
+  JsonObject *options;
   const gchar *command;
   gchar *stolen = NULL;
-  GList *l, *flush;
+  GBytes *payload;
 
   g_return_if_fail (COCKPIT_IS_TRANSPORT (self));
   g_return_if_fail (channel != NULL);
 
-  if (priv->freeze)
-    stolen = g_hash_table_lookup (priv->freeze, channel);
-  if (stolen)
-    g_hash_table_steal (priv->freeze, channel);
+  /* Messages that arrive while we flush are no longer frozen */
+  if (!priv->freeze ||
+      !g_hash_table_lookup_extended (priv->freeze, channel, (gpointer *)&stolen, (gpointer *)&frozen))
+    return;
+  g_hash_table_steal (priv->freeze, channel);
 
-  for (l = priv->frozen ? priv->frozen->head : NULL; l != NULL; )
-    {
-      frozen = l->data;
-      flush = (stolen == frozen->channel) ? l : NULL;
-      l = g_list_next (l);
+  g_object_ref (self);
 
-      if (flush)
+  while ((message = g_queue_pop_head (&frozen->messages)) != NULL)
+    {
+      if (message->control)
         {
-          if (frozen->control)
-            {
-              command = NULL;
-              cockpit_json_get_string (frozen->control, "command", NULL, &command);
-              cockpit_transport_emit_control (self, command, stolen, frozen->control, frozen->data);
-            }
-          else
-            {
-              cockpit_transport_emit_recv (self, stolen, frozen->data);
-            }
-          g_queue_delete_link (priv->frozen, flush);
-          frozen_message_free (frozen);
+          command = NULL;
+          cockpit_json_get_string (message->control, "command", NULL, &command);
+          cockpit_transport_emit_control (self, command, stolen, message->control, message->data);
         }
+      else
+        {
+          cockpit_transport_emit_recv (self, stolen, message->data);
+        }
+      frozen_message_free (message);
+    }
+
+  /* The sender didn't wait for the channel, tell whoever handles it to close */
+  if (frozen->overflowed)
+    {
+      options = json_object_new ();
+      json_object_set_string_member (options, "command", "close");
+      json_object_set_string_member (options, "channel", stolen);
+      json_object_set_string_member (options, "problem", "internal-error");
+      json_object_set_string_member (options, "message", "too much data was sent before the channel was ready");
+      payload = cockpit_json_write_bytes (options);
+      cockpit_transport_emit_control (self, "close", stolen, options, payload);
+      g_bytes_unref (payload);
+      json_object_unref (options);
     }
 
+  frozen_channel_free (frozen);
   g_free (stolen);
+  g_object_unref (self);
 }
 
 static GBytes *
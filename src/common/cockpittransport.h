@@ -23,6 +23,8 @@
 #include <glib-object.h>
 #include <json-glib/json-glib.h>
 
+#include "cockpitfairqueue.h"
+
 G_BEGIN_DECLS
 
 #define COCKPIT_TYPE_TRANSPORT            (cockpit_transport_get_type ())
@@ -61,15 +63,52 @@ struct _CockpitTransportClass
 
   void        (* close)       (CockpitTransport *transport,
                                const gchar *problem);
+
+  /*
+   * Called when a channel should get a different share of sent data.
+   */
+  void        (* set_priority) (CockpitTransport *transport,
+                                const gchar *channel,
+                                CockpitPriority priority);
+
+  /*
+   * Called to send a message that is already framed as it goes on the wire.
+   */
+  void        (* send_frame)  (CockpitTransport *transport,
+                               const gchar *channel,
+                               GBytes *data,
+                               GBytes *frame);
+
+  /*
+   * Called to send a control message about a channel.
+   */
+  void        (* send_control) (CockpitTransport *transport,
+                                const gchar *channel,
+                                GBytes *data);
 };
 
 void        cockpit_transport_send           (CockpitTransport *transport,
                                               const gchar *channel,
                                               GBytes *data);
 
+void        cockpit_transport_send_frame     (CockpitTransport *transport,
+                                              const gchar *channel,
+                                              GBytes *data,
+                                              GBytes *frame);
+
+void        cockpit_transport_send_control   (CockpitTransport *transport,
+                                              const gchar *channel,
+                                              GBytes *data);
+
 void        cockpit_transport_close          (CockpitTransport *transport,
                                               const gchar *problem);
 
+void        cockpit_transport_set_priority   (CockpitTransport *transport,
+                                              const gchar *channel,
+                                              CockpitPriority priority);
+
+CockpitPriority cockpit_transport_parse_priority (JsonObject *options);
+
 void        cockpit_transport_emit_recv      (CockpitTransport *transport,
                                               const gchar *channel,
                                               GBytes *data);
@@ -21,56 +21,224 @@
 
 #include "cockpitunicode.h"
 
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Most of what we validate is ASCII, so skip over that as many bytes
+ * at a time as we can. Returns the length of the leading run of ASCII,
+ * which may stop short. Nul bytes are not part of the run, as
+ * g_utf8_validate() treats them as invalid.
+ */
+static inline gsize
+ascii_run (const guchar *data,
+           gsize length)
+{
+  const guint64 ones = G_GUINT64_CONSTANT (0x0101010101010101);
+  const guint64 highs = G_GUINT64_CONSTANT (0x8080808080808080);
+  guint64 word;
+  gsize i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i block;
+
+  for (; i + 16 <= length; i += 16)
+    {
+      block = _mm_loadu_si128 ((const __m128i *)(data + i));
+      if (_mm_movemask_epi8 (_mm_or_si128 (block, _mm_cmpeq_epi8 (block, zero))))
+        break;
+    }
+#elif defined(__aarch64__)
+  uint8x16_t block;
+
+  for (; i + 16 <= length; i += 16)
+    {
+      block = vld1q_u8 (data + i);
+      if (vmaxvq_u8 (block) >= 0x80 || vminvq_u8 (block) == 0)
+        break;
+    }
+#endif
+
+  for (; i + 8 <= length; i += 8)
+    {
+      memcpy (&word, data + i, sizeof (word));
+      if ((word | ((word - ones) & ~word)) & highs)
+        break;
+    }
+
+  while (i < length && data[i] > 0 && data[i] < 0x80)
+    i++;
+
+  return i;
+}
+
+/*
+ * Checks the sequence at the start of @data. Returns its length if
+ * valid, or zero if not. If the sequence is valid as far as it goes, but
+ * cut off by the end of the data, @truncated is set.
+ */
+static inline gsize
+check_sequence (const guchar *data,
+                gsize length,
+                gboolean *truncated)
+{
+  guchar lead = data[0];
+  guchar min = 0x80;
+  guchar max = 0xBF;
+  gsize needed;
+  gsize i;
+
+  *truncated = FALSE;
+
+  if (lead > 0 && lead < 0x80)
+    return 1;
+  else if (lead >= 0xC2 && lead <= 0xDF)
+    needed = 2;
+  else if (lead >= 0xE0 && lead <= 0xEF)
+    needed = 3;
+  else if (lead >= 0xF0 && lead <= 0xF4)
+    needed = 4;
+  else
+    return 0;
+
+  /* No overlong forms, surrogates or code points past U+10FFFF */
+  if (lead == 0xE0)
+    min = 0xA0;
+  else if (lead == 0xED)
+    max = 0x9F;
+  else if (lead == 0xF0)
+    min = 0x90;
+  else if (lead == 0xF4)
+    max = 0x8F;
+
+  for (i = 1; i < needed; i++)
+    {
+      if (i == length)
+        {
+          *truncated = TRUE;
+          return length;
+        }
+      if (data[i] < min || data[i] > max)
+        return 0;
+      min = 0x80;
+      max = 0xBF;
+    }
+
+  return needed;
+}
+
+/**
+ * cockpit_unicode_validate:
+ * @data: the data to check
+ * @length: the length of the data
+ * @incomplete: (out) (optional): length of an incomplete ending
+ *
+ * Checks whether @data is valid UTF-8 in a single pass. A multi-byte
+ * character cut off by the end of @data is not counted as invalid, but
+ * its length is placed in @incomplete. It may be completed by whatever
+ * data follows.
+ *
+ * Like g_utf8_validate(), nul bytes are considered invalid.
+ *
+ * Returns: whether @data is valid, apart from an incomplete ending
+ */
+gboolean
+cockpit_unicode_validate (gconstpointer data,
+                          gsize length,
+                          gsize *incomplete)
+{
+  const guchar *bytes = data;
+  gboolean valid = TRUE;
+  gboolean truncated;
+  gsize tail = 0;
+  gsize i = 0;
+  gsize len;
+
+  while (i < length)
+    {
+      i += ascii_run (bytes + i, length - i);
+      if (i == length)
+        break;
+
+      len = check_sequence (bytes + i, length - i, &truncated);
+      if (len == 0)
+        {
+          valid = FALSE;
+          i++;
+        }
+      else
+        {
+          if (truncated)
+            tail = len;
+          i += len;
+        }
+    }
+
+  if (incomplete)
+    *incomplete = tail;
+  return valid;
+}
+
 gboolean
 cockpit_unicode_has_incomplete_ending (GBytes *input)
 {
-  const gchar *data;
-  const gchar *end;
+  gconstpointer data;
   gsize length;
+  gsize tail;
 
   data = g_bytes_get_data (input, &length);
-  if (g_utf8_validate (data, length, &end))
-    return FALSE;
+  cockpit_unicode_validate (data, length, &tail);
 
-  do
-    {
-      length -= (end - data) + 1;
-      data = end + 1;
-    }
-  while (!g_utf8_validate (data, length, &end));
-
-  return length == 0;
+  return tail > 0;
 }
 
 GBytes *
 cockpit_unicode_force_utf8 (GBytes *input)
 {
-  const gchar *data;
-  const gchar *end;
-  gsize length;
+  const guchar *data;
+  gboolean truncated;
   GString *string;
+  gsize length;
+  gsize tail;
+  gsize i, len;
+  gsize start;
 
   data = g_bytes_get_data (input, &length);
-  if (g_utf8_validate (data, length, &end))
+  if (cockpit_unicode_validate (data, length, &tail) && tail == 0)
     return g_bytes_ref (input);
 
   string = g_string_sized_new (length + 16);
-  do
+  start = i = 0;
+  while (i < length)
     {
+      i += ascii_run (data + i, length - i);
+      if (i == length)
+        break;
+
+      len = check_sequence (data + i, length - i, &truncated);
+      if (len > 0 && !truncated)
+        {
+          i += len;
+          continue;
+        }
+
       /* Valid part of the string */
-      g_string_append_len (string, data, end - data);
+      g_string_append_len (string, (const gchar *)data + start, i - start);
 
-      /* Replacement character */
+      /* Replacement character, for each invalid byte */
       g_string_append (string, "\xef\xbf\xbd");
 
-      length -= (end - data) + 1;
-      data = end + 1;
+      start = ++i;
     }
-  while (!g_utf8_validate (data, length, &end));
 
-  if (length)
-    g_string_append_len (string, data, length);
+  if (start < length)
+    g_string_append_len (string, (const gchar *)data + start, length - start);
 
   return g_string_free_to_bytes (string);
 }
-
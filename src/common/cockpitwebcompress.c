@@ -0,0 +1,513 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitwebcompress.h"
+
+#include "common/cockpitwebserver.h"
+
+#include <gio/gio.h>
+
+#include <string.h>
+
+/**
+ * CockpitWebCompress
+ *
+ * This is a CockpitWebFilter which compresses the data passing
+ * through it with gzip or deflate. It's meant to be the last
+ * filter applied to a response.
+ *
+ * Content up to a certain size is held back until the filter is
+ * finished, and then compressed in one go. Such content is looked
+ * up by checksum in a cache of compressed variants, so that the
+ * same file or manifest served over and over is only compressed
+ * once. Larger content is compressed as it streams through.
+ *
+ * All compression counts against a CPU budget, which a response
+ * checks before it decides to compress. Cache hits are free.
+ */
+
+/* Largest content that is held back and cached */
+#define CACHE_ENTRY_MAXIMUM (512 * 1024)
+
+/* Total size of compressed variants kept around */
+#define CACHE_MAXIMUM (8 * 1024 * 1024)
+
+/* Compression may use a quarter of a CPU, in bursts of up to a second */
+#define BUDGET_DIVISOR 4
+#define BUDGET_MAXIMUM G_USEC_PER_SEC
+
+#define OUTPUT_SIZE (16 * 1024)
+
+struct _CockpitWebCompress {
+  GObject parent;
+  CockpitWebEncoding encoding;
+
+  /* Set once the content is too large to hold back */
+  GConverter *converter;
+
+  GQueue held;
+  gsize held_size;
+};
+
+typedef struct {
+  gchar *key;
+  GBytes *bytes;
+  GList *link;
+} CacheEntry;
+
+/* Only used from the main thread, like the rest of the web server */
+static GHashTable *cache;
+static GQueue cache_lru = G_QUEUE_INIT;
+static gsize cache_size;
+
+static gint64 budget = BUDGET_MAXIMUM;
+static gint64 budget_stamp;
+
+static void cockpit_web_filter_compress_iface (CockpitWebFilterInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (CockpitWebCompress, cockpit_web_compress, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_WEB_FILTER, cockpit_web_filter_compress_iface)
+)
+
+static void
+budget_refill (void)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  if (budget_stamp)
+    budget = MIN (BUDGET_MAXIMUM, budget + (now - budget_stamp) / BUDGET_DIVISOR);
+  budget_stamp = now;
+}
+
+/**
+ * cockpit_web_compress_available:
+ *
+ * Check whether there is CPU budget left for compressing
+ * another response.
+ *
+ * Returns: %TRUE if compression is allowed
+ */
+gboolean
+cockpit_web_compress_available (void)
+{
+  budget_refill ();
+  return budget > 0;
+}
+
+static GConverter *
+converter_new (CockpitWebEncoding encoding)
+{
+  GZlibCompressorFormat format;
+
+  if (encoding == COCKPIT_WEB_ENCODING_DEFLATE)
+    format = G_ZLIB_COMPRESSOR_FORMAT_ZLIB;
+  else
+    format = G_ZLIB_COMPRESSOR_FORMAT_GZIP;
+
+  return G_CONVERTER (g_zlib_compressor_new (format, -1));
+}
+
+static GBytes *
+convert (GConverter *converter,
+         const guint8 *in,
+         gsize inl,
+         GConverterFlags flags)
+{
+  GConverterResult result;
+  GError *error = NULL;
+  gsize outl, read, written;
+  GByteArray *out;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  out = g_byte_array_new ();
+
+  for (;;)
+    {
+      outl = out->len;
+      g_byte_array_set_size (out, outl + OUTPUT_SIZE);
+
+      result = g_converter_convert (converter, in, inl, out->data + outl, OUTPUT_SIZE,
+                                    flags, &read, &written, &error);
+      if (result == G_CONVERTER_ERROR)
+        {
+          g_warning ("couldn't compress data: %s", error->message);
+          g_error_free (error);
+          written = 0;
+        }
+
+      g_byte_array_set_size (out, outl + written);
+
+      if (result == G_CONVERTER_ERROR || result == G_CONVERTER_FINISHED)
+        break;
+
+      in += read;
+      inl -= read;
+
+      /* Without INPUT_AT_END zlib may keep the remainder to itself */
+      if (inl == 0 && !(flags & G_CONVERTER_INPUT_AT_END))
+        break;
+    }
+
+  budget_refill ();
+  budget -= g_get_monotonic_time () - start;
+
+  return g_byte_array_free_to_bytes (out);
+}
+
+static void
+cache_entry_free (gpointer data)
+{
+  CacheEntry *entry = data;
+  cache_size -= g_bytes_get_size (entry->bytes);
+  g_queue_delete_link (&cache_lru, entry->link);
+  g_bytes_unref (entry->bytes);
+  g_free (entry->key);
+  g_free (entry);
+}
+
+/**
+ * cockpit_web_compress_bytes:
+ * @encoding: the encoding to use
+ * @bytes: the content to compress
+ *
+ * Compress @bytes in one go. The result is cached by
+ * checksum of the content, so that the same content is
+ * only compressed once.
+ *
+ * Returns: (transfer full): the compressed bytes
+ */
+GBytes *
+cockpit_web_compress_bytes (CockpitWebEncoding encoding,
+                            GBytes *bytes)
+{
+  GConverter *converter;
+  CacheEntry *entry;
+  GBytes *result;
+  gchar *checksum;
+  gchar *key;
+  gsize length;
+  gconstpointer data;
+
+  g_return_val_if_fail (encoding != COCKPIT_WEB_ENCODING_IDENTITY, NULL);
+
+  data = g_bytes_get_data (bytes, &length);
+  if (length > CACHE_ENTRY_MAXIMUM)
+    {
+      converter = converter_new (encoding);
+      result = convert (converter, data, length, G_CONVERTER_INPUT_AT_END);
+      g_object_unref (converter);
+      return result;
+    }
+
+  if (!cache)
+    cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cache_entry_free);
+
+  checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
+  key = g_strdup_printf ("%s:%s", cockpit_web_compress_encoding_name (encoding), checksum);
+  g_free (checksum);
+
+  entry = g_hash_table_lookup (cache, key);
+  if (entry)
+    {
+      g_free (key);
+      g_queue_unlink (&cache_lru, entry->link);
+      g_queue_push_head_link (&cache_lru, entry->link);
+      return g_bytes_ref (entry->bytes);
+    }
+
+  converter = converter_new (encoding);
+  result = convert (converter, data, length, G_CONVERTER_INPUT_AT_END);
+  g_object_unref (converter);
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->key = key;
+  entry->bytes = g_bytes_ref (result);
+  g_queue_push_head (&cache_lru, entry);
+  entry->link = cache_lru.head;
+  cache_size += g_bytes_get_size (result);
+  g_hash_table_replace (cache, entry->key, entry);
+
+  /* Drop the least recently used variants */
+  while (cache_size > CACHE_MAXIMUM && cache_lru.tail)
+    {
+      entry = cache_lru.tail->data;
+      g_hash_table_remove (cache, entry->key);
+    }
+
+  return result;
+}
+
+/**
+ * cockpit_web_compress_reset:
+ *
+ * Drop all cached compressed variants and refill the
+ * CPU budget. Used by tests.
+ */
+void
+cockpit_web_compress_reset (void)
+{
+  if (cache)
+    g_hash_table_remove_all (cache);
+  budget = BUDGET_MAXIMUM;
+  budget_stamp = 0;
+}
+
+static void
+cockpit_web_compress_init (CockpitWebCompress *self)
+{
+  g_queue_init (&self->held);
+}
+
+static void
+cockpit_web_compress_finalize (GObject *object)
+{
+  CockpitWebCompress *self = COCKPIT_WEB_COMPRESS (object);
+
+  g_queue_foreach (&self->held, (GFunc)g_bytes_unref, NULL);
+  g_queue_clear (&self->held);
+  if (self->converter)
+    g_object_unref (self->converter);
+
+  G_OBJECT_CLASS (cockpit_web_compress_parent_class)->finalize (object);
+}
+
+static void
+cockpit_web_compress_class_init (CockpitWebCompressClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = cockpit_web_compress_finalize;
+}
+
+static void
+stream_block (CockpitWebCompress *self,
+              GBytes *block,
+              void (* function) (gpointer, GBytes *),
+              gpointer func_data)
+{
+  GBytes *bytes;
+  gconstpointer data;
+  gsize length;
+
+  data = g_bytes_get_data (block, &length);
+  bytes = convert (self->converter, data, length, G_CONVERTER_NO_FLAGS);
+  if (g_bytes_get_size (bytes) > 0)
+    function (func_data, bytes);
+  g_bytes_unref (bytes);
+}
+
+static void
+cockpit_web_compress_push (CockpitWebFilter *filter,
+                           GBytes *block,
+                           void (* function) (gpointer, GBytes *),
+                           gpointer func_data)
+{
+  CockpitWebCompress *self = (CockpitWebCompress *)filter;
+  GBytes *held;
+  gsize length;
+
+  length = g_bytes_get_size (block);
+  if (length == 0)
+    return;
+
+  if (!self->converter)
+    {
+      if (self->held_size + length <= CACHE_ENTRY_MAXIMUM)
+        {
+          g_queue_push_tail (&self->held, g_bytes_ref (block));
+          self->held_size += length;
+          return;
+        }
+
+      /* Too large to cache, start streaming */
+      self->converter = converter_new (self->encoding);
+      while ((held = g_queue_pop_head (&self->held)))
+        {
+          stream_block (self, held, function, func_data);
+          g_bytes_unref (held);
+        }
+      self->held_size = 0;
+    }
+
+  stream_block (self, block, function, func_data);
+}
+
+static void
+cockpit_web_compress_finish (CockpitWebFilter *filter,
+                             void (* function) (gpointer, GBytes *),
+                             gpointer func_data)
+{
+  CockpitWebCompress *self = (CockpitWebCompress *)filter;
+  GByteArray *array;
+  GBytes *content;
+  GBytes *bytes;
+  gconstpointer data;
+  gsize length;
+  GList *l;
+
+  if (self->converter)
+    {
+      bytes = convert (self->converter, NULL, 0, G_CONVERTER_INPUT_AT_END);
+    }
+  else
+    {
+      if (self->held.length == 1)
+        {
+          content = g_bytes_ref (self->held.head->data);
+        }
+      else
+        {
+          array = g_byte_array_sized_new (self->held_size);
+          for (l = self->held.head; l != NULL; l = g_list_next (l))
+            {
+              data = g_bytes_get_data (l->data, &length);
+              g_byte_array_append (array, data, length);
+            }
+          content = g_byte_array_free_to_bytes (array);
+        }
+
+      bytes = cockpit_web_compress_bytes (self->encoding, content);
+      g_bytes_unref (content);
+
+      g_queue_foreach (&self->held, (GFunc)g_bytes_unref, NULL);
+      g_queue_clear (&self->held);
+      self->held_size = 0;
+    }
+
+  function (func_data, bytes);
+  g_bytes_unref (bytes);
+}
+
+static void
+cockpit_web_filter_compress_iface (CockpitWebFilterInterface *iface)
+{
+  iface->push = cockpit_web_compress_push;
+  iface->finish = cockpit_web_compress_finish;
+}
+
+/**
+ * cockpit_web_compress_new:
+ * @encoding: gzip or deflate
+ *
+ * Create a new CockpitWebFilter which compresses everything
+ * pushed through it. It must be finished with
+ * cockpit_web_filter_finish().
+ *
+ * Returns: A new CockpitWebFilter
+ */
+CockpitWebFilter *
+cockpit_web_compress_new (CockpitWebEncoding encoding)
+{
+  CockpitWebCompress *self;
+
+  g_return_val_if_fail (encoding != COCKPIT_WEB_ENCODING_IDENTITY, NULL);
+
+  self = g_object_new (COCKPIT_TYPE_WEB_COMPRESS, NULL);
+  self->encoding = encoding;
+
+  return COCKPIT_WEB_FILTER (self);
+}
+
+/**
+ * cockpit_web_compress_negotiate:
+ * @accept: the Accept-Encoding header or %NULL
+ *
+ * Pick the encoding the client prefers among those
+ * we can do on the fly.
+ *
+ * Returns: the encoding, identity if none is acceptable
+ */
+CockpitWebEncoding
+cockpit_web_compress_negotiate (const gchar *accept)
+{
+  CockpitWebEncoding encoding = COCKPIT_WEB_ENCODING_IDENTITY;
+  gchar **encodings;
+  gint i;
+
+  if (!accept)
+    return encoding;
+
+  encodings = cockpit_web_server_parse_accept_list (accept, NULL);
+  for (i = 0; encodings[i] != NULL; i++)
+    {
+      if (g_str_equal (encodings[i], "gzip") || g_str_equal (encodings[i], "*"))
+        encoding = COCKPIT_WEB_ENCODING_GZIP;
+      else if (g_str_equal (encodings[i], "deflate"))
+        encoding = COCKPIT_WEB_ENCODING_DEFLATE;
+      else
+        continue;
+      break;
+    }
+
+  g_strfreev (encodings);
+  return encoding;
+}
+
+const gchar *
+cockpit_web_compress_encoding_name (CockpitWebEncoding encoding)
+{
+  switch (encoding)
+    {
+    case COCKPIT_WEB_ENCODING_GZIP:
+      return "gzip";
+    case COCKPIT_WEB_ENCODING_DEFLATE:
+      return "deflate";
+    default:
+      return "identity";
+    }
+}
+
+/**
+ * cockpit_web_compress_content_type:
+ * @content_type: a Content-Type or %NULL
+ *
+ * Returns: whether content of this type is worth compressing
+ */
+gboolean
+cockpit_web_compress_content_type (const gchar *content_type)
+{
+  static const gchar *compressible[] = {
+    "application/javascript",
+    "application/json",
+    "application/wasm",
+    "application/xml",
+    "image/svg+xml",
+  };
+  gsize length;
+  gint i;
+
+  if (!content_type)
+    return FALSE;
+
+  if (g_ascii_strncasecmp (content_type, "text/", 5) == 0)
+    return TRUE;
+
+  for (i = 0; i < G_N_ELEMENTS (compressible); i++)
+    {
+      length = strlen (compressible[i]);
+      if (g_ascii_strncasecmp (content_type, compressible[i], length) == 0 &&
+          (content_type[length] == '\0' || content_type[length] == ';'))
+        return TRUE;
+    }
+
+  return FALSE;
+}
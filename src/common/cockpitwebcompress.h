@@ -0,0 +1,56 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_WEB_COMPRESS_H__
+#define COCKPIT_WEB_COMPRESS_H__
+
+#include "common/cockpitwebfilter.h"
+
+G_BEGIN_DECLS
+
+typedef enum {
+  COCKPIT_WEB_ENCODING_IDENTITY = 0,
+  COCKPIT_WEB_ENCODING_GZIP,
+  COCKPIT_WEB_ENCODING_DEFLATE,
+} CockpitWebEncoding;
+
+/* Content smaller than this is not worth compressing */
+#define COCKPIT_WEB_COMPRESS_MINIMUM 1024
+
+#define COCKPIT_TYPE_WEB_COMPRESS       (cockpit_web_compress_get_type ())
+G_DECLARE_FINAL_TYPE(CockpitWebCompress, cockpit_web_compress, COCKPIT, WEB_COMPRESS, GObject)
+
+CockpitWebFilter *  cockpit_web_compress_new            (CockpitWebEncoding encoding);
+
+CockpitWebEncoding  cockpit_web_compress_negotiate      (const gchar *accept);
+
+const gchar *       cockpit_web_compress_encoding_name  (CockpitWebEncoding encoding);
+
+gboolean            cockpit_web_compress_content_type   (const gchar *content_type);
+
+gboolean            cockpit_web_compress_available      (void);
+
+GBytes *            cockpit_web_compress_bytes          (CockpitWebEncoding encoding,
+                                                         GBytes *bytes);
+
+void                cockpit_web_compress_reset          (void);
+
+G_END_DECLS
+
+#endif /* COCKPIT_WEB_COMPRESS_H__ */
@@ -61,3 +61,27 @@ cockpit_web_filter_push (CockpitWebFilter *filter,
   g_assert (iface->push);
   (iface->push) (filter, queue, function, data);
 }
+
+/**
+ * cockpit_web_filter_finish:
+ * @filter: filter to finish
+ * @function: filter calls this function with bytes generated
+ * @data: value to pass to function
+ *
+ * Called once all data has been pushed through the filter. A filter
+ * that holds back data, like a compressor, should hand it to @function
+ * now. Filters that don't hold anything back need not implement this.
+ */
+void
+cockpit_web_filter_finish (CockpitWebFilter *filter,
+                           void (* function) (gpointer, GBytes *),
+                           gpointer data)
+{
+  CockpitWebFilterInterface *iface;
+
+  iface = COCKPIT_WEB_FILTER_GET_IFACE (filter);
+  g_return_if_fail (iface != NULL);
+
+  if (iface->finish)
+    (iface->finish) (filter, function, data);
+}
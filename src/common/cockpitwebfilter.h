@@ -34,6 +34,10 @@ struct _CockpitWebFilterInterface {
                                   GBytes *block,
                                   void (* function) (gpointer, GBytes *),
                                   gpointer data);
+
+  void       (* finish)          (CockpitWebFilter *filter,
+                                  void (* function) (gpointer, GBytes *),
+                                  gpointer data);
 };
 
 void                cockpit_web_filter_push         (CockpitWebFilter *filter,
@@ -41,6 +45,10 @@ void                cockpit_web_filter_push         (CockpitWebFilter *filter,
                                                      void (* function) (gpointer, GBytes *),
                                                      gpointer data);
 
+void                cockpit_web_filter_finish       (CockpitWebFilter *filter,
+                                                     void (* function) (gpointer, GBytes *),
+                                                     gpointer data);
+
 G_END_DECLS
 
 #endif /* COCKPIT_WEB_FILTER_H__ */
@@ -26,21 +26,49 @@
 /**
  * CockpitWebInject
  *
- * This is a CockpitWebFilter which looks for a marker data
- * and inject additional data after that point. The data is
+ * This is a CockpitWebFilter which looks for marker data
+ * and injects additional data after that point. The data is
  * not injected more than the specified number of times.
+ *
+ * Several markers can be added to the same filter. All of them
+ * are looked for at once, in a single pass over each block, by
+ * an Aho-Corasick automaton. The state of the automaton carries
+ * over between blocks, so markers split across blocks are found
+ * without holding anything back. The output is slices of the
+ * input blocks with the injected data in between.
  */
-struct _CockpitWebInject {
-  GObject parent;
-  /* partial_matches stores the lengths of partial matches, size is (marker length) - 1
-   * e.g. "ABA" with marker "ABAC" will result in [TRUE, FALSE, TRUE]
-   */
-  GArray *partial_matches;
-  GBytes *marker;
-  GBytes *inject;
 
+typedef struct {
+  gchar *marker;
+  GBytes *inject;
+  guint node;
   guint maximum;
   guint injected;
+} Pattern;
+
+typedef struct {
+  guint8 byte;
+  gboolean terminal;
+  guint child;
+  guint sibling;
+  guint fail;
+  /* The next node along the fail links that ends a marker */
+  guint output;
+} Node;
+
+struct _CockpitWebInject {
+  GObject parent;
+
+  GArray *patterns;
+  GArray *nodes;
+
+  /* Transitions out of the root node, zero for none */
+  guint root[256];
+
+  /* The automaton is built on the first push */
+  gboolean built;
+  guint state;
+  guint active;
 };
 
 static void cockpit_web_filter_inject_iface (CockpitWebFilterInterface *iface);
@@ -50,9 +78,19 @@ G_DEFINE_TYPE_WITH_CODE (CockpitWebInject, cockpit_web_inject, G_TYPE_OBJECT,
 )
 
 static void
-cockpit_web_inject_init (CockpitWebInject *self)
+clear_pattern (gpointer data)
 {
+  Pattern *pattern = data;
+  g_free (pattern->marker);
+  g_bytes_unref (pattern->inject);
+}
 
+static void
+cockpit_web_inject_init (CockpitWebInject *self)
+{
+  self->patterns = g_array_new (FALSE, TRUE, sizeof (Pattern));
+  g_array_set_clear_func (self->patterns, clear_pattern);
+  self->nodes = g_array_new (FALSE, TRUE, sizeof (Node));
 }
 
 static void
@@ -60,12 +98,8 @@ cockpit_web_inject_finalize (GObject *object)
 {
   CockpitWebInject *self = COCKPIT_WEB_INJECT (object);
 
-  if (self->partial_matches)
-    g_array_unref (self->partial_matches);
-  if (self->marker)
-    g_bytes_unref (self->marker);
-  if (self->inject)
-    g_bytes_unref (self->inject);
+  g_array_unref (self->patterns);
+  g_array_unref (self->nodes);
 
   G_OBJECT_CLASS (cockpit_web_inject_parent_class)->finalize (object);
 }
@@ -78,6 +112,124 @@ cockpit_web_inject_class_init (CockpitWebInjectClass *klass)
   gobject_class->finalize = cockpit_web_inject_finalize;
 }
 
+static guint
+find_child (CockpitWebInject *self,
+            guint node,
+            guint8 byte)
+{
+  guint child;
+
+  if (node == 0)
+    return self->root[byte];
+
+  for (child = g_array_index (self->nodes, Node, node).child; child != 0;
+       child = g_array_index (self->nodes, Node, child).sibling)
+    {
+      if (g_array_index (self->nodes, Node, child).byte == byte)
+        return child;
+    }
+
+  return 0;
+}
+
+static guint
+add_child (CockpitWebInject *self,
+           guint node,
+           guint8 byte)
+{
+  Node child = { byte, FALSE, 0, 0, 0, 0 };
+  guint index = self->nodes->len;
+
+  if (node == 0)
+    {
+      self->root[byte] = index;
+    }
+  else
+    {
+      child.sibling = g_array_index (self->nodes, Node, node).child;
+      g_array_index (self->nodes, Node, node).child = index;
+    }
+
+  g_array_append_val (self->nodes, child);
+  return index;
+}
+
+static guint
+next_state (CockpitWebInject *self,
+            guint state,
+            guint8 byte)
+{
+  guint next;
+
+  for (;;)
+    {
+      next = find_child (self, state, byte);
+      if (next != 0 || state == 0)
+        return next;
+      state = g_array_index (self->nodes, Node, state).fail;
+    }
+}
+
+static void
+build_automaton (CockpitWebInject *self)
+{
+  Node root = { 0, };
+  GQueue queue = G_QUEUE_INIT;
+  Pattern *pattern;
+  Node *node;
+  const gchar *p;
+  guint index;
+  guint child;
+  guint fail;
+  guint i;
+
+  g_array_append_val (self->nodes, root);
+
+  /* A trie of all the markers */
+  for (i = 0; i < self->patterns->len; i++)
+    {
+      pattern = &g_array_index (self->patterns, Pattern, i);
+      index = 0;
+      for (p = pattern->marker; *p != '\0'; p++)
+        {
+          child = find_child (self, index, *p);
+          if (child == 0)
+            child = add_child (self, index, *p);
+          index = child;
+        }
+      g_array_index (self->nodes, Node, index).terminal = TRUE;
+      pattern->node = index;
+      if (pattern->maximum > 0)
+        self->active++;
+    }
+
+  /* Breadth first, so the fail links point to nodes that are done */
+  for (i = 0; i < G_N_ELEMENTS (self->root); i++)
+    {
+      if (self->root[i])
+        g_queue_push_tail (&queue, GUINT_TO_POINTER (self->root[i]));
+    }
+
+  while (!g_queue_is_empty (&queue))
+    {
+      index = GPOINTER_TO_UINT (g_queue_pop_head (&queue));
+      for (child = g_array_index (self->nodes, Node, index).child; child != 0;
+           child = g_array_index (self->nodes, Node, child).sibling)
+        {
+          node = &g_array_index (self->nodes, Node, child);
+          fail = next_state (self, g_array_index (self->nodes, Node, index).fail, node->byte);
+          node->fail = fail;
+          if (g_array_index (self->nodes, Node, fail).terminal)
+            node->output = fail;
+          else
+            node->output = g_array_index (self->nodes, Node, fail).output;
+          g_queue_push_tail (&queue, GUINT_TO_POINTER (child));
+        }
+    }
+
+  self->built = TRUE;
+}
+
 static void
 cockpit_web_inject_push (CockpitWebFilter *filter,
                          GBytes *block,
@@ -85,100 +237,86 @@ cockpit_web_inject_push (CockpitWebFilter *filter,
                          gpointer func_data)
 {
   CockpitWebInject *self = (CockpitWebInject *)filter;
-  const gchar *mark, *data, *pos = NULL;
-  gsize mark_len, data_len, at;
-  GBytes *bytes;
+  const guint8 *data;
+  gsize data_len;
   gsize written;
-  gint partial_len, remaining_len;
+  gsize at;
+  GBytes *bytes;
+  Pattern *pattern;
+  guint state;
+  guint node;
+  guint i;
 
-  mark = g_bytes_get_data (self->marker, &mark_len);
   data = g_bytes_get_data (block, &data_len);
 
   if (data_len == 0)
     return;
 
-  written = at = 0;
+  if (!self->built)
+    build_automaton (self);
+
+  /* Nothing more to inject, no need to look at the data */
+  if (self->active == 0)
+    {
+      function (func_data, block);
+      return;
+    }
+
+  state = self->state;
+  written = 0;
 
-  /* look at our partial matches first
-   * longest partial matches have precedence (they either get longer or don't pan out)
-   * only do this if we haven't reached the maximum yet
-   */
-  if (self->injected < self->maximum)
+  for (at = 0; at < data_len && self->active > 0; at++)
     {
-      for (partial_len = self->partial_matches->len - 1; partial_len >= 0; --partial_len)
+      /* Skip quickly over data that can't start a marker */
+      if (state == 0)
+        {
+          while (at < data_len && self->root[data[at]] == 0)
+            at++;
+          if (at == data_len)
+            break;
+        }
+
+      state = next_state (self, state, data[at]);
+
+      /* Longest markers first, then the ones that are suffixes of them */
+      node = g_array_index (self->nodes, Node, state).terminal ? state :
+             g_array_index (self->nodes, Node, state).output;
+      for (; node != 0; node = g_array_index (self->nodes, Node, node).output)
         {
-          if (g_array_index (self->partial_matches, gboolean, partial_len))
+          for (i = 0; i < self->patterns->len; i++)
             {
-              /* our match can only grow longer */
-              g_array_index (self->partial_matches, gboolean, partial_len) = FALSE;
-              remaining_len = mark_len - partial_len;
-              /* our current block might be too short */
-              if (remaining_len > data_len)
-                {
-                  if (memcmp (mark + partial_len, data, data_len) == 0)
-                    g_array_index (self->partial_matches, gboolean, partial_len + data_len) = TRUE;
-                }
-              else if (memcmp (mark + partial_len, data, remaining_len) == 0)
+              pattern = &g_array_index (self->patterns, Pattern, i);
+              if (pattern->node != node || pattern->injected >= pattern->maximum)
+                continue;
+
+              /* Write out the data with the marker before we inject */
+              if (at + 1 != written)
                 {
-                  /* we have a match */
-                  at = remaining_len;
-                  pos = data + at;
-                  /* reset partials */
-                  g_array_set_size(self->partial_matches, 0);
-                  g_array_set_size(self->partial_matches, mark_len);
-                  break;
+                  bytes = g_bytes_new_from_bytes (block, written, at + 1 - written);
+                  function (func_data, bytes);
+                  g_bytes_unref (bytes);
+                  written = at + 1;
                 }
+
+              function (func_data, pattern->inject);
+              pattern->injected++;
+              if (pattern->injected == pattern->maximum)
+                self->active--;
             }
         }
     }
 
-  /* keep searching until we have found the maximum number of allowed matches or reached the end */
-  for(;;)
-  {
-    if (at != written)
-    {
-      bytes = g_bytes_new_from_bytes (block, written, at - written);
-      function (func_data, bytes);
-      g_bytes_unref (bytes);
-      written = at;
+  self->state = state;
 
-      /* did we have a match? */
-      if (pos == (data + at) && self->injected < self->maximum)
-        {
-          function (func_data, self->inject);
-          self->injected++;
-        }
+  if (written == 0)
+    {
+      function (func_data, block);
     }
-
-    if (at >= data_len)
-      break;
-
-    /* if there are enough chars left, try to find a complete match */
-    if (self->injected < self->maximum &&
-        data_len >= (at + mark_len) &&
-        (pos = memmem (data + at, data_len - at, mark, mark_len)))
-      {
-        /* we found a match, but we want to write out the mark also before we inject */
-        pos += mark_len;
-        at = pos - data;
-      }
-    else
-      {
-        /* nothing found, forward */
-        at = data_len;
-        pos = NULL;
-      }
-  }
-
-  /* if we haven't reached our max number of injections, look for partial matches at the end */
-  partial_len = mark_len - 1;
-  if (partial_len > data_len)
-    partial_len = data_len;
-  while (partial_len > 0)
+  else if (written != data_len)
     {
-      if (memcmp (mark, data + data_len - partial_len, partial_len) == 0)
-        g_array_index (self->partial_matches, gboolean, partial_len) = TRUE;
-      partial_len--;
+      bytes = g_bytes_new_from_bytes (block, written, data_len - written);
+      function (func_data, bytes);
+      g_bytes_unref (bytes);
     }
 }
 
@@ -189,13 +327,14 @@ cockpit_web_filter_inject_iface (CockpitWebFilterInterface *iface)
 }
 
 /**
- * cockpit_web_filter_new:
+ * cockpit_web_inject_new:
  * @marker: marker to search for
  * @inject: bytes to inject after marker
  * @count: number of times to inject
  *
  * Create a new CockpitWebFilter which injects @inject bytes
- * after the @marker. It injects the data once.
+ * after the @marker, up to @count times. More markers can be
+ * added with cockpit_web_inject_add().
  *
  * Returns: A new CockpitWebFilter
  */
@@ -205,20 +344,43 @@ cockpit_web_inject_new (const gchar *marker,
                         guint count)
 {
   CockpitWebInject *self;
-  gsize len;
 
-  g_return_val_if_fail (marker != NULL, NULL);
+  g_return_val_if_fail (marker != NULL && marker[0] != '\0', NULL);
   g_return_val_if_fail (inject != NULL, NULL);
 
-  len = strlen (marker);
-  g_return_val_if_fail (len > 0, NULL);
-
   self = g_object_new (COCKPIT_TYPE_WEB_INJECT, NULL);
-  self->marker = g_bytes_new (marker, len);
-  self->partial_matches = g_array_sized_new(FALSE, TRUE, sizeof(gboolean), len);
-  g_array_set_size(self->partial_matches, len);
-  self->inject = g_bytes_ref (inject);
-  self->maximum = count;
+  cockpit_web_inject_add (self, marker, inject, count);
 
   return COCKPIT_WEB_FILTER (self);
 }
+
+/**
+ * cockpit_web_inject_add:
+ * @self: the filter
+ * @marker: another marker to search for
+ * @inject: bytes to inject after marker
+ * @count: number of times to inject
+ *
+ * Also inject @inject after @marker. This must be called before
+ * any data goes through the filter. When several injections
+ * happen at the same place, they appear in the order they were
+ * added, after those for any longer marker that ends there.
+ */
+void
+cockpit_web_inject_add (CockpitWebInject *self,
+                        const gchar *marker,
+                        GBytes *inject,
+                        guint count)
+{
+  Pattern pattern = { NULL, };
+
+  g_return_if_fail (COCKPIT_IS_WEB_INJECT (self));
+  g_return_if_fail (marker != NULL && marker[0] != '\0');
+  g_return_if_fail (inject != NULL);
+  g_return_if_fail (!self->built);
+
+  pattern.marker = g_strdup (marker);
+  pattern.inject = g_bytes_ref (inject);
+  pattern.maximum = count;
+  g_array_append_val (self->patterns, pattern);
+}
@@ -31,6 +31,11 @@ CockpitWebFilter *  cockpit_web_inject_new          (const gchar *marker,
                                                      GBytes *inject,
                                                      guint count);
 
+void                cockpit_web_inject_add          (CockpitWebInject *self,
+                                                     const gchar *marker,
+                                                     GBytes *inject,
+                                                     guint count);
+
 G_END_DECLS
 
 #endif /* COCKPIT_WEB_INJECT_H__ */
@@ -26,6 +26,7 @@
 #include "config.h"
 
 #include "cockpitwebresponse.h"
+#include "cockpitwebcompress.h"
 #include "cockpitwebfilter.h"
 
 #include "common/cockpitconf.h"
@@ -89,6 +90,14 @@ struct _CockpitWebResponse {
   gboolean keep_alive;
 
   GList *filters;
+
+  /* On the fly compression, see cockpit_web_response_set_compress() */
+  CockpitWebEncoding accept_encoding;
+  CockpitWebFilter *compress;
+  gboolean hold_headers;
+  GBytes *held_headers;
+  GQueue held;
+  gsize held_size;
 };
 
 /* A megabyte is when we start to consider queue full enough */
@@ -105,6 +114,7 @@ static void
 cockpit_web_response_init (CockpitWebResponse *self)
 {
   self->queue = g_queue_new ();
+  g_queue_init (&self->held);
   self->out_queueable = G_MAXSIZE;
   self->cache_type = COCKPIT_WEB_RESPONSE_CACHE_UNSET;
 }
@@ -155,6 +165,7 @@ cockpit_web_response_dispose (GObject *object)
     cockpit_web_response_done (self);
   g_list_free_full (self->filters, g_object_unref);
   self->filters = NULL;
+  g_clear_object (&self->compress);
 
   G_OBJECT_CLASS (cockpit_web_response_parent_class)->dispose (object);
 }
@@ -173,6 +184,10 @@ cockpit_web_response_finalize (GObject *object)
   g_assert (self->out == NULL);
   g_queue_free_full (self->queue, (GDestroyNotify)g_bytes_unref);
   self->out_queued = 0;
+  if (self->held_headers)
+    g_bytes_unref (self->held_headers);
+  g_queue_foreach (&self->held, (GFunc)g_bytes_unref, NULL);
+  g_queue_clear (&self->held);
 
   G_OBJECT_CLASS (cockpit_web_response_parent_class)->finalize (object);
 }
@@ -549,6 +564,109 @@ queue_block (CockpitWebResponse *self,
     }
 }
 
+static void
+on_compressed (gpointer data,
+               GBytes *block)
+{
+  queue_block (data, block);
+}
+
+/*
+ * The compressed representation isn't byte for byte the same as the
+ * identity one, so it must not carry the same strong ETag.
+ */
+static void
+weaken_etag (GString *string)
+{
+  const gchar *line = string->str;
+  const gchar *value;
+
+  while (line && line[0])
+    {
+      if (g_ascii_strncasecmp (line, "ETag:", 5) == 0)
+        {
+          value = line + 5;
+          while (value[0] == ' ')
+            value++;
+          if (value[0] == '"')
+            g_string_insert (string, value - string->str, "W/");
+          return;
+        }
+
+      line = strstr (line, "\r\n");
+      if (line)
+        line += 2;
+    }
+}
+
+static void queue_compress (CockpitWebResponse *self,
+                            GBytes *block);
+
+static void
+release_held (CockpitWebResponse *self,
+              gboolean compress)
+{
+  GBytes *headers;
+  GBytes *block;
+  GString *string;
+  const gchar *data;
+  gsize length;
+
+  headers = self->held_headers;
+  self->held_headers = NULL;
+
+  if (compress)
+    {
+      self->compress = cockpit_web_compress_new (self->accept_encoding);
+
+      /* Splice the encoding in before the blank line ending the headers */
+      data = g_bytes_get_data (headers, &length);
+      g_assert (length >= 2);
+      string = g_string_new_len (data, length - 2);
+      weaken_etag (string);
+      g_string_append_printf (string, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n\r\n",
+                              cockpit_web_compress_encoding_name (self->accept_encoding));
+      g_bytes_unref (headers);
+      headers = g_string_free_to_bytes (string);
+    }
+
+  queue_bytes (self, headers);
+  g_bytes_unref (headers);
+
+  while ((block = g_queue_pop_head (&self->held)))
+    {
+      queue_compress (self, block);
+      g_bytes_unref (block);
+    }
+  self->held_size = 0;
+}
+
+/*
+ * The last stage of the filter chain. When the length isn't known
+ * up front, content is held back along with the headers until we
+ * know whether it's large enough to compress.
+ */
+static void
+queue_compress (CockpitWebResponse *self,
+                GBytes *block)
+{
+  if (self->held_headers)
+    {
+      g_queue_push_tail (&self->held, g_bytes_ref (block));
+      self->held_size += g_bytes_get_size (block);
+      if (self->held_size >= COCKPIT_WEB_COMPRESS_MINIMUM)
+        release_held (self, cockpit_web_compress_available ());
+    }
+  else if (self->compress)
+    {
+      cockpit_web_filter_push (self->compress, block, on_compressed, self);
+    }
+  else
+    {
+      queue_block (self, block);
+    }
+}
+
 typedef struct {
   CockpitWebResponse *response;
   GList *filters;
@@ -570,7 +688,7 @@ queue_filter (gpointer data,
     }
   else
     {
-      queue_block (qs->response, bytes);
+      queue_compress (qs->response, bytes);
     }
 }
 
@@ -634,7 +752,9 @@ cockpit_web_response_queue (CockpitWebResponse *self,
 void
 cockpit_web_response_complete (CockpitWebResponse *self)
 {
+  QueueStep qn = { .response = self };
   GBytes *bytes;
+  GList *l;
 
   g_return_if_fail (COCKPIT_IS_WEB_RESPONSE (self));
   g_return_if_fail (self->complete == FALSE);
@@ -642,6 +762,23 @@ cockpit_web_response_complete (CockpitWebResponse *self)
   if (self->failed)
     return;
 
+  /* Let the filters hand over anything they held back */
+  if (g_strcmp0 (self->method, "HEAD") != 0)
+    {
+      for (l = self->filters; l != NULL; l = g_list_next (l))
+        {
+          qn.filters = l->next;
+          cockpit_web_filter_finish (l->data, queue_filter, &qn);
+        }
+    }
+
+  /* Too little content to bother compressing */
+  if (self->held_headers)
+    release_held (self, FALSE);
+
+  if (self->compress && g_strcmp0 (self->method, "HEAD") != 0)
+    cockpit_web_filter_finish (self->compress, on_compressed, self);
+
   /* Hold a reference until cockpit_web_response_done() */
   g_object_ref (self);
   self->complete = TRUE;
@@ -718,7 +855,7 @@ cockpit_web_response_get_state (CockpitWebResponse *self)
     return COCKPIT_WEB_RESPONSE_SENT;
   else if (self->complete)
     return COCKPIT_WEB_RESPONSE_COMPLETE;
-  else if (self->count == 0)
+  else if (self->count == 0 && !self->held_headers)
     return COCKPIT_WEB_RESPONSE_READY;
   else
     return COCKPIT_WEB_RESPONSE_QUEUING;
@@ -766,7 +903,8 @@ begin_headers (CockpitWebResponse *response,
 static guint
 append_header (GString *string,
                const gchar *name,
-               const gchar *value)
+               const gchar *value,
+               const gchar **content_type)
 {
   if (value)
     {
@@ -775,7 +913,10 @@ append_header (GString *string,
       g_string_append_printf (string, "%s: %s\r\n", name, value);
     }
   if (g_ascii_strcasecmp ("Content-Type", name) == 0)
-    return HEADER_CONTENT_TYPE;
+    {
+      *content_type = value;
+      return HEADER_CONTENT_TYPE;
+    }
   if (g_ascii_strcasecmp ("Cache-Control", name) == 0)
     return HEADER_CACHE_CONTROL;
   if (g_ascii_strcasecmp ("Vary", name) == 0)
@@ -803,7 +944,8 @@ append_header (GString *string,
 
 static guint
 append_table (GString *string,
-              GHashTable *headers)
+              GHashTable *headers,
+              const gchar **content_type)
 {
   GHashTableIter iter;
   gpointer key;
@@ -814,7 +956,7 @@ append_table (GString *string,
     {
       g_hash_table_iter_init (&iter, headers);
       while (g_hash_table_iter_next (&iter, &key, &value))
-        seen |= append_header (string, key, value);
+        seen |= append_header (string, key, value, content_type);
     }
 
   return seen;
@@ -822,7 +964,8 @@ append_table (GString *string,
 
 static guint
 append_va (GString *string,
-           va_list va)
+           va_list va,
+           const gchar **content_type)
 {
   const gchar *name;
   const gchar *value;
@@ -834,7 +977,7 @@ append_va (GString *string,
       if (!name)
         break;
       value = va_arg (va, const gchar *);
-      seen |= append_header (string, name, value);
+      seen |= append_header (string, name, value, content_type);
     }
 
   return seen;
@@ -845,9 +988,10 @@ finish_headers (CockpitWebResponse *self,
                 GString *string,
                 gssize length,
                 gint status,
-                guint seen)
+                guint seen,
+                const gchar *content_type)
 {
-  const gchar *content_type;
+  gboolean compress = FALSE;
 
   /* Automatically figure out content type */
   if ((seen & HEADER_CONTENT_TYPE) == 0 &&
@@ -858,9 +1002,31 @@ finish_headers (CockpitWebResponse *self,
         g_string_append_printf (string, "Content-Type: %s\r\n", content_type);
     }
 
+  /*
+   * Compress on the fly if asked to, and worth it. When the length isn't
+   * known, hold back the headers until we have seen enough content.
+   */
+  if (self->accept_encoding != COCKPIT_WEB_ENCODING_IDENTITY && status == 200 &&
+      (seen & HEADER_CONTENT_ENCODING) == 0 &&
+      cockpit_web_compress_content_type (content_type))
+    {
+      if (length < 0)
+        self->hold_headers = TRUE;
+      else if (length >= COCKPIT_WEB_COMPRESS_MINIMUM && cockpit_web_compress_available ())
+        compress = TRUE;
+    }
+
+  if (compress)
+    {
+      self->compress = cockpit_web_compress_new (self->accept_encoding);
+      weaken_etag (string);
+      g_string_append_printf (string, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n",
+                              cockpit_web_compress_encoding_name (self->accept_encoding));
+    }
+
   if (status != 304)
     {
-      if (length < 0 || seen & HEADER_CONTENT_ENCODING || self->filters)
+      if (length < 0 || seen & HEADER_CONTENT_ENCODING || self->filters || self->compress)
         {
           self->chunked = TRUE;
           g_string_append_printf (string, "Transfer-Encoding: chunked\r\n");
@@ -911,6 +1077,48 @@ finish_headers (CockpitWebResponse *self,
   return g_string_free_to_bytes (string);
 }
 
+static void
+queue_headers (CockpitWebResponse *self,
+               GBytes *block)
+{
+  if (self->hold_headers)
+    {
+      self->hold_headers = FALSE;
+      self->held_headers = g_bytes_ref (block);
+    }
+  else
+    {
+      queue_bytes (self, block);
+    }
+}
+
+/**
+ * cockpit_web_response_set_compress:
+ * @self: the response
+ * @in_headers: the request headers
+ *
+ * Compress the response on the fly, if the Accept-Encoding in
+ * @in_headers allows gzip or deflate, and the content is of a
+ * type and size worth compressing. Call this before queueing
+ * the headers.
+ *
+ * When the length of the content isn't known up front, a
+ * little of it is held back to see whether it's large enough.
+ * So don't use this for content that trickles out slowly.
+ */
+void
+cockpit_web_response_set_compress (CockpitWebResponse *self,
+                                   GHashTable *in_headers)
+{
+  const gchar *accept = NULL;
+
+  g_return_if_fail (COCKPIT_IS_WEB_RESPONSE (self));
+
+  if (in_headers)
+    accept = g_hash_table_lookup (in_headers, "Accept-Encoding");
+  self->accept_encoding = cockpit_web_compress_negotiate (accept);
+}
+
 /**
  * cockpit_web_response_set_cache_type:
  * @self: the response
@@ -951,13 +1159,15 @@ cockpit_web_response_headers (CockpitWebResponse *self,
                               gssize length,
                               ...)
 {
+  const gchar *content_type = NULL;
   GString *string;
   GBytes *block;
+  guint seen;
   va_list va;
 
   g_return_if_fail (COCKPIT_IS_WEB_RESPONSE (self));
 
-  if (self->count > 0)
+  if (self->count > 0 || self->held_headers)
     {
       g_critical ("Headers should be sent first. This is a programmer error.");
       return;
@@ -966,11 +1176,12 @@ cockpit_web_response_headers (CockpitWebResponse *self,
   string = begin_headers (self, status, reason);
 
   va_start (va, length);
-  block = finish_headers (self, string, length, status,
-                          append_va (string, va));
+  seen = append_va (string, va, &content_type);
   va_end (va);
 
-  queue_bytes (self, block);
+  block = finish_headers (self, string, length, status, seen, content_type);
+
+  queue_headers (self, block);
   g_bytes_unref (block);
 }
 
@@ -999,12 +1210,14 @@ cockpit_web_response_headers_full  (CockpitWebResponse *self,
                                     gssize length,
                                     GHashTable *headers)
 {
+  const gchar *content_type = NULL;
   GString *string;
   GBytes *block;
+  guint seen;
 
   g_return_if_fail (COCKPIT_IS_WEB_RESPONSE (self));
 
-  if (self->count > 0)
+  if (self->count > 0 || self->held_headers)
     {
       g_critical ("Headers should be sent first. This is a programmer error.");
       return;
@@ -1012,10 +1225,10 @@ cockpit_web_response_headers_full  (CockpitWebResponse *self,
 
   string = begin_headers (self, status, reason);
 
-  block = finish_headers (self, string, length, status,
-                          append_table (string, headers));
+  seen = append_table (string, headers, &content_type);
+  block = finish_headers (self, string, length, status, seen, content_type);
 
-  queue_bytes (self, block);
+  queue_headers (self, block);
   g_bytes_unref (block);
 }
 
@@ -1314,6 +1527,7 @@ web_response_file (CockpitWebResponse *response,
   gchar *path = NULL;
   gchar *alloc = NULL;
   GMappedFile *file = NULL;
+  CockpitTemplate *template = NULL;
   const gchar *root;
   GBytes *body;
   GList *output = NULL;
@@ -1358,8 +1572,14 @@ again:
   g_assert (path_has_prefix (path, root));
 
   g_clear_error (&error);
-  file = g_mapped_file_new (path, FALSE, &error);
-  if (file == NULL)
+
+  /* Templates are parsed once, and then only expanded for each request */
+  if (template_func)
+    template = cockpit_template_load (path, "${", "}", &error);
+  else
+    file = g_mapped_file_new (path, FALSE, &error);
+
+  if (template == NULL && file == NULL)
     {
       if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT) ||
           g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NAMETOOLONG))
@@ -1382,17 +1602,16 @@ again:
         }
     }
 
-  body = g_mapped_file_get_bytes (file);
-  if (template_func)
+  if (template)
     {
-      output = cockpit_template_expand (body, "${", "}", template_func, user_data);
+      output = cockpit_template_render (template, template_func, user_data);
     }
   else
     {
-      output = g_list_prepend (output, g_bytes_ref (body));
+      body = g_mapped_file_get_bytes (file);
+      output = g_list_prepend (output, body);
       content_length = g_bytes_get_size (body);
     }
-  g_bytes_unref (body);
 
   if (response->origin)
     {
@@ -1429,6 +1648,8 @@ out:
   g_free (path);
   if (file)
     g_mapped_file_unref (file);
+  if (template)
+    cockpit_template_unref (template);
 
   if (output)
     g_list_free_full (output, (GDestroyNotify)g_bytes_unref);
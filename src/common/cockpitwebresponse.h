@@ -84,6 +84,9 @@ gchar *               cockpit_web_response_pop_path      (CockpitWebResponse *se
 void                  cockpit_web_response_add_filter    (CockpitWebResponse *self,
                                                           CockpitWebFilter *filter);
 
+void                  cockpit_web_response_set_compress  (CockpitWebResponse *self,
+                                                          GHashTable *in_headers);
+
 void                  cockpit_web_response_headers       (CockpitWebResponse *self,
                                                           guint status,
                                                           const gchar *reason,
@@ -432,52 +432,33 @@ cockpit_web_server_new_table (void)
   return g_hash_table_new_full (cockpit_str_case_hash, cockpit_str_case_equal, g_free, g_free);
 }
 
-gchar *
-cockpit_web_server_parse_cookie (GHashTable *headers,
-                                 const gchar *name)
+static gchar *
+parse_cookie (const gchar *header,
+              const gchar *header_end,
+              const gchar *name)
 {
-  const gchar *header;
-  const gchar *pos;
+  const gchar *pair;
   const gchar *value;
   const gchar *end;
-  gboolean at_start = TRUE;
   gchar *decoded;
-  gint diff;
-  gint offset;
+  gsize length;
 
-  header = g_hash_table_lookup (headers, "Cookie");
-  if (!header)
-    return NULL;
+  length = strlen (name);
 
-  for (;;)
+  /* A single pass over the "name=value; other=value" pairs */
+  for (pair = header; pair != NULL; pair = end ? end + 1 : NULL)
     {
-      pos = strstr (header, name);
-      if (!pos)
-        return NULL;
+      end = memchr (pair, ';', header_end - pair);
 
-      if (pos != header)
-        {
-          diff = strlen (header) - strlen (pos);
-          offset = 1;
-          at_start = FALSE;
-          while (offset < diff)
-            {
-              if (!g_ascii_isspace (*(pos - offset)))
-                {
-                  at_start = *(pos - offset) == ';';
-                  break;
-                }
-              offset++;
-            }
-        }
+      while (pair != header_end && g_ascii_isspace (*pair))
+        pair++;
 
-      pos += strlen (name);
-      if (*pos == '=' && at_start)
+      if ((gsize)(header_end - pair) > length &&
+          strncmp (pair, name, length) == 0 && pair[length] == '=')
         {
-          value = pos + 1;
-          end = strchr (value, ';');
+          value = pair + length + 1;
           if (end == NULL)
-            end = value + strlen (value);
+            end = header_end;
 
           decoded = g_uri_unescape_segment (value, end, NULL);
           if (!decoded)
@@ -485,12 +466,22 @@ cockpit_web_server_parse_cookie (GHashTable *headers,
 
           return decoded;
         }
-      else
-        {
-          at_start = FALSE;
-        }
-      header = pos;
     }
+
+  return NULL;
+}
+
+gchar *
+cockpit_web_server_parse_cookie (GHashTable *headers,
+                                 const gchar *name)
+{
+  const gchar *header;
+
+  header = g_hash_table_lookup (headers, "Cookie");
+  if (!header)
+    return NULL;
+
+  return parse_cookie (header, header + strlen (header), name);
 }
 
 typedef struct {
@@ -502,19 +493,21 @@ static gint
 sort_qvalue (gconstpointer a,
              gconstpointer b)
 {
-  const Language *la = *((Language **)a);
-  const Language *lb = *((Language **)b);
+  const Language *la = a;
+  const Language *lb = b;
   if (lb->qvalue == la->qvalue)
     return 0;
   return lb->qvalue < la->qvalue ? -1 : 1;
 }
 
-gchar **
-cockpit_web_server_parse_accept_list (const gchar *accept,
-                                      const gchar *defawlt)
+static gchar **
+parse_accept_list (const gchar *data,
+                   gsize length,
+                   const gchar *defawlt)
 {
-  Language *lang;
-  GPtrArray *langs;
+  const gchar *accept;
+  Language lang;
+  GArray *langs;
   GPtrArray *ret;
   gchar *copy;
   gchar *value;
@@ -522,18 +515,18 @@ cockpit_web_server_parse_accept_list (const gchar *accept,
   gchar *pos;
   guint i;
 
-  langs = g_ptr_array_new_with_free_func (g_free);
+  /* The entries point into our copy of the header, so no allocations per entry */
+  langs = g_array_sized_new (FALSE, FALSE, sizeof (Language), 8);
 
   if (defawlt)
     {
-      lang = g_new0 (Language, 1);
-      lang->qvalue = 0.1;
-      lang->value = defawlt;
-      g_ptr_array_add (langs, lang);
+      lang.qvalue = 0.1;
+      lang.value = defawlt;
+      g_array_append_val (langs, lang);
     }
 
   /* First build up an array we can sort */
-  accept = copy = g_strdup (accept);
+  accept = copy = g_strndup (data, length);
 
   while (accept)
     {
@@ -544,8 +537,7 @@ cockpit_web_server_parse_accept_list (const gchar *accept,
           next++;
         }
 
-      lang = g_new0 (Language, 1);
-      lang->qvalue = 1;
+      lang.qvalue = 1;
 
       pos = strchr (accept, ';');
       if (pos)
@@ -553,27 +545,27 @@ cockpit_web_server_parse_accept_list (const gchar *accept,
           *pos = '\0';
           if (strncmp (pos + 1, "q=", 2) == 0)
             {
-              lang->qvalue = g_ascii_strtod (pos + 3, NULL);
-              if (lang->qvalue < 0)
-                lang->qvalue = 0;
+              lang.qvalue = g_ascii_strtod (pos + 3, NULL);
+              if (lang.qvalue < 0)
+                lang.qvalue = 0;
             }
         }
 
-      lang->value = accept;
-      g_ptr_array_add (langs, lang);
+      lang.value = accept;
+      g_array_append_val (langs, lang);
       accept = next;
     }
 
-  g_ptr_array_sort (langs, sort_qvalue);
+  g_array_sort (langs, sort_qvalue);
 
   /* Now in the right order add all the prefs */
-  ret = g_ptr_array_new ();
+  ret = g_ptr_array_sized_new (langs->len * 2 + 1);
   for (i = 0; i < langs->len; i++)
     {
-      lang = langs->pdata[i];
-      if (lang->qvalue > 0)
+      const Language *l = &g_array_index (langs, Language, i);
+      if (l->qvalue > 0)
         {
-          value = g_strstrip (g_ascii_strdown (lang->value, -1));
+          value = g_strstrip (g_ascii_strdown (l->value, -1));
           g_ptr_array_add (ret, value);
         }
     }
@@ -581,13 +573,13 @@ cockpit_web_server_parse_accept_list (const gchar *accept,
   /* Add base languages after that */
   for (i = 0; i < langs->len; i++)
     {
-      lang = langs->pdata[i];
-      if (lang->qvalue > 0)
+      const Language *l = &g_array_index (langs, Language, i);
+      if (l->qvalue > 0)
         {
-          pos = strchr (lang->value, '-');
+          pos = strchr (l->value, '-');
           if (pos)
             {
-              value = g_strstrip (g_ascii_strdown (lang->value, pos - lang->value));
+              value = g_strstrip (g_ascii_strdown (l->value, pos - l->value));
               g_ptr_array_add (ret, value);
             }
         }
@@ -595,10 +587,324 @@ cockpit_web_server_parse_accept_list (const gchar *accept,
 
   g_free (copy);
   g_ptr_array_add (ret, NULL);
-  g_ptr_array_free (langs, TRUE);
+  g_array_free (langs, TRUE);
   return (gchar **)g_ptr_array_free (ret, FALSE);
 }
 
+gchar **
+cockpit_web_server_parse_accept_list (const gchar *accept,
+                                      const gchar *defawlt)
+{
+  return parse_accept_list (accept, accept ? strlen (accept) : 0, defawlt);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static const gchar *known_header_names[COCKPIT_WEB_N_HEADERS] = {
+  [COCKPIT_WEB_HEADER_HOST] = "Host",
+  [COCKPIT_WEB_HEADER_COOKIE] = "Cookie",
+  [COCKPIT_WEB_HEADER_ACCEPT_ENCODING] = "Accept-Encoding",
+  [COCKPIT_WEB_HEADER_IF_NONE_MATCH] = "If-None-Match",
+  [COCKPIT_WEB_HEADER_ACCEPT_LANGUAGE] = "Accept-Language",
+  [COCKPIT_WEB_HEADER_CONTENT_LENGTH] = "Content-Length",
+};
+
+/* The same rules as web_socket_util_parse_headers() */
+static gboolean
+is_valid_text (const gchar *data,
+               gsize length)
+{
+  gsize i;
+
+  for (i = 0; i < length; i++)
+    {
+      if (data[i] != '\t' && (data[i] < ' ' || data[i] & 0x80))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static CockpitWebSlice
+slice_strip (const gchar *data,
+             const gchar *end)
+{
+  CockpitWebSlice slice;
+
+  while (data < end && g_ascii_isspace (data[0]))
+    data++;
+  while (end > data && g_ascii_isspace (end[-1]))
+    end--;
+
+  slice.data = data;
+  slice.length = end - data;
+  return slice;
+}
+
+/* Returns the length of the header line, zero if truncated, negative if invalid */
+static gssize
+parse_header_line (const gchar *data,
+                   gsize length,
+                   CockpitWebSlice *name,
+                   CockpitWebSlice *value)
+{
+  const gchar *line_end;
+  const gchar *colon;
+
+  line_end = memchr (data, '\n', length);
+  if (line_end == NULL)
+    return 0;
+
+  colon = memchr (data, ':', line_end - data);
+  if (colon == NULL)
+    return -1;
+
+  *name = slice_strip (data, colon);
+  *value = slice_strip (colon + 1, line_end);
+
+  return (line_end - data) + 1;
+}
+
+static gssize
+parse_request_line (CockpitWebRequestHead *head,
+                    const gchar *data,
+                    gsize length)
+{
+  const gchar *end;
+  const gchar *method_end;
+  const gchar *path_beg;
+  const gchar *path_end;
+  const gchar *version;
+
+  end = memchr (data, '\n', length);
+  if (end == NULL)
+    return 0; /* need more data */
+
+  if (data[0] == ' ')
+    return -1;
+
+  method_end = memchr (data, ' ', end - data);
+  if (method_end == NULL)
+    return -1;
+
+  path_beg = method_end;
+  while (path_beg != end && path_beg[0] == ' ')
+    path_beg++;
+  path_end = memchr (path_beg, ' ', end - path_beg);
+  if (path_end == NULL)
+    return -1;
+
+  version = path_end;
+  while (version != end && version[0] == ' ')
+    version++;
+  if (end - version < 8 ||
+      (memcmp (version, "HTTP/1.0", 8) != 0 && memcmp (version, "HTTP/1.1", 8) != 0))
+    return -1;
+
+  /* Acceptable trailing characters */
+  for (version += 8; version != end; version++)
+    {
+      if (version[0] != '\r' && version[0] != ' ')
+        return -1;
+    }
+
+  if (!is_valid_text (data, method_end - data) ||
+      !is_valid_text (path_beg, path_end - path_beg))
+    return -1;
+
+  head->method.data = data;
+  head->method.length = method_end - data;
+  head->path.data = path_beg;
+  head->path.length = path_end - path_beg;
+
+  return (end - data) + 1;
+}
+
+/**
+ * cockpit_web_request_head_parse:
+ * @head: the request head to fill in
+ * @data: the request buffer
+ * @length: length of @data
+ *
+ * Parse the request line and the headers of an HTTP request, without
+ * copying anything: @head points into @data afterwards, and is only
+ * valid while @data is unchanged. The well known headers are found in
+ * @head->known, the rest can be had with cockpit_web_request_head_table().
+ * Any table from an earlier parse must have been released with
+ * cockpit_web_request_head_clear() first.
+ *
+ * When a header appears more than once, the last one counts.
+ *
+ * Returns: zero if truncated, negative if invalid, or the number
+ *          of bytes up to and including the empty line after the headers
+ */
+gssize
+cockpit_web_request_head_parse (CockpitWebRequestHead *head,
+                                const gchar *data,
+                                gsize length)
+{
+  CockpitWebSlice name;
+  CockpitWebSlice value;
+  gssize offset;
+  gssize line;
+  gint i;
+
+  memset (head, 0, sizeof (CockpitWebRequestHead));
+
+  if (length == 0)
+    return 0;
+
+  offset = parse_request_line (head, data, length);
+  if (offset <= 0)
+    return offset;
+
+  head->headers.data = data + offset;
+
+  for (;;)
+    {
+      if ((gsize)offset == length)
+        return 0;
+
+      /* An empty line, all done */
+      if (data[offset] == '\n')
+        {
+          head->headers.length = (data + offset) - head->headers.data;
+          return offset + 1;
+        }
+      if (data[offset] == '\r')
+        {
+          if ((gsize)offset + 1 == length)
+            return 0;
+          if (data[offset + 1] == '\n')
+            {
+              head->headers.length = (data + offset) - head->headers.data;
+              return offset + 2;
+            }
+        }
+
+      line = parse_header_line (data + offset, length - offset, &name, &value);
+      if (line <= 0)
+        {
+          if (line < 0)
+            g_debug ("received invalid header line");
+          return line;
+        }
+
+      if (!is_valid_text (name.data, name.length) ||
+          !g_utf8_validate (value.data, value.length, NULL))
+        {
+          g_debug ("received invalid header");
+          return -1;
+        }
+
+      for (i = 0; i < COCKPIT_WEB_N_HEADERS; i++)
+        {
+          if (name.length == strlen (known_header_names[i]) &&
+              g_ascii_strncasecmp (name.data, known_header_names[i], name.length) == 0)
+            {
+              head->known[i] = value;
+              break;
+            }
+        }
+
+      offset += line;
+    }
+}
+
+/**
+ * cockpit_web_request_head_table:
+ * @head: a head filled in by cockpit_web_request_head_parse()
+ *
+ * Copy all the headers into a table as made by cockpit_web_server_new_table(),
+ * for the handlers which want to look at them. The table is only built
+ * the first time this is called, and stays valid until
+ * cockpit_web_request_head_clear().
+ *
+ * Returns: (transfer none): the table
+ */
+GHashTable *
+cockpit_web_request_head_table (CockpitWebRequestHead *head)
+{
+  CockpitWebSlice name;
+  CockpitWebSlice value;
+  GHashTable *table;
+  gsize offset = 0;
+  gssize line;
+
+  if (head->table)
+    return head->table;
+
+  table = head->table = cockpit_web_server_new_table ();
+
+  /* Already validated by cockpit_web_request_head_parse() */
+  while ((line = parse_header_line (head->headers.data + offset, head->headers.length - offset,
+                                    &name, &value)) > 0)
+    {
+      g_hash_table_replace (table, g_strndup (name.data, name.length),
+                            g_strndup (value.data, value.length));
+      offset += line;
+    }
+
+  return table;
+}
+
+/**
+ * cockpit_web_request_head_clear:
+ * @head: a head filled in by cockpit_web_request_head_parse()
+ *
+ * Release the table built by cockpit_web_request_head_table(), if any.
+ */
+void
+cockpit_web_request_head_clear (CockpitWebRequestHead *head)
+{
+  if (head->table)
+    g_hash_table_unref (head->table);
+  head->table = NULL;
+}
+
+/**
+ * cockpit_web_request_head_parse_cookie:
+ * @head: a head filled in by cockpit_web_request_head_parse()
+ * @name: the name of the cookie
+ *
+ * The same as cockpit_web_server_parse_cookie(), but straight from
+ * the Cookie header in the request buffer, without building a table.
+ *
+ * Returns: (transfer full): the decoded value or %NULL
+ */
+gchar *
+cockpit_web_request_head_parse_cookie (const CockpitWebRequestHead *head,
+                                       const gchar *name)
+{
+  const CockpitWebSlice *cookie = &head->known[COCKPIT_WEB_HEADER_COOKIE];
+
+  if (!cookie->data)
+    return NULL;
+
+  return parse_cookie (cookie->data, cookie->data + cookie->length, name);
+}
+
+/**
+ * cockpit_web_request_head_parse_accept_list:
+ * @head: a head filled in by cockpit_web_request_head_parse()
+ * @header: one of the Accept-* headers
+ * @first: as for cockpit_web_server_parse_accept_list()
+ *
+ * The same as cockpit_web_server_parse_accept_list(), but straight
+ * from the request buffer, without building a table.
+ *
+ * Returns: (transfer full): the list of values in order of preference
+ */
+gchar **
+cockpit_web_request_head_parse_accept_list (const CockpitWebRequestHead *head,
+                                            CockpitWebHeader header,
+                                            const gchar *first)
+{
+  g_return_val_if_fail (header < COCKPIT_WEB_N_HEADERS, NULL);
+
+  return parse_accept_list (head->known[header].data, head->known[header].length, first);
+}
+
 /* ---------------------------------------------------------------------------------------------------- */
 
 typedef struct {
@@ -647,10 +953,10 @@ cockpit_request_finish (CockpitRequest *request)
 static void
 process_delayed_reply (CockpitRequest *request,
                        const gchar *path,
+                       const gchar *host,
                        GHashTable *headers)
 {
   CockpitWebResponse *response;
-  const gchar *host;
   const gchar *body;
   GBytes *bytes;
   gsize length;
@@ -668,7 +974,6 @@ process_delayed_reply (CockpitRequest *request,
     {
       body = "<html><head><title>Moved</title></head>"
         "<body>Please use TLS</body></html>";
-      host = g_hash_table_lookup (headers, "Host");
       url = g_strdup_printf ("https://%s%s",
                              host != NULL ? host : "", path);
       length = strlen (body);
@@ -725,13 +1030,15 @@ is_localhost_connection (GSocketConnection *conn)
 
 static void
 process_request (CockpitRequest *request,
+                 CockpitWebRequestHead *head,
+                 gsize length,
                  const gchar *method,
                  const gchar *path,
-                 const gchar *host,
-                 GHashTable *headers)
+                 const gchar *host)
 {
   gboolean claimed = FALSE;
   const gchar *actual_path;
+  GHashTable *headers;
 
   if (request->web_server->url_root->len &&
       !path_has_prefix (path, request->web_server->url_root))
@@ -765,9 +1072,16 @@ process_request (CockpitRequest *request,
         }
     }
 
+  /*
+   * Up to here only the well known headers were looked at. The replies
+   * and the handlers get all of them, so this is where they're copied.
+   */
+  headers = cockpit_web_request_head_table (head);
+  g_byte_array_remove_range (request->buffer, 0, length);
+
   if (request->delayed_reply)
     {
-      process_delayed_reply (request, path, headers);
+      process_delayed_reply (request, path, host, headers);
       return;
     }
 
@@ -792,19 +1106,37 @@ process_request (CockpitRequest *request,
     g_critical ("no handler responded to request: %s", actual_path);
 }
 
+static gboolean
+parse_content_length (const CockpitWebSlice *value,
+                      guint64 *length)
+{
+  gsize i;
+
+  *length = 0;
+  for (i = 0; i < value->length; i++)
+    {
+      if (!g_ascii_isdigit (value->data[i]) || *length > G_MAXUINT64 / 10 - 1)
+        return FALSE;
+      *length = *length * 10 + (value->data[i] - '0');
+    }
+
+  return TRUE;
+}
+
 static gboolean
 parse_and_process_request (CockpitRequest *request)
 {
+  CockpitWebRequestHead head;
   gboolean again = FALSE;
-  GHashTable *headers = NULL;
   gchar *method = NULL;
   gchar *path = NULL;
-  const gchar *str;
-  gchar *end = NULL;
-  gssize off1;
-  gssize off2;
+  gchar *host = NULL;
+  const CockpitWebSlice *value;
+  gssize off;
   guint64 length;
 
+  memset (&head, 0, sizeof (head));
+
   /* The hard input limit, we just terminate the connection */
   if (request->buffer->len > cockpit_webserver_request_maximum * 2)
     {
@@ -812,51 +1144,38 @@ parse_and_process_request (CockpitRequest *request)
       goto out;
     }
 
-  off1 = web_socket_util_parse_req_line ((const gchar *)request->buffer->data,
-                                         request->buffer->len,
-                                         &method,
-                                         &path);
-  if (off1 == 0)
+  /*
+   * This doesn't allocate anything, so it is cheap to do again each time
+   * more of the request arrives. The headers get copied into a table
+   * only once a reply or a handler needs them.
+   */
+  off = cockpit_web_request_head_parse (&head,
+                                        (const gchar *)request->buffer->data,
+                                        request->buffer->len);
+  if (off == 0)
     {
       again = TRUE;
       goto out;
     }
-  if (off1 < 0)
+  if (off < 0)
     {
-      g_message ("received invalid HTTP request line");
+      g_message ("received invalid HTTP request");
       request->delayed_reply = 400;
       goto out;
     }
-  if (!path || path[0] != '/')
+  if (head.path.length == 0 || head.path.data[0] != '/')
     {
       g_message ("received invalid HTTP path");
       request->delayed_reply = 400;
       goto out;
     }
 
-  off2 = web_socket_util_parse_headers ((const gchar *)request->buffer->data + off1,
-                                        request->buffer->len - off1,
-                                        &headers);
-  if (off2 == 0)
-    {
-      again = TRUE;
-      goto out;
-    }
-  if (off2 < 0)
-    {
-      g_message ("received invalid HTTP request headers");
-      request->delayed_reply = 400;
-      goto out;
-    }
-
   /* If we get a Content-Length then verify it is zero */
   length = 0;
-  str = g_hash_table_lookup (headers, "Content-Length");
-  if (str != NULL)
+  value = &head.known[COCKPIT_WEB_HEADER_CONTENT_LENGTH];
+  if (value->data != NULL)
     {
-      end = NULL;
-      length = g_ascii_strtoull (str, &end, 10);
-      if (!end || end[0])
+      if (!parse_content_length (value, &length))
         {
           g_message ("received invalid Content-Length");
           request->delayed_reply = 400;
@@ -872,31 +1191,34 @@ parse_and_process_request (CockpitRequest *request)
     }
 
   /* Not enough data yet */
-  if (request->buffer->len < off1 + off2 + length)
+  if (request->buffer->len < off + length)
     {
       again = TRUE;
       goto out;
     }
 
-  if (!g_str_equal (method, "GET") && !g_str_equal (method, "HEAD"))
+  if (!(head.method.length == 3 && memcmp (head.method.data, "GET", 3) == 0) &&
+      !(head.method.length == 4 && memcmp (head.method.data, "HEAD", 4) == 0))
     {
       g_message ("received unsupported HTTP method");
       request->delayed_reply = 405;
     }
 
-  str = g_hash_table_lookup (headers, "Host");
-  if (!str || g_str_equal (str, ""))
+  if (head.known[COCKPIT_WEB_HEADER_HOST].length == 0)
     {
       g_message ("received HTTP request without Host header");
       request->delayed_reply = 400;
     }
 
-  g_byte_array_remove_range (request->buffer, 0, off1 + off2);
-  process_request (request, method, path, str, headers);
+  method = g_strndup (head.method.data, head.method.length);
+  path = g_strndup (head.path.data, head.path.length);
+  host = g_strndup (head.known[COCKPIT_WEB_HEADER_HOST].data, head.known[COCKPIT_WEB_HEADER_HOST].length);
+
+  process_request (request, &head, off, method, path, host);
 
 out:
-  if (headers)
-    g_hash_table_unref (headers);
+  cockpit_web_request_head_clear (&head);
+  g_free (host);
   g_free (method);
   g_free (path);
   if (!again)
@@ -39,6 +39,47 @@ typedef enum {
   COCKPIT_WEB_SERVER_FLAGS_MAX = 1 << 3
 } CockpitWebServerFlags;
 
+/* Headers which CockpitWebRequestHead looks up while parsing */
+typedef enum {
+  COCKPIT_WEB_HEADER_HOST,
+  COCKPIT_WEB_HEADER_COOKIE,
+  COCKPIT_WEB_HEADER_ACCEPT_ENCODING,
+  COCKPIT_WEB_HEADER_IF_NONE_MATCH,
+  COCKPIT_WEB_HEADER_ACCEPT_LANGUAGE,
+  COCKPIT_WEB_HEADER_CONTENT_LENGTH,
+  COCKPIT_WEB_N_HEADERS
+} CockpitWebHeader;
+
+/* Part of the request buffer; not nul terminated */
+typedef struct {
+  const gchar *data;
+  gsize length;
+} CockpitWebSlice;
+
+typedef struct {
+  CockpitWebSlice method;
+  CockpitWebSlice path;
+  CockpitWebSlice headers;
+  /* with data == NULL if the header is not present */
+  CockpitWebSlice known[COCKPIT_WEB_N_HEADERS];
+  /* all the headers, built on the first lookup that needs them */
+  GHashTable *table;
+} CockpitWebRequestHead;
+
+gssize             cockpit_web_request_head_parse   (CockpitWebRequestHead *head,
+                                                     const gchar *data,
+                                                     gsize length);
+
+GHashTable *       cockpit_web_request_head_table   (CockpitWebRequestHead *head);
+
+void               cockpit_web_request_head_clear   (CockpitWebRequestHead *head);
+
+gchar *            cockpit_web_request_head_parse_cookie      (const CockpitWebRequestHead *head,
+                                                               const gchar *name);
+
+gchar **           cockpit_web_request_head_parse_accept_list (const CockpitWebRequestHead *head,
+                                                               CockpitWebHeader header,
+                                                               const gchar *first);
 
 CockpitWebServer * cockpit_web_server_new           (GTlsCertificate *certificate,
                                                      CockpitWebServerFlags flags);
@@ -25,6 +25,8 @@
 
 #include <gio/gio.h>
 
+#include <string.h>
+
 typedef CockpitTransportClass MockTransportClass;
 
 typedef struct {
@@ -32,6 +34,11 @@ typedef struct {
   GDestroyNotify func;
 } Trash;
 
+typedef struct {
+  gint64 due;
+  JsonObject *object;
+} LinkPong;
+
 G_DEFINE_TYPE (MockTransport, mock_transport, COCKPIT_TYPE_TRANSPORT);
 
 static void
@@ -54,9 +61,18 @@ trash_push (MockTransport *self,
   self->trash = g_list_prepend (self->trash, trash);
 }
 
+static void
+link_pong_free (gpointer data)
+{
+  LinkPong *pong = data;
+  json_object_unref (pong->object);
+  g_free (pong);
+}
+
 static void
 mock_transport_init (MockTransport *self)
 {
+  self->link_pongs = g_queue_new ();
   self->channels = g_hash_table_new_full (g_str_hash, g_str_equal,
                                           g_free, (GDestroyNotify)g_queue_free);
   self->control = g_queue_new ();
@@ -100,6 +116,9 @@ mock_transport_finalize (GObject *object)
 {
   MockTransport *self = (MockTransport *)object;
 
+  if (self->link_timer)
+    g_source_remove (self->link_timer);
+  g_queue_free_full (self->link_pongs, link_pong_free);
   g_free (self->problem);
   g_queue_free (self->control);
   g_list_free_full (self->trash, trash_free);
@@ -108,6 +127,82 @@ mock_transport_finalize (GObject *object)
   G_OBJECT_CLASS (mock_transport_parent_class)->finalize (object);
 }
 
+static gboolean
+on_link_timer (gpointer user_data)
+{
+  MockTransport *self = user_data;
+  LinkPong *pong;
+  const gchar *channel;
+  gint64 sequence;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  g_object_ref (self);
+
+  for (;;)
+    {
+      pong = g_queue_peek_head (self->link_pongs);
+      if (!pong || pong->due > now)
+        break;
+
+      g_queue_pop_head (self->link_pongs);
+      if (cockpit_json_get_int (pong->object, "sequence", 0, &sequence))
+        self->link_acked = MAX (self->link_acked, sequence);
+      if (!cockpit_json_get_string (pong->object, "channel", NULL, &channel))
+        channel = NULL;
+      json_object_set_string_member (pong->object, "command", "pong");
+      cockpit_transport_emit_control (COCKPIT_TRANSPORT (self), "pong", channel, pong->object, NULL);
+      link_pong_free (pong);
+    }
+
+  if (g_queue_is_empty (self->link_pongs))
+    self->link_timer = 0;
+
+  g_object_unref (self);
+  return self->link_timer != 0;
+}
+
+/*
+ * Pretend that channel data goes over a link with the given bandwidth
+ * and one way delay. Data is then discarded, and pings are answered by
+ * the other end once all the data before them has made it across.
+ */
+static gboolean
+link_send (MockTransport *self,
+           const gchar *channel_id,
+           JsonObject *object,
+           GBytes *data)
+{
+  const gchar *command;
+  LinkPong *pong;
+  gint64 now;
+
+  if (!self->link_bandwidth)
+    return FALSE;
+
+  now = g_get_monotonic_time ();
+  self->link_free = MAX (self->link_free, now);
+
+  if (channel_id)
+    {
+      self->link_free += g_bytes_get_size (data) * G_USEC_PER_SEC / self->link_bandwidth;
+      return TRUE;
+    }
+
+  if (!cockpit_json_get_string (object, "command", NULL, &command) ||
+      g_strcmp0 (command, "ping") != 0)
+    return FALSE;
+
+  pong = g_new0 (LinkPong, 1);
+  pong->due = self->link_free + 2 * self->link_delay;
+  pong->object = json_object_ref (object);
+  g_queue_push_tail (self->link_pongs, pong);
+
+  if (!self->link_timer)
+    self->link_timer = g_timeout_add (1, on_link_timer, self);
+  return TRUE;
+}
+
 static void
 mock_transport_send (CockpitTransport *transport,
                      const gchar *channel_id,
@@ -122,10 +217,16 @@ mock_transport_send (CockpitTransport *transport,
     {
       object = cockpit_json_parse_bytes (data, &error);
       g_assert_no_error (error);
+      if (link_send (self, NULL, object, data))
+        {
+          json_object_unref (object);
+          self->count++;
+          return;
+        }
       g_queue_push_tail (self->control, object);
       trash_push (self, object, (GDestroyNotify)json_object_unref);
     }
-  else
+  else if (!link_send (self, channel_id, NULL, data))
     {
       queue = g_hash_table_lookup (self->channels, channel_id);
       if (!queue)
@@ -139,6 +240,31 @@ mock_transport_send (CockpitTransport *transport,
   self->count++;
 }
 
+static void
+mock_transport_send_frame (CockpitTransport *transport,
+                           const gchar *channel_id,
+                           GBytes *data,
+                           GBytes *frame)
+{
+  MockTransport *self = (MockTransport *)transport;
+  gchar *prefix;
+  gsize length;
+
+  /* Check that the frame is exactly what would have been sent */
+  prefix = g_strdup_printf ("%" G_GSIZE_FORMAT "\n%s\n",
+                            (channel_id ? strlen (channel_id) : 0) + 1 + g_bytes_get_size (data),
+                            channel_id ? channel_id : "");
+  length = strlen (prefix);
+  g_assert_cmpuint (g_bytes_get_size (frame), ==, length + g_bytes_get_size (data));
+  g_assert (memcmp (g_bytes_get_data (frame, NULL), prefix, length) == 0);
+  g_assert (memcmp ((const gchar *)g_bytes_get_data (frame, NULL) + length,
+                    g_bytes_get_data (data, NULL), g_bytes_get_size (data)) == 0);
+  g_free (prefix);
+
+  self->frames++;
+  mock_transport_send (transport, channel_id, data);
+}
+
 static void
 mock_transport_close (CockpitTransport *transport,
                       const gchar *problem)
@@ -160,6 +286,7 @@ mock_transport_class_init (MockTransportClass *klass)
   object_class->set_property = mock_transport_set_property;
   g_object_class_override_property (object_class, 1, "name");
   transport_class->send = mock_transport_send;
+  transport_class->send_frame = mock_transport_send_frame;
   transport_class->close = mock_transport_close;
 }
 
@@ -183,6 +310,16 @@ mock_transport_pop_channel (MockTransport *mock,
   return NULL;
 }
 
+void
+mock_transport_set_link (MockTransport *mock,
+                         gint64 bandwidth,
+                         gint64 delay)
+{
+  g_assert (bandwidth >= 0);
+  mock->link_bandwidth = bandwidth;
+  mock->link_delay = delay;
+}
+
 JsonObject *
 mock_transport_pop_control (MockTransport *mock)
 {
@@ -195,6 +332,12 @@ mock_transport_count_sent (MockTransport *mock)
   return mock->count;
 }
 
+guint
+mock_transport_count_frames (MockTransport *mock)
+{
+  return mock->frames;
+}
+
 GBytes *
 mock_transport_combine_output (MockTransport *transport,
                                const gchar *channel_id,
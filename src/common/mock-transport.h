@@ -33,9 +33,18 @@ typedef struct {
   gboolean closed;
   gchar *problem;
   guint count;
+  guint frames;
   GQueue *control;
   GHashTable *channels;
   GList *trash;
+
+  /* A simulated link, see mock_transport_set_link() */
+  gint64 link_bandwidth;
+  gint64 link_delay;
+  gint64 link_free;
+  gint64 link_acked;
+  GQueue *link_pongs;
+  guint link_timer;
 } MockTransport;
 
 GType                mock_transport_get_type      (void);
@@ -44,11 +53,17 @@ MockTransport *      mock_transport_new           (void);
 
 guint                mock_transport_count_sent    (MockTransport *mock);
 
+guint                mock_transport_count_frames  (MockTransport *mock);
+
 JsonObject *         mock_transport_pop_control   (MockTransport *mock);
 
 GBytes *             mock_transport_pop_channel   (MockTransport *mock,
                                                    const gchar *channel);
 
+void                 mock_transport_set_link      (MockTransport *mock,
+                                                   gint64 bandwidth,
+                                                   gint64 delay);
+
 GBytes *             mock_transport_combine_output (MockTransport *transport,
                                                     const gchar *channel_id,
                                                     guint *count);
@@ -22,6 +22,7 @@
 #include "mock-transport.h"
 
 #include "cockpitchannel.h"
+#include "cockpitchannelstats.h"
 #include "cockpitjson.h"
 #include "cockpitpipe.h"
 #include "cockpitpipetransport.h"
@@ -180,6 +181,52 @@ test_recv_and_send (TestCase *tc,
   g_bytes_unref (payload);
 }
 
+static void
+test_send_incomplete (TestCase *tc,
+                      gconstpointer unused)
+{
+  GBytes *sent;
+  GBytes *payload;
+
+  cockpit_channel_ready (tc->channel, NULL);
+
+  /* The start of a euro sign is held back */
+  payload = g_bytes_new_static ("Price \xe2\x82", 8);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "554", payload);
+  g_bytes_unref (payload);
+
+  sent = mock_transport_pop_channel (tc->transport, "554");
+  cockpit_assert_bytes_eq (sent, "Price ", -1);
+  g_assert (mock_transport_pop_channel (tc->transport, "554") == NULL);
+
+  /* And sent with the rest of it */
+  payload = g_bytes_new_static ("\xac 5", 3);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "554", payload);
+  g_bytes_unref (payload);
+
+  sent = mock_transport_pop_channel (tc->transport, "554");
+  cockpit_assert_bytes_eq (sent, "\xe2\x82\xac 5", -1);
+}
+
+static void
+test_send_incomplete_flush (TestCase *tc,
+                            gconstpointer unused)
+{
+  GBytes *sent;
+  GBytes *payload;
+
+  cockpit_channel_ready (tc->channel, NULL);
+
+  payload = g_bytes_new_static ("\xe2\x82", 2);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "554", payload);
+  g_bytes_unref (payload);
+
+  /* Never completed, so replaced after a while */
+  while ((sent = mock_transport_pop_channel (tc->transport, "554")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_assert_bytes_eq (sent, "\xef\xbf\xbd\xef\xbf\xbd", -1);
+}
+
 static void
 test_recv_and_queue (TestCase *tc,
                      gconstpointer unused)
@@ -765,6 +812,202 @@ test_pressure_throttle (TestPairCase *tc,
   g_bytes_unref (sent);
 }
 
+typedef struct {
+  gint64 bandwidth;
+  gint64 delay;
+} TestLink;
+
+static const TestLink link_wan = { 32 * 1024 * 1024, 50 * 1000 };
+static const TestLink link_lan = { 32 * 1024 * 1024, 500 };
+
+static void
+test_flow_autotune (gconstpointer data)
+{
+  const TestLink *link = data;
+  CockpitChannel *channel;
+  JsonObject *options;
+  MockTransport *mock;
+  GBytes *chunk;
+  gint throttle = 0;
+  gint64 start;
+  gint64 since = 0;
+  gint64 acked = 0;
+  gint64 now;
+  gdouble rate;
+  gint64 bdp;
+
+  mock = mock_transport_new ();
+  mock_transport_set_link (mock, link->bandwidth, link->delay);
+
+  options = json_object_new ();
+  json_object_set_boolean_member (options, "flow-control", TRUE);
+  channel = g_object_new (mock_null_channel_get_type (),
+                          "transport", mock,
+                          "id", "55",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+  cockpit_channel_ready (channel, NULL);
+  g_signal_connect (channel, "pressure", G_CALLBACK (on_pressure_set_throttle), &throttle);
+
+  chunk = g_bytes_new_take (g_strnfill (16 * 1024, '?'), 16 * 1024);
+
+  /* Keep the link as busy as the window allows, and measure in the second half */
+  start = g_get_monotonic_time ();
+  for (;;)
+    {
+      now = g_get_monotonic_time ();
+      if (now - start > 2 * G_USEC_PER_SEC)
+        break;
+      if (!since && now - start > G_USEC_PER_SEC)
+        {
+          since = now;
+          acked = mock->link_acked;
+        }
+
+      if (throttle)
+        g_main_context_iteration (NULL, TRUE);
+      else
+        cockpit_channel_send (channel, chunk, FALSE);
+      while (g_main_context_iteration (NULL, FALSE));
+    }
+
+  bdp = link->bandwidth * 2 * link->delay / G_USEC_PER_SEC;
+
+  /* The window covers the link, but stays small when the link doesn't need more */
+  g_assert_cmpint (cockpit_channel_get_flow_window (channel), >=, MIN (bdp, cockpit_channel_flow_window_max ()));
+  if (bdp < cockpit_channel_flow_window_min ())
+    g_assert_cmpint (cockpit_channel_get_flow_window (channel), <, 2 * 1024 * 1024);
+
+  /*
+   * What that buys depends on how busy the machine is. A fixed window of
+   * 2 MiB would only get a third of the way on the WAN link.
+   */
+  if (g_test_perf ())
+    {
+      rate = (gdouble)(mock->link_acked - acked) * G_USEC_PER_SEC / (now - since);
+      g_test_maximized_result (rate / link->bandwidth, "%.0f%% of the link", rate * 100 / link->bandwidth);
+      g_assert_cmpfloat (rate, >, link->bandwidth * 0.7);
+    }
+
+  g_bytes_unref (chunk);
+  g_object_unref (channel);
+  g_object_unref (mock);
+}
+
+static void
+test_stats (void)
+{
+  MockTransport *transport;
+  CockpitChannelStats *stats;
+  CockpitChannel *channel;
+  JsonObject *options;
+  GBytes *payload;
+  GBytes *sent;
+
+  stats = cockpit_channel_stats_register ("test-stats");
+  cockpit_channel_stats_reset ();
+
+  transport = g_object_new (mock_transport_get_type (), NULL);
+  options = json_object_new ();
+  json_object_set_string_member (options, "payload", "test-stats");
+  channel = g_object_new (mock_echo_channel_get_type (),
+                          "transport", transport,
+                          "id", "55",
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+
+  g_assert_cmpuint (stats->opened, ==, 1);
+  g_assert_cmpuint (stats->active, ==, 1);
+  g_assert_cmpuint (stats->ready.count, ==, 0);
+
+  cockpit_channel_ready (channel, NULL);
+  g_assert_cmpuint (stats->ready.count, ==, 1);
+
+  payload = g_bytes_new ("Yeehaw!", 7);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), "55", payload);
+  sent = mock_transport_pop_channel (transport, "55");
+  g_assert (sent != NULL);
+  g_bytes_unref (payload);
+
+  g_assert_cmpuint (stats->frames_in, ==, 1);
+  g_assert_cmpuint (stats->bytes_in, ==, 7);
+  g_assert_cmpuint (stats->frames_out, ==, 1);
+  g_assert_cmpuint (stats->bytes_out, ==, 7);
+
+  cockpit_channel_close (channel, "terminated");
+  g_assert_cmpuint (stats->failed, ==, 1);
+
+  g_object_unref (channel);
+  g_assert_cmpuint (stats->active, ==, 0);
+
+  g_object_unref (transport);
+}
+
+static void
+count_stats (gpointer data,
+             gpointer user_data)
+{
+  guint *count = user_data;
+  (*count)++;
+}
+
+static void
+test_stats_other (void)
+{
+  CockpitChannelStats *other;
+  gchar *payload;
+  guint before = 0;
+  guint after = 0;
+  gint i;
+
+  other = cockpit_channel_stats_get (NULL);
+  g_assert_cmpstr (other->payload, ==, "other");
+  cockpit_channel_stats_foreach (count_stats, &before);
+
+  /* Payloads that nobody registered don't get entries of their own */
+  for (i = 0; i < 100; i++)
+    {
+      payload = g_strdup_printf ("unknown-%d", i);
+      g_assert (cockpit_channel_stats_get (payload) == other);
+      g_free (payload);
+    }
+
+  cockpit_channel_stats_foreach (count_stats, &after);
+  g_assert_cmpuint (before, ==, after);
+
+  g_assert (cockpit_channel_stats_get ("test-stats") == cockpit_channel_stats_register ("test-stats"));
+  g_assert (cockpit_channel_stats_get ("test-stats") != other);
+}
+
+static void
+test_stats_histogram (void)
+{
+  CockpitHistogram histogram = { 0, };
+  gint i;
+
+  g_assert_cmpuint (cockpit_histogram_percentile (&histogram, 0.5), ==, 0);
+
+  /* Below 2^10 microseconds */
+  for (i = 0; i < 90; i++)
+    cockpit_histogram_add (&histogram, 1000);
+
+  /* Below 2^20 microseconds */
+  for (i = 0; i < 10; i++)
+    cockpit_histogram_add (&histogram, 1000000);
+
+  g_assert_cmpuint (histogram.count, ==, 100);
+  g_assert_cmpuint (histogram.total, ==, 90 * 1000 + 10 * 1000000);
+  g_assert_cmpuint (histogram.buckets[10], ==, 90);
+  g_assert_cmpuint (histogram.buckets[20], ==, 10);
+  g_assert_cmpuint (cockpit_histogram_percentile (&histogram, 0.5), ==, 1 << 10);
+  g_assert_cmpuint (cockpit_histogram_percentile (&histogram, 0.95), ==, 1 << 20);
+
+  /* Way too long ends up in the last bucket */
+  cockpit_histogram_add (&histogram, G_GINT64_CONSTANT (1) << 40);
+  g_assert_cmpuint (histogram.buckets[COCKPIT_CHANNEL_STATS_BUCKETS - 1], ==, 1);
+}
 
 int
 main (int argc,
@@ -781,6 +1024,10 @@ main (int argc,
                    test_capable);
   g_test_add ("/channel/recv-send", TestCase, NULL,
               setup, test_recv_and_send, teardown);
+  g_test_add ("/channel/send-incomplete", TestCase, NULL,
+              setup, test_send_incomplete, teardown);
+  g_test_add ("/channel/send-incomplete-flush", TestCase, NULL,
+              setup, test_send_incomplete_flush, teardown);
   g_test_add ("/channel/recv-queue", TestCase, NULL,
               setup, test_recv_and_queue, teardown);
   g_test_add ("/channel/ready-message", TestCase, NULL,
@@ -802,5 +1049,12 @@ main (int argc,
   g_test_add_func ("/channel/ping/normal", test_ping_channel);
   g_test_add_func ("/channel/ping/no-channel", test_ping_no_channel);
 
+  g_test_add_data_func ("/channel/flow/autotune-wan", &link_wan, test_flow_autotune);
+  g_test_add_data_func ("/channel/flow/autotune-lan", &link_lan, test_flow_autotune);
+
+  g_test_add_func ("/channel/stats/counters", test_stats);
+  g_test_add_func ("/channel/stats/other", test_stats_other);
+  g_test_add_func ("/channel/stats/histogram", test_stats_histogram);
+
   return g_test_run ();
 }
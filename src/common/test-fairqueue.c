@@ -0,0 +1,247 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include "cockpitfairqueue.h"
+
+#include "cockpittest.h"
+
+#include <string.h>
+
+static void
+push (CockpitFairQueue *queue,
+      const gchar *lane,
+      guint weight,
+      const gchar *item,
+      gsize size,
+      gboolean boundary)
+{
+  cockpit_fair_queue_push (queue, lane, weight, (gpointer)item, size, boundary);
+}
+
+static gchar *
+pop_all (CockpitFairQueue *queue)
+{
+  GString *order = g_string_new ("");
+  const gchar *item;
+
+  while ((item = cockpit_fair_queue_pop (queue, NULL)) != NULL)
+    {
+      if (order->len)
+        g_string_append_c (order, ' ');
+      g_string_append (order, item);
+    }
+
+  g_assert (cockpit_fair_queue_is_empty (queue));
+  return g_string_free (order, FALSE);
+}
+
+static void
+test_single (void)
+{
+  CockpitFairQueue *queue;
+  gchar *order;
+  gsize size = 0;
+
+  queue = cockpit_fair_queue_new (NULL);
+  g_assert (cockpit_fair_queue_is_empty (queue));
+  g_assert (cockpit_fair_queue_pop (queue, NULL) == NULL);
+
+  push (queue, NULL, 1, "one", 100000, TRUE);
+  push (queue, NULL, 1, "two", 3, TRUE);
+  g_assert (!cockpit_fair_queue_is_empty (queue));
+
+  g_assert_cmpstr (cockpit_fair_queue_pop (queue, &size), ==, "one");
+  g_assert_cmpuint (size, ==, 100000);
+
+  push (queue, NULL, 1, "three", 100000, TRUE);
+  push (queue, NULL, 1, "four", 4, TRUE);
+
+  order = pop_all (queue);
+  g_assert_cmpstr (order, ==, "two three four");
+  g_free (order);
+
+  cockpit_fair_queue_free (queue);
+}
+
+static void
+test_interleave (void)
+{
+  CockpitFairQueue *queue;
+  gchar *order;
+
+  queue = cockpit_fair_queue_new (NULL);
+
+  push (queue, "a", 1, "a1", 4096, TRUE);
+  push (queue, "a", 1, "a2", 4096, TRUE);
+  push (queue, "a", 1, "a3", 4096, TRUE);
+  push (queue, "b", 1, "b1", 4096, TRUE);
+  push (queue, "b", 1, "b2", 4096, TRUE);
+  push (queue, "b", 1, "b3", 4096, TRUE);
+
+  order = pop_all (queue);
+  g_assert_cmpstr (order, ==, "a1 b1 a2 b2 a3 b3");
+  g_free (order);
+
+  cockpit_fair_queue_free (queue);
+}
+
+static void
+test_weight (void)
+{
+  CockpitFairQueue *queue;
+  gchar *order;
+
+  queue = cockpit_fair_queue_new (NULL);
+
+  push (queue, "a", 1, "a1", 4096, TRUE);
+  push (queue, "a", 1, "a2", 4096, TRUE);
+  push (queue, "a", 1, "a3", 4096, TRUE);
+  push (queue, "b", 2, "b1", 4096, TRUE);
+  push (queue, "b", 2, "b2", 4096, TRUE);
+  push (queue, "b", 2, "b3", 4096, TRUE);
+  push (queue, "b", 2, "b4", 4096, TRUE);
+  push (queue, "b", 2, "b5", 4096, TRUE);
+  push (queue, "b", 2, "b6", 4096, TRUE);
+
+  order = pop_all (queue);
+  g_assert_cmpstr (order, ==, "a1 b1 b2 a2 b3 b4 a3 b5 b6");
+  g_free (order);
+
+  cockpit_fair_queue_free (queue);
+}
+
+static void
+test_boundary (void)
+{
+  CockpitFairQueue *queue;
+  gchar *order;
+
+  queue = cockpit_fair_queue_new (NULL);
+
+  /* Like a frame prefix followed by its payload */
+  push (queue, "a", 1, "ap1", 10, FALSE);
+  push (queue, "a", 1, "ad1", 8000, TRUE);
+  push (queue, "a", 1, "ap2", 10, FALSE);
+  push (queue, "a", 1, "ad2", 8000, TRUE);
+  push (queue, "b", 1, "bp1", 10, FALSE);
+  push (queue, "b", 1, "bd1", 8000, TRUE);
+  push (queue, "b", 1, "bp2", 10, FALSE);
+  push (queue, "b", 1, "bd2", 8000, TRUE);
+
+  order = pop_all (queue);
+  g_assert_cmpstr (order, ==, "ap1 ad1 bp1 bd1 ap2 ad2 bp2 bd2");
+  g_free (order);
+
+  cockpit_fair_queue_free (queue);
+}
+
+static void
+test_overdraft (void)
+{
+  CockpitFairQueue *queue;
+  gchar *order;
+
+  queue = cockpit_fair_queue_new (NULL);
+
+  /* A large block goes right away, but the lane then sits out */
+  push (queue, "a", 1, "a1", 16384, TRUE);
+  push (queue, "a", 1, "a2", 4096, TRUE);
+  push (queue, "b", 1, "b1", 4096, TRUE);
+  push (queue, "b", 1, "b2", 4096, TRUE);
+  push (queue, "b", 1, "b3", 4096, TRUE);
+  push (queue, "b", 1, "b4", 4096, TRUE);
+  push (queue, "b", 1, "b5", 4096, TRUE);
+
+  order = pop_all (queue);
+  g_assert_cmpstr (order, ==, "a1 b1 b2 b3 b4 a2 b5");
+  g_free (order);
+
+  cockpit_fair_queue_free (queue);
+}
+
+static void
+test_no_debt_alone (void)
+{
+  CockpitFairQueue *queue;
+  gchar *order;
+  gint i;
+
+  queue = cockpit_fair_queue_new (NULL);
+
+  /* A lane that had the queue to itself isn't held back later */
+  for (i = 0; i < 10; i++)
+    {
+      push (queue, "a", 1, "a", 65536, TRUE);
+      g_assert_cmpstr (cockpit_fair_queue_pop (queue, NULL), ==, "a");
+    }
+
+  push (queue, "a", 1, "a1", 65536, TRUE);
+  push (queue, "a", 1, "a2", 65536, TRUE);
+  g_assert_cmpstr (cockpit_fair_queue_pop (queue, NULL), ==, "a1");
+
+  push (queue, "b", 1, "b1", 4096, TRUE);
+  push (queue, "a", 1, "a3", 65536, TRUE);
+  g_assert_cmpstr (cockpit_fair_queue_pop (queue, NULL), ==, "a2");
+
+  order = pop_all (queue);
+  g_assert_cmpstr (order, ==, "b1 a3");
+  g_free (order);
+
+  cockpit_fair_queue_free (queue);
+}
+
+static void
+test_free_queued (void)
+{
+  CockpitFairQueue *queue;
+
+  queue = cockpit_fair_queue_new (g_free);
+
+  cockpit_fair_queue_push (queue, "a", 1, g_strdup ("one"), 3, TRUE);
+  cockpit_fair_queue_push (queue, "b", 4, g_strdup ("two"), 3, FALSE);
+  cockpit_fair_queue_push (queue, NULL, 16, g_strdup ("three"), 5, TRUE);
+
+  cockpit_fair_queue_clear (queue);
+  g_assert (cockpit_fair_queue_is_empty (queue));
+
+  cockpit_fair_queue_push (queue, "a", 1, g_strdup ("four"), 4, TRUE);
+
+  /* Frees the rest */
+  cockpit_fair_queue_free (queue);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add_func ("/fair-queue/single", test_single);
+  g_test_add_func ("/fair-queue/interleave", test_interleave);
+  g_test_add_func ("/fair-queue/weight", test_weight);
+  g_test_add_func ("/fair-queue/boundary", test_boundary);
+  g_test_add_func ("/fair-queue/overdraft", test_overdraft);
+  g_test_add_func ("/fair-queue/no-debt-alone", test_no_debt_alone);
+  g_test_add_func ("/fair-queue/free-queued", test_free_queued);
+
+  return g_test_run ();
+}
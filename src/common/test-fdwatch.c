@@ -0,0 +1,357 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitfdwatch.h"
+#include "cockpitpipe.h"
+#include "cockpittest.h"
+
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+  int fds[2];
+  gint count;
+  gboolean ret;
+  CockpitFdWatch *watch;
+} TestCase;
+
+typedef struct {
+  gboolean no_epoll;
+} TestFixture;
+
+static const TestFixture fixture_epoll = { FALSE };
+static const TestFixture fixture_no_epoll = { TRUE };
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  const TestFixture *fixture = data;
+
+  if (fixture->no_epoll)
+    g_setenv ("COCKPIT_NO_EPOLL", "1", TRUE);
+  else
+    g_unsetenv ("COCKPIT_NO_EPOLL");
+
+  g_assert_cmpint (socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, tc->fds), ==, 0);
+  tc->ret = TRUE;
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  cockpit_fd_watch_free (tc->watch);
+  if (tc->fds[0] >= 0)
+    close (tc->fds[0]);
+  if (tc->fds[1] >= 0)
+    close (tc->fds[1]);
+
+  /* Nothing should be left to dispatch */
+  while (g_main_context_iteration (NULL, FALSE));
+
+  g_unsetenv ("COCKPIT_NO_EPOLL");
+  cockpit_assert_expected ();
+}
+
+static gboolean
+on_ready_count (gint fd,
+                GIOCondition cond,
+                gpointer user_data)
+{
+  TestCase *tc = user_data;
+  tc->count++;
+  return tc->ret;
+}
+
+static void
+drain (int fd)
+{
+  gchar buffer[256];
+  while (read (fd, buffer, sizeof (buffer)) > 0);
+}
+
+static void
+test_readable (TestCase *tc,
+               gconstpointer data)
+{
+  tc->watch = cockpit_fd_watch_new (NULL, tc->fds[0], G_IO_IN, "test", on_ready_count, tc);
+  g_assert (!cockpit_fd_watch_is_active (tc->watch));
+
+  /* Not started, so no callback */
+  g_assert_cmpint (write (tc->fds[1], "x", 1), ==, 1);
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpint (tc->count, ==, 0);
+
+  cockpit_fd_watch_start (tc->watch);
+  g_assert (cockpit_fd_watch_is_active (tc->watch));
+  while (tc->count == 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  drain (tc->fds[0]);
+  cockpit_fd_watch_stop (tc->watch);
+  g_assert (!cockpit_fd_watch_is_active (tc->watch));
+
+  /* Stopping and starting again picks up new data */
+  g_assert_cmpint (write (tc->fds[1], "y", 1), ==, 1);
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpint (tc->count, ==, 1);
+
+  cockpit_fd_watch_start (tc->watch);
+  while (tc->count == 1)
+    g_main_context_iteration (NULL, TRUE);
+  drain (tc->fds[0]);
+}
+
+static void
+test_return_false (TestCase *tc,
+                   gconstpointer data)
+{
+  tc->ret = FALSE;
+  tc->watch = cockpit_fd_watch_new (NULL, tc->fds[0], G_IO_IN, "test", on_ready_count, tc);
+  cockpit_fd_watch_start (tc->watch);
+
+  g_assert_cmpint (write (tc->fds[1], "x", 1), ==, 1);
+  while (tc->count == 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Returning FALSE stops the watch, even though data is still there */
+  g_assert (!cockpit_fd_watch_is_active (tc->watch));
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpint (tc->count, ==, 1);
+}
+
+static void
+test_shared_fd (TestCase *tc,
+                gconstpointer data)
+{
+  TestCase other = { .count = 0, .ret = FALSE };
+  CockpitFdWatch *out;
+
+  tc->watch = cockpit_fd_watch_new (NULL, tc->fds[0], G_IO_IN, "in", on_ready_count, tc);
+  out = cockpit_fd_watch_new (NULL, tc->fds[0], G_IO_OUT, "out", on_ready_count, &other);
+
+  cockpit_fd_watch_start (tc->watch);
+  cockpit_fd_watch_start (out);
+
+  /* Writable straight away, and the callback stops itself */
+  while (other.count == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert (!cockpit_fd_watch_is_active (out));
+  g_assert (cockpit_fd_watch_is_active (tc->watch));
+  g_assert_cmpint (tc->count, ==, 0);
+
+  g_assert_cmpint (write (tc->fds[1], "x", 1), ==, 1);
+  while (tc->count == 0)
+    g_main_context_iteration (NULL, TRUE);
+  drain (tc->fds[0]);
+  g_assert_cmpint (other.count, ==, 1);
+
+  /* Freeing one direction leaves the other working */
+  cockpit_fd_watch_free (out);
+  g_assert_cmpint (write (tc->fds[1], "y", 1), ==, 1);
+  while (tc->count == 1)
+    g_main_context_iteration (NULL, TRUE);
+  drain (tc->fds[0]);
+}
+
+static gboolean
+on_ready_free (gint fd,
+               GIOCondition cond,
+               gpointer user_data)
+{
+  TestCase *tc = user_data;
+  tc->count++;
+  cockpit_fd_watch_free (tc->watch);
+  tc->watch = NULL;
+  return TRUE;
+}
+
+static void
+test_free_in_callback (TestCase *tc,
+                       gconstpointer data)
+{
+  tc->watch = cockpit_fd_watch_new (NULL, tc->fds[0], G_IO_IN, "test", on_ready_free, tc);
+  cockpit_fd_watch_start (tc->watch);
+
+  g_assert_cmpint (write (tc->fds[1], "x", 1), ==, 1);
+  while (tc->count == 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert (tc->watch == NULL);
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpint (tc->count, ==, 1);
+}
+
+static void
+test_hangup_stopped (TestCase *tc,
+                     gconstpointer data)
+{
+  gint dispatched = 0;
+  gint i;
+
+  tc->watch = cockpit_fd_watch_new (NULL, tc->fds[0], G_IO_IN, "test", on_ready_count, tc);
+  cockpit_fd_watch_start (tc->watch);
+  cockpit_fd_watch_stop (tc->watch);
+
+  /* A hangup on a stopped watch must neither dispatch nor spin */
+  close (tc->fds[1]);
+  tc->fds[1] = -1;
+
+  for (i = 0; i < 10; i++)
+    {
+      if (g_main_context_iteration (NULL, FALSE))
+        dispatched++;
+    }
+  g_assert_cmpint (dispatched, <=, 1);
+  g_assert_cmpint (tc->count, ==, 0);
+
+  cockpit_fd_watch_start (tc->watch);
+  while (tc->count == 0)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_fd_watch_stop (tc->watch);
+}
+
+/*
+ * Many idle pipes and one busy one. Each round trip writes a byte out
+ * through the busy pipe, echoes it back, and waits for the pipe to read
+ * it. The output side of the pipe is started and stopped on every round,
+ * which is where a GSource per watch costs the most.
+ */
+
+#define PERF_IDLE 400
+#define PERF_ROUNDS 20000
+
+static void
+on_perf_read (CockpitPipe *pipe,
+              GByteArray *buffer,
+              gboolean eof,
+              gpointer user_data)
+{
+  gint *count = user_data;
+  *count += buffer->len;
+  g_byte_array_set_size (buffer, 0);
+}
+
+static gdouble
+perf_round_trips (gboolean no_epoll)
+{
+  CockpitPipe *idle[PERF_IDLE];
+  CockpitPipe *busy;
+  GBytes *bytes;
+  gdouble elapsed;
+  gint count = 0;
+  gchar ch;
+  int fds[2];
+  int i;
+
+  if (no_epoll)
+    g_setenv ("COCKPIT_NO_EPOLL", "1", TRUE);
+  else
+    g_unsetenv ("COCKPIT_NO_EPOLL");
+
+  for (i = 0; i < PERF_IDLE; i++)
+    {
+      g_assert_cmpint (pipe (fds), ==, 0);
+      idle[i] = cockpit_pipe_new ("idle", fds[0], fds[1]);
+    }
+
+  g_assert_cmpint (socketpair (AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+  busy = cockpit_pipe_new ("busy", fds[0], fds[0]);
+  g_signal_connect (busy, "read", G_CALLBACK (on_perf_read), &count);
+  bytes = g_bytes_new_static ("x", 1);
+
+  g_test_timer_start ();
+  for (i = 0; i < PERF_ROUNDS; i++)
+    {
+      cockpit_pipe_write (busy, bytes);
+      while (recv (fds[1], &ch, 1, MSG_DONTWAIT) != 1)
+        g_main_context_iteration (NULL, TRUE);
+      g_assert_cmpint (send (fds[1], &ch, 1, 0), ==, 1);
+      while (count <= i)
+        g_main_context_iteration (NULL, TRUE);
+    }
+  elapsed = g_test_timer_elapsed ();
+
+  g_bytes_unref (bytes);
+  g_object_unref (busy);
+  close (fds[1]);
+  for (i = 0; i < PERF_IDLE; i++)
+    g_object_unref (idle[i]);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  g_unsetenv ("COCKPIT_NO_EPOLL");
+  return elapsed;
+}
+
+static void
+test_perf_wakeups (void)
+{
+  gdouble sources, epoll;
+
+  if (!g_test_perf ())
+    return;
+
+  sources = perf_round_trips (TRUE);
+  epoll = perf_round_trips (FALSE);
+
+  g_test_message ("%d round trips with %d idle pipes: %.3fs with sources, %.3fs with epoll",
+                  PERF_ROUNDS, PERF_IDLE, sources, epoll);
+  g_test_minimized_result (epoll * 1000000 / PERF_ROUNDS,
+                           "%.2f microseconds per round trip", epoll * 1000000 / PERF_ROUNDS);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/fdwatch/epoll/readable", TestCase, &fixture_epoll,
+              setup, test_readable, teardown);
+  g_test_add ("/fdwatch/epoll/return-false", TestCase, &fixture_epoll,
+              setup, test_return_false, teardown);
+  g_test_add ("/fdwatch/epoll/shared-fd", TestCase, &fixture_epoll,
+              setup, test_shared_fd, teardown);
+  g_test_add ("/fdwatch/epoll/free-in-callback", TestCase, &fixture_epoll,
+              setup, test_free_in_callback, teardown);
+  g_test_add ("/fdwatch/epoll/hangup-stopped", TestCase, &fixture_epoll,
+              setup, test_hangup_stopped, teardown);
+
+  g_test_add ("/fdwatch/source/readable", TestCase, &fixture_no_epoll,
+              setup, test_readable, teardown);
+  g_test_add ("/fdwatch/source/return-false", TestCase, &fixture_no_epoll,
+              setup, test_return_false, teardown);
+  g_test_add ("/fdwatch/source/shared-fd", TestCase, &fixture_no_epoll,
+              setup, test_shared_fd, teardown);
+  g_test_add ("/fdwatch/source/free-in-callback", TestCase, &fixture_no_epoll,
+              setup, test_free_in_callback, teardown);
+  g_test_add ("/fdwatch/source/hangup-stopped", TestCase, &fixture_no_epoll,
+              setup, test_hangup_stopped, teardown);
+
+  g_test_add_func ("/fdwatch/perf/wakeups", test_perf_wakeups);
+
+  return g_test_run ();
+}
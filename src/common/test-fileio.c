@@ -0,0 +1,393 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include "cockpitfileio.h"
+#include "cockpitflow.h"
+#include "cockpittest.h"
+
+#include "mock-pressure.h"
+
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+  gchar *directory;
+  gchar *path;
+  CockpitFileIO *io;
+  GByteArray *received;
+  gint blocks;
+  gboolean done;
+  gint error;
+  gchar *diagnostic;
+  gboolean pressure;
+  gint pressures;
+} TestCase;
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  GError *error = NULL;
+
+  tc->directory = g_dir_make_tmp ("test-cockpit-fileio.XXXXXX", &error);
+  g_assert_no_error (error);
+  tc->path = g_build_filename (tc->directory, "file", NULL);
+  tc->received = g_byte_array_new ();
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  if (tc->io)
+    {
+      g_object_add_weak_pointer (G_OBJECT (tc->io), (gpointer *)&tc->io);
+      g_object_unref (tc->io);
+
+      /* Any running operation still holds a reference */
+      while (tc->io)
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+  g_byte_array_unref (tc->received);
+  g_unlink (tc->path);
+  g_rmdir (tc->directory);
+  g_free (tc->path);
+  g_free (tc->directory);
+  g_free (tc->diagnostic);
+
+  cockpit_assert_expected ();
+}
+
+static GBytes *
+pattern_bytes (gsize length,
+               guint seed)
+{
+  guchar *data;
+  gsize i;
+
+  data = g_malloc (length);
+  for (i = 0; i < length; i++)
+    data[i] = (i * 7 + seed) & 0xFF;
+  return g_bytes_new_take (data, length);
+}
+
+static void
+on_read (CockpitFileIO *io,
+         GBytes *block,
+         gpointer user_data)
+{
+  TestCase *tc = user_data;
+  g_byte_array_append (tc->received, g_bytes_get_data (block, NULL), g_bytes_get_size (block));
+  tc->blocks++;
+}
+
+static void
+on_done (CockpitFileIO *io,
+         gint error,
+         const gchar *diagnostic,
+         gpointer user_data)
+{
+  TestCase *tc = user_data;
+  g_assert (!tc->done);
+  tc->done = TRUE;
+  tc->error = error;
+  tc->diagnostic = g_strdup (diagnostic);
+}
+
+static void
+on_pressure (CockpitFlow *flow,
+             gboolean pressure,
+             gpointer user_data)
+{
+  TestCase *tc = user_data;
+  tc->pressure = pressure;
+  tc->pressures++;
+}
+
+static CockpitFileIO *
+open_io (TestCase *tc,
+         gint flags)
+{
+  gint fd;
+
+  fd = g_open (tc->path, flags | O_CLOEXEC, 0666);
+  g_assert_cmpint (fd, >=, 0);
+
+  tc->io = cockpit_file_io_new ("test", fd);
+  g_signal_connect (tc->io, "read", G_CALLBACK (on_read), tc);
+  g_signal_connect (tc->io, "done", G_CALLBACK (on_done), tc);
+  g_signal_connect (tc->io, "pressure", G_CALLBACK (on_pressure), tc);
+  return tc->io;
+}
+
+static void
+wait_done (TestCase *tc)
+{
+  while (!tc->done)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_read (TestCase *tc,
+           gconstpointer data)
+{
+  GBytes *content;
+  GError *error = NULL;
+
+  content = pattern_bytes (1024 * 1024 + 11, 3);
+  g_file_set_contents (tc->path, g_bytes_get_data (content, NULL), g_bytes_get_size (content), &error);
+  g_assert_no_error (error);
+
+  cockpit_file_io_read (open_io (tc, O_RDONLY));
+
+  /* Nothing happens until the main loop runs */
+  g_assert_cmpint (tc->blocks, ==, 0);
+
+  wait_done (tc);
+  g_assert_cmpint (tc->error, ==, 0);
+  g_assert (tc->diagnostic == NULL);
+  g_assert_cmpint (tc->blocks, >, 1);
+  g_assert_cmpuint (tc->received->len, ==, g_bytes_get_size (content));
+  g_assert (memcmp (tc->received->data, g_bytes_get_data (content, NULL), tc->received->len) == 0);
+
+  g_bytes_unref (content);
+}
+
+static void
+test_read_empty (TestCase *tc,
+                 gconstpointer data)
+{
+  GError *error = NULL;
+
+  g_file_set_contents (tc->path, "", 0, &error);
+  g_assert_no_error (error);
+
+  cockpit_file_io_read (open_io (tc, O_RDONLY));
+  wait_done (tc);
+
+  g_assert_cmpint (tc->error, ==, 0);
+  g_assert_cmpint (tc->blocks, ==, 0);
+}
+
+static void
+on_read_throttle (CockpitFileIO *io,
+                  GBytes *block,
+                  gpointer user_data)
+{
+  CockpitFlow *pressure = user_data;
+  cockpit_flow_emit_pressure (pressure, TRUE);
+}
+
+static void
+test_read_throttle (TestCase *tc,
+                    gconstpointer data)
+{
+  CockpitFlow *pressure = mock_pressure_new ();
+  GBytes *content;
+  GError *error = NULL;
+  gint blocks;
+  gint i;
+
+  content = pattern_bytes (4 * 1024 * 1024, 5);
+  g_file_set_contents (tc->path, g_bytes_get_data (content, NULL), g_bytes_get_size (content), &error);
+  g_assert_no_error (error);
+
+  open_io (tc, O_RDONLY);
+  cockpit_flow_throttle (COCKPIT_FLOW (tc->io), pressure);
+  g_signal_connect (tc->io, "read", G_CALLBACK (on_read_throttle), pressure);
+  cockpit_file_io_read (tc->io);
+
+  while (tc->blocks == 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* At most the block that was read ahead arrives */
+  for (i = 0; i < 20; i++)
+    {
+      g_usleep (1000);
+      while (g_main_context_iteration (NULL, FALSE));
+    }
+  g_assert_cmpint (tc->blocks, <=, 2);
+  g_assert (!tc->done);
+
+  /* Relieving the pressure reads the rest */
+  blocks = tc->blocks;
+  g_signal_handlers_disconnect_by_func (tc->io, on_read_throttle, pressure);
+  cockpit_flow_emit_pressure (pressure, FALSE);
+  wait_done (tc);
+
+  g_assert_cmpint (tc->error, ==, 0);
+  g_assert_cmpint (tc->blocks, >, blocks);
+  g_assert_cmpuint (tc->received->len, ==, g_bytes_get_size (content));
+  g_assert (memcmp (tc->received->data, g_bytes_get_data (content, NULL), tc->received->len) == 0);
+
+  g_bytes_unref (content);
+  g_object_unref (pressure);
+}
+
+static void
+test_write (TestCase *tc,
+            gconstpointer data)
+{
+  GByteArray *expected;
+  GBytes *block;
+  GError *error = NULL;
+  gchar *contents;
+  gsize length;
+  guint i;
+
+  expected = g_byte_array_new ();
+  open_io (tc, O_WRONLY | O_CREAT | O_TRUNC);
+
+  for (i = 0; i < 50; i++)
+    {
+      block = pattern_bytes (10000 + i, i);
+      g_byte_array_append (expected, g_bytes_get_data (block, NULL), g_bytes_get_size (block));
+      cockpit_file_io_write (tc->io, block);
+      g_bytes_unref (block);
+    }
+
+  cockpit_file_io_finish (tc->io);
+  wait_done (tc);
+
+  g_assert_cmpint (tc->error, ==, 0);
+  g_assert_cmpuint (cockpit_file_io_get_queued (tc->io), ==, 0);
+
+  g_file_get_contents (tc->path, &contents, &length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (length, ==, expected->len);
+  g_assert (memcmp (contents, expected->data, length) == 0);
+
+  g_byte_array_unref (expected);
+  g_free (contents);
+}
+
+static void
+test_write_pressure (TestCase *tc,
+                     gconstpointer data)
+{
+  GBytes *block;
+  guint i;
+
+  open_io (tc, O_WRONLY | O_CREAT | O_TRUNC);
+  block = pattern_bytes (64 * 1024, 1);
+
+  /* Queue more than the write-behind limit without running the loop */
+  for (i = 0; i < 128; i++)
+    cockpit_file_io_write (tc->io, block);
+
+  g_assert (tc->pressure);
+  g_assert_cmpint (tc->pressures, ==, 1);
+  g_assert_cmpuint (cockpit_file_io_get_queued (tc->io), >=, 4 * 1024 * 1024);
+
+  cockpit_file_io_finish (tc->io);
+  wait_done (tc);
+
+  /* The pressure was released as the queue drained */
+  g_assert_cmpint (tc->error, ==, 0);
+  g_assert (!tc->pressure);
+  g_assert_cmpint (tc->pressures, ==, 2);
+  g_assert_cmpuint (cockpit_file_io_get_queued (tc->io), ==, 0);
+
+  g_bytes_unref (block);
+}
+
+static void
+test_write_error (TestCase *tc,
+                  gconstpointer data)
+{
+  GBytes *block;
+  GError *error = NULL;
+
+  g_file_set_contents (tc->path, "", 0, &error);
+  g_assert_no_error (error);
+
+  open_io (tc, O_RDONLY);
+
+  block = g_bytes_new_static ("blah", 4);
+  cockpit_file_io_write (tc->io, block);
+  cockpit_file_io_write (tc->io, block);
+  cockpit_file_io_finish (tc->io);
+  g_bytes_unref (block);
+
+  wait_done (tc);
+  g_assert_cmpint (tc->error, ==, EBADF);
+  g_assert_cmpstr (tc->diagnostic, ==, "couldn't write");
+
+  /* Queued operations were dropped */
+  g_assert_cmpuint (cockpit_file_io_get_queued (tc->io), ==, 0);
+}
+
+static void
+test_close_running (TestCase *tc,
+                    gconstpointer data)
+{
+  GBytes *content;
+  GError *error = NULL;
+  gint i;
+
+  content = pattern_bytes (1024 * 1024, 9);
+  g_file_set_contents (tc->path, g_bytes_get_data (content, NULL), g_bytes_get_size (content), &error);
+  g_assert_no_error (error);
+  g_bytes_unref (content);
+
+  cockpit_file_io_read (open_io (tc, O_RDONLY));
+  cockpit_file_io_close (tc->io);
+
+  /* Nothing is emitted after closing */
+  for (i = 0; i < 20; i++)
+    {
+      g_usleep (1000);
+      while (g_main_context_iteration (NULL, FALSE));
+    }
+
+  g_assert_cmpint (tc->blocks, ==, 0);
+  g_assert (!tc->done);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/fileio/read", TestCase, NULL,
+              setup, test_read, teardown);
+  g_test_add ("/fileio/read-empty", TestCase, NULL,
+              setup, test_read_empty, teardown);
+  g_test_add ("/fileio/read-throttle", TestCase, NULL,
+              setup, test_read_throttle, teardown);
+  g_test_add ("/fileio/write", TestCase, NULL,
+              setup, test_write, teardown);
+  g_test_add ("/fileio/write-pressure", TestCase, NULL,
+              setup, test_write_pressure, teardown);
+  g_test_add ("/fileio/write-error", TestCase, NULL,
+              setup, test_write_error, teardown);
+  g_test_add ("/fileio/close-running", TestCase, NULL,
+              setup, test_close_running, teardown);
+
+  return g_test_run ();
+}
@@ -853,6 +853,37 @@ test_spawn_and_fail (void)
   g_object_unref (pipe);
 }
 
+static void
+test_spawn_path_from_env (void)
+{
+  gchar *problem = NULL;
+  CockpitPipe *pipe;
+
+  const gchar *argv[] = { "true", NULL };
+  const gchar *env[] = { "PATH=/non-existent", NULL };
+
+  /* The PATH in the child environment is used for the search */
+  pipe = cockpit_pipe_spawn (argv, env, NULL, COCKPIT_PIPE_FLAGS_NONE);
+  g_assert (pipe != NULL);
+  g_signal_connect (pipe, "close", G_CALLBACK (on_close_get_problem), &problem);
+
+  while (problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (problem, ==, "not-found");
+  g_free (problem);
+  g_object_unref (pipe);
+}
+
+static void
+test_spawn_no_vfork (void)
+{
+  g_setenv ("COCKPIT_NO_VFORK", "1", TRUE);
+  test_spawn_and_read ();
+  test_spawn_and_fail ();
+  g_unsetenv ("COCKPIT_NO_VFORK");
+}
+
 static void
 test_spawn_close_terminate (TestCase *tc,
                             gconstpointer unused)
@@ -905,6 +936,29 @@ test_spawn_close_clean (TestCase *tc,
   g_object_unref (pipe);
 }
 
+static void
+test_spawn_stderr_to_stdout (void)
+{
+  gboolean closed = FALSE;
+  GByteArray *buffer;
+  CockpitPipe *pipe;
+
+  const gchar *argv[] = { "/bin/sh", "-c", "echo output; echo error >&2", NULL };
+
+  pipe = cockpit_pipe_spawn (argv, NULL, NULL, COCKPIT_PIPE_STDERR_TO_STDOUT);
+  g_assert (pipe != NULL);
+  g_signal_connect (pipe, "close", G_CALLBACK (on_close_get_flag), &closed);
+
+  while (closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+
+  buffer = cockpit_pipe_get_buffer (pipe);
+  g_byte_array_append (buffer, (const guint8 *)"\0", 1);
+  g_assert_cmpstr ((gchar *)buffer->data, ==, "output\nerror\n");
+
+  g_object_unref (pipe);
+}
+
 static void
 test_spawn_and_buffer_stderr (void)
 {
@@ -1278,6 +1332,64 @@ test_get_environ_null (void)
   g_strfreev (environ);
 }
 
+/*
+ * Spawning from a process with a large address space, like a bridge
+ * that has been running for a while. Compare with $COCKPIT_NO_VFORK
+ * to see what fork() costs.
+ */
+
+#define PERF_BALLAST (500UL * 1024UL * 1024UL)
+#define PERF_SPAWNS 200
+
+static gdouble
+perf_spawn_many (void)
+{
+  const gchar *argv[] = { "/bin/true", NULL };
+  gboolean closed;
+  CockpitPipe *pipe;
+  gint i;
+
+  g_test_timer_start ();
+  for (i = 0; i < PERF_SPAWNS; i++)
+    {
+      closed = FALSE;
+      pipe = cockpit_pipe_spawn (argv, NULL, NULL, COCKPIT_PIPE_FLAGS_NONE);
+      g_signal_connect (pipe, "close", G_CALLBACK (on_close_get_flag), &closed);
+      while (!closed)
+        g_main_context_iteration (NULL, TRUE);
+      g_object_unref (pipe);
+    }
+
+  return g_test_timer_elapsed ();
+}
+
+static void
+test_perf_spawn (void)
+{
+  gdouble vfork, fork;
+  gchar *ballast;
+
+  if (!g_test_perf ())
+    return;
+
+  /* Touch every page, so that it's all mapped */
+  ballast = g_malloc (PERF_BALLAST);
+  memset (ballast, 0xAA, PERF_BALLAST);
+
+  vfork = perf_spawn_many ();
+
+  g_setenv ("COCKPIT_NO_VFORK", "1", TRUE);
+  fork = perf_spawn_many ();
+  g_unsetenv ("COCKPIT_NO_VFORK");
+
+  g_free (ballast);
+
+  g_test_message ("%d spawns with %lu MB resident: %.3fs with fork, %.3fs with vfork",
+                  PERF_SPAWNS, PERF_BALLAST / (1024 * 1024), fork, vfork);
+  g_test_minimized_result (vfork * 1000000 / PERF_SPAWNS,
+                           "%.1f microseconds per spawn", vfork * 1000000 / PERF_SPAWNS);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -1333,6 +1445,10 @@ main (int argc,
   g_test_add_func ("/pipe/spawn/and-write", test_spawn_and_write);
   g_test_add_func ("/pipe/spawn/and-fail", test_spawn_and_fail);
   g_test_add_func ("/pipe/spawn/buffer-stderr", test_spawn_and_buffer_stderr);
+  g_test_add_func ("/pipe/spawn/stderr-to-stdout", test_spawn_stderr_to_stdout);
+  g_test_add_func ("/pipe/spawn/path-from-env", test_spawn_path_from_env);
+  g_test_add_func ("/pipe/spawn/no-vfork", test_spawn_no_vfork);
+  g_test_add_func ("/pipe/perf/spawn", test_perf_spawn);
 
   g_test_add ("/pipe/spawn/close-clean", TestCase, NULL,
               setup_timeout, test_spawn_close_clean, teardown);
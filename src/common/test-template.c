@@ -24,7 +24,10 @@
 
 #include "common/cockpittest.h"
 
+#include <glib/gstdio.h>
+
 #include <string.h>
+#include <sys/stat.h>
 
 typedef struct {
     GHashTable *variables;
@@ -120,6 +123,125 @@ test_expand (TestCase *tc,
   g_list_free_full (output, (GDestroyNotify)g_bytes_unref);
 }
 
+static void
+test_render (TestCase *tc,
+             gconstpointer data)
+{
+  const Fixture *fixture = data;
+  CockpitTemplate *template;
+  GBytes *input;
+  GList *output;
+  GList *l;
+  int i, round;
+
+  input = g_bytes_new_static (fixture->input, strlen (fixture->input));
+  template = cockpit_template_new (input, fixture->start, fixture->end);
+  g_bytes_unref (input);
+
+  /* The same parsed template expands the same way each time */
+  for (round = 0; round < 2; round++)
+    {
+      output = cockpit_template_render (template, lookup_table, tc->variables);
+
+      for (i = 0, l = output; l && fixture->output[i] != NULL; i++, l = g_list_next (l))
+        cockpit_assert_bytes_eq (l->data, fixture->output[i], -1);
+      g_assert_cmpint (g_list_length (output), ==, i);
+
+      g_list_free_full (output, (GDestroyNotify)g_bytes_unref);
+    }
+
+  cockpit_template_unref (template);
+}
+
+static gchar *
+render_string (CockpitTemplate *template,
+               TestCase *tc)
+{
+  GString *result = g_string_new ("");
+  GList *output;
+
+  output = cockpit_template_render (template, lookup_table, tc->variables);
+  while (output)
+    {
+      g_string_append_len (result, g_bytes_get_data (output->data, NULL), g_bytes_get_size (output->data));
+      g_bytes_unref (output->data);
+      output = g_list_delete_link (output, output);
+    }
+
+  return g_string_free (result, FALSE);
+}
+
+static void
+test_load (TestCase *tc,
+           gconstpointer data)
+{
+  CockpitTemplate *one;
+  CockpitTemplate *two;
+  GError *error = NULL;
+  gchar *directory;
+  gchar *filename;
+  gchar *result;
+
+  directory = g_dir_make_tmp ("test-cockpit-template.XXXXXX", &error);
+  g_assert_no_error (error);
+  filename = g_build_filename (directory, "index.html", NULL);
+
+  g_file_set_contents (filename, "Oh ${oh} says ${Scruffy}", -1, &error);
+  g_assert_no_error (error);
+
+  one = cockpit_template_load (filename, "${", "}", &error);
+  g_assert_no_error (error);
+  result = render_string (one, tc);
+  g_assert_cmpstr (result, ==, "Oh marmalade says janitor");
+  g_free (result);
+
+  /* Unchanged files are only parsed once */
+  two = cockpit_template_load (filename, "${", "}", &error);
+  g_assert_no_error (error);
+  g_assert (one == two);
+  cockpit_template_unref (two);
+
+  /* But not shared with different markers */
+  two = cockpit_template_load (filename, "@@", "@@", &error);
+  g_assert_no_error (error);
+  g_assert (one != two);
+  cockpit_template_unref (two);
+
+  /* A change to the file is noticed */
+  g_file_set_contents (filename, "The ${Scruffy} is ${unknown}", -1, &error);
+  g_assert_no_error (error);
+
+  two = cockpit_template_load (filename, "${", "}", &error);
+  g_assert_no_error (error);
+  g_assert (one != two);
+  result = render_string (two, tc);
+  g_assert_cmpstr (result, ==, "The janitor is ${unknown}");
+  g_free (result);
+  cockpit_template_unref (two);
+
+  /* The old template still works for whoever holds it */
+  result = render_string (one, tc);
+  g_assert_cmpstr (result, ==, "Oh marmalade says janitor");
+  g_free (result);
+  cockpit_template_unref (one);
+
+  g_assert_cmpint (g_unlink (filename), ==, 0);
+
+  one = cockpit_template_load (filename, "${", "}", &error);
+  g_assert (one == NULL);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+  g_clear_error (&error);
+
+  one = cockpit_template_load (directory, "${", "}", &error);
+  g_assert (one == NULL);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_ISDIR);
+  g_clear_error (&error);
+
+  g_assert_cmpint (g_rmdir (directory), ==, 0);
+  g_free (filename);
+  g_free (directory);
+}
+
 static void
 test_json (TestCase *tc,
            gconstpointer data)
@@ -178,6 +300,119 @@ test_json (TestCase *tc,
   g_assert (json_object_equal (at_bracket_results, expected_both));
 }
 
+#define PERF_ROUNDS 1000
+
+static GBytes *
+perf_document (void)
+{
+  GString *document = g_string_new ("<!DOCTYPE html>\n<html>\n<head>\n");
+  int i;
+
+  /* Something like a shell index.html, but with a lot more markup */
+  for (i = 0; i < 2000; i++)
+    {
+      g_string_append_printf (document, "<link href=\"../${oh}/style-%d.css\" rel=\"stylesheet\">\n"
+                              "<div class=\"pf-c-page__main\" id=\"item-%d\">No variables here at all</div>\n", i, i);
+    }
+  g_string_append (document, "</head>\n<body>${Scruffy}</body>\n</html>\n");
+
+  return g_string_free_to_bytes (document);
+}
+
+static gsize
+perf_consume (GList *output)
+{
+  gsize length = 0;
+
+  while (output)
+    {
+      length += g_bytes_get_size (output->data);
+      g_bytes_unref (output->data);
+      output = g_list_delete_link (output, output);
+    }
+
+  return length;
+}
+
+static void
+test_perf_render (TestCase *tc,
+                  gconstpointer data)
+{
+  CockpitTemplate *template;
+  GBytes *input;
+  gdouble expand;
+  gdouble render;
+  gsize length = 0;
+  int i;
+
+  input = perf_document ();
+
+  g_test_timer_start ();
+  for (i = 0; i < PERF_ROUNDS; i++)
+    length += perf_consume (cockpit_template_expand (input, "${", "}", lookup_table, tc->variables));
+  expand = g_test_timer_elapsed ();
+
+  template = cockpit_template_new (input, "${", "}");
+  g_test_timer_start ();
+  for (i = 0; i < PERF_ROUNDS; i++)
+    length -= perf_consume (cockpit_template_render (template, lookup_table, tc->variables));
+  render = g_test_timer_elapsed ();
+  cockpit_template_unref (template);
+
+  g_assert_cmpuint (length, ==, 0);
+
+  g_test_message ("%d expansions of a %d byte document: %.3fs parsing each time, %.3fs parsed once",
+                  PERF_ROUNDS, (int)g_bytes_get_size (input), expand, render);
+  g_test_minimized_result (render * 1000000 / PERF_ROUNDS,
+                           "%.2f microseconds per expansion", render * 1000000 / PERF_ROUNDS);
+
+  g_bytes_unref (input);
+}
+
+static void
+test_perf_json (TestCase *tc,
+                gconstpointer data)
+{
+  JsonObject *manifests;
+  JsonObject *manifest;
+  JsonObject *expanded;
+  gchar *name;
+  gdouble elapsed;
+  int i, j;
+
+  /* Lots of packages, each with a fair number of strings */
+  manifests = json_object_new ();
+  for (i = 0; i < 200; i++)
+    {
+      manifest = json_object_new ();
+      for (j = 0; j < 50; j++)
+        {
+          name = g_strdup_printf ("key-%d", j);
+          if (j % 10 == 0)
+            json_object_set_string_member (manifest, name, "${oh}/libexec/program --option ${Scruffy}");
+          else
+            json_object_set_string_member (manifest, name, "A label that has no variables in it at all");
+          g_free (name);
+        }
+      name = g_strdup_printf ("package-%d", i);
+      json_object_set_object_member (manifests, name, manifest);
+      g_free (name);
+    }
+
+  g_test_timer_start ();
+  for (i = 0; i < PERF_ROUNDS / 10; i++)
+    {
+      expanded = cockpit_template_expand_json (manifests, "${", "}", lookup_table, tc->variables);
+      json_object_unref (expanded);
+    }
+  elapsed = g_test_timer_elapsed ();
+
+  g_test_minimized_result (elapsed * 1000000 / (PERF_ROUNDS / 10),
+                           "%.2f microseconds per manifests expansion", elapsed * 1000000 / (PERF_ROUNDS / 10));
+
+  json_object_unref (manifests);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -194,7 +429,21 @@ main (int argc,
       g_free (name);
     }
 
+  for (i = 0; i < G_N_ELEMENTS (expand_fixtures); i++)
+    {
+      name = g_strdup_printf ("/template/render/%s", expand_fixtures[i].name);
+      g_test_add (name, TestCase, expand_fixtures + i, setup, test_render, teardown);
+      g_free (name);
+    }
+
   g_test_add ("/template/expand/json", TestCase, NULL, setup, test_json, teardown);
+  g_test_add ("/template/load", TestCase, NULL, setup, test_load, teardown);
+
+  if (g_test_perf ())
+    {
+      g_test_add ("/template/perf/render", TestCase, NULL, setup, test_perf_render, teardown);
+      g_test_add ("/template/perf/json", TestCase, NULL, setup, test_perf_json, teardown);
+    }
 
   return g_test_run ();
 }
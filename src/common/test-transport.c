@@ -23,12 +23,14 @@
 #include "cockpitpipe.h"
 #include "cockpitpipetransport.h"
 
+#include "common/cockpitjson.h"
 #include "common/cockpittest.h"
 #include "common/mock-transport.h"
 
 #include "websocket/websocket.h"
 
 #include <glib.h>
+#include <glib-unix.h>
 
 #include <string.h>
 
@@ -249,6 +251,198 @@ test_ping_channel (void)
   g_object_unref (mock);
 }
 
+static gboolean
+on_recv_log (CockpitTransport *transport,
+             const gchar *channel,
+             GBytes *payload,
+             gpointer user_data)
+{
+  GString *log = user_data;
+
+  /* Control messages are parsed by the default handler */
+  if (!channel)
+    return FALSE;
+
+  g_string_append_printf (log, "%s:%.*s ", channel, (gint)g_bytes_get_size (payload),
+                          (const gchar *)g_bytes_get_data (payload, NULL));
+  return TRUE;
+}
+
+static gboolean
+on_control_log (CockpitTransport *transport,
+                const gchar *command,
+                const gchar *channel,
+                JsonObject *options,
+                GBytes *payload,
+                gpointer user_data)
+{
+  GString *log = user_data;
+  const gchar *problem = NULL;
+
+  cockpit_json_get_string (options, "problem", NULL, &problem);
+  g_string_append_printf (log, "%s:%s%s%s ", channel, command, problem ? "/" : "", problem ? problem : "");
+  return TRUE;
+}
+
+static void
+emit_frozen (CockpitTransport *transport,
+             const gchar *channel,
+             const gchar *string)
+{
+  GBytes *sent;
+
+  if (g_str_has_prefix (string, "!"))
+    {
+      sent = cockpit_transport_build_control ("command", string + 1, "channel", channel, NULL);
+      cockpit_transport_emit_recv (transport, NULL, sent);
+    }
+  else
+    {
+      sent = g_bytes_new (string, strlen (string));
+      cockpit_transport_emit_recv (transport, channel, sent);
+    }
+  g_bytes_unref (sent);
+}
+
+static void
+test_freeze_order (void)
+{
+  CockpitTransport *transport;
+  GString *log;
+
+  transport = COCKPIT_TRANSPORT (mock_transport_new ());
+  log = g_string_new ("");
+  g_signal_connect (transport, "recv", G_CALLBACK (on_recv_log), log);
+  g_signal_connect (transport, "control", G_CALLBACK (on_control_log), log);
+
+  cockpit_transport_freeze (transport, "a");
+  cockpit_transport_freeze (transport, "b");
+
+  emit_frozen (transport, "a", "!open");
+  emit_frozen (transport, "b", "!open");
+  emit_frozen (transport, "a", "one");
+  emit_frozen (transport, "c", "other");
+  emit_frozen (transport, "b", "two");
+  emit_frozen (transport, "a", "three");
+  emit_frozen (transport, "b", "!done");
+  emit_frozen (transport, "a", "four");
+
+  g_assert_cmpstr (log->str, ==, "c:other ");
+  g_string_truncate (log, 0);
+
+  cockpit_transport_thaw (transport, "b");
+  g_assert_cmpstr (log->str, ==, "b:open b:two b:done ");
+  g_string_truncate (log, 0);
+
+  /* Thawing twice, or something never frozen, does nothing */
+  cockpit_transport_thaw (transport, "b");
+  cockpit_transport_thaw (transport, "c");
+  g_assert_cmpstr (log->str, ==, "");
+
+  emit_frozen (transport, "b", "five");
+  cockpit_transport_thaw (transport, "a");
+  g_assert_cmpstr (log->str, ==, "b:five a:open a:one a:three a:four ");
+
+  g_string_free (log, TRUE);
+  g_object_unref (transport);
+}
+
+static void
+test_freeze_overflow (void)
+{
+  CockpitTransport *transport;
+  GBytes *block;
+  GString *log;
+  gint i;
+
+  cockpit_expect_message ("a: too much data queued while channel is frozen");
+
+  transport = COCKPIT_TRANSPORT (mock_transport_new ());
+  log = g_string_new ("");
+  g_signal_connect (transport, "recv", G_CALLBACK (on_recv_log), log);
+  g_signal_connect (transport, "control", G_CALLBACK (on_control_log), log);
+
+  cockpit_transport_freeze (transport, "a");
+  emit_frozen (transport, "a", "!open");
+
+  block = g_bytes_new_take (g_strnfill (1024 * 1024, 'x'), 1024 * 1024);
+  for (i = 0; i < 20; i++)
+    cockpit_transport_emit_recv (transport, "a", block);
+  g_bytes_unref (block);
+
+  emit_frozen (transport, "a", "!done");
+
+  /* The data is gone, and whoever handles the channel is told to close it */
+  cockpit_transport_thaw (transport, "a");
+  g_assert_cmpstr (log->str, ==, "a:open a:done a:close/internal-error ");
+
+  g_string_free (log, TRUE);
+  g_object_unref (transport);
+
+  cockpit_assert_expected ();
+}
+
+static gboolean
+on_recv_count (CockpitTransport *transport,
+               const gchar *channel,
+               GBytes *payload,
+               gpointer user_data)
+{
+  guint *count = user_data;
+  if (!channel)
+    return FALSE;
+  (*count)++;
+  return TRUE;
+}
+
+static void
+test_freeze_many (void)
+{
+  CockpitTransport *transport;
+  gchar *channels[1000];
+  guint count = 0;
+  GBytes *sent;
+  gint64 start;
+  guint i, j;
+
+  transport = COCKPIT_TRANSPORT (mock_transport_new ());
+  g_signal_connect (transport, "recv", G_CALLBACK (on_recv_count), &count);
+
+  /* Like a page load starting many channels on a peer that isn't ready yet */
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    {
+      channels[i] = g_strdup_printf ("%d", i);
+      cockpit_transport_freeze (transport, channels[i]);
+    }
+
+  sent = g_bytes_new_static ("message", 7);
+  for (j = 0; j < 100; j++)
+    {
+      for (i = 0; i < G_N_ELEMENTS (channels); i++)
+        cockpit_transport_emit_recv (transport, channels[i], sent);
+    }
+  g_bytes_unref (sent);
+
+  g_assert_cmpuint (count, ==, 0);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    cockpit_transport_thaw (transport, channels[i]);
+
+  g_assert_cmpuint (count, ==, G_N_ELEMENTS (channels) * 100);
+
+  if (g_test_perf ())
+    {
+      g_test_minimized_result ((g_get_monotonic_time () - start) / 1000.0,
+                               "thawing 1000 channels with 100 messages each: %.3f ms",
+                               (g_get_monotonic_time () - start) / 1000.0);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    g_free (channels[i]);
+  g_object_unref (transport);
+}
+
 static void
 test_echo_queue (TestCase *tc,
                  gconstpointer data)
@@ -311,6 +505,130 @@ test_echo_large (TestCase *tc,
 
 }
 
+typedef struct {
+  gsize bulk;
+  gsize bulk_at_echo;
+  gint64 echoed;
+} Latency;
+
+static gboolean
+on_recv_latency (CockpitTransport *transport,
+                 const gchar *channel,
+                 GBytes *message,
+                 gpointer user_data)
+{
+  Latency *latency = user_data;
+
+  if (g_strcmp0 (channel, "bulk") == 0)
+    {
+      latency->bulk += g_bytes_get_size (message);
+    }
+  else if (g_strcmp0 (channel, "terminal") == 0)
+    {
+      latency->bulk_at_echo = latency->bulk;
+      latency->echoed = g_get_monotonic_time ();
+    }
+  else
+    {
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+test_priority_latency (TestCase *tc,
+                       gconstpointer data)
+{
+  static gchar block[64 * 1024];
+  Latency latency = { 0, };
+  gsize bulk_at_send;
+  GBytes *sent;
+  gint64 start;
+  gint i;
+
+  g_signal_connect (tc->transport, "recv", G_CALLBACK (on_recv_latency), &latency);
+
+  cockpit_transport_set_priority (tc->transport, "bulk", COCKPIT_PRIORITY_LOW);
+  cockpit_transport_set_priority (tc->transport, "terminal", COCKPIT_PRIORITY_HIGH);
+
+  /* Like a 100MB fsread1 in flight */
+  memset (block, 'x', sizeof (block));
+  sent = g_bytes_new_static (block, sizeof (block));
+  for (i = 0; i < 1600; i++)
+    cockpit_transport_send (tc->transport, "bulk", sent);
+  g_bytes_unref (sent);
+
+  WAIT_UNTIL (latency.bulk > 0);
+
+  /* And now a keystroke echo on the terminal */
+  bulk_at_send = latency.bulk;
+  start = g_get_monotonic_time ();
+  sent = g_bytes_new_static ("x", 1);
+  cockpit_transport_send (tc->transport, "terminal", sent);
+  g_bytes_unref (sent);
+
+  WAIT_UNTIL (latency.echoed != 0);
+
+  /* Only what was already written or about to be, not the whole queue */
+  g_assert_cmpuint (latency.bulk_at_echo - bulk_at_send, <, 4 * 1024 * 1024);
+
+  if (g_test_perf ())
+    {
+      g_test_minimized_result ((latency.echoed - start) / 1000.0,
+                               "echo latency during bulk transfer: %.3f ms",
+                               (latency.echoed - start) / 1000.0);
+    }
+}
+
+static gboolean
+on_control_done (CockpitTransport *transport,
+                 const gchar *command,
+                 const gchar *channel,
+                 JsonObject *options,
+                 GBytes *payload,
+                 gpointer user_data)
+{
+  Latency *latency = user_data;
+
+  g_assert_cmpstr (command, ==, "done");
+  g_assert_cmpstr (channel, ==, "bulk");
+  latency->bulk_at_echo = latency->bulk;
+  latency->echoed = g_get_monotonic_time ();
+  return TRUE;
+}
+
+static void
+test_priority_control (TestCase *tc,
+                       gconstpointer data)
+{
+  static gchar block[64 * 1024];
+  const gchar *done = "{ \"command\": \"done\", \"channel\": \"bulk\" }";
+  Latency latency = { 0, };
+  GBytes *sent;
+  gint i;
+
+  g_signal_connect (tc->transport, "recv", G_CALLBACK (on_recv_latency), &latency);
+  g_signal_connect (tc->transport, "control", G_CALLBACK (on_control_done), &latency);
+
+  cockpit_transport_set_priority (tc->transport, "bulk", COCKPIT_PRIORITY_LOW);
+
+  memset (block, 'x', sizeof (block));
+  sent = g_bytes_new_static (block, sizeof (block));
+  for (i = 0; i < 160; i++)
+    cockpit_transport_send (tc->transport, "bulk", sent);
+  g_bytes_unref (sent);
+
+  /* Goes in the lane of the channel, not ahead of its data */
+  sent = g_bytes_new_static (done, strlen (done));
+  cockpit_transport_send_control (tc->transport, "bulk", sent);
+  g_bytes_unref (sent);
+
+  WAIT_UNTIL (latency.echoed != 0);
+
+  g_assert_cmpuint (latency.bulk_at_echo, ==, 160 * sizeof (block));
+}
+
 static void
 on_closed_get_problem (CockpitTransport *transport,
                        const gchar *problem,
@@ -488,6 +806,100 @@ test_read_combined (void)
   g_object_unref (transport);
 }
 
+static gboolean
+on_recv_relay (CockpitTransport *transport,
+               const gchar *channel,
+               GBytes *payload,
+               gpointer user_data)
+{
+  CockpitTransport *other = user_data;
+  GBytes *frame;
+
+  frame = cockpit_pipe_transport_peek_frame (COCKPIT_PIPE_TRANSPORT (transport));
+  g_assert (frame != NULL);
+  cockpit_transport_send_frame (other, channel, payload, frame);
+  return TRUE;
+}
+
+static void
+test_relay_frame (void)
+{
+  CockpitTransport *transport;
+  CockpitTransport *other;
+  const gchar *input;
+  GString *output;
+  gchar buffer[256];
+  gssize ret;
+  gint fds[2];
+  gint ifds[2];
+  gint ofds[2];
+  gint out;
+
+  if (pipe (fds) < 0 || pipe (ifds) < 0 || pipe (ofds) < 0)
+    g_assert_not_reached ();
+  g_assert (g_unix_set_fd_nonblocking (ofds[0], TRUE, NULL));
+
+  out = dup (2);
+  g_assert (out >= 0);
+
+  transport = cockpit_pipe_transport_new_fds ("test", fds[0], out);
+  other = cockpit_pipe_transport_new_fds ("other", ifds[0], ofds[1]);
+  g_signal_connect (transport, "recv", G_CALLBACK (on_recv_relay), other);
+
+  /* Nothing outside of the recv handler */
+  g_assert (cockpit_pipe_transport_peek_frame (COCKPIT_PIPE_TRANSPORT (transport)) == NULL);
+
+  input = "6\nfoo\nhi15\nbar\nmarmalade\n\n6\nfoo\n\0\xff";
+  g_assert_cmpint (write (fds[1], input, 34), ==, 34);
+
+  /* What comes out the other side is exactly what went in */
+  output = g_string_new ("");
+  while (output->len < 34)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      while ((ret = read (ofds[0], buffer, sizeof (buffer))) > 0)
+        g_string_append_len (output, buffer, ret);
+    }
+
+  g_assert_cmpuint (output->len, ==, 34);
+  g_assert (memcmp (output->str, input, 34) == 0);
+
+  g_string_free (output, TRUE);
+  close (fds[1]);
+  close (ifds[1]);
+  close (ofds[0]);
+  g_object_unref (transport);
+  g_object_unref (other);
+}
+
+static void
+test_relay_frame_fallback (void)
+{
+  MockTransport *mock;
+  GBytes *payload;
+  GBytes *frame;
+  GBytes *sent;
+
+  /* Transports check the frame, or build their own */
+  mock = mock_transport_new ();
+  payload = g_bytes_new_static ("marmalade", 9);
+  frame = g_bytes_new_static ("13\nbar\nmarmalade", 17);
+  cockpit_transport_send_frame (COCKPIT_TRANSPORT (mock), "bar", payload, frame);
+  cockpit_transport_send_frame (COCKPIT_TRANSPORT (mock), "bar", payload, NULL);
+  g_bytes_unref (payload);
+  g_bytes_unref (frame);
+
+  g_assert_cmpuint (mock_transport_count_sent (mock), ==, 2);
+  g_assert_cmpuint (mock_transport_count_frames (mock), ==, 1);
+
+  sent = mock_transport_pop_channel (mock, "bar");
+  cockpit_assert_bytes_eq (sent, "marmalade", 9);
+  sent = mock_transport_pop_channel (mock, "bar");
+  cockpit_assert_bytes_eq (sent, "marmalade", 9);
+
+  g_object_unref (mock);
+}
+
 static void
 test_read_truncated (void)
 {
@@ -701,6 +1113,37 @@ struct {
     { "newline-channel", "{ \"command\": \"test\", \"channel\": \"blah\nline\" }", },
 };
 
+static const struct {
+  const gchar *json;
+  CockpitPriority priority;
+} priority_fixtures[] = {
+  { "{ }", COCKPIT_PRIORITY_NORMAL },
+  { "{ \"payload\": \"echo\" }", COCKPIT_PRIORITY_NORMAL },
+  { "{ \"payload\": \"stream\" }", COCKPIT_PRIORITY_NORMAL },
+  { "{ \"payload\": \"stream\", \"pty\": true }", COCKPIT_PRIORITY_HIGH },
+  { "{ \"payload\": \"fsread1\" }", COCKPIT_PRIORITY_LOW },
+  { "{ \"payload\": \"metrics1\" }", COCKPIT_PRIORITY_LOW },
+  { "{ \"payload\": \"fsread1\", \"priority\": \"high\" }", COCKPIT_PRIORITY_HIGH },
+  { "{ \"payload\": \"stream\", \"pty\": true, \"priority\": \"normal\" }", COCKPIT_PRIORITY_NORMAL },
+  { "{ \"payload\": \"echo\", \"priority\": \"low\" }", COCKPIT_PRIORITY_LOW },
+};
+
+static void
+test_parse_priority (void)
+{
+  JsonObject *options;
+  GError *error = NULL;
+  gint i;
+
+  for (i = 0; i < G_N_ELEMENTS (priority_fixtures); i++)
+    {
+      options = cockpit_json_parse_object (priority_fixtures[i].json, -1, &error);
+      g_assert_no_error (error);
+      g_assert_cmpint (cockpit_transport_parse_priority (options), ==, priority_fixtures[i].priority);
+      json_object_unref (options);
+    }
+}
+
 static void
 test_parse_command_bad (gconstpointer input)
 {
@@ -745,6 +1188,8 @@ main (int argc,
       g_free (name);
     }
 
+  g_test_add_func ("/transport/parse-priority", test_parse_priority);
+
   g_test_add ("/transport/properties", TestCase, NULL,
               setup_no_child, test_properties, teardown_transport);
 
@@ -767,6 +1212,13 @@ main (int argc,
               NULL, setup_no_child,
               test_echo_large, teardown_transport);
 
+  g_test_add ("/transport/priority-latency", TestCase,
+              NULL, setup_no_child,
+              test_priority_latency, teardown_transport);
+  g_test_add ("/transport/priority-control", TestCase,
+              NULL, setup_no_child,
+              test_priority_control, teardown_transport);
+
   g_test_add ("/transport/close-problem/child", TestCase,
               BUILDDIR "/mock-echo", setup_with_child,
               test_close_problem, teardown_transport);
@@ -789,10 +1241,16 @@ main (int argc,
   g_test_add_func ("/transport/ping/pong", test_ping_pong);
   g_test_add_func ("/transport/ping/channel", test_ping_channel);
 
+  g_test_add_func ("/transport/freeze/order", test_freeze_order);
+  g_test_add_func ("/transport/freeze/overflow", test_freeze_overflow);
+  g_test_add_func ("/transport/freeze/many", test_freeze_many);
+
   g_test_add_func ("/transport/read-error", test_read_error);
   g_test_add_func ("/transport/write-error", test_write_error);
   g_test_add_func ("/transport/read-combined", test_read_combined);
   g_test_add_func ("/transport/read-truncated", test_read_truncated);
+  g_test_add_func ("/transport/relay-frame", test_relay_frame);
+  g_test_add_func ("/transport/relay-frame-fallback", test_relay_frame_fallback);
   g_test_add_func ("/transport/read-incorrect", test_incorrect_protocol);
 
   return g_test_run ();
@@ -83,6 +83,115 @@ static const Fixture fixtures[] = {
   { "Marmalaade!""\xe2\x94\x80", NULL, FALSE },
 };
 
+typedef struct {
+  const gchar *input;
+  gsize length;
+  gboolean valid;
+  gsize incomplete;
+} ValidateFixture;
+
+static const ValidateFixture validate_fixtures[] = {
+  { "", 0, TRUE, 0 },
+  { "this is a longer ascii string, longer than a block", 50, TRUE, 0 },
+  { "this is a longer ascii string \303\244 with utf8 in it", 48, TRUE, 0 },
+  { "ascii with a nul\000 in it", 23, FALSE, 0 },
+  { "euro \342\202\254", 8, TRUE, 0 },
+  { "euro \342\202", 7, TRUE, 2 },
+  { "euro \342", 6, TRUE, 1 },
+  { "emoji \360\237\230", 9, TRUE, 3 },
+  { "invalid \377 then incomplete \342", 27, FALSE, 1 },
+  { "overlong \300\257", 11, FALSE, 0 },
+  { "surrogate \355\240\200", 13, FALSE, 0 },
+  { "too large \364\220\200\200", 14, FALSE, 0 },
+  { "bad continuation \342\050\241", 20, FALSE, 0 },
+  { "truncated overlong \340\200", 21, FALSE, 0 },
+};
+
+static void
+test_validate (gconstpointer data)
+{
+  const ValidateFixture *fixture = data;
+  gsize incomplete = 99;
+  gboolean valid;
+
+  valid = cockpit_unicode_validate (fixture->input, fixture->length, &incomplete);
+  g_assert_cmpint (valid, ==, fixture->valid);
+  g_assert_cmpuint (incomplete, ==, fixture->incomplete);
+
+  /* Must always agree with glib about complete input */
+  if (fixture->incomplete == 0)
+    g_assert_cmpint (valid, ==, g_utf8_validate (fixture->input, fixture->length, NULL));
+}
+
+static GBytes *
+build_corpus (const gchar **words,
+              gsize n_words,
+              gsize size)
+{
+  GString *string = g_string_sized_new (size + 64);
+  guint32 seed = 0;
+
+  while (string->len < size)
+    {
+      seed = seed * 1103515245 + 12345;
+      g_string_append (string, words[(seed >> 16) % n_words]);
+      g_string_append_c (string, (seed >> 8) % 13 == 0 ? '\n' : ' ');
+    }
+
+  return g_string_free_to_bytes (string);
+}
+
+static void
+test_perf_validate (void)
+{
+  const gchar *ascii[] = { "Started", "session", "of", "user", "root.", "[  OK  ]", "Reached", "target", "0x7f3a" };
+  const gchar *mixed[] = { "\303\234berpr\303\274fung", "l\303\244uft", "systemd", "caf\303\251", "ok",
+                           "\346\227\245\346\234\254\350\252\236\343\201\256", "\343\203\255\343\202\260",
+                           "\342\224\200\342\224\200", "\360\237\232\200" };
+  const gchar *invalid[] = { "binary", "\377\376", "garbage", "\300", "text", "\355\240\200" };
+  struct {
+    const gchar *name;
+    GBytes *corpus;
+  } corpora[] = {
+    { "ascii", build_corpus (ascii, G_N_ELEMENTS (ascii), 1024 * 1024) },
+    { "mixed", build_corpus (mixed, G_N_ELEMENTS (mixed), 1024 * 1024) },
+    { "invalid", build_corpus (invalid, G_N_ELEMENTS (invalid), 1024 * 1024) },
+  };
+  const gint rounds = 50;
+  gconstpointer data;
+  GBytes *output;
+  gdouble glib, ours;
+  gsize length;
+  gint i, j;
+
+  for (i = 0; i < G_N_ELEMENTS (corpora); i++)
+    {
+      data = g_bytes_get_data (corpora[i].corpus, &length);
+
+      /* What we did before: validate once to check, once to send */
+      g_test_timer_start ();
+      for (j = 0; j < rounds; j++)
+        {
+          g_utf8_validate (data, length, NULL);
+          g_utf8_validate (data, length, NULL);
+        }
+      glib = g_test_timer_elapsed ();
+
+      g_test_timer_start ();
+      for (j = 0; j < rounds; j++)
+        {
+          output = cockpit_unicode_force_utf8 (corpora[i].corpus);
+          g_bytes_unref (output);
+        }
+      ours = g_test_timer_elapsed ();
+
+      g_test_minimized_result (ours, "%s: %.1f MB/s (glib twice: %.1f MB/s)", corpora[i].name,
+                               (length * rounds) / ours / (1024 * 1024),
+                               (length * rounds) / glib / (1024 * 1024));
+      g_bytes_unref (corpora[i].corpus);
+    }
+}
+
 int
 main (int argc,
       char *argv[])
@@ -108,5 +217,19 @@ main (int argc,
       g_free (name2);
     }
 
+  for (i = 0; i < G_N_ELEMENTS (validate_fixtures); i++)
+    {
+      escaped = g_strcanon (g_strndup (validate_fixtures[i].input, validate_fixtures[i].length),
+                            COCKPIT_TEST_CHARS, '_');
+      name = g_strdup_printf ("/unicode/validate/%s", escaped);
+      g_free (escaped);
+
+      g_test_add_data_func (name, validate_fixtures + i, test_validate);
+      g_free (name);
+    }
+
+  if (g_test_perf ())
+    g_test_add_func ("/unicode/perf/validate", test_perf_validate);
+
   return g_test_run ();
 }
@@ -19,6 +19,7 @@
 
 #include "config.h"
 
+#include "cockpitwebcompress.h"
 #include "cockpitwebinject.h"
 #include "cockpitwebresponse.h"
 #include "cockpitwebserver.h"
@@ -964,6 +965,132 @@ test_web_filter_shift_three (TestCase *tc,
                    "0\r\n\r\n");
 }
 
+static void
+test_web_filter_combined (TestCase *tc,
+                          gconstpointer data)
+{
+  CockpitWebFilter *filter;
+  const gchar *string;
+  const gchar *resp;
+  GBytes *inject;
+  GBytes *block;
+  gsize i, x, len;
+
+  /* Same as the split test above, but a single filter */
+  inject = bytes_static ("<meta inject>");
+  filter = cockpit_web_inject_new ("<head>", inject, 1);
+  g_bytes_unref (inject);
+
+  inject = bytes_static ("<body>Body</body>");
+  cockpit_web_inject_add (COCKPIT_WEB_INJECT (filter), "</head>", inject, 1);
+  g_bytes_unref (inject);
+
+  inject = bytes_static ("Prefix ");
+  cockpit_web_inject_add (COCKPIT_WEB_INJECT (filter), "<title>", inject, 1);
+  g_bytes_unref (inject);
+
+  cockpit_web_response_add_filter (tc->response, filter);
+  g_object_unref (filter);
+
+  cockpit_web_response_headers (tc->response, 200, "OK", -1, NULL);
+
+  string = "<html><head><title>The Title</title></head></html>";
+  len = strlen (string);
+
+  for (i = 0, x = 1; i < len; i += x, x = 1 + (i % 4))
+    {
+      block = g_bytes_new_static (string + i, MIN (x, strlen (string + i)));
+      g_assert (cockpit_web_response_queue (tc->response, block) == TRUE);
+      g_bytes_unref (block);
+    }
+
+  cockpit_web_response_complete (tc->response);
+
+  while (cockpit_web_response_get_state (tc->response) != COCKPIT_WEB_RESPONSE_COMPLETE)
+    g_main_context_iteration (NULL, TRUE);
+
+  resp = output_as_string (tc);
+  g_assert_cmpint (cockpit_web_response_get_state (tc->response), ==, COCKPIT_WEB_RESPONSE_SENT);
+
+  g_assert_cmpstr (resp, ==, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n" STATIC_HEADERS
+                   "1\r\n<\r\n"
+                   "2\r\nht\r\n"
+                   "4\r\nml><\r\n"
+                   "4\r\nhead\r\n"
+                   "1\r\n>\r\n"
+                   "d\r\n<meta inject>\r\n"
+                   "3\r\n<ti\r\n"
+                   "4\r\ntle>\r\n"
+                   "7\r\nPrefix \r\n"
+                   "4\r\nThe \r\n"
+                   "4\r\nTitl\r\n"
+                   "4\r\ne</t\r\n"
+                   "4\r\nitle\r\n"
+                   "4\r\n></h\r\n"
+                   "4\r\nead>\r\n"
+                   "11\r\n<body>Body</body>\r\n"
+                   "4\r\n</ht\r\n"
+                   "3\r\nml>\r\n"
+                   "0\r\n\r\n");
+}
+
+static void
+test_web_filter_overlap (TestCase *tc,
+                         gconstpointer data)
+{
+  CockpitWebFilter *filter;
+  const gchar *resp;
+  GBytes *block;
+  GBytes *inject;
+
+  inject = bytes_static ("one");
+  filter = cockpit_web_inject_new ("foofn", inject, 1);
+  g_bytes_unref (inject);
+
+  inject = bytes_static ("two");
+  cockpit_web_inject_add (COCKPIT_WEB_INJECT (filter), "ofn", inject, 2);
+  g_bytes_unref (inject);
+
+  inject = bytes_static ("three");
+  cockpit_web_inject_add (COCKPIT_WEB_INJECT (filter), "foofn", inject, 1);
+  g_bytes_unref (inject);
+
+  cockpit_web_response_add_filter (tc->response, filter);
+  g_object_unref (filter);
+
+  cockpit_web_response_headers_full (tc->response, 200, "OK", -1, NULL);
+
+  /* Total content is foofoofnofn and split in the middle of the markers */
+  block = bytes_static ("foof");
+  g_assert (cockpit_web_response_queue (tc->response, block) == TRUE);
+  g_bytes_unref (block);
+  block = bytes_static ("oofno");
+  g_assert (cockpit_web_response_queue (tc->response, block) == TRUE);
+  g_bytes_unref (block);
+  block = bytes_static ("fnofn");
+  g_assert (cockpit_web_response_queue (tc->response, block) == TRUE);
+  g_bytes_unref (block);
+  cockpit_web_response_complete (tc->response);
+
+  while (cockpit_web_response_get_state (tc->response) != COCKPIT_WEB_RESPONSE_COMPLETE)
+    g_main_context_iteration (NULL, TRUE);
+
+  resp = output_as_string (tc);
+  g_assert_cmpint (cockpit_web_response_get_state (tc->response), ==, COCKPIT_WEB_RESPONSE_SENT);
+
+  g_assert_cmpstr (resp, ==, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n" STATIC_HEADERS
+                   "4\r\nfoof\r\n"
+                   "4\r\noofn\r\n"
+                   "3\r\none\r\n"
+                   "5\r\nthree\r\n"
+                   "3\r\ntwo\r\n"
+                   "1\r\no\r\n"
+                   "2\r\nfn\r\n"
+                   "3\r\ntwo\r\n"
+                   "3\r\nofn\r\n"
+                   "0\r\n\r\n");
+}
+
 static void
 test_web_filter_passthrough (TestCase *tc,
                              gconstpointer data)
@@ -1254,6 +1381,321 @@ test_removed_prefix (TestPlain *tc,
   g_clear_object (&response);
 }
 
+static GBytes *
+output_body (TestCase *tc,
+             gchar **headers)
+{
+  const gchar *data;
+  const gchar *pos;
+  gchar *next;
+  GByteArray *body;
+  gsize length;
+  gsize chunk;
+
+  output_as_string (tc);
+
+  data = g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (tc->output));
+  length = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (tc->output));
+
+  pos = g_strstr_len (data, length, "\r\n\r\n");
+  g_assert (pos != NULL);
+  pos += 4;
+  *headers = g_strndup (data, pos - data);
+
+  body = g_byte_array_new ();
+  if (strstr (*headers, "Transfer-Encoding: chunked\r\n"))
+    {
+      for (;;)
+        {
+          chunk = strtoul (pos, &next, 16);
+          g_assert (next[0] == '\r' && next[1] == '\n');
+          pos = next + 2;
+          if (chunk == 0)
+            break;
+          g_byte_array_append (body, (const guint8 *)pos, chunk);
+          pos += chunk + 2;
+        }
+    }
+  else
+    {
+      g_byte_array_append (body, (const guint8 *)pos, (data + length) - pos);
+    }
+
+  return g_byte_array_free_to_bytes (body);
+}
+
+static GBytes *
+compressible_content (guint lines)
+{
+  GString *string = g_string_new ("");
+  guint i;
+
+  for (i = 0; i < lines; i++)
+    g_string_append_printf (string, "Line %u of text that compresses rather well\n", i);
+
+  return g_string_free_to_bytes (string);
+}
+
+static void
+set_compress (TestCase *tc,
+              const gchar *accept)
+{
+  GHashTable *headers = cockpit_web_server_new_table ();
+  g_hash_table_insert (headers, g_strdup ("Accept-Encoding"), g_strdup (accept));
+  cockpit_web_response_set_compress (tc->response, headers);
+  g_hash_table_unref (headers);
+}
+
+static void
+assert_gzipped (GBytes *body,
+                GBytes *expected)
+{
+  GError *error = NULL;
+  GBytes *bytes;
+
+  g_assert_cmpuint (g_bytes_get_size (body), <, g_bytes_get_size (expected));
+
+  bytes = cockpit_web_response_gunzip (body, &error);
+  g_assert_no_error (error);
+  g_assert (g_bytes_equal (bytes, expected));
+  g_bytes_unref (bytes);
+}
+
+static void
+test_compress_content (TestCase *tc,
+                       gconstpointer data)
+{
+  GHashTable *headers;
+  GBytes *content;
+  GBytes *body;
+  gchar *resp;
+
+  set_compress (tc, "gzip, deflate");
+
+  headers = cockpit_web_server_new_table ();
+  g_hash_table_insert (headers, g_strdup ("Content-Type"), g_strdup ("text/plain"));
+  g_hash_table_insert (headers, g_strdup ("ETag"), g_strdup ("\"abc\""));
+
+  content = compressible_content (200);
+  cockpit_web_response_content (tc->response, headers, content, NULL);
+  g_hash_table_unref (headers);
+
+  body = output_body (tc, &resp);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK\r\n*"
+                           "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"
+                           "Transfer-Encoding: chunked\r\n*");
+  g_assert (strstr (resp, "\r\nContent-Type: text/plain\r\n"));
+  g_assert (strstr (resp, "\r\nETag: W/\"abc\"\r\n"));
+  assert_gzipped (body, content);
+
+  g_bytes_unref (content);
+  g_bytes_unref (body);
+  g_free (resp);
+}
+
+static void
+test_compress_small (TestCase *tc,
+                     gconstpointer data)
+{
+  GHashTable *headers;
+  GBytes *content;
+
+  set_compress (tc, "gzip");
+
+  headers = cockpit_web_server_new_table ();
+  g_hash_table_insert (headers, g_strdup ("Content-Type"), g_strdup ("text/plain"));
+
+  content = g_bytes_new_static ("the content", 11);
+  cockpit_web_response_content (tc->response, headers, content, NULL);
+  g_bytes_unref (content);
+  g_hash_table_unref (headers);
+
+  g_assert_cmpstr (output_as_string (tc), ==, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                   "Content-Length: 11\r\n" STATIC_HEADERS "the content");
+}
+
+static void
+test_compress_binary (TestCase *tc,
+                      gconstpointer data)
+{
+  GHashTable *headers;
+  GBytes *content;
+  GBytes *body;
+  gchar *resp;
+
+  set_compress (tc, "gzip");
+
+  headers = cockpit_web_server_new_table ();
+  g_hash_table_insert (headers, g_strdup ("Content-Type"), g_strdup ("image/png"));
+
+  content = compressible_content (200);
+  cockpit_web_response_content (tc->response, headers, content, NULL);
+  g_hash_table_unref (headers);
+
+  body = output_body (tc, &resp);
+  g_assert (strstr (resp, "Content-Encoding") == NULL);
+  g_assert (g_bytes_equal (body, content));
+
+  g_bytes_unref (content);
+  g_bytes_unref (body);
+  g_free (resp);
+}
+
+static void
+test_compress_stream (TestCase *tc,
+                      gconstpointer data)
+{
+  GBytes *content;
+  GBytes *block;
+  GBytes *body;
+  gchar *resp;
+  gsize length;
+  gsize offset;
+
+  set_compress (tc, "gzip;q=0.5, deflate;q=0.1");
+
+  cockpit_web_response_headers (tc->response, 200, "OK", -1, "Content-Type", "text/plain",
+                                "ETag", "\"abc\"", NULL);
+  g_assert_cmpint (cockpit_web_response_get_state (tc->response), ==, COCKPIT_WEB_RESPONSE_QUEUING);
+
+  content = compressible_content (200);
+  length = g_bytes_get_size (content);
+  for (offset = 0; offset < length; offset += 100)
+    {
+      block = g_bytes_new_from_bytes (content, offset, MIN (100, length - offset));
+      cockpit_web_response_queue (tc->response, block);
+      g_bytes_unref (block);
+    }
+
+  cockpit_web_response_complete (tc->response);
+
+  body = output_body (tc, &resp);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                           "ETag: W/\"abc\"\r\nTransfer-Encoding: chunked\r\n*"
+                           "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n\r\n");
+  assert_gzipped (body, content);
+
+  g_bytes_unref (content);
+  g_bytes_unref (body);
+  g_free (resp);
+}
+
+static void
+test_compress_stream_small (TestCase *tc,
+                            gconstpointer data)
+{
+  GBytes *content;
+
+  set_compress (tc, "gzip");
+
+  cockpit_web_response_headers (tc->response, 200, "OK", -1, "Content-Type", "text/plain",
+                                "ETag", "\"abc\"", NULL);
+
+  content = g_bytes_new_static ("the content", 11);
+  cockpit_web_response_queue (tc->response, content);
+  g_bytes_unref (content);
+
+  cockpit_web_response_complete (tc->response);
+
+  g_assert_cmpstr (output_as_string (tc), ==, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                   "ETag: \"abc\"\r\nTransfer-Encoding: chunked\r\n" STATIC_HEADERS
+                   "b\r\nthe content\r\n0\r\n\r\n");
+}
+
+static void
+on_filter_output (gpointer data,
+                  GBytes *block)
+{
+  GByteArray *array = data;
+  gsize length;
+  gconstpointer bytes = g_bytes_get_data (block, &length);
+  g_byte_array_append (array, bytes, length);
+}
+
+static void
+test_compress_filter_large (void)
+{
+  CockpitWebFilter *filter;
+  GByteArray *array;
+  GBytes *content;
+  GBytes *block;
+  GBytes *body;
+  gsize length;
+  gsize offset;
+
+  /* Large enough to not be held back and cached */
+  content = compressible_content (20000);
+  length = g_bytes_get_size (content);
+  g_assert_cmpuint (length, >, 512 * 1024);
+
+  filter = cockpit_web_compress_new (COCKPIT_WEB_ENCODING_GZIP);
+  array = g_byte_array_new ();
+
+  for (offset = 0; offset < length; offset += 4096)
+    {
+      block = g_bytes_new_from_bytes (content, offset, MIN (4096, length - offset));
+      cockpit_web_filter_push (filter, block, on_filter_output, array);
+      g_bytes_unref (block);
+    }
+
+  /* Output started before the end */
+  g_assert_cmpuint (array->len, >, 0);
+
+  cockpit_web_filter_finish (filter, on_filter_output, array);
+  g_object_unref (filter);
+
+  body = g_byte_array_free_to_bytes (array);
+  assert_gzipped (body, content);
+
+  g_bytes_unref (body);
+  g_bytes_unref (content);
+}
+
+static void
+test_compress_cache (void)
+{
+  GBytes *content;
+  GBytes *one;
+  GBytes *two;
+  GBytes *deflated;
+
+  cockpit_web_compress_reset ();
+
+  content = compressible_content (100);
+  one = cockpit_web_compress_bytes (COCKPIT_WEB_ENCODING_GZIP, content);
+  two = cockpit_web_compress_bytes (COCKPIT_WEB_ENCODING_GZIP, content);
+  deflated = cockpit_web_compress_bytes (COCKPIT_WEB_ENCODING_DEFLATE, content);
+
+  /* The same variant comes from the cache */
+  g_assert (one == two);
+  g_assert (one != deflated);
+  g_assert (!g_bytes_equal (one, deflated));
+  assert_gzipped (one, content);
+
+  g_bytes_unref (one);
+  g_bytes_unref (two);
+  g_bytes_unref (deflated);
+  g_bytes_unref (content);
+}
+
+static void
+test_compress_negotiate (void)
+{
+  g_assert_cmpint (cockpit_web_compress_negotiate (NULL), ==, COCKPIT_WEB_ENCODING_IDENTITY);
+  g_assert_cmpint (cockpit_web_compress_negotiate ("identity"), ==, COCKPIT_WEB_ENCODING_IDENTITY);
+  g_assert_cmpint (cockpit_web_compress_negotiate ("gzip;q=0"), ==, COCKPIT_WEB_ENCODING_IDENTITY);
+  g_assert_cmpint (cockpit_web_compress_negotiate ("br, gzip"), ==, COCKPIT_WEB_ENCODING_GZIP);
+  g_assert_cmpint (cockpit_web_compress_negotiate ("*"), ==, COCKPIT_WEB_ENCODING_GZIP);
+  g_assert_cmpint (cockpit_web_compress_negotiate ("gzip;q=0.5, deflate"), ==, COCKPIT_WEB_ENCODING_DEFLATE);
+  g_assert_cmpint (cockpit_web_compress_negotiate ("deflate;q=0.9, gzip"), ==, COCKPIT_WEB_ENCODING_GZIP);
+
+  g_assert (cockpit_web_compress_content_type ("text/html; charset=utf8"));
+  g_assert (cockpit_web_compress_content_type ("application/javascript"));
+  g_assert (!cockpit_web_compress_content_type ("application/javascriptx"));
+  g_assert (!cockpit_web_compress_content_type ("image/png"));
+  g_assert (!cockpit_web_compress_content_type (NULL));
+}
+
 static void
 test_gunzip_small (void)
 {
@@ -1536,6 +1978,10 @@ main (int argc,
               setup, test_web_filter_split, teardown);
   g_test_add ("/web-response/filter/shift", TestCase, NULL,
               setup, test_web_filter_shift, teardown);
+  g_test_add ("/web-response/filter/combined", TestCase, NULL,
+              setup, test_web_filter_combined, teardown);
+  g_test_add ("/web-response/filter/overlap", TestCase, NULL,
+              setup, test_web_filter_overlap, teardown);
   g_test_add ("/web-response/filter/shift_three", TestCase, NULL,
               setup, test_web_filter_shift_three, teardown);
 
@@ -1550,6 +1996,20 @@ main (int argc,
   g_test_add ("/web-response/path/removed-prefix", TestPlain, NULL,
               setup_plain, test_removed_prefix, teardown_plain);
 
+  g_test_add ("/web-response/compress/content", TestCase, NULL,
+              setup, test_compress_content, teardown);
+  g_test_add ("/web-response/compress/small", TestCase, NULL,
+              setup, test_compress_small, teardown);
+  g_test_add ("/web-response/compress/binary", TestCase, NULL,
+              setup, test_compress_binary, teardown);
+  g_test_add ("/web-response/compress/stream", TestCase, NULL,
+              setup, test_compress_stream, teardown);
+  g_test_add ("/web-response/compress/stream-small", TestCase, NULL,
+              setup, test_compress_stream_small, teardown);
+  g_test_add_func ("/web-response/compress/filter-large", test_compress_filter_large);
+  g_test_add_func ("/web-response/compress/cache", test_compress_cache);
+  g_test_add_func ("/web-response/compress/negotiate", test_compress_negotiate);
+
   g_test_add_func ("/web-response/gunzip/small", test_gunzip_small);
   g_test_add_func ("/web-response/gunzip/large", test_gunzip_large);
   g_test_add_func ("/web-response/gunzip/invalid", test_gunzip_invalid);
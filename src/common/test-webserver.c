@@ -130,6 +130,99 @@ test_table (void)
   g_hash_table_destroy (table);
 }
 
+static void
+test_request_head (void)
+{
+  const gchar *request = "GET /path?query HTTP/1.1\r\n"
+                         "host:  example.com \r\n"
+                         "Cookie: one=1\r\n"
+                         "X-Other: value\r\n"
+                         "COOKIE: two=2\r\n"
+                         "Accept-Language: de;q=0.5, en-US\r\n"
+                         "\r\n"
+                         "trailing";
+  CockpitWebRequestHead head;
+  GHashTable *table;
+  gchar **languages;
+  gchar *cookie;
+  gssize off;
+
+  off = cockpit_web_request_head_parse (&head, request, strlen (request));
+  g_assert_cmpint (off, ==, strlen (request) - strlen ("trailing"));
+
+  g_assert_cmpint (head.method.length, ==, 3);
+  g_assert (strncmp (head.method.data, "GET", 3) == 0);
+  g_assert_cmpint (head.path.length, ==, 11);
+  g_assert (strncmp (head.path.data, "/path?query", 11) == 0);
+
+  /* Case insensitive, stripped, and the last one wins */
+  g_assert_cmpint (head.known[COCKPIT_WEB_HEADER_HOST].length, ==, 11);
+  g_assert (strncmp (head.known[COCKPIT_WEB_HEADER_HOST].data, "example.com", 11) == 0);
+  g_assert_cmpint (head.known[COCKPIT_WEB_HEADER_COOKIE].length, ==, 5);
+  g_assert (strncmp (head.known[COCKPIT_WEB_HEADER_COOKIE].data, "two=2", 5) == 0);
+  g_assert (head.known[COCKPIT_WEB_HEADER_CONTENT_LENGTH].data == NULL);
+  g_assert (head.known[COCKPIT_WEB_HEADER_IF_NONE_MATCH].data == NULL);
+
+  /* The well known headers don't need the table */
+  cookie = cockpit_web_request_head_parse_cookie (&head, "two");
+  g_assert_cmpstr (cookie, ==, "2");
+  g_free (cookie);
+  g_assert (cockpit_web_request_head_parse_cookie (&head, "one") == NULL);
+  languages = cockpit_web_request_head_parse_accept_list (&head, COCKPIT_WEB_HEADER_ACCEPT_LANGUAGE, NULL);
+  g_assert_cmpuint (g_strv_length (languages), ==, 3);
+  g_assert_cmpstr (languages[0], ==, "en-us");
+  g_assert_cmpstr (languages[1], ==, "de");
+  g_assert_cmpstr (languages[2], ==, "en");
+  g_strfreev (languages);
+  g_assert (head.table == NULL);
+
+  table = cockpit_web_request_head_table (&head);
+  g_assert_cmpuint (g_hash_table_size (table), ==, 4);
+  g_assert_cmpstr (g_hash_table_lookup (table, "Host"), ==, "example.com");
+  g_assert_cmpstr (g_hash_table_lookup (table, "Cookie"), ==, "two=2");
+  g_assert_cmpstr (g_hash_table_lookup (table, "x-other"), ==, "value");
+
+  /* Only built once */
+  g_assert (cockpit_web_request_head_table (&head) == table);
+  cockpit_web_request_head_clear (&head);
+  g_assert (head.table == NULL);
+}
+
+static void
+test_request_head_truncated (void)
+{
+  const gchar *request = "GET / HTTP/1.0\nHost: example.com\n\n";
+  CockpitWebRequestHead head;
+  gsize i;
+
+  for (i = 0; i < strlen (request); i++)
+    g_assert_cmpint (cockpit_web_request_head_parse (&head, request, i), ==, 0);
+
+  g_assert_cmpint (cockpit_web_request_head_parse (&head, request, i), ==, i);
+  g_assert_cmpint (head.known[COCKPIT_WEB_HEADER_HOST].length, ==, 11);
+  g_assert_cmpint (head.headers.length, ==, strlen ("Host: example.com\n"));
+}
+
+static void
+test_request_head_invalid (void)
+{
+  const gchar *invalid[] = {
+    "GET /\r\n\r\n",
+    " GET / HTTP/1.1\r\n\r\n",
+    "GET / HTTP/2.0\r\n\r\n",
+    "GET / HTTP/1.1 x\r\n\r\n",
+    "GET /pa\x01th HTTP/1.1\r\n\r\n",
+    "GET / HTTP/1.1\r\nNo colon\r\n\r\n",
+    "GET / HTTP/1.1\r\nBad\x01Name: value\r\n\r\n",
+    "GET / HTTP/1.1\r\nName: \xff\xfe\r\n\r\n",
+  };
+  CockpitWebRequestHead head;
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (invalid); i++)
+    g_assert_cmpint (cockpit_web_request_head_parse (&head, invalid[i], strlen (invalid[i])), <, 0);
+}
+
 static void
 test_cookie_simple (void)
 {
@@ -1055,6 +1148,10 @@ main (int argc,
 
   g_test_add_func ("/web-server/table", test_table);
 
+  g_test_add_func ("/web-server/request-head", test_request_head);
+  g_test_add_func ("/web-server/request-head/truncated", test_request_head_truncated);
+  g_test_add_func ("/web-server/request-head/invalid", test_request_head_invalid);
+
   g_test_add_func ("/web-server/cookie/simple", test_cookie_simple);
   g_test_add_func ("/web-server/cookie/multiple", test_cookie_multiple);
   g_test_add_func ("/web-server/cookie/overlap", test_cookie_overlap);
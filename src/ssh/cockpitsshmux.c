@@ -0,0 +1,1110 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitsshmux.h"
+#include "cockpitsshrelay.h"
+
+#include "common/cockpitfdpassing.h"
+#include "common/cockpitframe.h"
+#include "common/cockpitjson.h"
+
+#include <glib-unix.h>
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <systemd/sd-journal.h>
+
+/*
+ * Connection multiplexing for cockpit-ssh
+ *
+ * The first cockpit-ssh relay that authenticates against a given
+ * (user, host, port) forks off a small master process which takes over
+ * the authenticated libssh session and listens on a unix socket in the
+ * user's runtime directory. Further relays for the same destination
+ * connect to that socket, hand over their stdin/stdout/stderr, and the
+ * master opens a new channel on the existing session for them. The relay
+ * process then only waits for the master to report the exit status of
+ * the channel.
+ *
+ * Protocol on the mux socket, each message a cockpit frame with JSON:
+ *
+ *   client: { "command": "open", "auth": digest, "exec": ..., "remote-peer": ... }
+ *   client: three SCM_RIGHTS messages with fds 0, 1 and 2
+ *   master: { "command": "ready" } or { "command": "refused", "problem": ... }
+ *   master: { "command": "close", "exit-code": N, "received-frame": bool }
+ *
+ *   client: { "command": "stats" }
+ *   master: { "command": "stats", "channels": N, "active": N, "handshakes-avoided": N, ... }
+ *
+ * A relay whose credentials don't match the ones the master authenticated
+ * with is refused, and falls back to its own connection.
+ */
+
+#define MUX_IO_TIMEOUT 10
+
+/* Requests are tiny, don't let a client make us buffer more */
+#define MUX_MAX_REQUEST (64 * 1024)
+
+typedef struct {
+  gchar *logname;
+  gchar *connection_string;
+  gchar *path;
+  gchar *auth_digest;
+  ssh_session session;
+  ssh_event event;
+  int listen_fd;
+  guint listen_watch;
+  guint session_watch;
+  guint linger;
+  guint linger_timeout;
+  GList *clients;
+  GList *pending;
+  GMainLoop *loop;
+  gboolean quitting;
+
+  /* Counters */
+  guint64 channels;
+  guint64 handshakes_avoided;
+  guint64 refused;
+} CockpitSshMux;
+
+typedef struct {
+  CockpitSshMux *mux;
+  int fd;
+  guint watch;
+  CockpitSshRelay *relay;
+  gulong sig_disconnect;
+} CockpitSshMuxClient;
+
+/* A client whose request and fds haven't all arrived yet */
+typedef struct {
+  CockpitSshMux *mux;
+  int fd;
+  guint watch;
+  guint timeout;
+  GByteArray *buffer;
+  gsize header;
+  gsize size;
+  JsonObject *request;
+  int fds[3];
+  guint n_fds;
+} CockpitSshMuxPending;
+
+static gboolean
+write_message (int fd,
+               JsonObject *object)
+{
+  gboolean ret = TRUE;
+  gchar *payload;
+  gsize length;
+
+  payload = cockpit_json_write_object (object, &length);
+  if (cockpit_frame_write (fd, (unsigned char *)payload, length) < 0)
+    ret = FALSE;
+  g_free (payload);
+
+  return ret;
+}
+
+static JsonObject *
+read_message (int fd)
+{
+  JsonObject *object = NULL;
+  GError *error = NULL;
+  guchar *data = NULL;
+  gssize length;
+
+  length = cockpit_frame_read (fd, &data);
+  if (length > 0)
+    {
+      object = cockpit_json_parse_object ((const gchar *)data, length, &error);
+      if (!object)
+        {
+          g_message ("invalid ssh multiplexer message: %s", error->message);
+          g_error_free (error);
+        }
+    }
+
+  free (data);
+  return object;
+}
+
+static void
+set_io_timeout (int fd)
+{
+  struct timeval tv = { MUX_IO_TIMEOUT, 0 };
+
+  if (setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) < 0 ||
+      setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv)) < 0)
+    g_debug ("couldn't set ssh multiplexer socket timeout: %s", g_strerror (errno));
+}
+
+static gboolean
+digest_equal (const gchar *one,
+              const gchar *two)
+{
+  gsize len = strlen (one);
+  guchar diff = 0;
+  gsize i;
+
+  if (len != strlen (two))
+    return FALSE;
+
+  /* Don't leak how much of the digest matched */
+  for (i = 0; i < len; i++)
+    diff |= one[i] ^ two[i];
+  return diff == 0;
+}
+
+static gboolean
+ensure_socket_dir (const gchar *dir)
+{
+  struct stat st;
+
+  if (g_mkdir_with_parents (dir, 0700) < 0)
+    {
+      g_debug ("couldn't create ssh multiplexer directory %s: %s", dir, g_strerror (errno));
+      return FALSE;
+    }
+
+  /* Only ever use a private directory owned by us */
+  if (lstat (dir, &st) < 0 || !S_ISDIR (st.st_mode) ||
+      st.st_uid != geteuid () || (st.st_mode & 077) != 0)
+    {
+      g_message ("not multiplexing ssh connections: %s is not a private directory", dir);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * cockpit_ssh_mux_socket_path:
+ * @connection_string: the [user@]host[:port] to connect to
+ * @options: the options in effect for the connection
+ *
+ * Calculates the path of the multiplexer socket for a destination. Relays
+ * only share a connection when they would have connected the same way.
+ *
+ * Returns: the socket path, or %NULL if multiplexing is not possible
+ */
+gchar *
+cockpit_ssh_mux_socket_path (const gchar *connection_string,
+                             CockpitSshOptions *options)
+{
+  struct sockaddr_un addr;
+  gchar *checksum;
+  gchar *name;
+  gchar *key;
+  gchar *path = NULL;
+  gchar *dir;
+
+  dir = g_build_filename (g_get_user_runtime_dir (), "cockpit-ssh", NULL);
+  if (ensure_socket_dir (dir))
+    {
+      key = g_strdup_printf ("%s\n%s\n%d", connection_string,
+                             options->knownhosts_file ? options->knownhosts_file : "",
+                             options->connect_to_unknown_hosts);
+      checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+
+      /* Truncated, to stay well below the sun_path limit */
+      name = g_strdup_printf ("%.32s.sock", checksum);
+      path = g_build_filename (dir, name, NULL);
+
+      if (strlen (path) >= sizeof (addr.sun_path))
+        {
+          g_message ("not multiplexing ssh connections: socket path too long: %s", path);
+          g_clear_pointer (&path, g_free);
+        }
+
+      g_free (name);
+      g_free (checksum);
+      g_free (key);
+    }
+
+  g_free (dir);
+  return path;
+}
+
+/**
+ * cockpit_ssh_mux_auth_digest:
+ * @auth_type: the type of the initial authorize response
+ * @auth_data: the initial authorize response
+ *
+ * Only relays presenting the same credentials may share an authenticated
+ * session. The credentials are compared by digest so that they never need
+ * to cross the multiplexer socket.
+ */
+gchar *
+cockpit_ssh_mux_auth_digest (const gchar *auth_type,
+                             const gchar *auth_data)
+{
+  GChecksum *checksum;
+  gchar *digest;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (checksum, (const guchar *)(auth_type ? auth_type : ""), -1);
+  g_checksum_update (checksum, (const guchar *)"\n", 1);
+  if (auth_data)
+    g_checksum_update (checksum, (const guchar *)auth_data, -1);
+  digest = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  return digest;
+}
+
+static int
+connect_socket (const gchar *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int fd;
+
+  g_return_val_if_fail (strlen (path) < sizeof (addr.sun_path), -1);
+  strcpy (addr.sun_path, path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+    {
+      int errn = errno;
+      close (fd);
+      errno = errn;
+      return -1;
+    }
+
+  set_io_timeout (fd);
+  return fd;
+}
+
+/**
+ * cockpit_ssh_mux_connect:
+ * @path: path of the multiplexer socket
+ *
+ * Returns: a connected socket, or -1 if no master is running
+ */
+int
+cockpit_ssh_mux_connect (const gchar *path)
+{
+  int fd;
+
+  fd = connect_socket (path);
+  if (fd < 0 && errno != ENOENT && errno != ECONNREFUSED)
+    g_debug ("couldn't connect to ssh multiplexer %s: %s", path, g_strerror (errno));
+
+  return fd;
+}
+
+/**
+ * cockpit_ssh_mux_open:
+ * @fd: a connected multiplexer socket
+ * @auth_digest: digest of the credentials, see cockpit_ssh_mux_auth_digest()
+ * @options: options for the channel
+ * @logname: for messages
+ *
+ * Asks the master to run the bridge command in a new channel on its
+ * session, connected to our stdin, stdout and stderr.
+ *
+ * Returns: %NULL on success, or a problem code
+ */
+const gchar *
+cockpit_ssh_mux_open (int fd,
+                      const gchar *auth_digest,
+                      CockpitSshOptions *options,
+                      const gchar *logname)
+{
+  const gchar *problem = "internal-error";
+  const gchar *command = NULL;
+  JsonObject *request;
+  JsonObject *reply;
+  int i;
+
+  request = json_object_new ();
+  json_object_set_string_member (request, "command", "open");
+  json_object_set_string_member (request, "auth", auth_digest);
+  json_object_set_string_member (request, "exec", options->command);
+  if (options->remote_peer)
+    json_object_set_string_member (request, "remote-peer", options->remote_peer);
+
+  if (!write_message (fd, request))
+    {
+      g_message ("%s: couldn't send request to ssh multiplexer: %s", logname, g_strerror (errno));
+      goto out;
+    }
+
+  for (i = 0; i < 3; i++)
+    {
+      if (!cockpit_socket_send_fd (fd, i))
+        {
+          g_message ("%s: couldn't pass fd to ssh multiplexer: %s", logname, g_strerror (errno));
+          goto out;
+        }
+    }
+
+  reply = read_message (fd);
+  if (!reply)
+    {
+      g_message ("%s: no reply from ssh multiplexer", logname);
+      goto out;
+    }
+
+  if (cockpit_json_get_string (reply, "command", NULL, &command) &&
+      g_strcmp0 (command, "ready") == 0)
+    {
+      g_debug ("%s: attached to ssh multiplexer", logname);
+      problem = NULL;
+    }
+  else if (!cockpit_json_get_string (reply, "problem", "internal-error", &problem))
+    {
+      problem = "internal-error";
+    }
+  else
+    {
+      g_debug ("%s: ssh multiplexer refused channel: %s", logname, problem);
+    }
+
+  /* All problems are static strings */
+  problem = g_intern_string (problem);
+  json_object_unref (reply);
+
+out:
+  json_object_unref (request);
+  return problem;
+}
+
+/**
+ * cockpit_ssh_mux_read_close:
+ * @fd: a multiplexer socket after a successful cockpit_ssh_mux_open()
+ *
+ * Reads the "close" message sent when the remote command exits.
+ *
+ * Returns: the message, or %NULL if the master went away
+ */
+JsonObject *
+cockpit_ssh_mux_read_close (int fd)
+{
+  const gchar *command = NULL;
+  JsonObject *object;
+
+  object = read_message (fd);
+  if (object && (!cockpit_json_get_string (object, "command", NULL, &command) ||
+                 g_strcmp0 (command, "close") != 0))
+    {
+      g_message ("unexpected message from ssh multiplexer: %s", command);
+      g_clear_pointer (&object, json_object_unref);
+    }
+
+  return object;
+}
+
+/**
+ * cockpit_ssh_mux_query_stats:
+ * @path: the multiplexer socket
+ *
+ * Returns: the counters of a running multiplexer master, or %NULL
+ */
+JsonObject *
+cockpit_ssh_mux_query_stats (const gchar *path)
+{
+  JsonObject *request;
+  JsonObject *reply = NULL;
+  int fd;
+
+  fd = cockpit_ssh_mux_connect (path);
+  if (fd < 0)
+    return NULL;
+
+  request = json_object_new ();
+  json_object_set_string_member (request, "command", "stats");
+  if (write_message (fd, request))
+    reply = read_message (fd);
+
+  json_object_unref (request);
+  close (fd);
+  return reply;
+}
+
+/* -----------------------------------------------------------------------------
+ * The multiplexer master
+ */
+
+static void
+mux_quit (CockpitSshMux *mux)
+{
+  if (!mux->quitting)
+    {
+      g_debug ("%s: ssh multiplexer exiting: %" G_GUINT64_FORMAT " channels, "
+               "%" G_GUINT64_FORMAT " handshakes avoided, %" G_GUINT64_FORMAT " refused",
+               mux->logname, mux->channels, mux->handshakes_avoided, mux->refused);
+      mux->quitting = TRUE;
+    }
+
+  /* Stop taking new clients right away */
+  if (mux->listen_watch)
+    {
+      g_source_remove (mux->listen_watch);
+      mux->listen_watch = 0;
+      g_unlink (mux->path);
+    }
+
+  if (!mux->clients && !mux->pending)
+    g_main_loop_quit (mux->loop);
+}
+
+static gboolean
+on_linger_timeout (gpointer user_data)
+{
+  CockpitSshMux *mux = user_data;
+
+  mux->linger_timeout = 0;
+  g_debug ("%s: ssh multiplexer idle for %u seconds", mux->logname, mux->linger);
+  mux_quit (mux);
+  return FALSE;
+}
+
+static void
+mux_maybe_idle (CockpitSshMux *mux)
+{
+  if (mux->clients || mux->pending)
+    return;
+
+  if (mux->quitting || !ssh_is_connected (mux->session))
+    mux_quit (mux);
+
+  /* Don't linger if not a single channel was opened */
+  else if (mux->linger == 0 || mux->channels == 0)
+    mux_quit (mux);
+  else if (!mux->linger_timeout)
+    mux->linger_timeout = g_timeout_add_seconds (mux->linger, on_linger_timeout, mux);
+}
+
+static void
+mux_client_free (CockpitSshMuxClient *client)
+{
+  CockpitSshMux *mux = client->mux;
+
+  mux->clients = g_list_remove (mux->clients, client);
+
+  if (client->watch)
+    g_source_remove (client->watch);
+  if (client->relay)
+    {
+      g_signal_handler_disconnect (client->relay, client->sig_disconnect);
+      g_object_unref (client->relay);
+    }
+  close (client->fd);
+  g_free (client);
+
+  mux_maybe_idle (mux);
+}
+
+static void
+on_relay_disconnect (CockpitSshRelay *relay,
+                     gpointer user_data)
+{
+  CockpitSshMuxClient *client = user_data;
+  JsonObject *object;
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "command", "close");
+  json_object_set_int_member (object, "exit-code", cockpit_ssh_relay_result (relay));
+  json_object_set_boolean_member (object, "received-frame", cockpit_ssh_relay_received_frame (relay));
+  if (!write_message (client->fd, object))
+    g_debug ("%s: couldn't send close to ssh multiplexer client: %s", client->mux->logname, g_strerror (errno));
+  json_object_unref (object);
+
+  mux_client_free (client);
+}
+
+static gboolean
+on_client_hangup (gint fd,
+                  GIOCondition cond,
+                  gpointer user_data)
+{
+  CockpitSshMuxClient *client = user_data;
+
+  /*
+   * The relay process doesn't send anything after its request, so this is
+   * either a hangup or garbage. The channel keeps running until the other
+   * end of the passed fds closes, we just can't report its exit anymore.
+   */
+  g_debug ("%s: ssh multiplexer client went away", client->mux->logname);
+  client->watch = 0;
+  return FALSE;
+}
+
+static void
+send_refused (int fd,
+              const gchar *problem)
+{
+  JsonObject *object = json_object_new ();
+  json_object_set_string_member (object, "command", "refused");
+  json_object_set_string_member (object, "problem", problem);
+  write_message (fd, object);
+  json_object_unref (object);
+}
+
+static void
+send_stats (CockpitSshMux *mux,
+            int fd)
+{
+  JsonObject *object = json_object_new ();
+  json_object_set_string_member (object, "command", "stats");
+  json_object_set_int_member (object, "channels", mux->channels);
+  json_object_set_int_member (object, "active", g_list_length (mux->clients));
+  json_object_set_int_member (object, "handshakes-avoided", mux->handshakes_avoided);
+  json_object_set_int_member (object, "refused", mux->refused);
+  write_message (fd, object);
+  json_object_unref (object);
+}
+
+static void
+mux_pending_free (CockpitSshMuxPending *pending)
+{
+  CockpitSshMux *mux = pending->mux;
+  int i;
+
+  mux->pending = g_list_remove (mux->pending, pending);
+
+  if (pending->watch)
+    g_source_remove (pending->watch);
+  if (pending->timeout)
+    g_source_remove (pending->timeout);
+  for (i = 0; i < 3; i++)
+    {
+      if (pending->fds[i] >= 0)
+        close (pending->fds[i]);
+    }
+  if (pending->fd >= 0)
+    close (pending->fd);
+  if (pending->request)
+    json_object_unref (pending->request);
+  g_byte_array_unref (pending->buffer);
+  g_free (pending);
+
+  mux_maybe_idle (mux);
+}
+
+/*
+ * Returns -1 on failure, 0 to wait for more, 1 once the whole request
+ * was read. Never reads past the request frame, since the fds follow it.
+ */
+static gint
+read_request (CockpitSshMuxPending *pending)
+{
+  GError *error = NULL;
+  gsize consumed;
+  gssize size;
+  gssize count;
+  gsize want;
+  gsize len;
+
+  while (!pending->request)
+    {
+      /* Byte by byte until we know the size of the frame */
+      if (pending->header == 0)
+        want = pending->buffer->len + 1;
+      else
+        want = pending->header + pending->size;
+
+      len = pending->buffer->len;
+      g_byte_array_set_size (pending->buffer, want);
+      count = read (pending->fd, pending->buffer->data + len, want - len);
+      g_byte_array_set_size (pending->buffer, len + MAX (count, 0));
+
+      if (count < 0)
+        {
+          if (errno == EAGAIN || errno == EINTR)
+            return 0;
+          g_message ("%s: couldn't read ssh multiplexer request: %s", pending->mux->logname, g_strerror (errno));
+          return -1;
+        }
+      else if (count == 0)
+        {
+          g_message ("%s: ssh multiplexer client went away before its request", pending->mux->logname);
+          return -1;
+        }
+
+      if (pending->header == 0)
+        {
+          size = cockpit_frame_parse (pending->buffer->data, pending->buffer->len, &consumed);
+          if (size < 0 || size > MUX_MAX_REQUEST)
+            {
+              g_message ("%s: invalid request to ssh multiplexer", pending->mux->logname);
+              return -1;
+            }
+          else if (size > 0)
+            {
+              pending->header = consumed;
+              pending->size = size;
+            }
+        }
+      else if (pending->buffer->len == pending->header + pending->size)
+        {
+          pending->request = cockpit_json_parse_object ((const gchar *)pending->buffer->data + pending->header,
+                                                        pending->size, &error);
+          if (!pending->request)
+            {
+              g_message ("invalid ssh multiplexer message: %s", error->message);
+              g_error_free (error);
+              return -1;
+            }
+        }
+    }
+
+  return 1;
+}
+
+/* Same return values as read_request() */
+static gint
+read_fds (CockpitSshMuxPending *pending)
+{
+  int ret;
+
+  while (pending->n_fds < 3)
+    {
+      ret = cockpit_socket_receive_fd (pending->fd, pending->fds + pending->n_fds);
+      if (ret < 0 && errno == EAGAIN)
+        return 0;
+      if (ret != 1 || pending->fds[pending->n_fds] < 0)
+        {
+          g_message ("%s: didn't receive fds for ssh multiplexer channel", pending->mux->logname);
+          return -1;
+        }
+      pending->n_fds++;
+    }
+
+  return 1;
+}
+
+static void
+open_channel (CockpitSshMuxPending *pending,
+              const gchar *auth,
+              const gchar *exec,
+              const gchar *remote_peer)
+{
+  CockpitSshMux *mux = pending->mux;
+  CockpitSshMuxClient *client = NULL;
+  const gchar *problem = "internal-error";
+  CockpitSshRelay *relay;
+  JsonObject *object;
+
+  if (mux->quitting || !ssh_is_connected (mux->session))
+    {
+      problem = "disconnected";
+      goto refuse;
+    }
+
+  if (!digest_equal (auth, mux->auth_digest))
+    {
+      g_debug ("%s: refusing ssh multiplexer channel with different credentials", mux->logname);
+      problem = "authentication-failed";
+      goto refuse;
+    }
+
+  relay = cockpit_ssh_relay_new_channel (mux->connection_string, mux->session, mux->event,
+                                         exec, remote_peer, pending->fds[0], pending->fds[1],
+                                         pending->fds[2], &problem);
+
+  /* The relay owns these now, even when it failed */
+  pending->fds[0] = pending->fds[1] = pending->fds[2] = -1;
+
+  if (!relay)
+    goto refuse;
+
+  if (mux->linger_timeout)
+    {
+      g_source_remove (mux->linger_timeout);
+      mux->linger_timeout = 0;
+    }
+
+  /* The very first channel paid for the handshake */
+  if (mux->channels > 0)
+    mux->handshakes_avoided++;
+  mux->channels++;
+
+  client = g_new0 (CockpitSshMuxClient, 1);
+  client->mux = mux;
+  client->fd = pending->fd;
+  client->relay = relay;
+  client->sig_disconnect = g_signal_connect (relay, "disconnect", G_CALLBACK (on_relay_disconnect), client);
+  client->watch = g_unix_fd_add (client->fd, G_IO_IN | G_IO_HUP | G_IO_ERR, on_client_hangup, client);
+  mux->clients = g_list_prepend (mux->clients, client);
+  pending->fd = -1;
+
+  g_debug ("%s: ssh multiplexer opened channel %" G_GUINT64_FORMAT, mux->logname, mux->channels);
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "command", "ready");
+  write_message (client->fd, object);
+  json_object_unref (object);
+  return;
+
+refuse:
+  mux->refused++;
+  send_refused (pending->fd, problem);
+}
+
+static gboolean
+on_pending_ready (gint fd,
+                  GIOCondition cond,
+                  gpointer user_data)
+{
+  CockpitSshMuxPending *pending = user_data;
+  CockpitSshMux *mux = pending->mux;
+  const gchar *command = NULL;
+  const gchar *auth = NULL;
+  const gchar *exec = NULL;
+  const gchar *remote_peer = NULL;
+  gint ret;
+
+  ret = read_request (pending);
+  if (ret <= 0)
+    goto out;
+
+  if (!cockpit_json_get_string (pending->request, "command", NULL, &command))
+    {
+      g_message ("%s: invalid request to ssh multiplexer", mux->logname);
+      ret = -1;
+    }
+  else if (g_strcmp0 (command, "stats") == 0)
+    {
+      send_stats (mux, pending->fd);
+    }
+  else if (g_strcmp0 (command, "open") != 0 ||
+           !cockpit_json_get_string (pending->request, "auth", NULL, &auth) ||
+           !cockpit_json_get_string (pending->request, "exec", NULL, &exec) ||
+           !cockpit_json_get_string (pending->request, "remote-peer", NULL, &remote_peer) ||
+           !auth || !exec)
+    {
+      g_message ("%s: invalid request to ssh multiplexer", mux->logname);
+      ret = -1;
+    }
+  else
+    {
+      ret = read_fds (pending);
+      if (ret > 0)
+        open_channel (pending, auth, exec, remote_peer);
+    }
+
+out:
+  if (ret == 0)
+    return TRUE;
+
+  pending->watch = 0;
+  mux_pending_free (pending);
+  return FALSE;
+}
+
+static gboolean
+on_pending_timeout (gpointer user_data)
+{
+  CockpitSshMuxPending *pending = user_data;
+
+  g_message ("%s: ssh multiplexer client didn't send its request in time", pending->mux->logname);
+  pending->timeout = 0;
+  mux_pending_free (pending);
+  return FALSE;
+}
+
+/*
+ * Takes ownership of fd. The request and the fds are read as they
+ * arrive, so that a slow client doesn't hold up the other channels.
+ */
+static void
+mux_handle_client (CockpitSshMux *mux,
+                   int fd)
+{
+  CockpitSshMuxPending *pending;
+  GError *error = NULL;
+
+  if (!g_unix_set_fd_nonblocking (fd, TRUE, &error))
+    {
+      g_warning ("%s: couldn't make ssh multiplexer client non-blocking: %s", mux->logname, error->message);
+      g_error_free (error);
+      close (fd);
+      return;
+    }
+
+  pending = g_new0 (CockpitSshMuxPending, 1);
+  pending->mux = mux;
+  pending->fd = fd;
+  pending->fds[0] = pending->fds[1] = pending->fds[2] = -1;
+  pending->buffer = g_byte_array_new ();
+  pending->watch = g_unix_fd_add (fd, G_IO_IN | G_IO_HUP | G_IO_ERR, on_pending_ready, pending);
+  pending->timeout = g_timeout_add_seconds (MUX_IO_TIMEOUT, on_pending_timeout, pending);
+  mux->pending = g_list_prepend (mux->pending, pending);
+}
+
+static gboolean
+on_listen_ready (gint fd,
+                 GIOCondition cond,
+                 gpointer user_data)
+{
+  CockpitSshMux *mux = user_data;
+  int client;
+
+  client = accept4 (fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (client < 0)
+    {
+      if (errno != EAGAIN && errno != EINTR)
+        g_warning ("%s: couldn't accept ssh multiplexer client: %s", mux->logname, g_strerror (errno));
+      return TRUE;
+    }
+
+  mux_handle_client (mux, client);
+  return TRUE;
+}
+
+static gboolean
+on_session_ready (gint fd,
+                  GIOCondition cond,
+                  gpointer user_data)
+{
+  CockpitSshMux *mux = user_data;
+
+  /*
+   * While channels are active their relays process the session. Here we
+   * only notice when the server goes away, and answer keepalives while idle.
+   */
+  if (!mux->clients)
+    ssh_event_dopoll (mux->event, 0);
+
+  if (!ssh_is_connected (mux->session) || (cond & (G_IO_HUP | G_IO_ERR)))
+    {
+      g_debug ("%s: ssh multiplexer session disconnected", mux->logname);
+      mux->session_watch = 0;
+      mux_quit (mux);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+run_master (CockpitSshMux *mux,
+            int first_client)
+{
+  mux->loop = g_main_loop_new (NULL, FALSE);
+  mux->event = ssh_event_new ();
+  ssh_set_blocking (mux->session, 0);
+  ssh_event_add_session (mux->event, mux->session);
+
+  mux->listen_watch = g_unix_fd_add (mux->listen_fd, G_IO_IN, on_listen_ready, mux);
+  mux->session_watch = g_unix_fd_add (ssh_get_fd (mux->session), G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                      on_session_ready, mux);
+
+  /* The relay that forked us is the first client */
+  mux_handle_client (mux, first_client);
+  mux_maybe_idle (mux);
+
+  g_main_loop_run (mux->loop);
+
+  if (mux->session_watch)
+    g_source_remove (mux->session_watch);
+  if (mux->linger_timeout)
+    g_source_remove (mux->linger_timeout);
+  close (mux->listen_fd);
+
+  ssh_event_remove_session (mux->event, mux->session);
+  ssh_event_free (mux->event);
+  ssh_disconnect (mux->session);
+  ssh_free (mux->session);
+  g_main_loop_unref (mux->loop);
+}
+
+static int
+bind_socket (const gchar *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  gboolean retried = FALSE;
+  int other;
+  int fd;
+
+  g_return_val_if_fail (strlen (path) < sizeof (addr.sun_path), -1);
+  strcpy (addr.sun_path, path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    return -1;
+
+again:
+  if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+    {
+      if (errno == EADDRINUSE && !retried)
+        {
+          /* Another master came up in the meantime, use our own connection */
+          other = connect_socket (path);
+          if (other >= 0)
+            {
+              close (other);
+              close (fd);
+              return -1;
+            }
+
+          /* A stale socket left over from a master that crashed */
+          retried = TRUE;
+          g_unlink (path);
+          goto again;
+        }
+
+      g_debug ("couldn't bind ssh multiplexer socket %s: %s", path, g_strerror (errno));
+      close (fd);
+      return -1;
+    }
+
+  if (listen (fd, 64) < 0)
+    {
+      g_debug ("couldn't listen on ssh multiplexer socket %s: %s", path, g_strerror (errno));
+      g_unlink (path);
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+static void
+redirect_stdio (void)
+{
+  int fd;
+
+  /* The master must not hold on to the pipes of the relay that forked it */
+  fd = open ("/dev/null", O_RDWR | O_CLOEXEC);
+  if (fd >= 0)
+    {
+      dup2 (fd, 0);
+      dup2 (fd, 1);
+      close (fd);
+    }
+
+  /* But keep logging to the journal, so that failures of the master show up */
+  if (!g_log_writer_is_journald (2))
+    {
+      fd = sd_journal_stream_fd ("cockpit/ssh", LOG_WARNING, 0);
+      if (fd < 0)
+        fd = open ("/dev/null", O_RDWR | O_CLOEXEC);
+      if (fd >= 0)
+        {
+          dup2 (fd, 2);
+          close (fd);
+        }
+    }
+}
+
+/**
+ * cockpit_ssh_mux_start_master:
+ * @path: the multiplexer socket
+ * @connection_string: the [user@]host[:port] @session is connected to
+ * @auth_digest: digest of the credentials used to authenticate @session
+ * @session: an authenticated session
+ * @linger: seconds to keep the session after the last channel closed
+ *
+ * Forks a detached master process which takes over @session. The caller
+ * must not use @session for anything but ssh_free() afterwards, and should
+ * use cockpit_ssh_mux_open() on the returned socket to start its channel.
+ *
+ * Returns: a socket connected to the master, or -1 if no master was
+ *   started and the caller should use @session itself.
+ */
+int
+cockpit_ssh_mux_start_master (const gchar *path,
+                              const gchar *connection_string,
+                              const gchar *auth_digest,
+                              ssh_session session,
+                              guint linger)
+{
+  CockpitSshMux mux = { 0, };
+  g_autofree gchar *logname = NULL;
+  int listen_fd;
+  int pair[2];
+  int status;
+  pid_t pid;
+
+  listen_fd = bind_socket (path);
+  if (listen_fd < 0)
+    return -1;
+
+  logname = g_strdup_printf ("cockpit-ssh %s", connection_string);
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+    {
+      g_warning ("%s: couldn't create socket pair: %s", logname, g_strerror (errno));
+      goto fail;
+    }
+
+  pid = fork ();
+  if (pid < 0)
+    {
+      g_warning ("%s: couldn't fork ssh multiplexer: %s", logname, g_strerror (errno));
+      close (pair[0]);
+      close (pair[1]);
+      goto fail;
+    }
+
+  if (pid == 0)
+    {
+      close (pair[0]);
+
+      /* Detach completely, so that we outlive the relay and its process group */
+      if (setsid () < 0 || fork () != 0)
+        _exit (0);
+
+      redirect_stdio ();
+
+      mux.logname = g_strdup (logname);
+      mux.connection_string = g_strdup (connection_string);
+      mux.path = g_strdup (path);
+      mux.auth_digest = g_strdup (auth_digest);
+      mux.session = session;
+      mux.listen_fd = listen_fd;
+      mux.linger = linger;
+      run_master (&mux, pair[1]);
+
+      /* Don't run atexit() handlers of the relay that forked us */
+      _exit (0);
+    }
+
+  /* Reap the intermediate child */
+  while (waitpid (pid, &status, 0) < 0 && errno == EINTR);
+
+  close (listen_fd);
+  close (pair[1]);
+  set_io_timeout (pair[0]);
+
+  g_debug ("%s: started ssh multiplexer at %s", logname, path);
+  return pair[0];
+
+fail:
+  g_unlink (path);
+  close (listen_fd);
+  return -1;
+}
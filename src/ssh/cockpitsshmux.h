@@ -0,0 +1,56 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_SSH_MUX_H__
+#define __COCKPIT_SSH_MUX_H__
+
+#include <json-glib/json-glib.h>
+
+#include <libssh/libssh.h>
+
+#include "cockpitsshoptions.h"
+
+G_BEGIN_DECLS
+
+gchar *             cockpit_ssh_mux_socket_path     (const gchar *connection_string,
+                                                     CockpitSshOptions *options);
+
+gchar *             cockpit_ssh_mux_auth_digest     (const gchar *auth_type,
+                                                     const gchar *auth_data);
+
+int                 cockpit_ssh_mux_connect         (const gchar *path);
+
+const gchar *       cockpit_ssh_mux_open            (int fd,
+                                                     const gchar *auth_digest,
+                                                     CockpitSshOptions *options,
+                                                     const gchar *logname);
+
+JsonObject *        cockpit_ssh_mux_read_close      (int fd);
+
+int                 cockpit_ssh_mux_start_master    (const gchar *path,
+                                                     const gchar *connection_string,
+                                                     const gchar *auth_digest,
+                                                     ssh_session session,
+                                                     guint linger);
+
+JsonObject *        cockpit_ssh_mux_query_stats     (const gchar *path);
+
+G_END_DECLS
+
+#endif
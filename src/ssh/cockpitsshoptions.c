@@ -22,6 +22,7 @@
 #include "cockpitsshoptions.h"
 
 static const gchar *default_command = "cockpit-bridge";
+static const guint default_multiplex_linger = 60;
 
 static gboolean
 has_environment_val (gchar **env,
@@ -90,6 +91,28 @@ get_connect_to_unknown_hosts (gchar **env)
   return get_environment_bool (env, "COCKPIT_SSH_CONNECT_TO_UNKNOWN_HOSTS", FALSE);
 }
 
+static gboolean
+get_multiplex (gchar **env)
+{
+  if (cockpit_conf_bool (COCKPIT_CONF_SSH_SECTION, "Multiplex", FALSE))
+    return TRUE;
+
+  return get_environment_bool (env, "COCKPIT_SSH_MULTIPLEX", FALSE);
+}
+
+static guint
+get_multiplex_linger (gchar **env)
+{
+  const gchar *value = get_environment_val (env, "COCKPIT_SSH_MULTIPLEX_LINGER", NULL);
+  guint64 linger;
+
+  if (value && g_ascii_string_to_unsigned (value, 10, 0, G_MAXUINT, &linger, NULL))
+    return linger;
+
+  return cockpit_conf_uint (COCKPIT_CONF_SSH_SECTION, "MultiplexLinger",
+                            default_multiplex_linger, G_MAXUINT, 0);
+}
+
 CockpitSshOptions *
 cockpit_ssh_options_from_env (gchar **env)
 {
@@ -99,6 +122,8 @@ cockpit_ssh_options_from_env (gchar **env)
   options->command = get_environment_val (env, "COCKPIT_SSH_BRIDGE_COMMAND", default_command);
   options->remote_peer = get_environment_val (env, "COCKPIT_REMOTE_PEER", "localhost");
   options->connect_to_unknown_hosts = get_connect_to_unknown_hosts (env);
+  options->multiplex = get_multiplex (env);
+  options->multiplex_linger = get_multiplex_linger (env);
 
   return options;
 }
@@ -113,6 +138,14 @@ cockpit_ssh_options_to_env (CockpitSshOptions *options,
                              options->knownhosts_file);
   env = set_environment_val (env, "COCKPIT_REMOTE_PEER",
                              options->remote_peer);
+  env = set_environment_bool (env, "COCKPIT_SSH_MULTIPLEX",
+                              options->multiplex);
+  if (options->multiplex)
+    {
+      gchar *linger = g_strdup_printf ("%u", options->multiplex_linger);
+      env = set_environment_val (env, "COCKPIT_SSH_MULTIPLEX_LINGER", linger);
+      g_free (linger);
+    }
 
   /* Don't reset these vars unless we have values for them */
   if (options->command)
@@ -29,6 +29,8 @@ typedef struct {
   const gchar *command;
   const gchar *remote_peer;
   gboolean connect_to_unknown_hosts;
+  gboolean multiplex;
+  guint multiplex_linger;
 } CockpitSshOptions;
 
 CockpitSshOptions * cockpit_ssh_options_from_env   (gchar **env);
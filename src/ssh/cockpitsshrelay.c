@@ -31,6 +31,7 @@
 
 #include "cockpitsshrelay.h"
 #include "cockpitsshoptions.h"
+#include "cockpitsshmux.h"
 
 #include <libssh/libssh.h>
 #include <libssh/callbacks.h>
@@ -41,6 +42,7 @@
 #include <gssapi/gssapi_ext.h>
 
 #include <glib/gstdio.h>
+#include <glib-unix.h>
 
 #include <errno.h>
 #include <stdlib.h>
@@ -1383,10 +1385,48 @@ username_from_basic (const gchar *basic_data)
   return user;
 }
 
+static const gchar *
+open_session_channel (ssh_session session,
+                      const gchar *remote_peer,
+                      const gchar *logname,
+                      ssh_channel *out_channel)
+{
+  ssh_channel channel;
+  int rc;
+
+  channel = ssh_channel_new (session);
+  rc = ssh_channel_open_session (channel);
+  if (rc != SSH_OK)
+    {
+      g_message ("%s: couldn't open session: %s", logname,
+                 ssh_get_error (session));
+      ssh_channel_free (channel);
+      return "internal-error";
+    }
+
+  if (remote_peer)
+    {
+      /* Try to set the remote peer env var, this will
+       * often fail as ssh servers have to be configured
+       * to allow it.
+       */
+      rc = ssh_channel_request_env (channel, "COCKPIT_REMOTE_PEER", remote_peer);
+      if (rc != SSH_OK)
+        {
+          g_debug ("%s: Couldn't set COCKPIT_REMOTE_PEER: %s",
+                   logname, ssh_get_error (session));
+        }
+    }
+
+  g_debug ("%s: opened channel", logname);
+
+  *out_channel = channel;
+  return NULL;
+}
+
 static const gchar*
 cockpit_ssh_connect (CockpitSshData *data,
-                     const gchar *host_arg,
-                     ssh_channel *out_channel)
+                     const gchar *host_arg)
 {
   const gchar *ignore_hostkey;
   gboolean host_is_whitelisted;
@@ -1396,7 +1436,6 @@ cockpit_ssh_connect (CockpitSshData *data,
   guint port = 0;
   gchar *host = NULL;
 
-  ssh_channel channel;
   int rc;
 
   if (!parse_host (host_arg, &host, &data->username, &port))
@@ -1476,38 +1515,7 @@ cockpit_ssh_connect (CockpitSshData *data,
 
   /* The problem returned when auth failure */
   problem = cockpit_ssh_authenticate (data);
-  if (problem != NULL)
-    goto out;
-
-  channel = ssh_channel_new (data->session);
-  rc = ssh_channel_open_session (channel);
-  if (rc != SSH_OK)
-    {
-      g_message ("%s: couldn't open session: %s", data->logname,
-                 ssh_get_error (data->session));
-      problem = "internal-error";
-      goto out;
-    }
-
-  if (data->ssh_options->remote_peer)
-    {
-      /* Try to set the remote peer env var, this will
-       * often fail as ssh servers have to be configured
-       * to allow it.
-       */
-      rc = ssh_channel_request_env (channel, "COCKPIT_REMOTE_PEER",
-                                    data->ssh_options->remote_peer);
-      if (rc != SSH_OK)
-        {
-          g_debug ("%s: Couldn't set COCKPIT_REMOTE_PEER: %s",
-                   data->logname,
-                   ssh_get_error (data->session));
-        }
-    }
-
-  g_debug ("%s: opened channel", data->logname);
 
-  *out_channel = channel;
 out:
   g_free (host);
   return problem;
@@ -1516,6 +1524,9 @@ out:
 static void
 cockpit_ssh_data_free (CockpitSshData *data)
 {
+  if (data == NULL)
+    return;
+
   if (data->initial_auth_data)
     {
       memset (data->initial_auth_data, 0, strlen (data->initial_auth_data));
@@ -1548,6 +1559,7 @@ struct  _CockpitSshRelay {
   CockpitSshData *ssh_data;
 
   gboolean sent_disconnect;
+  guint emit_disconnect;
   gboolean received_eof;
   gboolean received_frame;
   gboolean received_close;
@@ -1572,6 +1584,16 @@ struct  _CockpitSshRelay {
   ssh_channel channel;
   ssh_event event;
 
+  /* Session and event belong to a multiplexer master */
+  gboolean shared_session;
+  /* Session was taken over by a multiplexer master we forked */
+  gboolean session_handed_off;
+  int err_fd;
+
+  /* Attached to a multiplexer master */
+  int mux_fd;
+  guint mux_watch;
+
   GSource *io;
 
   struct ssh_channel_callbacks_struct channel_cbs;
@@ -1585,7 +1607,8 @@ static guint sig_disconnect = 0;
 
 enum {
   PROP_0,
-  PROP_CONNECTION_STRING
+  PROP_CONNECTION_STRING,
+  PROP_SESSION,
 };
 
 G_DEFINE_TYPE (CockpitSshRelay, cockpit_ssh_relay, G_TYPE_OBJECT);
@@ -1608,6 +1631,14 @@ cockpit_ssh_relay_dispose (GObject *object)
   if (self->io)
     g_source_destroy (self->io);
 
+  if (self->mux_watch)
+    g_source_remove (self->mux_watch);
+  self->mux_watch = 0;
+
+  if (self->emit_disconnect)
+    g_source_remove (self->emit_disconnect);
+  self->emit_disconnect = 0;
+
   G_OBJECT_CLASS (cockpit_ssh_relay_parent_class)->dispose (object);
 }
 
@@ -1621,12 +1652,24 @@ cockpit_ssh_relay_finalize (GObject *object)
 
   g_queue_free_full (self->queue, (GDestroyNotify)g_bytes_unref);
 
-  if (self->event)
-    ssh_event_free (self->event);
+  if (self->shared_session)
+    {
+      /* The session outlives us, so give back the channel */
+      if (self->channel)
+        {
+          ssh_remove_channel_callbacks (self->channel, &self->channel_cbs);
+          ssh_channel_free (self->channel);
+        }
+    }
+  else
+    {
+      if (self->event)
+        ssh_event_free (self->event);
 
-  /* libssh channels like to hang around even after they're freed */
-  if (self->channel)
-    memset (&self->channel_cbs, 0, sizeof (self->channel_cbs));
+      /* libssh channels like to hang around even after they're freed */
+      if (self->channel)
+        memset (&self->channel_cbs, 0, sizeof (self->channel_cbs));
+    }
 
   g_free (self->logname);
   g_free (self->connection_string);
@@ -1634,8 +1677,18 @@ cockpit_ssh_relay_finalize (GObject *object)
   if (self->io)
     g_source_unref (self->io);
 
-  ssh_disconnect (self->session);
-  ssh_free (self->session);
+  if (self->err_fd >= 0)
+    close (self->err_fd);
+  if (self->mux_fd >= 0)
+    close (self->mux_fd);
+
+  if (!self->shared_session)
+    {
+      /* Our copy of a handed off session must not talk to the server */
+      if (!self->session_handed_off)
+        ssh_disconnect (self->session);
+      ssh_free (self->session);
+    }
 
   G_OBJECT_CLASS (cockpit_ssh_relay_parent_class)->finalize (object);
 }
@@ -1645,10 +1698,15 @@ emit_disconnect (gpointer user_data)
 {
   CockpitSshRelay *self = user_data;
 
+  self->emit_disconnect = 0;
   if (!self->sent_disconnect)
     {
       self->sent_disconnect = TRUE;
+
+      /* Handlers may drop the last reference */
+      g_object_ref (self);
       g_signal_emit (self, sig_disconnect, 0);
+      g_object_unref (self);
     }
 
   return FALSE;
@@ -1666,14 +1724,28 @@ cockpit_relay_disconnect (CockpitSshRelay *self,
     }
 
   /* libssh channels like to hang around even after they're freed */
-  if (self->channel)
-      memset (&self->channel_cbs, 0, sizeof (self->channel_cbs));
-  self->channel = NULL;
+  if (self->shared_session)
+    {
+      /* Freed along with us, outside of any channel callback */
+      if (self->channel)
+        ssh_remove_channel_callbacks (self->channel, &self->channel_cbs);
+    }
+  else
+    {
+      if (self->channel)
+        memset (&self->channel_cbs, 0, sizeof (self->channel_cbs));
+      self->channel = NULL;
+    }
 
   if (self->io)
     g_source_destroy (self->io);
 
-  g_timeout_add (0, emit_disconnect, self);
+  if (self->mux_watch)
+    g_source_remove (self->mux_watch);
+  self->mux_watch = 0;
+
+  if (!self->emit_disconnect)
+    self->emit_disconnect = g_timeout_add (0, emit_disconnect, self);
 }
 
 static int
@@ -1730,7 +1802,10 @@ on_channel_data (ssh_session session,
 
   if (is_stderr || self->exit_code == NO_COCKPIT)
     {
-      g_printerr ("%.*s", (int) len, bdata);
+      if (self->err_fd >= 0)
+        cockpit_fd_write_all (self->err_fd, bdata, len);
+      else
+        g_printerr ("%.*s", (int) len, bdata);
       ret = len;
     }
   else if (self->received_frame)
@@ -2198,12 +2273,12 @@ cockpit_ssh_relay_start_source (CockpitSshRelay *self) {
   return source;
 }
 
-static void
-cockpit_ssh_relay_start (CockpitSshRelay *self)
+static const gchar *
+cockpit_ssh_relay_attach_channel (CockpitSshRelay *self,
+                                  const gchar *command,
+                                  int in,
+                                  int out)
 {
-  const gchar *problem;
-  int in;
-  int out;
   int rc;
 
   static struct ssh_channel_callbacks_struct channel_cbs = {
@@ -2215,24 +2290,18 @@ cockpit_ssh_relay_start (CockpitSshRelay *self)
     .channel_exit_status_function = on_channel_exit_status,
   };
 
-  self->ssh_data->initial_auth_data = challenge_for_auth_data ("*", &self->ssh_data->auth_type);
-
-  problem = cockpit_ssh_connect (self->ssh_data, self->connection_string, &self->channel);
-  if (problem)
-    goto out;
-
-  self->event = ssh_event_new ();
   memcpy (&self->channel_cbs, &channel_cbs, sizeof (channel_cbs));
   self->channel_cbs.userdata = self;
   ssh_callbacks_init (&self->channel_cbs);
   ssh_set_channel_callbacks (self->channel, &self->channel_cbs);
-  ssh_set_blocking (self->session, 0);
-  ssh_event_add_session (self->event, self->session);
 
-  in = dup (0);
-  g_assert (in >= 0);
-  out = dup (1);
-  g_assert (out >= 0);
+  /* A shared session is already part of the multiplexer's event */
+  if (!self->shared_session)
+    {
+      self->event = ssh_event_new ();
+      ssh_set_blocking (self->session, 0);
+      ssh_event_add_session (self->event, self->session);
+    }
 
   self->pipe = g_object_new (COCKPIT_TYPE_PIPE,
                              "in-fd", in,
@@ -2249,18 +2318,142 @@ cockpit_ssh_relay_start (CockpitSshRelay *self)
                                       self);
 
   for (rc = SSH_AGAIN; rc == SSH_AGAIN; )
-    rc = ssh_channel_request_exec (self->channel, self->ssh_data->ssh_options->command);
+    rc = ssh_channel_request_exec (self->channel, command);
 
   if (rc != SSH_OK)
     {
       g_message ("%s: couldn't execute command: %s: %s", self->logname,
-                 self->ssh_data->ssh_options->command,
-                 ssh_get_error (self->session));
-      problem = "internal-error";
-      goto out;
+                 command, ssh_get_error (self->session));
+      return "internal-error";
     }
 
   self->io = cockpit_ssh_relay_start_source (self);
+  return NULL;
+}
+
+static gboolean
+on_mux_close (gint fd,
+              GIOCondition cond,
+              gpointer user_data)
+{
+  CockpitSshRelay *self = user_data;
+  gboolean received_frame = TRUE;
+  gint64 exit_code = 0;
+  JsonObject *object;
+
+  self->mux_watch = 0;
+
+  object = cockpit_ssh_mux_read_close (fd);
+  if (object)
+    {
+      if (!cockpit_json_get_int (object, "exit-code", 0, &exit_code) ||
+          !cockpit_json_get_bool (object, "received-frame", TRUE, &received_frame))
+        g_message ("%s: invalid close message from ssh multiplexer", self->logname);
+      json_object_unref (object);
+    }
+  else
+    {
+      g_message ("%s: ssh multiplexer went away", self->logname);
+      exit_code = DISCONNECTED;
+    }
+
+  self->received_exit = TRUE;
+  self->received_frame = received_frame;
+  if (!self->exit_code)
+    self->exit_code = exit_code;
+
+  /* The remote bridge has already sent its own init message */
+  if (received_frame)
+    {
+      cockpit_ssh_data_free (self->ssh_data);
+      self->ssh_data = NULL;
+    }
+  else if (!self->exit_code)
+    {
+      self->exit_code = NO_COCKPIT;
+    }
+
+  cockpit_relay_disconnect (self, NULL);
+  return FALSE;
+}
+
+static const gchar *
+cockpit_ssh_relay_attach_mux (CockpitSshRelay *self,
+                              int fd,
+                              const gchar *auth_digest)
+{
+  const gchar *problem;
+
+  problem = cockpit_ssh_mux_open (fd, auth_digest, self->ssh_data->ssh_options, self->logname);
+  if (problem)
+    {
+      close (fd);
+      return problem;
+    }
+
+  /* Our stdio now belongs to the channel in the master, wait for it to finish */
+  self->mux_fd = fd;
+  self->mux_watch = g_unix_fd_add (fd, G_IO_IN | G_IO_HUP | G_IO_ERR, on_mux_close, self);
+  return NULL;
+}
+
+static void
+cockpit_ssh_relay_start (CockpitSshRelay *self)
+{
+  g_autofree gchar *auth_digest = NULL;
+  g_autofree gchar *mux_path = NULL;
+  CockpitSshOptions *options;
+  const gchar *problem;
+  int in;
+  int out;
+  int fd;
+
+  self->ssh_data->initial_auth_data = challenge_for_auth_data ("*", &self->ssh_data->auth_type);
+  options = self->ssh_data->ssh_options;
+
+  if (options->multiplex)
+    {
+      mux_path = cockpit_ssh_mux_socket_path (self->connection_string, options);
+      auth_digest = cockpit_ssh_mux_auth_digest (self->ssh_data->auth_type,
+                                                 self->ssh_data->initial_auth_data);
+    }
+
+  /* Try to reuse an already authenticated session to this host */
+  if (mux_path)
+    {
+      fd = cockpit_ssh_mux_connect (mux_path);
+      if (fd >= 0 && cockpit_ssh_relay_attach_mux (self, fd, auth_digest) == NULL)
+        return;
+    }
+
+  problem = cockpit_ssh_connect (self->ssh_data, self->connection_string);
+  if (problem)
+    goto out;
+
+  /* Let a multiplexer master take over our session, and be its first client */
+  if (mux_path)
+    {
+      fd = cockpit_ssh_mux_start_master (mux_path, self->connection_string, auth_digest,
+                                         self->session, options->multiplex_linger);
+      if (fd >= 0)
+        {
+          self->session_handed_off = TRUE;
+          problem = cockpit_ssh_relay_attach_mux (self, fd, auth_digest);
+          goto out;
+        }
+    }
+
+  problem = open_session_channel (self->session, options->remote_peer,
+                                  self->logname, &self->channel);
+  if (problem)
+    goto out;
+
+  in = dup (0);
+  g_assert (in >= 0);
+  out = dup (1);
+  g_assert (out >= 0);
+
+  problem = cockpit_ssh_relay_attach_channel (self, options->command, in, out);
 
 out:
   if (problem)
@@ -2278,6 +2471,8 @@ cockpit_ssh_relay_init (CockpitSshRelay *self)
   ssh_init ();
 
   self->queue = g_queue_new ();
+  self->err_fd = -1;
+  self->mux_fd = -1;
   debug = g_getenv ("G_MESSAGES_DEBUG");
 
   if (debug && (strstr (debug, "libssh") || g_strcmp0 (debug, "all") == 0))
@@ -2298,6 +2493,9 @@ cockpit_ssh_relay_set_property (GObject *obj,
       self->connection_string = g_value_dup_string (value);
       self->logname = g_strdup_printf ("cockpit-ssh %s", self->connection_string);
       break;
+    case PROP_SESSION:
+      self->session = g_value_get_pointer (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
       break;
@@ -2311,6 +2509,13 @@ cockpit_ssh_relay_constructed (GObject *object)
 
   G_OBJECT_CLASS (cockpit_ssh_relay_parent_class)->constructed (object);
 
+  /* Channels on a multiplexed session don't authenticate */
+  if (self->session)
+    {
+      self->shared_session = TRUE;
+      return;
+    }
+
   self->session = ssh_new ();
   self->ssh_data = g_new0 (CockpitSshData, 1);
   self->ssh_data->env = g_get_environ ();
@@ -2340,6 +2545,10 @@ cockpit_ssh_relay_class_init (CockpitSshRelayClass *klass)
          g_param_spec_string ("connection-string", NULL, NULL, "localhost",
                               G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (object_class, PROP_SESSION,
+         g_param_spec_pointer ("session", NULL, NULL,
+                               G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
+
   sig_disconnect = g_signal_new ("disconnect", COCKPIT_TYPE_SSH_RELAY,
                                  G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
                                  G_TYPE_NONE, 0);
@@ -2358,8 +2567,72 @@ cockpit_ssh_relay_new (const gchar *connection_string)
   return self;
 }
 
+/**
+ * cockpit_ssh_relay_new_channel:
+ * @connection_string: the [user@]host[:port] @session is connected to
+ * @session: an authenticated session shared with other relays
+ * @event: the event @session is processed with
+ * @command: the bridge command to run
+ * @remote_peer: value for COCKPIT_REMOTE_PEER, or %NULL
+ * @in_fd: read channel input from here
+ * @out_fd: write channel output here
+ * @err_fd: write channel stderr here
+ * @problem: set to a problem code on failure
+ *
+ * Used by the ssh multiplexer to run another bridge over an existing
+ * session. The relay takes ownership of the fds, even on failure.
+ *
+ * Returns: a relay, or %NULL with @problem set
+ */
+CockpitSshRelay *
+cockpit_ssh_relay_new_channel (const gchar *connection_string,
+                               ssh_session session,
+                               ssh_event event,
+                               const gchar *command,
+                               const gchar *remote_peer,
+                               int in_fd,
+                               int out_fd,
+                               int err_fd,
+                               const gchar **problem)
+{
+  CockpitSshRelay *self;
+
+  self = g_object_new (COCKPIT_TYPE_SSH_RELAY,
+                       "connection-string", connection_string,
+                       "session", session,
+                       NULL);
+  self->event = event;
+  self->err_fd = err_fd;
+
+  /* Be quick about opening the channel, other channels wait meanwhile */
+  ssh_set_blocking (session, 1);
+  *problem = open_session_channel (session, remote_peer, self->logname, &self->channel);
+  if (*problem == NULL)
+    *problem = cockpit_ssh_relay_attach_channel (self, command, in_fd, out_fd);
+  ssh_set_blocking (session, 0);
+
+  if (*problem == NULL)
+    return self;
+
+  /* Not yet handed over to a pipe */
+  if (!self->pipe)
+    {
+      close (in_fd);
+      close (out_fd);
+    }
+
+  g_object_unref (self);
+  return NULL;
+}
+
 gint
 cockpit_ssh_relay_result (CockpitSshRelay* self)
 {
   return self->exit_code;
 }
+
+gboolean
+cockpit_ssh_relay_received_frame (CockpitSshRelay *self)
+{
+  return self->received_frame;
+}
@@ -23,6 +23,8 @@
 #include <glib.h>
 #include <glib-object.h>
 
+#include <libssh/libssh.h>
+
 G_BEGIN_DECLS
 
 /* EXIT CODE CONSTANTS */
@@ -41,8 +43,20 @@ GType                   cockpit_ssh_relay_get_type     (void) G_GNUC_CONST;
 
 CockpitSshRelay *       cockpit_ssh_relay_new          (const gchar *connection_string);
 
+CockpitSshRelay *       cockpit_ssh_relay_new_channel  (const gchar *connection_string,
+                                                        ssh_session session,
+                                                        ssh_event event,
+                                                        const gchar *command,
+                                                        const gchar *remote_peer,
+                                                        int in_fd,
+                                                        int out_fd,
+                                                        int err_fd,
+                                                        const gchar **problem);
+
 gint                    cockpit_ssh_relay_result       (CockpitSshRelay* self);
 
+gboolean                cockpit_ssh_relay_received_frame (CockpitSshRelay *self);
+
 G_END_DECLS
 
 #endif
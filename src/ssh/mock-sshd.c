@@ -402,6 +402,11 @@ do_exec (ssh_event event,
   return 0;
 }
 
+static int
+channel_open_callback (ssh_session session,
+                       ssh_message message,
+                       gpointer user_data);
+
 static int
 channel_request_callback (ssh_session session,
                           ssh_message message,
@@ -409,6 +414,10 @@ channel_request_callback (ssh_session session,
 {
   const gchar *cmd;
 
+  /* Another channel on the same session, once the previous one is done */
+  if (ssh_message_type (message) == SSH_REQUEST_CHANNEL_OPEN && state.channel == NULL)
+    return channel_open_callback (session, message, &state.channel);
+
   /* wait for a shell */
   switch (ssh_message_type (message))
     {
@@ -471,6 +480,8 @@ deny:
   return 1;
 accept:
   ssh_set_message_callback (state.session, channel_request_callback, NULL);
+  g_byte_array_set_size (state.buffer, 0);
+  state.buffer_eof = FALSE;
   *channel = ssh_message_channel_request_open_reply_accept (message);
   return 0;
 }
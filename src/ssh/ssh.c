@@ -22,11 +22,57 @@
 #include <gio/gio.h>
 
 #include "common/cockpithacks-glib.h"
+#include "common/cockpitjson.h"
 #include "common/cockpittest.h"
 #include "common/cockpitsystem.h"
 
+#include "cockpitsshmux.h"
+#include "cockpitsshoptions.h"
 #include "cockpitsshrelay.h"
 
+static gboolean opt_multiplex_stats = FALSE;
+
+static GOptionEntry entries[] = {
+  { "multiplex-stats", 0, 0, G_OPTION_ARG_NONE, &opt_multiplex_stats,
+    "Show statistics of the multiplexed connection to the host", NULL },
+  { NULL }
+};
+
+static gint
+print_multiplex_stats (const gchar *connection_string)
+{
+  CockpitSshOptions *options;
+  gchar **env = g_get_environ ();
+  JsonObject *stats = NULL;
+  gint ret = 1;
+  gchar *path;
+  gchar *output;
+
+  options = cockpit_ssh_options_from_env (env);
+  path = cockpit_ssh_mux_socket_path (connection_string, options);
+  if (path)
+    stats = cockpit_ssh_mux_query_stats (path);
+
+  if (stats)
+    {
+      json_object_remove_member (stats, "command");
+      output = cockpit_json_write_object (stats, NULL);
+      g_print ("%s\n", output);
+      g_free (output);
+      json_object_unref (stats);
+      ret = 0;
+    }
+  else
+    {
+      g_printerr ("cockpit-ssh: no multiplexed connection to %s\n", connection_string);
+    }
+
+  g_free (path);
+  g_free (options);
+  g_strfreev (env);
+  return ret;
+}
+
 
 int
 main (int argc,
@@ -57,6 +103,7 @@ main (int argc,
   cockpit_setenv_check ("GIO_USE_VFS", "local", TRUE);
 
   context = g_option_context_new ("- cockpit-ssh [user@]host[:port]");
+  g_option_context_add_main_entries (context, entries, NULL);
 
   if (!g_option_context_parse (context, &argc, &argv, &error))
     {
@@ -71,6 +118,12 @@ main (int argc,
       goto out;
     }
 
+  if (opt_multiplex_stats)
+    {
+      ret = print_multiplex_stats (argv[1]);
+      goto out;
+    }
+
   loop = g_main_loop_new (NULL, FALSE);
 
   relay = cockpit_ssh_relay_new (argv[1]);
@@ -34,6 +34,7 @@
 #include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 
 #define TIMEOUT 120
 
@@ -57,6 +58,11 @@ typedef struct {
   gchar *home_ssh_dir;
   gchar *home_knownhosts_file;
   gchar *home_ssh_config_file;
+
+  /* multiplexing */
+  gchar *runtime_dir;
+  gchar **env;
+  gchar *host;
 } TestCase;
 
 typedef struct {
@@ -75,6 +81,7 @@ typedef struct {
     const char *problem;
     const char *ssh_config_identity_file;
     gboolean allow_unknown;
+    gboolean multiplex;
     gboolean test_home_ssh_config;
     enum { USER_NONE = 0, USER_INVALID, USER_INVALID_HOST_PRIORITY, USER_ME } ssh_config_user;
     enum { PORT_VALID = 0, PORT_INVALID_HOST_PRIORITY } ssh_config_port;
@@ -230,6 +237,13 @@ setup_env (const TestFixture *fix)
 
   env = g_environ_setenv (env, "COCKPIT_SSH_KNOWN_HOSTS_FILE",
                           knownhosts_file, TRUE);
+
+  if (fix && fix->multiplex)
+    {
+      env = g_environ_setenv (env, "COCKPIT_SSH_MULTIPLEX", "1", TRUE);
+      env = g_environ_setenv (env, "COCKPIT_SSH_MULTIPLEX_LINGER", "30", TRUE);
+    }
+
   return env;
 }
 
@@ -373,6 +387,18 @@ setup (TestCase *tc,
       env = g_environ_setenv (env, "PATH", path, TRUE);
     }
 
+  if (fixture->multiplex)
+    {
+      /* A private runtime dir for the multiplexer socket */
+      tc->runtime_dir = g_dir_make_tmp ("runtime.XXXXXX", NULL);
+      g_assert (tc->runtime_dir != NULL);
+      env = g_environ_setenv (env, "XDG_RUNTIME_DIR", tc->runtime_dir, TRUE);
+
+      /* Tests start more relays to the same host */
+      tc->env = g_strdupv (env);
+      tc->host = g_strdup (host);
+    }
+
   tc->transport = start_bridge (env, (gchar **) argv);
   g_signal_connect (tc->transport, "closed", G_CALLBACK (on_closed_set_flag), &tc->closed);
   g_strfreev (env);
@@ -416,6 +442,21 @@ teardown (TestCase *tc,
       g_spawn_close_pid (tc->mock_sshd);
     }
 
+  if (tc->runtime_dir)
+    {
+      gchar *mux_dir = g_build_filename (tc->runtime_dir, "cockpit-ssh", NULL);
+
+      /* The multiplexer master removes its socket once mock-sshd is gone */
+      while (rmdir (mux_dir) < 0 && errno == ENOTEMPTY)
+        g_usleep (10 * 1000);
+      rmdir (tc->runtime_dir);
+
+      g_free (mux_dir);
+      g_free (tc->runtime_dir);
+      g_strfreev (tc->env);
+      g_free (tc->host);
+    }
+
   alarm (0);
 }
 
@@ -606,6 +647,104 @@ test_echo_and_close (TestCase *tc,
   json_object_unref (init);
 }
 
+static const TestFixture fixture_multiplex = {
+  .ssh_command = BUILDDIR "/mock-echo",
+  .multiplex = TRUE,
+};
+
+static JsonObject *
+query_multiplex_stats (TestCase *tc)
+{
+  const gchar *argv[] = { BUILDDIR "/cockpit-ssh", "--multiplex-stats", tc->host, NULL };
+  GError *error = NULL;
+  gchar *output = NULL;
+  JsonObject *stats;
+  gint status;
+
+  g_spawn_sync (BUILDDIR, (gchar **)argv, tc->env, 0, NULL, NULL,
+                &output, NULL, &status, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (status, ==, 0);
+
+  stats = cockpit_json_parse_object (output, -1, &error);
+  g_assert_no_error (error);
+  g_free (output);
+  return stats;
+}
+
+static int
+connect_multiplexer (TestCase *tc)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  const gchar *name;
+  gchar *dir;
+  GDir *d;
+  int fd;
+
+  /* The only socket in our private runtime dir */
+  dir = g_build_filename (tc->runtime_dir, "cockpit-ssh", NULL);
+  d = g_dir_open (dir, 0, NULL);
+  g_assert (d != NULL);
+  name = g_dir_read_name (d);
+  g_assert (name != NULL);
+  g_snprintf (addr.sun_path, sizeof (addr.sun_path), "%s/%s", dir, name);
+  g_dir_close (d);
+  g_free (dir);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpint (connect (fd, (struct sockaddr *)&addr, sizeof (addr)), ==, 0);
+  return fd;
+}
+
+static void
+test_multiplex (TestCase *tc,
+                gconstpointer data)
+{
+  const gchar *argv[] = { BUILDDIR "/cockpit-ssh", tc->host, NULL };
+  JsonObject *stats;
+  JsonObject *init;
+  gchar buf[1];
+  int stalled;
+  gint i;
+
+  do_fixture_auth (tc->transport, data);
+  init = wait_until_transport_init (tc->transport, NULL);
+  do_echo_and_close (tc);
+  json_object_unref (init);
+
+  /* A client that starts its request and then stalls doesn't hold up the others */
+  stalled = connect_multiplexer (tc);
+  g_assert_cmpint (write (stalled, "50\n{", 4), ==, 4);
+
+  /*
+   * mock-sshd only ever accepts a single connection, so these can only
+   * work when they reuse the session of the first relay.
+   */
+  for (i = 0; i < 2; i++)
+    {
+      g_object_unref (tc->transport);
+      tc->closed = FALSE;
+
+      tc->transport = start_bridge (tc->env, (gchar **)argv);
+      g_signal_connect (tc->transport, "closed", G_CALLBACK (on_closed_set_flag), &tc->closed);
+
+      do_fixture_auth (tc->transport, data);
+      init = wait_until_transport_init (tc->transport, NULL);
+      do_echo_and_close (tc);
+      json_object_unref (init);
+    }
+
+  stats = query_multiplex_stats (tc);
+  cockpit_assert_json_eq (stats, "{\"channels\":3,\"active\":0,\"handshakes-avoided\":2,\"refused\":0}");
+  json_object_unref (stats);
+
+  /* Still waiting for the rest of its request, rather than timed out */
+  g_assert_cmpint (recv (stalled, buf, sizeof (buf), MSG_DONTWAIT), ==, -1);
+  g_assert_cmpint (errno, ==, EAGAIN);
+  close (stalled);
+}
+
 static void
 test_echo_queue (TestCase *tc,
                  gconstpointer data)
@@ -1473,6 +1612,8 @@ main (int argc,
               setup, test_echo_queue, teardown);
   g_test_add ("/ssh-bridge/echo-large", TestCase, &fixture_cat,
               setup, test_echo_large, teardown);
+  g_test_add ("/ssh-bridge/multiplex", TestCase, &fixture_multiplex,
+              setup, test_multiplex, teardown);
 
   if (have_ipv6 ())
     g_test_add ("/ssh-bridge/ipv6-address", TestCase, &fixture_ipv6_address,
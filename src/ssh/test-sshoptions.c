@@ -109,6 +109,36 @@ test_ssh_options_deprecated (void)
   g_strfreev (env);
 }
 
+static void
+test_ssh_options_multiplex (void)
+{
+  gchar **env = NULL;
+  CockpitSshOptions *options = NULL;
+
+  options = cockpit_ssh_options_from_env (NULL);
+  g_assert_false (options->multiplex);
+  g_assert_cmpuint (options->multiplex_linger, ==, 60);
+  g_free (options);
+
+  env = g_environ_setenv (NULL, "COCKPIT_SSH_MULTIPLEX", "1", TRUE);
+  env = g_environ_setenv (env, "COCKPIT_SSH_MULTIPLEX_LINGER", "5", TRUE);
+  options = cockpit_ssh_options_from_env (env);
+  g_assert_true (options->multiplex);
+  g_assert_cmpuint (options->multiplex_linger, ==, 5);
+  g_strfreev (env);
+
+  env = cockpit_ssh_options_to_env (options, NULL);
+  g_assert_cmpstr (g_environ_getenv (env, "COCKPIT_SSH_MULTIPLEX"), ==, "1");
+  g_assert_cmpstr (g_environ_getenv (env, "COCKPIT_SSH_MULTIPLEX_LINGER"), ==, "5");
+  g_free (options);
+
+  env = g_environ_setenv (env, "COCKPIT_SSH_MULTIPLEX_LINGER", "bogus", TRUE);
+  options = cockpit_ssh_options_from_env (env);
+  g_assert_cmpuint (options->multiplex_linger, ==, 60);
+  g_free (options);
+  g_strfreev (env);
+}
+
 static void
 test_ssh_options_alt_conf (void)
 {
@@ -143,6 +173,7 @@ main (int argc,
 
   g_test_add_func ("/ssh-options/basic", test_ssh_options);
   g_test_add_func ("/ssh-options/deprecated", test_ssh_options_deprecated);
+  g_test_add_func ("/ssh-options/multiplex", test_ssh_options_multiplex);
   g_test_add_func ("/ssh-options/alt-conf", test_ssh_options_alt_conf);
   g_test_add_func ("/ssh-options/deprecated-conf", test_ssh_options_conf_deprecated);
 
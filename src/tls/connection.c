@@ -40,6 +40,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/timerfd.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
@@ -55,6 +56,7 @@
 #include "certificate.h"
 #include "client-certificate.h"
 #include "socket-io.h"
+#include "stats.h"
 #include "utils.h"
 
 /* cockpit-tls TCP server state (singleton) */
@@ -63,16 +65,88 @@ static struct {
   Certificate *certificate;
   int wsinstance_sockdir;
   int cert_session_dir;
+  bool session_tickets;
+  bool fixed_buffers;
 } parameters = {
   .wsinstance_sockdir = -1,
   .cert_session_dir = -1
 };
 
+/* Replace the session ticket key this often; older tickets then need a full handshake */
+#define TICKET_KEY_LIFETIME (6 * 60 * 60)
+
+/* Remember unused wsinstances, and finished activations, this long */
+#define WSINSTANCE_LIFETIME 30
+
+/*
+ * A cockpit-ws instance which we relay connections to. The dynamic ones
+ * are named by their client certificate fingerprint, the static ones
+ * after their socket.
+ *
+ * Dynamic instances get started by a request to https-factory.sock. Only
+ * one such activation is in flight per instance: other connections which
+ * need the same instance wait for its outcome.
+ */
+typedef struct WsInstance {
+  struct WsInstance *next;
+  char name[WSINSTANCE_MAX];
+  unsigned connections;
+  bool pending;
+  bool success;
+  unsigned waiters;
+  unsigned long activations; /* number of finished activations */
+  unsigned long generation; /* shared.generation after the last one */
+  time_t last_used;
+} WsInstance;
+
+/* Shared between the connection threads, protected by the mutex */
+static struct {
+  pthread_mutex_t mutex;
+  gnutls_datum_t ticket_key;
+  time_t ticket_key_created;
+  pthread_cond_t activated;
+  WsInstance *wsinstances;
+  unsigned long generation; /* number of finished activations, of any instance */
+  pthread_t preactivate_thread;
+  bool preactivating;
+} shared = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .activated = PTHREAD_COND_INITIALIZER,
+};
+
+/* Shared between the connection threads, without locking; see stats.h */
+static struct {
+  atomic_ulong handshakes_full;
+  atomic_ulong handshakes_resumed;
+  atomic_ulong handshakes_failed;
+  Histogram handshake_usec;
+  atomic_ulong bytes_client_to_ws;
+  atomic_ulong bytes_ws_to_client;
+  atomic_ulong wakeups;
+  Histogram wakeups_per_connection;
+  atomic_ulong activation_requests;
+  atomic_ulong activation_failures;
+  Histogram activation_usec;
+} stats;
+
+/*
+ * Buffers start out small, and double in size each time a read fills
+ * them, up to the maximum. Once a connection goes idle with empty
+ * buffers, they shrink back again.
+ */
+#define BUFFER_MIN_SIZE (16u << 10) /* 16KiB */
+#define BUFFER_MAX_SIZE (256u << 10) /* 256KiB */
+#define BUFFER_IDLE_TIMEOUT 1000 /* ms */
+
 typedef struct
 {
-  char buffer[16u << 10]; /* 16KiB */
+  char *buffer;
+  unsigned size; /* always a power of 2 */
   unsigned start, end;
   bool eof, shut_rd, shut_wr;
+  bool flushing; /* corked data still in the TLS session */
+  bool resend; /* the TLS session holds a record of our data */
+  atomic_ulong *bytes_counter;
 #ifdef DEBUG
   const char *name;
 #endif
@@ -90,20 +164,33 @@ typedef struct {
 
   char *client_cert_filename;
   char *wsinstance;
+  WsInstance *instance;
   int metadata_fd;
+  unsigned long wakeups;
 } Connection;
 
-#define BUFFER_SIZE (sizeof ((Buffer *) 0)->buffer)
-#define BUFFER_MASK (BUFFER_SIZE - 1)
+static_assert (!(BUFFER_MIN_SIZE & (BUFFER_MIN_SIZE - 1)), "buffer size not a power of 2");
+static_assert (!(BUFFER_MAX_SIZE & (BUFFER_MAX_SIZE - 1)), "buffer size not a power of 2");
+static_assert ((typeof (((Buffer *) 0)->start)) BUFFER_MAX_SIZE, "buffer is too big");
 
-static_assert (!(BUFFER_SIZE & BUFFER_MASK), "buffer size not a power of 2");
-static_assert ((typeof (((Buffer *) 0)->start)) BUFFER_SIZE, "buffer is too big");
+static void
+buffer_init (Buffer *self)
+{
+  self->size = BUFFER_MIN_SIZE;
+  self->buffer = mallocx (self->size);
+}
 
+static void
+buffer_free (Buffer *self)
+{
+  free (self->buffer);
+  self->buffer = NULL;
+}
 
 static inline bool
 buffer_full (Buffer *self)
 {
-  return self->end - self->start == BUFFER_SIZE;
+  return self->end - self->start == self->size;
 }
 
 static inline bool
@@ -121,7 +208,7 @@ buffer_can_read (Buffer *self)
 static inline bool
 buffer_can_write (Buffer *self)
 {
-  return !self->shut_wr && !buffer_empty (self);
+  return !self->shut_wr && (!buffer_empty (self) || self->flushing);
 }
 
 static inline bool
@@ -133,7 +220,7 @@ buffer_needs_shut_rd (Buffer *self)
 static inline bool
 buffer_needs_shut_wr (Buffer *self)
 {
-  return self->eof && buffer_empty (self) && !self->shut_wr;
+  return self->eof && buffer_empty (self) && !self->flushing && !self->shut_wr;
 }
 
 static inline bool
@@ -170,7 +257,7 @@ buffer_epipe (Buffer *self)
 static inline bool
 buffer_valid (Buffer *self)
 {
-  return self->end - self->start <= BUFFER_SIZE;
+  return self->end - self->start <= self->size;
 }
 
 static short
@@ -190,25 +277,25 @@ calculate_revents (Buffer *reader,
 static int
 get_iovecs (struct iovec *iov,
             int           iov_length,
-            char         *buffer,
+            Buffer       *self,
             unsigned      start,
             unsigned      end)
 {
   int i = 0;
 
-  debug (IOVEC, "  get_iovecs (%p, %i, %p, 0x%x, 0x%x)", iov, iov_length, buffer, start, end);
-  assert (end - start <= BUFFER_SIZE);
+  debug (IOVEC, "  get_iovecs (%p, %i, %p/0x%x, 0x%x, 0x%x)", iov, iov_length, self->buffer, self->size, start, end);
+  assert (end - start <= self->size);
 
   for (i = 0; i < iov_length && start != end; i++)
     {
-      unsigned start_offset = start & BUFFER_MASK;
+      unsigned start_offset = start & (self->size - 1);
 
-      iov[i].iov_base = &buffer[start_offset];
-      iov[i].iov_len = MIN(BUFFER_SIZE - start_offset, end - start);
+      iov[i].iov_base = &self->buffer[start_offset];
+      iov[i].iov_len = MIN(self->size - start_offset, end - start);
       start += iov[i].iov_len;
 
       debug (IOVEC, "    iov[%i] = { 0x%zx, 0x%zx };  start = 0x%x;", i,
-             ((char *) iov[i].iov_base - buffer), iov[i].iov_len, start);
+             ((char *) iov[i].iov_base - self->buffer), iov[i].iov_len, start);
     }
 
   debug (IOVEC, "    return %i;", i);
@@ -216,6 +303,55 @@ get_iovecs (struct iovec *iov,
   return i;
 }
 
+static void
+buffer_resize (Buffer   *self,
+               unsigned  size)
+{
+  struct iovec iov[2];
+  unsigned length = 0;
+  char *buffer;
+  int iovcnt;
+
+  assert (self->end - self->start <= size);
+
+  debug (BUFFER, "buffer_resize (%s/0x%x/0x%x, 0x%x -> 0x%x)", self->name, self->start, self->end, self->size, size);
+
+  buffer = mallocx (size);
+  iovcnt = get_iovecs (iov, 2, self, self->start, self->end);
+  for (int i = 0; i < iovcnt; i++)
+    {
+      memcpy (buffer + length, iov[i].iov_base, iov[i].iov_len);
+      length += iov[i].iov_len;
+    }
+
+  free (self->buffer);
+  self->buffer = buffer;
+  self->size = size;
+  self->start = 0;
+  self->end = length;
+}
+
+/* the reader is faster than the writer: give it more room */
+static void
+buffer_maybe_grow (Buffer *self)
+{
+  if (!parameters.fixed_buffers && buffer_full (self) && self->size < BUFFER_MAX_SIZE)
+    buffer_resize (self, self->size * 2);
+}
+
+static bool
+buffer_oversized (Buffer *self)
+{
+  return self->size > BUFFER_MIN_SIZE && buffer_empty (self);
+}
+
+static void
+buffer_shrink (Buffer *self)
+{
+  if (buffer_oversized (self))
+    buffer_resize (self, BUFFER_MIN_SIZE);
+}
+
 static void
 buffer_write_to_fd (Buffer *self,
                     int     fd,
@@ -227,7 +363,7 @@ buffer_write_to_fd (Buffer *self,
   debug (BUFFER, "buffer_write_to_fd (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
 
   struct msghdr msg = { .msg_iov = iov };
-  msg.msg_iovlen = get_iovecs (iov, 2, self->buffer, self->start, self->end);
+  msg.msg_iovlen = get_iovecs (iov, 2, self, self->start, self->end);
 
   if (msg.msg_iovlen)
     {
@@ -282,7 +418,7 @@ buffer_read_from_fd (Buffer *self,
 
   struct iovec iov[2];
   ssize_t s;
-  int iovcnt = get_iovecs (iov, 2, self->buffer, self->end, self->start + BUFFER_SIZE);
+  int iovcnt = get_iovecs (iov, 2, self, self->end, self->start + self->size);
   assert (iovcnt > 0);
 
   do
@@ -299,21 +435,24 @@ buffer_read_from_fd (Buffer *self,
   else if (s == 0)
     buffer_eof (self);
   else
-    self->end += s;
+    {
+      self->end += s;
+      counter_add (self->bytes_counter, s);
+      buffer_maybe_grow (self);
+    }
 
   assert (buffer_valid (self));
 }
 
+/* one record per call, without coalescing; see connection_set_fixed_buffers() */
 static void
-buffer_write_to_tls (Buffer           *self,
-                     gnutls_session_t  tls)
+buffer_write_to_tls_single (Buffer           *self,
+                              gnutls_session_t  tls)
 {
   struct iovec iov;
   ssize_t s;
 
-  debug (BUFFER, "buffer_write_to_tls (%s/0x%x/0x%x, %p)", self->name, self->start, self->end, tls);
-
-  if (get_iovecs (&iov, 1, self->buffer, self->start, self->end))
+  if (get_iovecs (&iov, 1, self, self->start, self->end))
     {
       do
         s = gnutls_record_send (tls, iov.iov_base, iov.iov_len);
@@ -329,6 +468,110 @@ buffer_write_to_tls (Buffer           *self,
       else
         self->start += s;
     }
+}
+
+static bool
+buffer_check_tls_result (Buffer   *self,
+                         ssize_t   s,
+                         bool     *again)
+{
+  if (s >= 0)
+    {
+      *again = false;
+      return true;
+    }
+
+  *again = (s == GNUTLS_E_AGAIN);
+  if (!*again)
+    buffer_epipe (self);
+
+  return false;
+}
+
+/*
+ * Send as many full sized records as the socket takes. Where the data
+ * wraps around the end of the ring, cork the two pieces together, so
+ * that they don't go out as two small records. When the socket would
+ * block, GnuTLS keeps what it already encrypted, and we finish sending
+ * that before anything else.
+ */
+static void
+buffer_write_to_tls_coalesced (Buffer           *self,
+                               gnutls_session_t  tls)
+{
+  size_t max_size = gnutls_record_get_max_size (tls);
+  struct iovec iov[2];
+  ssize_t s;
+  int iovcnt;
+
+  if (self->resend)
+    {
+      do
+        s = gnutls_record_send (tls, NULL, 0);
+      while (s == GNUTLS_E_INTERRUPTED);
+      if (!buffer_check_tls_result (self, s, &self->resend))
+        return;
+      self->start += s;
+    }
+
+  if (self->flushing)
+    {
+      do
+        s = gnutls_record_uncork (tls, 0);
+      while (s == GNUTLS_E_INTERRUPTED);
+      if (!buffer_check_tls_result (self, s, &self->flushing))
+        return;
+    }
+
+  while ((iovcnt = get_iovecs (iov, 2, self, self->start, self->end)) > 0)
+    {
+      if (iovcnt == 2 && iov[0].iov_len < max_size)
+        {
+          size_t head = MIN (iov[1].iov_len, max_size - iov[0].iov_len);
+
+          gnutls_record_cork (tls);
+          if (gnutls_record_send (tls, iov[0].iov_base, iov[0].iov_len) < 0 ||
+              gnutls_record_send (tls, iov[1].iov_base, head) < 0)
+            {
+              buffer_epipe (self);
+              return;
+            }
+          self->start += iov[0].iov_len + head;
+
+          do
+            s = gnutls_record_uncork (tls, 0);
+          while (s == GNUTLS_E_INTERRUPTED);
+
+          debug (BUFFER, "  gnutls_record_uncork returns %zi %s", s, (s < 0) ? gnutls_strerror (-s) : "");
+
+          if (!buffer_check_tls_result (self, s, &self->flushing))
+            return;
+        }
+      else
+        {
+          do
+            s = gnutls_record_send (tls, iov[0].iov_base, iov[0].iov_len);
+          while (s == GNUTLS_E_INTERRUPTED);
+
+          debug (BUFFER, "  gnutls_record_send returns %zi %s", s, (s < 0) ? gnutls_strerror (-s) : "");
+
+          if (!buffer_check_tls_result (self, s, &self->resend))
+            return;
+          self->start += s;
+        }
+    }
+}
+
+static void
+buffer_write_to_tls (Buffer           *self,
+                     gnutls_session_t  tls)
+{
+  debug (BUFFER, "buffer_write_to_tls (%s/0x%x/0x%x, %p)", self->name, self->start, self->end, tls);
+
+  if (parameters.fixed_buffers)
+    buffer_write_to_tls_single (self, tls);
+  else
+    buffer_write_to_tls_coalesced (self, tls);
 
   if (buffer_needs_shut_wr (self))
     {
@@ -358,7 +601,7 @@ buffer_read_from_tls (Buffer           *self,
       return;
     }
 
-  int iovcnt = get_iovecs (&iov, 1, self->buffer, self->end, self->start + BUFFER_SIZE);
+  int iovcnt = get_iovecs (&iov, 1, self, self->end, self->start + self->size);
   assert (iovcnt == 1);
 
   do
@@ -373,7 +616,11 @@ buffer_read_from_tls (Buffer           *self,
         buffer_epipe (self);
     }
   else
-    self->end += s;
+    {
+      self->end += s;
+      counter_add (self->bytes_counter, s);
+      buffer_maybe_grow (self);
+    }
 
   assert (buffer_valid (self));
 }
@@ -424,9 +671,163 @@ out:
   return status;
 }
 
+static time_t
+monotonic_seconds (void)
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) != 0)
+    err (EXIT_FAILURE, "clock_gettime() failed");
+
+  return ts.tv_sec;
+}
+
+/* call with shared.mutex held */
+static WsInstance *
+wsinstance_lookup (const char *name,
+                   bool create)
+{
+  WsInstance **link = &shared.wsinstances;
+  WsInstance *instance = NULL;
+  time_t now = monotonic_seconds ();
+
+  while (*link)
+    {
+      WsInstance *entry = *link;
+
+      if (strcmp (entry->name, name) == 0)
+        {
+          instance = entry;
+        }
+      else if (!entry->pending && entry->waiters == 0 && entry->connections == 0 &&
+               now - entry->last_used >= WSINSTANCE_LIFETIME)
+        {
+          *link = entry->next;
+          free (entry);
+          continue;
+        }
+
+      link = &entry->next;
+    }
+
+  if (!instance && create)
+    {
+      instance = callocx (1, sizeof (WsInstance));
+      assert (strlen (name) < sizeof instance->name);
+      strcpy (instance->name, name);
+      instance->last_used = now;
+      instance->next = shared.wsinstances;
+      shared.wsinstances = instance;
+    }
+
+  return instance;
+}
+
+/*
+ * This is global rather than per instance: an unused instance entry can
+ * get pruned and recreated at any time, and it must not look like it was
+ * activated before the caller took its generation.
+ */
+static unsigned long
+activation_generation (void)
+{
+  unsigned long generation;
+
+  pthread_mutex_lock (&shared.mutex);
+  generation = shared.generation;
+  pthread_mutex_unlock (&shared.mutex);
+
+  return generation;
+}
+
+/* count the connection towards the wsinstance, for the stats */
+static void
+connection_attach_wsinstance (Connection *self,
+                              const char *name)
+{
+  pthread_mutex_lock (&shared.mutex);
+  self->instance = wsinstance_lookup (name, true);
+  self->instance->connections++;
+  pthread_mutex_unlock (&shared.mutex);
+}
+
+static void
+connection_detach_wsinstance (Connection *self)
+{
+  pthread_mutex_lock (&shared.mutex);
+  self->instance->connections--;
+  self->instance->last_used = monotonic_seconds ();
+  self->instance = NULL;
+  pthread_mutex_unlock (&shared.mutex);
+}
+
+/**
+ * activate_wsinstance: Make sure the wsinstance for a fingerprint runs
+ *
+ * @generation: from activation_generation(), before the caller last
+ *   failed to connect to the instance
+ *
+ * If some other request for this instance finished since @generation was
+ * taken, the instance was just started and its outcome is returned right
+ * away.
+ * If a request is in flight, this waits for it instead of asking the
+ * factory again.
+ */
+static bool
+activate_wsinstance (const char *fingerprint,
+                     unsigned long generation)
+{
+  uint64_t start = stats_monotonic_usec ();
+  WsInstance *instance;
+  bool success;
+
+  pthread_mutex_lock (&shared.mutex);
+
+  instance = wsinstance_lookup (fingerprint, true);
+
+  if (instance->generation > generation)
+    {
+      debug (CONNECTION, "  -> %s was activated recently", fingerprint);
+    }
+  else if (instance->pending)
+    {
+      debug (CONNECTION, "  -> waiting for pending activation of %s", fingerprint);
+      instance->waiters++;
+      while (instance->pending)
+        pthread_cond_wait (&shared.activated, &shared.mutex);
+      instance->waiters--;
+    }
+  else
+    {
+      instance->pending = true;
+      pthread_mutex_unlock (&shared.mutex);
+
+      counter_add (&stats.activation_requests, 1);
+      success = request_dynamic_wsinstance (fingerprint);
+      if (!success)
+        counter_add (&stats.activation_failures, 1);
+
+      pthread_mutex_lock (&shared.mutex);
+      instance->pending = false;
+      instance->success = success;
+      instance->activations++;
+      instance->generation = ++shared.generation;
+      instance->last_used = monotonic_seconds ();
+      pthread_cond_broadcast (&shared.activated);
+    }
+
+  success = instance->success;
+  pthread_mutex_unlock (&shared.mutex);
+
+  histogram_add (&stats.activation_usec, stats_monotonic_usec () - start);
+
+  return success;
+}
+
 static bool
 connection_connect_to_dynamic_wsinstance (Connection *self)
 {
+  unsigned long generation;
   char sockname[80];
   int r;
 
@@ -437,6 +838,8 @@ connection_connect_to_dynamic_wsinstance (Connection *self)
 
   debug (CONNECTION, "Connecting to dynamic https instance %s...", sockname);
 
+  generation = activation_generation ();
+
   /* fast path: the socket already exists, so we can just connect to it */
   if (af_unix_connectat (self->ws_fd, parameters.wsinstance_sockdir, sockname) == 0)
     return true;
@@ -446,7 +849,7 @@ connection_connect_to_dynamic_wsinstance (Connection *self)
 
   debug (CONNECTION, "  -> failed (%m).  Requesting activation.");
   /* otherwise, ask for the instance to be started */
-  if (!request_dynamic_wsinstance (self->wsinstance))
+  if (!activate_wsinstance (self->wsinstance, generation))
     return false;
 
   /* ... and try one more time. */
@@ -495,9 +898,91 @@ connection_connect_to_wsinstance (Connection *self)
     }
 
   if (self->tls)
-    return connection_connect_to_dynamic_wsinstance (self);
+    {
+      if (!connection_connect_to_dynamic_wsinstance (self))
+        return false;
+
+      connection_attach_wsinstance (self, self->wsinstance);
+    }
   else
-    return connection_connect_to_static_wsinstance (self);
+    {
+      if (!connection_connect_to_static_wsinstance (self))
+        return false;
+
+      connection_attach_wsinstance (self, parameters.certificate ? "http-redirect" : "http");
+    }
+
+  return true;
+}
+
+static void
+ticket_key_clear (void)
+{
+  if (shared.ticket_key.data)
+    {
+      gnutls_memset (shared.ticket_key.data, 0, shared.ticket_key.size);
+      gnutls_free (shared.ticket_key.data);
+      shared.ticket_key.data = NULL;
+      shared.ticket_key.size = 0;
+    }
+}
+
+/* call with shared.mutex held */
+static void
+ticket_key_generate (void)
+{
+  int ret;
+
+  ticket_key_clear ();
+
+  ret = gnutls_session_ticket_key_generate (&shared.ticket_key);
+  if (ret != GNUTLS_E_SUCCESS)
+    errx (EXIT_FAILURE, "gnutls_session_ticket_key_generate failed: %s", gnutls_strerror (ret));
+
+  shared.ticket_key_created = monotonic_seconds ();
+  debug (CONNECTION, "generated new session ticket key");
+}
+
+/*
+ * Stateless session tickets let a returning client, or the parallel
+ * connections of one browser, resume a session without a full handshake.
+ * The ticket is encrypted with our in-memory key, which is rotated
+ * periodically. GnuTLS copies the key into the session.
+ */
+static bool
+connection_enable_session_tickets (Connection *self)
+{
+  int ret;
+
+  pthread_mutex_lock (&shared.mutex);
+
+  if (!shared.ticket_key.data ||
+      monotonic_seconds () - shared.ticket_key_created >= TICKET_KEY_LIFETIME)
+    ticket_key_generate ();
+
+  ret = gnutls_session_ticket_enable_server (self->tls, &shared.ticket_key);
+
+  pthread_mutex_unlock (&shared.mutex);
+
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_session_ticket_enable_server failed: %s", gnutls_strerror (ret));
+      return false;
+    }
+
+  return true;
+}
+
+static void
+connection_count_handshake (Connection *self,
+                            uint64_t start)
+{
+  bool resumed = gnutls_session_is_resumed (self->tls);
+
+  debug (CONNECTION, "TLS handshake completed (%s)", resumed ? "resumed" : "full");
+
+  counter_add (resumed ? &stats.handshakes_resumed : &stats.handshakes_full, 1);
+  histogram_add (&stats.handshake_usec, stats_monotonic_usec () - start);
 }
 
 /**
@@ -580,6 +1065,9 @@ connection_handshake (Connection *self)
           return false;
         }
 
+      if (parameters.session_tickets && !connection_enable_session_tickets (self))
+        return false;
+
       gnutls_session_set_verify_function (self->tls, client_certificate_verify);
       gnutls_certificate_server_set_request (self->tls, parameters.request_mode);
       gnutls_handshake_set_timeout (self->tls, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
@@ -587,6 +1075,8 @@ connection_handshake (Connection *self)
 
       debug (CONNECTION, "TLS is initialised; doing handshake");
 
+      uint64_t start = stats_monotonic_usec ();
+
       do
         ret = gnutls_handshake (self->tls);
       while (ret == GNUTLS_E_INTERRUPTED);
@@ -594,10 +1084,11 @@ connection_handshake (Connection *self)
       if (ret != GNUTLS_E_SUCCESS)
         {
           warnx ("gnutls_handshake failed: %s", gnutls_strerror (ret));
+          counter_add (&stats.handshakes_failed, 1);
           return false;
         }
 
-      debug (CONNECTION, "TLS handshake completed");
+      connection_count_handshake (self, start);
 
       if (!client_certificate_accept (self->tls, parameters.cert_session_dir,
                                       &self->wsinstance, &self->client_cert_filename))
@@ -614,6 +1105,7 @@ connection_thread_loop (Connection *self)
     {
       short client_events, ws_events;
       short client_revents, ws_revents;
+      int timeout;
       int n_ready;
 
       client_events = calculate_events (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
@@ -628,13 +1120,21 @@ connection_thread_loop (Connection *self)
              self->client_fd, client_events, client_revents,
              self->ws_fd, ws_events, ws_revents);
 
+      /* give back grown buffers once the connection goes idle */
+      if (client_revents | ws_revents)
+        timeout = 0;
+      else if (buffer_oversized (&self->client_to_ws_buffer) || buffer_oversized (&self->ws_to_client_buffer))
+        timeout = BUFFER_IDLE_TIMEOUT;
+      else
+        timeout = -1;
+
       do
         {
           /* don't poll for no events, we'd spin in a POLLHUP loop otherwise */
           struct pollfd fds[] = { { client_events ? self->client_fd : -1, client_events },
                                   { ws_events ? self->ws_fd : -1, ws_events }};
 
-          n_ready = poll (fds, N_ELEMENTS (fds), (client_revents | ws_revents) ? 0 : -1);
+          n_ready = poll (fds, N_ELEMENTS (fds), timeout);
 
           client_revents |= fds[0].revents;
           ws_revents |= fds[1].revents;
@@ -648,9 +1148,19 @@ connection_thread_loop (Connection *self)
           err (EXIT_FAILURE, "poll failed");
         }
 
+      self->wakeups++;
+      counter_add (&stats.wakeups, 1);
+
       debug (POLL, "poll result %i | client %d/x%x | ws %d/x%x |", n_ready,
              self->client_fd, client_revents, self->ws_fd, ws_revents);
 
+      if (n_ready == 0 && timeout > 0)
+        {
+          buffer_shrink (&self->client_to_ws_buffer);
+          buffer_shrink (&self->ws_to_client_buffer);
+          continue;
+        }
+
       if (self->tls)
         {
           if (client_revents & POLLIN)
@@ -762,6 +1272,11 @@ connection_thread_main (int fd)
 {
   Connection self = { .client_fd = fd, .ws_fd = -1, .metadata_fd = -1 };
 
+  buffer_init (&self.client_to_ws_buffer);
+  buffer_init (&self.ws_to_client_buffer);
+  self.client_to_ws_buffer.bytes_counter = &stats.bytes_client_to_ws;
+  self.ws_to_client_buffer.bytes_counter = &stats.bytes_ws_to_client;
+
   assert (!buffer_can_write (&self.client_to_ws_buffer));
   assert (!buffer_can_write (&self.ws_to_client_buffer));
   assert (!self.tls);
@@ -776,7 +1291,11 @@ connection_thread_main (int fd)
   if (connection_handshake (&self) &&
       connection_create_metadata (&self) &&
       connection_connect_to_wsinstance (&self))
-    connection_thread_loop (&self);
+    {
+      connection_thread_loop (&self);
+      histogram_add (&stats.wakeups_per_connection, self.wakeups);
+      connection_detach_wsinstance (&self);
+    }
 
   debug (CONNECTION, "Thread for fd %i is going to exit now", fd);
 
@@ -796,6 +1315,9 @@ connection_thread_main (int fd)
 
   if (self.metadata_fd != -1)
     close (self.metadata_fd);
+
+  buffer_free (&self.client_to_ws_buffer);
+  buffer_free (&self.ws_to_client_buffer);
 }
 
 /**
@@ -810,14 +1332,129 @@ connection_thread_main (int fd)
  *
  * @certfile: Server TLS certificate file; cannot be %NULL
  * @request_mode: Whether to ask for client certificates
+ * @session_tickets: Whether to let clients resume sessions with tickets
  */
 void
 connection_crypto_init (const char *certificate_filename,
                         const char *key_filename,
-                        gnutls_certificate_request_t request_mode)
+                        gnutls_certificate_request_t request_mode,
+                        bool session_tickets)
 {
   parameters.certificate = certificate_load (certificate_filename, key_filename);
   parameters.request_mode = request_mode;
+  parameters.session_tickets = session_tickets;
+}
+
+static void *
+preactivate_thread_main (void *data)
+{
+  unsigned long generation = activation_generation ();
+  int fd;
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    {
+      warn ("socket() failed");
+      return NULL;
+    }
+
+  if (af_unix_connectat (fd, parameters.wsinstance_sockdir, "https@" SHA256_NIL ".sock") != 0)
+    {
+      debug (CONNECTION, "Pre-activating wsinstance for connections without a client certificate");
+      if (!activate_wsinstance (SHA256_NIL, generation))
+        warnx ("Failed to pre-activate wsinstance for connections without a client certificate");
+    }
+
+  close (fd);
+  return NULL;
+}
+
+/**
+ * connection_preactivate_wsinstance: Start the default wsinstance early
+ *
+ * Ask for the cockpit-ws instance for connections without a client
+ * certificate in the background, so that the first connections don't
+ * have to wait for it to start. Connections which arrive in the meantime
+ * wait for this request instead of making their own.
+ */
+void
+connection_preactivate_wsinstance (void)
+{
+  int r;
+
+  assert (parameters.wsinstance_sockdir != -1);
+  assert (!shared.preactivating);
+
+  r = pthread_create (&shared.preactivate_thread, NULL, preactivate_thread_main, NULL);
+  if (r != 0)
+    {
+      errno = r;
+      warn ("pthread_create() failed");
+      return;
+    }
+
+  shared.preactivating = true;
+}
+
+/**
+ * connection_set_fixed_buffers: For comparing performance
+ *
+ * Keep buffers at their initial size, and send TLS records as they come,
+ * without coalescing them. This is how connections used to be relayed.
+ */
+void
+connection_set_fixed_buffers (bool fixed)
+{
+  parameters.fixed_buffers = fixed;
+}
+
+/**
+ * connection_get_handshake_stats: Count completed TLS handshakes
+ *
+ * Resumed handshakes are the ones that used a session ticket, and so
+ * skipped the certificate exchange.
+ */
+void
+connection_get_handshake_stats (ConnectionHandshakeStats *handshakes)
+{
+  handshakes->full = counter_get (&stats.handshakes_full);
+  handshakes->resumed = counter_get (&stats.handshakes_resumed);
+}
+
+/**
+ * connection_print_stats: Add connection statistics to a JSON object
+ *
+ * Durations are in microseconds. As with the cockpit_json_print_*()
+ * functions, this starts with a separating comma.
+ */
+void
+connection_print_stats (FILE *stream)
+{
+  fprintf (stream, ", \"handshakes\": {\"full\": %lu, \"resumed\": %lu, \"failed\": %lu",
+           counter_get (&stats.handshakes_full), counter_get (&stats.handshakes_resumed),
+           counter_get (&stats.handshakes_failed));
+  histogram_print (stream, "usec", &stats.handshake_usec);
+
+  fprintf (stream, "}, \"bytes\": {\"client-to-ws\": %lu, \"ws-to-client\": %lu}",
+           counter_get (&stats.bytes_client_to_ws), counter_get (&stats.bytes_ws_to_client));
+
+  fprintf (stream, ", \"wakeups\": {\"total\": %lu", counter_get (&stats.wakeups));
+  histogram_print (stream, "per-connection", &stats.wakeups_per_connection);
+
+  fprintf (stream, "}, \"activations\": {\"requests\": %lu, \"failed\": %lu",
+           counter_get (&stats.activation_requests), counter_get (&stats.activation_failures));
+  histogram_print (stream, "wait-usec", &stats.activation_usec);
+
+  fputs ("}, \"wsinstances\": {", stream);
+
+  pthread_mutex_lock (&shared.mutex);
+  for (WsInstance *instance = shared.wsinstances; instance; instance = instance->next)
+    fprintf (stream, "%s\"%s\": {\"connections\": %u, \"activations\": %lu}",
+             instance == shared.wsinstances ? "" : ", ",
+             instance->name, instance->connections, instance->activations);
+  pthread_mutex_unlock (&shared.mutex);
+
+  fputc ('}', stream);
 }
 
 void
@@ -854,12 +1491,31 @@ connection_cleanup (void)
   assert (parameters.wsinstance_sockdir != -1);
   assert (parameters.cert_session_dir != -1);
 
+  if (shared.preactivating)
+    {
+      pthread_join (shared.preactivate_thread, NULL);
+      shared.preactivating = false;
+    }
+
   if (parameters.certificate)
     {
       certificate_unref (parameters.certificate);
       parameters.certificate = NULL;
     }
 
+  pthread_mutex_lock (&shared.mutex);
+  ticket_key_clear ();
+  while (shared.wsinstances)
+    {
+      WsInstance *instance = shared.wsinstances;
+      assert (!instance->pending && instance->connections == 0);
+      shared.wsinstances = instance->next;
+      free (instance);
+    }
+  pthread_mutex_unlock (&shared.mutex);
+
+  memset (&stats, 0, sizeof stats);
+
   close (parameters.cert_session_dir);
   parameters.cert_session_dir = -1;
 
@@ -21,9 +21,15 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include <gnutls/gnutls.h>
 
+typedef struct {
+  unsigned long full;
+  unsigned long resumed;
+} ConnectionHandshakeStats;
+
 /* init/teardown */
 void
 connection_set_directories (const char *wsinstance_sockdir,
@@ -32,11 +38,25 @@ connection_set_directories (const char *wsinstance_sockdir,
 void
 connection_crypto_init (const char *certificate_filename,
                         const char *key_filename,
-                        gnutls_certificate_request_t request_mode);
+                        gnutls_certificate_request_t request_mode,
+                        bool session_tickets);
+
+void
+connection_preactivate_wsinstance (void);
 
 void
 connection_cleanup (void);
 
+void
+connection_get_handshake_stats (ConnectionHandshakeStats *handshakes);
+
+void
+connection_print_stats (FILE *stream);
+
+/* for benchmarks */
+void
+connection_set_fixed_buffers (bool fixed);
+
 /* handle a new connection */
 void
 connection_thread_main (int fd);
@@ -37,11 +37,15 @@
 struct arguments {
   uint16_t port;
   bool no_tls;
+  bool no_session_tickets;
+  bool preactivate;
   int idle_timeout;
 };
 
 #define OPT_NO_TLS 1000
 #define OPT_IDLE_TIMEOUT 1001
+#define OPT_NO_SESSION_TICKETS 1002
+#define OPT_PREACTIVATE 1003
 
 static int
 arg_parse_int (char *arg, struct argp_state *state, int min, int max, const char *error_msg)
@@ -68,6 +72,12 @@ parse_opt (int key, char *arg, struct argp_state *state)
       case 'p':
         arguments->port = arg_parse_int (arg, state, 1, UINT16_MAX, "Invalid port");
         break;
+      case OPT_NO_SESSION_TICKETS:
+        arguments->no_session_tickets = true;
+        break;
+      case OPT_PREACTIVATE:
+        arguments->preactivate = true;
+        break;
       case OPT_IDLE_TIMEOUT:
         arguments->idle_timeout = arg_parse_int (arg, state, 0, INT_MAX, "Invalid idle timeout");
         break;
@@ -79,6 +89,8 @@ parse_opt (int key, char *arg, struct argp_state *state)
 
 static struct argp_option options[] = {
   {"no-tls", OPT_NO_TLS, 0, 0,  "Don't use TLS" },
+  {"no-session-tickets", OPT_NO_SESSION_TICKETS, 0, 0, "Don't let clients resume TLS sessions" },
+  {"preactivate", OPT_PREACTIVATE, 0, 0, "Start the cockpit-ws instance for clients without a certificate right away" },
   {"port", 'p', "PORT", 0, "Local port to bind to (9090 if unset)" },
   {"idle-timeout", OPT_IDLE_TIMEOUT, "SECONDS", 0, "Time after which to exit if there are no connections; 0 to run forever (default: 90)" },
   { 0 }
@@ -99,6 +111,8 @@ main (int argc, char **argv)
 
   /* default option values */
   arguments.no_tls = false;
+  arguments.no_session_tickets = false;
+  arguments.preactivate = false;
   arguments.port = 9090;
   arguments.idle_timeout = 90;
 
@@ -122,7 +136,8 @@ main (int argc, char **argv)
 
       connection_crypto_init ("/run/cockpit/tls/server/cert",
                               "/run/cockpit/tls/server/key",
-                              client_cert_mode);
+                              client_cert_mode,
+                              !arguments.no_session_tickets);
 
       /* There's absolutely no need to keep these around */
       if (unlink ("/run/cockpit/tls/server/cert") != 0)
@@ -130,6 +145,9 @@ main (int argc, char **argv)
 
       if (unlink ("/run/cockpit/tls/server/key") != 0)
         err (EXIT_FAILURE, "unlink: /run/cockpit/tls/server/key");
+
+      if (arguments.preactivate)
+        connection_preactivate_wsinstance ();
     }
 
   server_run ();
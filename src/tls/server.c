@@ -29,6 +29,7 @@
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -37,11 +38,16 @@
 #include <sys/epoll.h>
 #include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <common/cockpitjsonprint.h>
+
 #include "connection.h"
+#include "socket-io.h"
+#include "stats.h"
 #include "utils.h"
 
 /* cockpit-tls TCP server state (singleton) */
@@ -51,6 +57,13 @@ static struct {
   int first_listener;
   int last_listener;
   int epollfd;
+  int runtime_dir_fd;
+  int stats_fd;
+  unsigned long stats_requests;
+
+  /* updated without locking, see stats.h */
+  atomic_ulong connections_accepted;
+  atomic_ulong thread_failures;
 
   /* rw, protected by mutex */
   pthread_mutex_t connection_mutex;
@@ -140,6 +153,7 @@ handle_accept (int listen_fd)
     }
 
   debug (CONNECTION, "New connection accepted, fd %i", fd);
+  counter_add (&server.connections_accepted, 1);
 
   {
     pthread_mutex_lock (&server.connection_mutex);
@@ -169,12 +183,110 @@ handle_accept (int listen_fd)
     {
       errno = r;
       warn ("pthread_create() failed.  dropping connection");
+      counter_add (&server.thread_failures, 1);
       close (fd);
     }
 
   pthread_attr_destroy (&attr);
 }
 
+/**
+ * handle_stats: Handle event on the stats socket
+ *
+ * Send a JSON object with our statistics, and close the connection. Only
+ * root and our own user may ask.
+ */
+static void
+handle_stats (void)
+{
+  struct ucred cred;
+  socklen_t cred_len = sizeof cred;
+  char *data = NULL;
+  size_t length = 0;
+  FILE *stream;
+  ssize_t sent;
+  int fd;
+
+  fd = accept4 (server.stats_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0)
+    {
+      if (errno != EINTR)
+        warn ("failed to accept stats connection");
+      return;
+    }
+
+  if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+      (cred.uid != 0 && cred.uid != geteuid ()))
+    {
+      debug (SERVER, "refusing stats request from uid %u", (unsigned) cred.uid);
+      close (fd);
+      return;
+    }
+
+  server.stats_requests++;
+
+  stream = open_memstream (&data, &length);
+  if (stream == NULL)
+    err (EXIT_FAILURE, "open_memstream() failed");
+
+  fputs ("{\"version\": 1", stream);
+
+  pthread_mutex_lock (&server.connection_mutex);
+  fprintf (stream, ", \"connections\": {\"active\": %u", server.connection_count);
+  pthread_mutex_unlock (&server.connection_mutex);
+  cockpit_json_print_integer_property (stream, "accepted", counter_get (&server.connections_accepted));
+  cockpit_json_print_integer_property (stream, "thread-failures", counter_get (&server.thread_failures));
+  fputc ('}', stream);
+
+  cockpit_json_print_integer_property (stream, "stats-requests", server.stats_requests);
+  connection_print_stats (stream);
+  fputs ("}\n", stream);
+
+  if (fclose (stream) != 0)
+    err (EXIT_FAILURE, "failed to format stats");
+
+  /* This is small, and fits into the socket buffer in one go. This runs on
+   * the accept thread, so don't wait for a reader which doesn't keep up. */
+  sent = send (fd, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (sent < 0 || (size_t) sent != length)
+    debug (SERVER, "dropping stats reply: %s", sent < 0 ? strerror (errno) : "short write");
+
+  free (data);
+  close (fd);
+}
+
+static void
+server_stats_init (const char *runtime_directory)
+{
+  struct epoll_event ev = { .events = EPOLLIN };
+
+  server.runtime_dir_fd = open (runtime_directory, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (server.runtime_dir_fd == -1)
+    err (EXIT_FAILURE, "Unable to open runtime directory %s", runtime_directory);
+
+  server.stats_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server.stats_fd == -1)
+    err (EXIT_FAILURE, "failed to create stats socket");
+
+  /* left behind by an earlier instance which crashed */
+  if (unlinkat (server.runtime_dir_fd, "stats.sock", 0) != 0 && errno != ENOENT)
+    err (EXIT_FAILURE, "unlink: %s/stats.sock", runtime_directory);
+
+  if (af_unix_bindat (server.stats_fd, server.runtime_dir_fd, "stats.sock") != 0)
+    err (EXIT_FAILURE, "failed to bind %s/stats.sock", runtime_directory);
+
+  /* peer credentials get checked as well, this just keeps out the rest */
+  if (fchmodat (server.runtime_dir_fd, "stats.sock", 0600, 0) != 0)
+    err (EXIT_FAILURE, "chmod: %s/stats.sock", runtime_directory);
+
+  if (listen (server.stats_fd, 8) < 0)
+    err (EXIT_FAILURE, "failed to listen to stats socket");
+
+  ev.data.fd = server.stats_fd;
+  if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, server.stats_fd, &ev) < 0)
+    err (EXIT_FAILURE, "Failed to epoll stats socket");
+}
+
 /***********************************
  *
  * Public API
@@ -188,7 +300,8 @@ handle_accept (int listen_fd)
  * is an error.
  *
  * @wsinstance_sockdir: Path to cockpit-wsinstance sockets directory
- * @cert_session_dir: Path to store session certificates
+ * @cert_session_dir: Path to store session certificates, and the stats.sock
+ *                    socket which serves statistics as JSON
  * @idle_timeout: When positive, stop server after given number of seconds with
  *                no connections
  * @port: Port to listen to; ignored when the listening socket is handed over
@@ -260,6 +373,8 @@ server_init (const char *wsinstance_sockdir,
         err (EXIT_FAILURE, "Failed to epoll server listening fd");
     }
 
+  server_stats_init (cert_session_dir);
+
   /* we use timerfd for idle timeout.  epoll that too. */
   if (idle_timeout > 0)
     {
@@ -297,6 +412,11 @@ server_cleanup (void)
 
   close (server.epollfd);
 
+  close (server.stats_fd);
+  if (unlinkat (server.runtime_dir_fd, "stats.sock", 0) != 0)
+    warn ("failed to remove stats.sock");
+  close (server.runtime_dir_fd);
+
   pthread_mutex_destroy (&server.connection_mutex);
 
   connection_cleanup ();
@@ -310,8 +430,8 @@ server_cleanup (void)
  * @timeout: number of milliseconds to wait for an event to happen; after that,
  * the function will return false. -1 will to block until an event occurs.
  *
- * This can be an event on a listening socket, or the idle timeout if no
- * clients are connected.
+ * This can be an event on a listening socket, a request on the stats socket,
+ * or the idle timeout if no clients are connected.
  *
  * Returns: false on timeout, true if some (other) event was handled.
  */
@@ -338,6 +458,12 @@ server_poll_event (int timeout)
           return false;
         }
 
+      if (fd == server.stats_fd)
+        {
+          handle_stats ();
+          return true;
+        }
+
       assert (server.first_listener <= fd && fd <= server.last_listener);
 
       handle_accept (fd);
@@ -0,0 +1,76 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "stats.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <time.h>
+
+uint64_t
+stats_monotonic_usec (void)
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) != 0)
+    err (EXIT_FAILURE, "clock_gettime() failed");
+
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+histogram_add (Histogram *self,
+               unsigned long value)
+{
+  unsigned bucket = 0;
+
+  if (value)
+    bucket = 64 - __builtin_clzll (value);
+  if (bucket >= HISTOGRAM_BUCKETS)
+    bucket = HISTOGRAM_BUCKETS - 1;
+
+  counter_add (&self->count, 1);
+  counter_add (&self->total, value);
+  counter_add (&self->buckets[bucket], 1);
+}
+
+/**
+ * histogram_print: Add a histogram to a JSON object
+ *
+ * Prints it as a nested object with the "count" of values, their "total",
+ * and the "buckets" array.  As with cockpit_json_print_integer_property(),
+ * a separating comma is written first.
+ */
+void
+histogram_print (FILE *stream,
+                 const char *key,
+                 Histogram *self)
+{
+  fprintf (stream, ", \"%s\": {\"count\": %lu, \"total\": %lu, \"buckets\": [",
+           key, counter_get (&self->count), counter_get (&self->total));
+
+  for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++)
+    fprintf (stream, "%s%lu", i ? ", " : "", counter_get (&self->buckets[i]));
+
+  fputs ("]}", stream);
+}
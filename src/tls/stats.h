@@ -0,0 +1,65 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2022 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Counters for the stats socket. These are updated from all connection
+ * threads without taking any locks, so they are only ever added to, with
+ * relaxed atomics. A reader may see a snapshot that is slightly torn
+ * between counters, which is fine for monitoring.
+ */
+
+/* Bucket N counts values below 2^N, the last one the rest */
+#define HISTOGRAM_BUCKETS 26
+
+typedef struct {
+  atomic_ulong count;
+  atomic_ulong total;
+  atomic_ulong buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+static inline void
+counter_add (atomic_ulong *counter,
+             unsigned long value)
+{
+  atomic_fetch_add_explicit (counter, value, memory_order_relaxed);
+}
+
+static inline unsigned long
+counter_get (atomic_ulong *counter)
+{
+  return atomic_load_explicit (counter, memory_order_relaxed);
+}
+
+uint64_t
+stats_monotonic_usec (void);
+
+void
+histogram_add (Histogram *self,
+               unsigned long value);
+
+void
+histogram_print (FILE *stream,
+                 const char *key,
+                 Histogram *self);
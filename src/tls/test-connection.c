@@ -19,13 +19,397 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gnutls/gnutls.h>
+
+#include "connection.h"
+#include "utils.h"
 #include "common/cockpittest.h"
 
+/* this has a corresponding mock-server.key */
+#define CERTFILE SRCDIR "/src/bridge/mock-server.crt"
+#define KEYFILE SRCDIR "/src/bridge/mock-server.key"
+
+typedef struct {
+  gchar *ws_socket_dir;
+  gchar *runtime_dir;
+  int ws_listen_fd;
+  pthread_t ws_thread;
+  size_t transfer_size;
+
+  /* mock https-factory.sock */
+  int factory_listen_fd;
+  pthread_t factory_thread;
+  unsigned factory_requests;
+} TestCase;
+
+typedef struct {
+  size_t transfer_size;
+  bool activate;
+} TestFixture;
+
+static const TestFixture fixture_large = {
+  .transfer_size = 8u << 20, /* 8MiB */
+};
+
+static const TestFixture fixture_perf = {
+  .transfer_size = 256u << 20, /* 256MiB */
+};
+
+static const TestFixture fixture_activate = {
+  .transfer_size = 64u << 10, /* 64KiB */
+  .activate = true,
+};
+
+/* a prime, so that the pattern doesn't line up with any buffer size */
+#define PATTERN_PERIOD 65521
+#define PERF_RUNS 3
+
+static char pattern[PATTERN_PERIOD * 2];
+
+static void
+pattern_init (void)
+{
+  for (size_t i = 0; i < sizeof pattern; i++)
+    pattern[i] = (char) ((i % PATTERN_PERIOD) * 7 + (i % PATTERN_PERIOD >> 12));
+}
+
+/* a stand-in for cockpit-ws which sends a large response to each connection */
+static void *
+mock_ws_thread (void *data)
+{
+  TestCase *tc = data;
+  char buffer[4096];
+  int fd;
+
+  while ((fd = accept4 (tc->ws_listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+    {
+      size_t sent = 0;
+
+      /* the request, along with the metadata fd */
+      g_assert_cmpint (recv (fd, buffer, sizeof buffer, 0), >, 0);
+
+      while (sent < tc->transfer_size)
+        {
+          size_t len = MIN (PATTERN_PERIOD, tc->transfer_size - sent);
+          ssize_t r = send (fd, pattern + sent % PATTERN_PERIOD, len, MSG_NOSIGNAL);
+          g_assert_cmpint (r, >, 0);
+          sent += r;
+        }
+
+      close (fd);
+    }
+
+  return NULL;
+}
+
+static int
+listen_unix (const char *directory,
+             const char *name)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int fd;
+
+  g_snprintf (addr.sun_path, sizeof addr.sun_path, "%s/%s", directory, name);
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpint (bind (fd, (struct sockaddr *) &addr, sizeof addr), ==, 0);
+  g_assert_cmpint (listen (fd, 16), ==, 0);
+
+  return fd;
+}
+
+static void
+start_mock_ws (TestCase *tc)
+{
+  tc->ws_listen_fd = listen_unix (tc->ws_socket_dir, "https@" SHA256_NIL ".sock");
+  g_assert_cmpint (pthread_create (&tc->ws_thread, NULL, mock_ws_thread, tc), ==, 0);
+}
+
+/* a stand-in for cockpit-wsinstance-factory, which takes a while to start the instance */
+static void *
+mock_factory_thread (void *data)
+{
+  TestCase *tc = data;
+  char fingerprint[WSINSTANCE_MAX];
+  int fd;
+
+  while ((fd = accept4 (tc->factory_listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+    {
+      size_t len = 0;
+      ssize_t r;
+
+      while ((r = recv (fd, fingerprint + len, sizeof fingerprint - len, 0)) > 0)
+        len += r;
+      g_assert_cmpint (r, ==, 0);
+      g_assert_cmpmem (fingerprint, len, SHA256_NIL, strlen (SHA256_NIL));
+
+      g_usleep (G_USEC_PER_SEC / 5);
+
+      if (tc->factory_requests++ == 0)
+        start_mock_ws (tc);
+
+      g_assert_cmpint (send (fd, "done", 4, MSG_NOSIGNAL), ==, 4);
+      close (fd);
+    }
+
+  return NULL;
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  const TestFixture *fixture = data;
+
+  tc->transfer_size = fixture->transfer_size;
+  tc->ws_listen_fd = -1;
+  tc->factory_listen_fd = -1;
+
+  tc->ws_socket_dir = g_dir_make_tmp ("connection.wssock.XXXXXX", NULL);
+  g_assert (tc->ws_socket_dir);
+  tc->runtime_dir = g_dir_make_tmp ("connection.runtime.XXXXXX", NULL);
+  g_assert (tc->runtime_dir);
+
+  if (fixture->activate)
+    {
+      tc->factory_listen_fd = listen_unix (tc->ws_socket_dir, "https-factory.sock");
+      g_assert_cmpint (pthread_create (&tc->factory_thread, NULL, mock_factory_thread, tc), ==, 0);
+    }
+  else
+    {
+      start_mock_ws (tc);
+    }
+
+  connection_set_directories (tc->ws_socket_dir, tc->runtime_dir);
+  connection_crypto_init (CERTFILE, KEYFILE, GNUTLS_CERT_IGNORE, false);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  g_autofree gchar *sockname = g_build_filename (tc->ws_socket_dir, "https@" SHA256_NIL ".sock", NULL);
+  g_autofree gchar *factory = g_build_filename (tc->ws_socket_dir, "https-factory.sock", NULL);
+  g_autofree gchar *clients_dir = g_build_filename (tc->runtime_dir, "clients", NULL);
+
+  connection_cleanup ();
+  connection_set_fixed_buffers (false);
+
+  if (tc->factory_listen_fd != -1)
+    {
+      shutdown (tc->factory_listen_fd, SHUT_RDWR);
+      g_assert_cmpint (pthread_join (tc->factory_thread, NULL), ==, 0);
+      close (tc->factory_listen_fd);
+      g_assert_cmpint (g_unlink (factory), ==, 0);
+    }
+
+  if (tc->ws_listen_fd != -1)
+    {
+      shutdown (tc->ws_listen_fd, SHUT_RDWR);
+      g_assert_cmpint (pthread_join (tc->ws_thread, NULL), ==, 0);
+      close (tc->ws_listen_fd);
+      g_assert_cmpint (g_unlink (sockname), ==, 0);
+    }
+
+  g_assert_cmpint (g_rmdir (tc->ws_socket_dir), ==, 0);
+  g_assert_cmpint (g_rmdir (clients_dir), ==, 0);
+  g_assert_cmpint (g_rmdir (tc->runtime_dir), ==, 0);
+  g_free (tc->ws_socket_dir);
+  g_free (tc->runtime_dir);
+}
+
+static void *
+connection_thread (void *data)
+{
+  connection_thread_main (GPOINTER_TO_INT (data));
+  return NULL;
+}
+
+/* make a TLS request through the relay, and return how many bytes came back */
+static size_t
+relay_request (TestCase *tc,
+               bool check_data)
+{
+  const char request[] = "GET / HTTP/1.0\r\nHost: localhost\r\n\r\n";
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl (INADDR_LOOPBACK) };
+  socklen_t addrlen = sizeof addr;
+  gnutls_certificate_credentials_t xcred;
+  gnutls_session_t session;
+  char buffer[64u << 10];
+  size_t received = 0;
+  pthread_t thread;
+  ssize_t len;
+  int listen_fd;
+  int fd;
+  int ret;
+
+  /* connection_thread_main() wants a real TCP connection */
+  listen_fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_cmpint (listen_fd, >=, 0);
+  g_assert_cmpint (bind (listen_fd, (struct sockaddr *) &addr, sizeof addr), ==, 0);
+  g_assert_cmpint (listen (listen_fd, 1), ==, 0);
+  g_assert_cmpint (getsockname (listen_fd, (struct sockaddr *) &addr, &addrlen), ==, 0);
+
+  fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_cmpint (connect (fd, (struct sockaddr *) &addr, addrlen), ==, 0);
+  int server_fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  g_assert_cmpint (server_fd, >=, 0);
+  close (listen_fd);
+
+  g_assert_cmpint (pthread_create (&thread, NULL, connection_thread, GINT_TO_POINTER (server_fd)), ==, 0);
+
+  g_assert_cmpint (gnutls_init (&session, GNUTLS_CLIENT | GNUTLS_NO_SIGNAL), ==, GNUTLS_E_SUCCESS);
+  gnutls_transport_set_int (session, fd);
+  g_assert_cmpint (gnutls_set_default_priority (session), ==, GNUTLS_E_SUCCESS);
+  g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
+  g_assert_cmpint (gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred), ==, GNUTLS_E_SUCCESS);
+  g_assert_cmpint (gnutls_handshake (session), ==, GNUTLS_E_SUCCESS);
+
+  g_assert_cmpint (gnutls_record_send (session, request, sizeof request), ==, sizeof request);
+
+  for (;;)
+    {
+      do
+        len = gnutls_record_recv (session, buffer, sizeof buffer);
+      while (len == GNUTLS_E_AGAIN || len == GNUTLS_E_INTERRUPTED);
+
+      if (len <= 0)
+        break;
+
+      if (check_data)
+        {
+          for (ssize_t i = 0; i < len; i++)
+            g_assert_cmpint (buffer[i], ==, pattern[(received + i) % PATTERN_PERIOD]);
+        }
+
+      received += len;
+    }
+
+  g_assert_cmpint (len, ==, 0);
+
+  ret = gnutls_bye (session, GNUTLS_SHUT_WR);
+  g_assert (ret == GNUTLS_E_SUCCESS || ret == GNUTLS_E_PUSH_ERROR);
+  gnutls_deinit (session);
+  gnutls_certificate_free_credentials (xcred);
+  close (fd);
+
+  g_assert_cmpint (pthread_join (thread, NULL), ==, 0);
+
+  return received;
+}
+
+static void
+test_relay_large (TestCase *tc,
+                  gconstpointer data)
+{
+  g_assert_cmpuint (relay_request (tc, true), ==, tc->transfer_size);
+
+  connection_set_fixed_buffers (true);
+  g_assert_cmpuint (relay_request (tc, true), ==, tc->transfer_size);
+}
+
+static void *
+relay_request_thread (void *data)
+{
+  TestCase *tc = data;
+  g_assert_cmpuint (relay_request (tc, true), ==, tc->transfer_size);
+  return NULL;
+}
+
+static void
+test_activate_parallel (TestCase *tc,
+                        gconstpointer data)
+{
+  pthread_t threads[6];
+
+  /* like a browser opening several connections at first load */
+  for (int i = 0; i < N_ELEMENTS (threads); i++)
+    g_assert_cmpint (pthread_create (&threads[i], NULL, relay_request_thread, tc), ==, 0);
+  for (int i = 0; i < N_ELEMENTS (threads); i++)
+    g_assert_cmpint (pthread_join (threads[i], NULL), ==, 0);
+
+  g_assert_cmpuint (tc->factory_requests, ==, 1);
+
+  /* now the instance is running, and gets used directly */
+  g_assert_cmpuint (relay_request (tc, true), ==, tc->transfer_size);
+  g_assert_cmpuint (tc->factory_requests, ==, 1);
+}
+
+static void
+test_activate_preactivate (TestCase *tc,
+                           gconstpointer data)
+{
+  connection_preactivate_wsinstance ();
+
+  /* this waits for the pending activation rather than making its own */
+  g_assert_cmpuint (relay_request (tc, true), ==, tc->transfer_size);
+  g_assert_cmpuint (tc->factory_requests, ==, 1);
+}
+
+/* best of several runs, in MiB/s */
+static double
+measure_relay (TestCase *tc)
+{
+  double best = 0;
+
+  for (int i = 0; i < PERF_RUNS; i++)
+    {
+      g_test_timer_start ();
+      g_assert_cmpuint (relay_request (tc, false), ==, tc->transfer_size);
+      best = MAX (best, tc->transfer_size / g_test_timer_elapsed () / (1024 * 1024));
+    }
+
+  return best;
+}
+
+static void
+test_relay_throughput (TestCase *tc,
+                       gconstpointer data)
+{
+  double fixed, adaptive;
+
+  if (!g_test_perf ())
+    return;
+
+  connection_set_fixed_buffers (true);
+  fixed = measure_relay (tc);
+
+  connection_set_fixed_buffers (false);
+  adaptive = measure_relay (tc);
+
+  g_test_message ("relayed %zu MiB: %.1f MiB/s with fixed buffers, %.1f MiB/s with adaptive buffers",
+                  tc->transfer_size >> 20, fixed, adaptive);
+  g_test_maximized_result (adaptive, "%.1f MiB/s", adaptive);
+}
+
 int
 main (int argc,
       char *argv[])
 {
   cockpit_test_init (&argc, &argv);
 
+  pattern_init ();
+
+  g_test_add ("/connection/relay/large", TestCase, &fixture_large,
+              setup, test_relay_large, teardown);
+  g_test_add ("/connection/activate/parallel", TestCase, &fixture_activate,
+              setup, test_activate_parallel, teardown);
+  g_test_add ("/connection/activate/preactivate", TestCase, &fixture_activate,
+              setup, test_activate_preactivate, teardown);
+  g_test_add ("/connection/perf/throughput", TestCase, &fixture_perf,
+              setup, test_relay_throughput, teardown);
+
   return g_test_run ();
 }
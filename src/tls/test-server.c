@@ -27,6 +27,7 @@
 #include <netinet/in.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <glib.h>
@@ -38,6 +39,7 @@
 #include "server.h"
 #include "utils.h"
 #include "common/cockpithacks.h"
+#include "common/cockpitjson.h"
 #include "common/cockpittest.h"
 
 #define SOCKET_ACTIVATION_HELPER BUILDDIR "/socket-activation-helper"
@@ -71,6 +73,7 @@ typedef struct {
   const char *client_crt;
   const char *client_key;
   const char *client_fingerprint;
+  bool no_session_tickets;
 } TestFixture;
 
 static const TestFixture fixture_separate_crt_key = {
@@ -105,6 +108,12 @@ static const TestFixture fixture_alternate_client_cert = {
   .client_fingerprint = ALTERNATE_FINGERPRINT,
 };
 
+static const TestFixture fixture_no_session_tickets = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .no_session_tickets = true,
+};
+
 static const TestFixture fixture_run_idle = {
   .idle_timeout = 1,
 };
@@ -286,7 +295,10 @@ assert_https_outcome (TestCase *tc,
         exit (0);
       g_assert_cmpint (len, ==, sizeof (request));
 
-      len = gnutls_record_recv (session, buf, sizeof (buf) - 1);
+      /* session tickets arrive as post-handshake messages, which return E_AGAIN */
+      do
+        len = gnutls_record_recv (session, buf, sizeof (buf) - 1);
+      while (len == GNUTLS_E_AGAIN || len == GNUTLS_E_INTERRUPTED);
       if (len < 0 && expect_tls_failure)
         exit (0);
       g_assert_cmpint (len, >=, 100);
@@ -345,6 +357,90 @@ assert_https (TestCase *tc, const TestFixture *fixture, unsigned expected_server
   assert_https_outcome (tc, fixture, expected_server_certs, false);
 }
 
+/* one request over TLS, optionally resuming a session; runs in the forked client */
+static void
+https_request_with_session (TestCase *tc,
+                            const TestFixture *fixture,
+                            gnutls_datum_t *session_data,
+                            bool expect_resumed)
+{
+  const char request[] = "GET / HTTP/1.0\r\nHost: localhost\r\n\r\n";
+  char buf[4096];
+  gnutls_session_t session;
+  gnutls_certificate_credentials_t xcred;
+  ssize_t len;
+  int fd = do_connect (tc);
+
+  g_assert_cmpint (fd, >, 0);
+
+  g_assert_cmpint (gnutls_init (&session, GNUTLS_CLIENT), ==, GNUTLS_E_SUCCESS);
+  gnutls_transport_set_int (session, fd);
+  g_assert_cmpint (gnutls_set_default_priority (session), ==, GNUTLS_E_SUCCESS);
+  gnutls_handshake_set_timeout (session, 5000);
+  g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
+  if (fixture->client_crt)
+    g_assert_cmpint (gnutls_certificate_set_x509_key_file (xcred, fixture->client_crt, fixture->client_key,
+                                                           GNUTLS_X509_FMT_PEM), ==, GNUTLS_E_SUCCESS);
+  g_assert_cmpint (gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred), ==, GNUTLS_E_SUCCESS);
+
+  if (session_data->data)
+    g_assert_cmpint (gnutls_session_set_data (session, session_data->data, session_data->size), ==, GNUTLS_E_SUCCESS);
+
+  g_assert_cmpint (gnutls_handshake (session), ==, GNUTLS_E_SUCCESS);
+  g_assert_cmpint (gnutls_session_is_resumed (session), ==, expect_resumed);
+
+  g_assert_cmpint (gnutls_record_send (session, request, sizeof (request)), ==, sizeof (request));
+  do
+    len = gnutls_record_recv (session, buf, sizeof (buf) - 1);
+  while (len == GNUTLS_E_AGAIN || len == GNUTLS_E_INTERRUPTED);
+  g_assert_cmpint (len, >=, 100);
+  buf[len] = '\0';
+  cockpit_assert_strmatch (buf, "HTTP/1.1 *");
+
+  /* with TLS 1.3 the ticket arrives after the handshake, so only ask now */
+  if (!session_data->data)
+    g_assert_cmpint (gnutls_session_get_data2 (session, session_data), ==, GNUTLS_E_SUCCESS);
+
+  g_assert_cmpint (gnutls_bye (session, GNUTLS_SHUT_RDWR), ==, GNUTLS_E_SUCCESS);
+  gnutls_deinit (session);
+  gnutls_certificate_free_credentials (xcred);
+  close (fd);
+}
+
+static void
+assert_https_resumption (TestCase *tc,
+                         const TestFixture *fixture,
+                         bool expect_resumed)
+{
+  ConnectionHandshakeStats stats;
+  pid_t pid;
+  int status = -1;
+
+  block_sigchld ();
+
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      gnutls_datum_t session_data = { NULL, 0 };
+
+      https_request_with_session (tc, fixture, &session_data, false);
+      https_request_with_session (tc, fixture, &session_data, expect_resumed);
+
+      gnutls_free (session_data.data);
+      exit (0);
+    }
+
+  for (int retry = 0; retry < 100 && waitpid (pid, &status, WNOHANG) <= 0; ++retry)
+    server_poll_event (200);
+  g_assert_cmpint (status, ==, 0);
+
+  connection_get_handshake_stats (&stats);
+  g_assert_cmpuint (stats.full, ==, expect_resumed ? 1 : 2);
+  g_assert_cmpuint (stats.resumed, ==, expect_resumed ? 1 : 0);
+}
+
 static void
 setup (TestCase *tc, gconstpointer data)
 {
@@ -387,7 +483,8 @@ setup (TestCase *tc, gconstpointer data)
 
   server_init (tc->ws_socket_dir, tc->runtime_dir, fixture ? fixture->idle_timeout : 0, server_port);
   if (fixture && fixture->certfile)
-    connection_crypto_init (fixture->certfile, fixture->keyfile, fixture->cert_request_mode);
+    connection_crypto_init (fixture->certfile, fixture->keyfile, fixture->cert_request_mode,
+                            !fixture->no_session_tickets);
 
   tc->server_addr.sin_family = AF_INET;
   tc->server_addr.sin_port = htons (server_port);
@@ -614,6 +711,106 @@ test_tls_client_cert_expired (TestCase *tc, gconstpointer data)
   assert_https_outcome (tc, data, 1, true);
 }
 
+static void
+test_tls_session_resumption (TestCase *tc, gconstpointer data)
+{
+  assert_https_resumption (tc, data, true);
+}
+
+static void
+test_tls_no_session_tickets (TestCase *tc, gconstpointer data)
+{
+  assert_https_resumption (tc, data, false);
+}
+
+static JsonObject *
+request_stats (TestCase *tc)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  g_autoptr(GString) reply = g_string_new ("");
+  g_autoptr(GError) error = NULL;
+  char buf[4096];
+  JsonObject *object;
+  ssize_t len;
+  int fd;
+
+  g_snprintf (addr.sun_path, sizeof addr.sun_path, "%s/stats.sock", tc->runtime_dir);
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpint (connect (fd, (struct sockaddr *) &addr, sizeof addr), ==, 0);
+
+  g_assert (server_poll_event (1000));
+
+  while ((len = recv (fd, buf, sizeof buf, 0)) > 0)
+    g_string_append_len (reply, buf, len);
+  g_assert_cmpint (len, ==, 0);
+  close (fd);
+
+  object = cockpit_json_parse_object (reply->str, reply->len, &error);
+  g_assert_no_error (error);
+  return object;
+}
+
+static gint64
+stats_get_int (JsonObject *stats,
+               const char *section,
+               const char *name)
+{
+  JsonObject *object = NULL;
+  gint64 value = -1;
+
+  g_assert (cockpit_json_get_object (stats, section, NULL, &object));
+  g_assert (object != NULL);
+  g_assert (cockpit_json_get_int (object, name, -1, &value));
+
+  return value;
+}
+
+static void
+test_stats (TestCase *tc, gconstpointer data)
+{
+  g_autoptr(JsonObject) stats = NULL;
+  JsonObject *wsinstances = NULL;
+  JsonObject *instance = NULL;
+  JsonObject *histogram = NULL;
+
+  assert_http (tc);
+  assert_https (tc, NULL, 1);
+
+  for (int retries = 0; retries < 10 && server_num_connections () > 0; ++retries)
+    server_poll_event (100);
+  g_assert_cmpuint (server_num_connections (), ==, 0);
+
+  stats = request_stats (tc);
+
+  g_assert_cmpint (stats_get_int (stats, "connections", "accepted"), ==, 2);
+  g_assert_cmpint (stats_get_int (stats, "connections", "active"), ==, 0);
+  g_assert_cmpint (stats_get_int (stats, "handshakes", "full"), ==, 1);
+  g_assert_cmpint (stats_get_int (stats, "handshakes", "failed"), ==, 0);
+  g_assert_cmpint (stats_get_int (stats, "bytes", "client-to-ws"), >, 0);
+  g_assert_cmpint (stats_get_int (stats, "bytes", "ws-to-client"), >, 0);
+  g_assert_cmpint (stats_get_int (stats, "wakeups", "total"), >, 0);
+  g_assert_cmpint (stats_get_int (stats, "activations", "requests"), ==, 0);
+
+  g_assert (cockpit_json_get_object (json_object_get_object_member (stats, "handshakes"), "usec", NULL, &histogram));
+  g_assert (histogram != NULL);
+  g_assert_cmpint (json_object_get_int_member (histogram, "count"), ==, 1);
+  g_assert_cmpint (json_array_get_length (json_object_get_array_member (histogram, "buckets")), ==, 26);
+
+  /* the plain http connection was redirected, the https one went to the no-certificate instance */
+  g_assert (cockpit_json_get_object (stats, "wsinstances", NULL, &wsinstances));
+  g_assert (cockpit_json_get_object (wsinstances, "http-redirect", NULL, &instance));
+  g_assert (instance != NULL);
+  g_assert_cmpint (json_object_get_int_member (instance, "connections"), ==, 0);
+  g_assert (cockpit_json_get_object (wsinstances, SHA256_NIL, NULL, &instance));
+  g_assert (instance != NULL);
+
+  /* the stats requests get counted too */
+  json_object_unref (stats);
+  stats = request_stats (tc);
+  g_assert_cmpint (json_object_get_int_member (stats, "stats-requests"), ==, 2);
+}
+
 static void
 test_tls_client_cert_parallel (TestCase *tc, gconstpointer data)
 {
@@ -680,7 +877,7 @@ test_tls_client_cert_parallel (TestCase *tc, gconstpointer data)
 
               do
                 s = gnutls_record_recv (sessions[i], buffer, sizeof buffer);
-              while (s == GNUTLS_E_INTERRUPTED);
+              while (s == GNUTLS_E_INTERRUPTED || s == GNUTLS_E_AGAIN);
               g_assert_cmpint (s, ==, 5);
               g_assert (memcmp (buffer, "hello", 5) == 0);
             }
@@ -796,12 +993,20 @@ main (int argc, char *argv[])
               setup, test_tls_client_cert_parallel, teardown);
   g_test_add ("/server/tls/client-cert-parallel/alternate", TestCase, &fixture_alternate_client_cert,
               setup, test_tls_client_cert_parallel, teardown);
+  g_test_add ("/server/tls/session-resumption", TestCase, &fixture_separate_crt_key,
+              setup, test_tls_session_resumption, teardown);
+  g_test_add ("/server/tls/session-resumption/client-cert", TestCase, &fixture_separate_crt_key_client_cert,
+              setup, test_tls_session_resumption, teardown);
+  g_test_add ("/server/tls/no-session-tickets", TestCase, &fixture_no_session_tickets,
+              setup, test_tls_no_session_tickets, teardown);
   g_test_add ("/server/tls/no-server-cert", TestCase, NULL,
               setup, test_tls_no_server_cert, teardown);
   g_test_add ("/server/tls/redirect", TestCase, &fixture_separate_crt_key,
               setup, test_tls_redirect, teardown);
   g_test_add ("/server/tls/blocked-handshake", TestCase, &fixture_separate_crt_key,
               setup, test_tls_blocked_handshake, teardown);
+  g_test_add ("/server/stats", TestCase, &fixture_separate_crt_key,
+              setup, test_stats, teardown);
   g_test_add ("/server/mixed-protocols", TestCase, &fixture_separate_crt_key,
               setup, test_mixed_protocols, teardown);
   g_test_add ("/server/run-idle", TestCase, &fixture_run_idle,
@@ -33,6 +33,24 @@ typedef struct {
   WebSocketConnection *server;
 } Test;
 
+typedef struct {
+  gboolean client_compression;
+  gboolean server_compression;
+} Fixture;
+
+static const Fixture fixture_compression = {
+  .client_compression = TRUE,
+  .server_compression = TRUE,
+};
+
+static const Fixture fixture_client_compression = {
+  .client_compression = TRUE,
+};
+
+static const Fixture fixture_server_compression = {
+  .server_compression = TRUE,
+};
+
 static void
 null_log_handler (const gchar *log_domain,
                   GLogLevelFlags log_level,
@@ -472,6 +490,7 @@ static void
 setup_pair (Test *test,
             gconstpointer data)
 {
+  const Fixture *fixture = data;
   GIOStream *ioc;
   GIOStream *ios;
 
@@ -480,6 +499,13 @@ setup_pair (Test *test,
   test->server = web_socket_server_new_for_stream ("ws://localhost/unix", NULL, NULL, ios, NULL, NULL);
   test->client =  web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, ioc);
 
+  /* Compress every message, so even the small ones exercise it */
+  if (fixture)
+    {
+      g_object_set (test->server, "compression", fixture->server_compression, "compression-threshold", 0, NULL);
+      g_object_set (test->client, "compression", fixture->client_compression, "compression-threshold", 0, NULL);
+    }
+
   g_signal_connect (test->server, "error", G_CALLBACK (on_error_not_reached), NULL);
 
   g_object_unref (ioc);
@@ -796,6 +822,49 @@ test_send_prefixed (Test *test,
   g_bytes_unref (received);
 }
 
+static void
+on_message_count_lanes (WebSocketConnection *ws,
+                        WebSocketDataType type,
+                        GBytes *message,
+                        gpointer user_data)
+{
+  gint *counts = user_data;
+
+  /* The small message records how many large ones went before it */
+  if (g_bytes_get_size (message) == 1)
+    counts[1] = counts[0];
+  else
+    counts[0]++;
+}
+
+static void
+test_send_lanes (Test *test,
+                 gconstpointer data)
+{
+  gint counts[2] = { 0, -1 };
+  GBytes *bulk;
+  GBytes *echo;
+  gint i;
+
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_count_lanes), counts);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  bulk = g_bytes_new_take (g_strnfill (64 * 1024, 'b'), 64 * 1024);
+  for (i = 0; i < 100; i++)
+    web_socket_connection_send_lane (test->server, WEB_SOCKET_DATA_TEXT, NULL, bulk, "bulk", 1);
+  g_bytes_unref (bulk);
+
+  echo = g_bytes_new_static ("e", 1);
+  web_socket_connection_send_lane (test->server, WEB_SOCKET_DATA_TEXT, NULL, echo, "echo", 16);
+  g_bytes_unref (echo);
+
+  /* The echo doesn't wait behind all the bulk messages queued before it */
+  WAIT_UNTIL (counts[0] == 100);
+  g_assert_cmpint (counts[1], ==, 1);
+}
+
 static void
 test_send_bad_data (Test *test,
                     gconstpointer unused)
@@ -1183,6 +1252,227 @@ test_receive_fragmented (void)
   g_object_unref (io_b);
 }
 
+typedef struct {
+  WebSocketDataType type;
+  const gchar *pattern;
+  gsize length;
+  gsize fragment;
+  gboolean streamed;
+} StreamFixture;
+
+typedef struct {
+  GIOStream *io;
+  const StreamFixture *fixture;
+} StreamSender;
+
+typedef struct {
+  GChecksum *checksum;
+  gsize total;
+  gsize largest;
+  guint count;
+  gboolean final;
+} StreamReceived;
+
+static void
+fill_pattern (const StreamFixture *fixture,
+              gsize offset,
+              guint8 *data,
+              gsize length)
+{
+  gsize plen = strlen (fixture->pattern);
+  gsize i;
+
+  for (i = 0; i < length; i++)
+    data[i] = fixture->pattern[(offset + i) % plen];
+}
+
+static gpointer
+send_stream_thread (gpointer user_data)
+{
+  StreamSender *sender = user_data;
+  const StreamFixture *fixture = sender->fixture;
+  const guint8 mask[] = { 0x12, 0x34, 0x56, 0x78 };
+  GOutputStream *output;
+  guint8 *frame;
+  gsize offset;
+  gsize len;
+  gsize at;
+  gsize i;
+
+  mock_perform_handshake (sender->io);
+  output = g_io_stream_get_output_stream (sender->io);
+
+  for (offset = 0; offset < fixture->length; offset += len)
+    {
+      len = fixture->length - offset;
+      if (fixture->fragment && len > fixture->fragment)
+        len = fixture->fragment;
+
+      frame = g_malloc (len + 14);
+      frame[0] = (offset == 0 ? fixture->type : 0x00) | (offset + len == fixture->length ? 0x80 : 0x00);
+      if (len < 126)
+        {
+          frame[1] = 0x80 | len;
+          at = 2;
+        }
+      else if (len < 65536)
+        {
+          frame[1] = 0x80 | 126;
+          frame[2] = (len >> 8) & 0xFF;
+          frame[3] = len & 0xFF;
+          at = 4;
+        }
+      else
+        {
+          frame[1] = 0x80 | 127;
+          for (i = 0; i < 8; i++)
+            frame[2 + i] = ((guint64)len >> (56 - i * 8)) & 0xFF;
+          at = 10;
+        }
+
+      /* Masked, which has to carry on correctly between pieces */
+      memcpy (frame + at, mask, sizeof (mask));
+      at += sizeof (mask);
+      fill_pattern (fixture, offset, frame + at, len);
+      for (i = 0; i < len; i++)
+        frame[at + i] ^= mask[i & 3];
+
+      if (!g_output_stream_write_all (output, frame, at + len, NULL, NULL, NULL))
+        g_assert_not_reached ();
+      g_free (frame);
+    }
+
+  return NULL;
+}
+
+static void
+on_partial_message (WebSocketConnection *ws,
+                    WebSocketDataType type,
+                    GBytes *message,
+                    gboolean final,
+                    gpointer user_data)
+{
+  StreamReceived *received = user_data;
+  const gchar *data;
+  gsize len;
+
+  g_assert (!received->final);
+
+  data = g_bytes_get_data (message, &len);
+  if (len > 0)
+    {
+      if (type == WEB_SOCKET_DATA_TEXT)
+        g_assert (g_utf8_validate (data, len, NULL));
+      g_assert (data[len] == '\0');
+    }
+
+  g_checksum_update (received->checksum, (const guchar *)data, len);
+  received->total += len;
+  received->largest = MAX (received->largest, len);
+  received->count++;
+  received->final = final;
+}
+
+static void
+test_receive_streaming (gconstpointer data)
+{
+  const StreamFixture *fixture = data;
+  StreamReceived received = { NULL, };
+  StreamSender sender;
+  WebSocketConnection *client;
+  GByteArray *messages;
+  GChecksum *expected;
+  guint8 buffer[4096];
+  GIOStream *io_a;
+  GIOStream *io_b;
+  GThread *thread;
+  gsize offset;
+  gsize len;
+
+  /* Note that no server is around in this test, so no close happens */
+  cockpit_socket_streampair (&io_a, &io_b);
+  sender.io = io_a;
+  sender.fixture = fixture;
+  thread = g_thread_new ("stream-thread", send_stream_thread, &sender);
+
+  received.checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  messages = g_byte_array_new ();
+
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  g_object_set (client, "streaming", TRUE, NULL);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (client, "message", G_CALLBACK (on_message_append), messages);
+  g_signal_connect (client, "partial-message", G_CALLBACK (on_partial_message), &received);
+
+  if (fixture->streamed)
+    {
+      WAIT_UNTIL (received.final);
+
+      /* Delivered in pieces, and never the whole message at once */
+      g_assert_cmpuint (received.total, ==, fixture->length);
+      g_assert_cmpuint (received.count, >, 1);
+      g_assert_cmpuint (received.largest, <=, 256 * 1024);
+      g_assert_cmpuint (messages->len, ==, 0);
+    }
+  else
+    {
+      WAIT_UNTIL (messages->len >= fixture->length);
+      g_assert_cmpuint (messages->len, ==, fixture->length);
+      g_assert_cmpuint (received.count, ==, 0);
+      g_checksum_update (received.checksum, messages->data, messages->len);
+    }
+
+  expected = g_checksum_new (G_CHECKSUM_SHA256);
+  for (offset = 0; offset < fixture->length; offset += len)
+    {
+      len = MIN (sizeof (buffer), fixture->length - offset);
+      fill_pattern (fixture, offset, buffer, len);
+      g_checksum_update (expected, buffer, len);
+    }
+  g_assert_cmpstr (g_checksum_get_string (received.checksum), ==, g_checksum_get_string (expected));
+  g_checksum_free (expected);
+
+  g_thread_join (thread);
+  g_object_unref (client);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+
+  g_checksum_free (received.checksum);
+  g_byte_array_free (messages, TRUE);
+}
+
+static const StreamFixture stream_fragments = {
+  .type = WEB_SOCKET_DATA_TEXT,
+  .pattern = "Lorem ipsum dolor sit amet, ",
+  .length = 4 * 1024 * 1024,
+  .fragment = 4096,
+  .streamed = TRUE,
+};
+
+static const StreamFixture stream_oversized = {
+  .type = WEB_SOCKET_DATA_BINARY,
+  .pattern = "\x01\xff\x80\x7f binary",
+  .length = 3 * 1024 * 1024,
+  .fragment = 0,
+  .streamed = TRUE,
+};
+
+static const StreamFixture stream_characters = {
+  .type = WEB_SOCKET_DATA_TEXT,
+  .pattern = "\xc3\xb1\xe2\x82\xac\xf0\x9f\x98\x80", /* multibyte characters */
+  .length = 9 * 200 * 1000,
+  .fragment = 4099,
+  .streamed = TRUE,
+};
+
+static const StreamFixture stream_small = {
+  .type = WEB_SOCKET_DATA_TEXT,
+  .pattern = "small",
+  .length = 1000,
+  .fragment = 0,
+  .streamed = FALSE,
+};
+
 static gpointer
 client_thread (gpointer data)
 {
@@ -1256,6 +1546,306 @@ test_handshake_with_buffer_and_headers (void)
   g_object_unref (ios);
 }
 
+static void
+test_compression_negotiate (Test *test,
+                            gconstpointer data)
+{
+  GHashTable *headers;
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+
+  headers = web_socket_client_get_headers (WEB_SOCKET_CLIENT (test->client));
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Sec-WebSocket-Extensions"), ==, "permessage-deflate");
+}
+
+static void
+test_compression_declined (Test *test,
+                           gconstpointer data)
+{
+  GBytes *sent = NULL;
+  GBytes *received = NULL;
+  GHashTable *headers;
+
+  g_signal_connect (test->server, "message", G_CALLBACK (on_text_message), &received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+
+  headers = web_socket_client_get_headers (WEB_SOCKET_CLIENT (test->client));
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Sec-WebSocket-Extensions"), ==, NULL);
+
+  sent = g_bytes_new_take (g_strnfill (1000, '#'), 1000);
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (sent, received));
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+}
+
+static void
+test_compression_many (Test *test,
+                       gconstpointer data)
+{
+  GBytes *sent = NULL;
+  GBytes *received = NULL;
+  gchar *text;
+  gint i;
+
+  g_signal_connect (test->server, "message", G_CALLBACK (on_text_message), &received);
+  g_signal_connect (test->client, "message", G_CALLBACK (on_text_message), &received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* Similar messages, so each one refers back into the previous */
+  for (i = 0; i < 50; i++)
+    {
+      text = g_strdup_printf ("{ \"command\": \"ping\", \"number\": %d, \"padding\": \"%0*d\" }", i, i * 10, 0);
+      sent = g_bytes_new_take (text, strlen (text));
+
+      web_socket_connection_send ((i % 2) ? test->server : test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+      WAIT_UNTIL (received != NULL);
+      g_assert (g_bytes_equal (sent, received));
+
+      g_bytes_unref (sent);
+      g_bytes_unref (received);
+      received = NULL;
+    }
+}
+
+static gchar *
+lane_message (const gchar *lane,
+              gint number)
+{
+  /* Similar messages, so each one refers back into the ones before */
+  return g_strdup_printf ("%s %d %0*d", lane, number, 4096 + number, 0);
+}
+
+static void
+on_message_check_lanes (WebSocketConnection *ws,
+                        WebSocketDataType type,
+                        GBytes *message,
+                        gpointer user_data)
+{
+  gint *counts = user_data;
+  gchar *expected;
+  gint lane;
+
+  lane = memcmp (g_bytes_get_data (message, NULL), "bulk", 4) == 0 ? 0 : 1;
+  expected = lane_message (lane == 0 ? "bulk" : "echo", counts[lane]);
+  g_assert_cmpuint (g_bytes_get_size (message), ==, strlen (expected));
+  g_assert (memcmp (g_bytes_get_data (message, NULL), expected, strlen (expected)) == 0);
+  g_free (expected);
+
+  counts[lane]++;
+}
+
+static void
+test_compression_lanes (Test *test,
+                        gconstpointer data)
+{
+  gint counts[2] = { 0, 0 };
+  GBytes *sent;
+  gchar *text;
+  gint i;
+
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_check_lanes), counts);
+  g_signal_connect (test->client, "error", G_CALLBACK (on_error_not_reached), NULL);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* The lanes send these in another order than they were queued */
+  for (i = 0; i < 100; i++)
+    {
+      text = lane_message ("bulk", i);
+      sent = g_bytes_new_take (text, strlen (text));
+      web_socket_connection_send_lane (test->server, WEB_SOCKET_DATA_TEXT, NULL, sent, "bulk", 1);
+      g_bytes_unref (sent);
+
+      if (i % 10 == 0)
+        {
+          text = lane_message ("echo", i / 10);
+          sent = g_bytes_new_take (text, strlen (text));
+          web_socket_connection_send_lane (test->server, WEB_SOCKET_DATA_TEXT, NULL, sent, "echo", 16);
+          g_bytes_unref (sent);
+        }
+    }
+
+  /* The client inflates them all in the order they arrive */
+  WAIT_UNTIL (counts[0] == 100 && counts[1] == 10);
+}
+
+static void
+test_compression_too_big (Test *test,
+                          gconstpointer data)
+{
+  GError *error = NULL;
+  GBytes *sent;
+  guint logid;
+
+  g_signal_handlers_disconnect_by_func (test->server, on_error_not_reached, NULL);
+  g_signal_connect (test->client, "error", G_CALLBACK (on_error_copy), &error);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  /* Small on the wire, but too large once inflated */
+  sent = g_bytes_new_take (g_strnfill (1000 * 1000, '?'), 1000 * 1000);
+  web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  g_bytes_unref (sent);
+
+  WAIT_UNTIL (error != NULL);
+  g_assert_error (error, WEB_SOCKET_ERROR, WEB_SOCKET_CLOSE_TOO_BIG);
+  g_error_free (error);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) == WEB_SOCKET_STATE_CLOSED);
+  g_assert_cmpuint (web_socket_connection_get_close_code (test->client), ==, WEB_SOCKET_CLOSE_TOO_BIG);
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+}
+
+static void
+test_compression_unexpected (Test *test,
+                             gconstpointer data)
+{
+  GError *error = NULL;
+  GIOStream *io;
+  gsize written;
+  const gchar *frame;
+  guint logid;
+
+  g_signal_handlers_disconnect_by_func (test->server, on_error_not_reached, NULL);
+  g_signal_connect (test->server, "error", G_CALLBACK (on_error_copy), &error);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+
+  io = web_socket_connection_get_io_stream (test->client);
+
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  /* RSV1 set, but compression wasn't negotiated */
+  frame = "\xC1\x01\x61";
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (io),
+                                  frame, 3, &written, NULL, NULL))
+    g_assert_not_reached ();
+  g_assert_cmpuint (written, ==, 3);
+
+  WAIT_UNTIL (error != NULL);
+  g_assert_error (error, WEB_SOCKET_ERROR, WEB_SOCKET_CLOSE_PROTOCOL);
+  g_error_free (error);
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+}
+
+static const struct {
+  const gchar *offer;
+  const gchar *response;
+} choose_extensions_fixtures[] = {
+  { NULL, NULL },
+  { "permessage-deflate", "permessage-deflate" },
+  { "permessage-deflate; client_max_window_bits", "permessage-deflate" },
+  { "permessage-deflate;client_max_window_bits=10", "permessage-deflate" },
+  { "permessage-deflate; server_max_window_bits=10, permessage-deflate", "permessage-deflate" },
+  { "permessage-deflate; server_max_window_bits=\"15\"", "permessage-deflate; server_max_window_bits=15" },
+  { "permessage-deflate; client_no_context_takeover; server_no_context_takeover",
+    "permessage-deflate; server_no_context_takeover; client_no_context_takeover" },
+  { "x-webkit-deflate-frame", NULL },
+  { "x-webkit-deflate-frame, permessage-deflate", "permessage-deflate" },
+  { "permessage-deflate; unknown", NULL },
+  { "permessage-deflate; client_max_window_bits=7", NULL },
+  { "permessage-deflate; server_max_window_bits", NULL },
+  { "permessage-deflate; server_no_context_takeover=1", NULL },
+  { "permessage-deflate; server_no_context_takeover; server_no_context_takeover", NULL },
+};
+
+static WebSocketConnection *
+new_unconnected (gboolean compression)
+{
+  WebSocketConnection *conn;
+
+  /* Negotiation doesn't need a stream, or to be on a particular side */
+  conn = web_socket_client_new ("ws://localhost/unix", NULL, NULL);
+  g_object_set (conn, "compression", compression, NULL);
+  return conn;
+}
+
+static void
+free_unconnected (WebSocketConnection *conn)
+{
+  web_socket_connection_close (conn, 0, NULL);
+  g_assert_cmpint (web_socket_connection_get_ready_state (conn), ==, WEB_SOCKET_STATE_CLOSED);
+  g_object_unref (conn);
+}
+
+static void
+test_compression_choose (void)
+{
+  WebSocketConnection *conn;
+  gchar *response;
+  gint i;
+
+  for (i = 0; i < G_N_ELEMENTS (choose_extensions_fixtures); i++)
+    {
+      conn = new_unconnected (TRUE);
+
+      response = _web_socket_connection_choose_extensions (conn, choose_extensions_fixtures[i].offer);
+      g_assert_cmpstr (response, ==, choose_extensions_fixtures[i].response);
+      g_free (response);
+
+      free_unconnected (conn);
+    }
+
+  /* Never agree when compression is off */
+  conn = new_unconnected (FALSE);
+  g_assert_cmpstr (_web_socket_connection_choose_extensions (conn, "permessage-deflate"), ==, NULL);
+  free_unconnected (conn);
+}
+
+static const struct {
+  const gchar *response;
+  gboolean accept;
+} accept_extensions_fixtures[] = {
+  { NULL, TRUE },
+  { "", TRUE },
+  { "permessage-deflate", TRUE },
+  { "permessage-deflate; server_max_window_bits=10", TRUE },
+  { "permessage-deflate; server_no_context_takeover; client_no_context_takeover", TRUE },
+  { "permessage-deflate; client_max_window_bits=10", FALSE },
+  { "permessage-deflate; server_max_window_bits=16", FALSE },
+  { "permessage-deflate, permessage-deflate", FALSE },
+  { "x-webkit-deflate-frame", FALSE },
+};
+
+static void
+test_compression_accept (void)
+{
+  WebSocketConnection *conn;
+  guint logid;
+  gint i;
+
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (accept_extensions_fixtures); i++)
+    {
+      conn = new_unconnected (TRUE);
+      g_assert_cmpint (_web_socket_connection_accept_extensions (conn, accept_extensions_fixtures[i].response),
+                       ==, accept_extensions_fixtures[i].accept);
+      free_unconnected (conn);
+    }
+
+  /* We didn't offer anything, so the server can't agree to it */
+  conn = new_unconnected (FALSE);
+  g_assert (!_web_socket_connection_accept_extensions (conn, "permessage-deflate"));
+  free_unconnected (conn);
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -1272,6 +1862,7 @@ main (int argc,
       { test_send_server_to_client, "send-server-to-client" },
       { test_send_big_packets, "send-big-packets" },
       { test_send_prefixed, "send-prefixed" },
+      { test_send_lanes, "send-lanes" },
       { test_send_bad_data, "send-bad-data" },
       { test_pressure_queue, "pressure-queue" },
       { test_pressure_throttle, "pressure-throttle" },
@@ -1283,6 +1874,23 @@ main (int argc,
       { test_close_clean_server, "close-clean-server" },
   };
 
+  struct {
+    void (* func) (Test *, gconstpointer);
+    const gchar *name;
+  } tests_with_compression[] = {
+      { test_compression_negotiate, "negotiate" },
+      { test_send_client_to_server, "send-client-to-server" },
+      { test_send_server_to_client, "send-server-to-client" },
+      { test_send_big_packets, "send-big-packets" },
+      { test_send_prefixed, "send-prefixed" },
+      { test_send_bad_data, "send-bad-data" },
+      { test_compression_many, "many" },
+      { test_compression_lanes, "lanes" },
+      { test_compression_too_big, "too-big" },
+      { test_close_clean_client, "close-clean-client" },
+      { test_close_clean_server, "close-clean-server" },
+  };
+
   signal (SIGPIPE, SIG_IGN);
   g_assert (g_setenv ("GSETTINGS_BACKEND", "memory", TRUE));
   g_assert (g_setenv ("GIO_USE_PROXY_RESOLVER", "dummy", TRUE));
@@ -1322,10 +1930,30 @@ main (int argc,
       g_free (name);
     }
 
+  for (j = 0; j < G_N_ELEMENTS (tests_with_compression); j++)
+    {
+      name = g_strdup_printf ("/web-socket/compression/%s", tests_with_compression[j].name);
+      g_test_add (name, Test, &fixture_compression, setup_pair, tests_with_compression[j].func, teardown);
+      g_free (name);
+    }
+
+  g_test_add ("/web-socket/compression/client-only", Test, &fixture_client_compression,
+              setup_pair, test_compression_declined, teardown);
+  g_test_add ("/web-socket/compression/server-only", Test, &fixture_server_compression,
+              setup_pair, test_compression_declined, teardown);
+  g_test_add ("/web-socket/compression/unexpected", Test, NULL,
+              setup_pair, test_compression_unexpected, teardown);
+  g_test_add_func ("/web-socket/compression/choose", test_compression_choose);
+  g_test_add_func ("/web-socket/compression/accept", test_compression_accept);
+
   g_test_add_func ("/web-socket/close-immediately", test_close_immediately);
   if (g_test_slow ())
     g_test_add_func ("/web-socket/close-after-timeout", test_close_after_timeout);
   g_test_add_func ("/web-socket/receive-fragmented", test_receive_fragmented);
+  g_test_add_data_func ("/web-socket/streaming/fragments", &stream_fragments, test_receive_streaming);
+  g_test_add_data_func ("/web-socket/streaming/oversized", &stream_oversized, test_receive_streaming);
+  g_test_add_data_func ("/web-socket/streaming/split-characters", &stream_characters, test_receive_streaming);
+  g_test_add_data_func ("/web-socket/streaming/small", &stream_small, test_receive_streaming);
   g_test_add_func ("/web-socket/handshake-with-buffer-headers", test_handshake_with_buffer_and_headers);
 
   g_test_add ("/web-socket/message-after-closing", Test, NULL, setup_pair, test_message_after_closing, teardown);
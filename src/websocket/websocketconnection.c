@@ -22,8 +22,10 @@
 #include "websocket.h"
 #include "websocketprivate.h"
 
+#include "common/cockpitfairqueue.h"
 #include "common/cockpitflow.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 /*
@@ -85,11 +87,15 @@ enum {
   PROP_READY_STATE,
   PROP_BUFFERED_AMOUNT,
   PROP_IO_STREAM,
+  PROP_COMPRESSION,
+  PROP_COMPRESSION_THRESHOLD,
+  PROP_STREAMING,
 };
 
 enum {
   OPEN,
   MESSAGE,
+  PARTIAL_MESSAGE,
   ERROR,
   CLOSING,
   CLOSE,
@@ -103,6 +109,9 @@ typedef struct {
   gboolean last;
   gsize sent;
   gsize amount;
+
+  /* When set, data is a message still to be compressed with this opcode */
+  guint8 deflate;
 } Frame;
 
 struct _WebSocketConnectionPrivate
@@ -142,17 +151,62 @@ struct _WebSocketConnectionPrivate
   gsize output_queued;
   GQueue outgoing;
 
+  /* Frames sent in lanes, moved to outgoing one at a time */
+  CockpitFairQueue *lanes;
+  gsize lanes_amount;
+
   /* Current message being assembled */
   guint8 message_opcode;
   GByteArray *message_data;
+  gboolean message_compressed;
+
+  /*
+   * The permessage-deflate extension from RFC 7692. The converters
+   * are only present once it has been negotiated in the handshake.
+   */
+  gboolean compression;
+  guint compression_threshold;
+  GConverter *deflater;
+  GConverter *inflater;
+  gboolean deflater_reset;
+  gboolean inflater_reset;
+
+  /*
+   * When streaming, fragmented and oversized messages are delivered
+   * piece by piece as they arrive, rather than assembled.
+   */
+  gboolean streaming;
+  guint8 stream_opcode;
+  gboolean stream_frame;
+  gboolean stream_fin;
+  gboolean stream_discard;
+  gboolean stream_masked;
+  guint8 stream_mask[4];
+  guint64 stream_remaining;
+  guint64 stream_offset;
+  guint8 stream_utf8[4];
+  gsize stream_utf8_len;
 
   /* Pressure which throttles input on this web socket */
   CockpitFlow *pressure;
   gulong pressure_sig;
+  gboolean throttled;
 };
 
 #define MAX_PAYLOAD   128 * 1024
 
+/* Don't read more than this before processing what we have */
+#define MAX_INCOMING  (MAX_PAYLOAD + 1024)
+
+/* The smallest piece of a streamed message we deliver, apart from the end */
+#define STREAM_CHUNK  16 * 1024
+
+/* Messages smaller than this are not worth compressing */
+#define DEFAULT_COMPRESSION_THRESHOLD 128
+
+/* The trailer that a sync flush leaves at the end of each message */
+static const guint8 deflate_trailer[] = { 0x00, 0x00, 0xff, 0xff };
+
 /* The queue size above which we consider applying back pressure */
 #define QUEUE_PRESSURE       1UL * 1024UL * 1024UL /* 1 megabyte */
 
@@ -181,7 +235,9 @@ web_socket_connection_init (WebSocketConnection *self)
                                                WebSocketConnectionPrivate);
 
   g_queue_init (&pv->outgoing);
+  pv->lanes = cockpit_fair_queue_new (frame_free);
   pv->main_context = g_main_context_ref_thread_default ();
+  pv->compression_threshold = DEFAULT_COMPRESSION_THRESHOLD;
 }
 
 static void
@@ -357,18 +413,131 @@ xor_with_mask_rfc6455 (const guint8 *mask,
     data[n] ^= mask[n & 3];
 }
 
+/*
+ * Run @input through a zlib converter, appending to @output. When
+ * @limit is non-zero, fail once the output grows larger than that.
+ */
+static gboolean
+convert_bytes (GConverter *converter,
+               GConverterFlags flags,
+               const guint8 *input,
+               gsize input_len,
+               GByteArray *output,
+               gsize limit,
+               GError **error)
+{
+  GConverterResult res;
+  GError *local_error = NULL;
+  gsize bytes_read;
+  gsize bytes_written;
+  gsize space;
+  gsize len;
+
+  if (input_len == 0 && !(flags & G_CONVERTER_FLUSH))
+    return TRUE;
+
+  for (;;)
+    {
+      len = output->len;
+      space = MAX (input_len * 2, 4096);
+      g_byte_array_set_size (output, len + space);
+
+      res = g_converter_convert (converter, input, input_len, output->data + len, space,
+                                 flags, &bytes_read, &bytes_written, &local_error);
+      if (res == G_CONVERTER_ERROR)
+        {
+          output->len = len;
+
+          /* Nothing more to produce from the input we have */
+          if (input_len == 0 && g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT))
+            {
+              g_error_free (local_error);
+              return TRUE;
+            }
+
+          g_propagate_error (error, local_error);
+          return FALSE;
+        }
+
+      output->len = len + bytes_written;
+      input += bytes_read;
+      input_len -= bytes_read;
+
+      if (limit && output->len > limit)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_MESSAGE_TOO_LARGE,
+                       "Message larger than %" G_GSIZE_FORMAT " bytes", limit);
+          return FALSE;
+        }
+
+      /* The peer may end the deflate stream, and begin a new one */
+      if (res == G_CONVERTER_FINISHED)
+        g_converter_reset (converter);
+      else if (res == G_CONVERTER_FLUSHED)
+        return TRUE;
+
+      /* Done when everything is consumed, and the output wasn't full */
+      if (input_len == 0 && bytes_written < space)
+        return TRUE;
+    }
+}
+
+static GByteArray *
+deflate_message (WebSocketConnection *self,
+                 const guint8 *prefix,
+                 gsize prefix_len,
+                 const guint8 *payload,
+                 gsize payload_len)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  GByteArray *compressed;
+  GError *error = NULL;
+
+  compressed = g_byte_array_sized_new ((prefix_len + payload_len) / 2 + 64);
+
+  if (!convert_bytes (pv->deflater, G_CONVERTER_NO_FLAGS, prefix, prefix_len, compressed, 0, &error) ||
+      !convert_bytes (pv->deflater, G_CONVERTER_FLUSH, payload, payload_len, compressed, 0, &error))
+    {
+      g_critical ("couldn't compress WebSocket message: %s", error->message);
+      g_error_free (error);
+      g_byte_array_unref (compressed);
+      return NULL;
+    }
+
+  /* RFC 7692 section 7.2.1: the trailer is left off, the peer puts it back */
+  if (compressed->len >= sizeof (deflate_trailer) &&
+      memcmp (compressed->data + compressed->len - sizeof (deflate_trailer),
+              deflate_trailer, sizeof (deflate_trailer)) == 0)
+    compressed->len -= sizeof (deflate_trailer);
+
+  if (pv->deflater_reset)
+    g_converter_reset (pv->deflater);
+
+  return compressed;
+}
+
 static void
-send_prefixed_message_rfc6455 (WebSocketConnection *self,
-                               WebSocketQueueFlags flags,
-                               guint8 opcode,
-                               const guint8 *prefix,
-                               gsize prefix_len,
-                               const guint8 *payload,
-                               gsize payload_len)
+queue_frame (WebSocketConnection *self,
+             WebSocketQueueFlags flags,
+             const gchar *lane,
+             guint weight,
+             guint8 deflate,
+             gpointer data,
+             gsize len,
+             gsize amount);
+
+static GByteArray *
+build_frame_rfc6455 (WebSocketConnection *self,
+                     guint8 opcode,
+                     gboolean compress,
+                     const guint8 *prefix,
+                     gsize prefix_len,
+                     const guint8 *payload,
+                     gsize payload_len,
+                     gsize *amount)
 {
-  gsize amount;
   GByteArray *bytes;
-  gsize frame_len;
+  GByteArray *compressed = NULL;
   guint8 *outer;
   guint8 *mask = 0;
   guint8 *at;
@@ -376,12 +545,28 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
   guint64 size;
 
   len = payload_len + prefix_len;
-  amount = len;
+  *amount = len;
+
+  if (compress)
+    compressed = deflate_message (self, prefix, prefix_len, payload, payload_len);
+
+  if (compressed)
+    {
+      prefix = NULL;
+      prefix_len = 0;
+      payload = compressed->data;
+      payload_len = compressed->len;
+      len = payload_len;
+    }
 
   bytes = g_byte_array_sized_new (14 + len);
   outer = bytes->data;
   outer[0] = 0x80 | opcode;
 
+  /* RSV1 marks a compressed message */
+  if (compressed)
+    outer[0] |= 0x40;
+
   /* If control message, truncate payload */
   if (opcode & 0x08)
     {
@@ -395,7 +580,7 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
         }
 
       /* Buffered amount of bytes is zero for control messages */
-      amount = 0;
+      *amount = 0;
     }
 
   size = len;
@@ -446,9 +631,55 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
   if (is_client_side)
     xor_with_mask_rfc6455 (mask, at, len);
 
+  if (compressed)
+    g_byte_array_unref (compressed);
+
+  return bytes;
+}
+
+static void
+send_prefixed_message_rfc6455 (WebSocketConnection *self,
+                               WebSocketQueueFlags flags,
+                               const gchar *lane,
+                               guint weight,
+                               guint8 opcode,
+                               const guint8 *prefix,
+                               gsize prefix_len,
+                               const guint8 *payload,
+                               gsize payload_len)
+{
+  GByteArray *bytes;
+  gboolean compress;
+  gsize frame_len;
+  gsize amount;
+  gsize len;
+
+  len = payload_len + prefix_len;
+
+  /* Compress data messages, but not small ones */
+  compress = self->pv->deflater && !(opcode & 0x08) && len >= self->pv->compression_threshold;
+
+  /*
+   * The peer inflates messages in the order they arrive, with the
+   * context of the ones before. So compress when the message leaves
+   * the lanes, not now, see take_lane_frame(). Messages that skip
+   * the lanes aren't compressed at all.
+   */
+  if (compress && flags == WEB_SOCKET_QUEUE_NORMAL)
+    {
+      bytes = g_byte_array_sized_new (len);
+      g_byte_array_append (bytes, prefix, prefix_len);
+      g_byte_array_append (bytes, payload, payload_len);
+      queue_frame (self, flags, lane, weight, opcode, g_byte_array_free (bytes, FALSE), len, len);
+      g_debug ("queued rfc6455 %d message of len %u to compress", (gint)opcode, (guint)len);
+      return;
+    }
+
+  bytes = build_frame_rfc6455 (self, opcode, FALSE, prefix, prefix_len,
+                               payload, payload_len, &amount);
   frame_len = bytes->len;
-  _web_socket_connection_queue (self, flags, g_byte_array_free (bytes, FALSE),
-                                frame_len, amount);
+  queue_frame (self, flags, lane, weight, 0, g_byte_array_free (bytes, FALSE),
+               frame_len, amount);
   g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame_len);
 }
 
@@ -459,7 +690,8 @@ send_message_rfc6455 (WebSocketConnection *self,
                       const guint8 *payload,
                       gsize payload_len)
 {
-  return send_prefixed_message_rfc6455 (self, flags, opcode, NULL, 0, payload, payload_len);
+  return send_prefixed_message_rfc6455 (self, flags, NULL, COCKPIT_FAIR_QUEUE_DEFAULT_WEIGHT,
+                                        opcode, NULL, 0, payload, payload_len);
 }
 
 static void
@@ -683,10 +915,61 @@ receive_ping_rfc6455 (WebSocketConnection *self,
   send_message_rfc6455 (self, WEB_SOCKET_QUEUE_URGENT, 0x0A, data, len);
 }
 
+static void
+discard_message (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+
+  g_byte_array_unref (pv->message_data);
+  pv->message_data = NULL;
+  pv->message_opcode = 0;
+  pv->message_compressed = FALSE;
+}
+
+static gboolean
+inflate_payload (WebSocketConnection *self,
+                 gconstpointer payload,
+                 gsize payload_len,
+                 gboolean fin)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  GError *error = NULL;
+  gsize size;
+
+  /*
+   * The size limit applies to the decompressed message, as that
+   * is what we have to hold in memory.
+   */
+  if (convert_bytes (pv->inflater, G_CONVERTER_NO_FLAGS, payload, payload_len,
+                     pv->message_data, MAX_PAYLOAD, &error) &&
+      (!fin || convert_bytes (pv->inflater, G_CONVERTER_NO_FLAGS, deflate_trailer,
+                              sizeof (deflate_trailer), pv->message_data, MAX_PAYLOAD, &error)))
+    {
+      return TRUE;
+    }
+
+  size = pv->message_data->len;
+  discard_message (self);
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_MESSAGE_TOO_LARGE))
+    {
+      too_big_error_and_close (self, size);
+    }
+  else
+    {
+      g_message ("received invalid compressed data: %s", error->message);
+      bad_data_error_and_close (self);
+    }
+
+  g_error_free (error);
+  return FALSE;
+}
+
 static void
 process_contents_rfc6455 (WebSocketConnection *self,
                           gboolean control,
                           gboolean fin,
+                          guint8 rsv,
                           guint8 opcode,
                           gconstpointer payload,
                           gsize payload_len)
@@ -694,6 +977,14 @@ process_contents_rfc6455 (WebSocketConnection *self,
   WebSocketConnectionPrivate *pv = self->pv;
   GBytes *message;
 
+  /* Only RSV1 has a meaning, on the first frame of a compressed message */
+  if ((rsv & 0x30) || ((rsv & 0x40) && (control || !opcode || !pv->inflater)))
+    {
+      g_message ("received frame with invalid reserved bits");
+      protocol_error_and_close (self);
+      return;
+    }
+
   if (control)
     {
       /* Control frames must never be fragmented */
@@ -783,35 +1074,63 @@ process_contents_rfc6455 (WebSocketConnection *self,
         {
           pv->message_opcode = opcode;
           pv->message_data = g_byte_array_sized_new (payload_len);
+          pv->message_compressed = (rsv & 0x40) ? TRUE : FALSE;
         }
 
-      switch (pv->message_opcode)
+      if (pv->message_compressed)
+        {
+          if (!inflate_payload (self, payload, payload_len, fin))
+            return;
+        }
+      else
         {
-        case 0x01:
-          if (!g_utf8_validate ((gchar *)payload, payload_len, NULL))
+          switch (pv->message_opcode)
             {
-              g_message ("received invalid non-UTF8 text data");
-
-              /* Discard the entire message */
-              g_byte_array_unref (pv->message_data);
-              pv->message_data = NULL;
-              pv->message_opcode = 0;
-
-              bad_data_error_and_close (self);
-              return;
+            case 0x01:
+              if (!g_utf8_validate ((gchar *)payload, payload_len, NULL))
+                {
+                  g_message ("received invalid non-UTF8 text data");
+
+                  /* Discard the entire message */
+                  discard_message (self);
+
+                  bad_data_error_and_close (self);
+                  return;
+                }
+              /* fall through */
+            case 0x02:
+              g_byte_array_append (pv->message_data, payload, payload_len);
+              break;
+            default:
+              g_debug ("received unknown data frame: %d", (gint)opcode);
+              break;
             }
-          /* fall through */
-        case 0x02:
-          g_byte_array_append (pv->message_data, payload, payload_len);
-          break;
-        default:
-          g_debug ("received unknown data frame: %d", (gint)opcode);
-          break;
         }
 
       /* Actually deliver the message? */
       if (fin)
         {
+          if (pv->message_compressed)
+            {
+              if (pv->inflater_reset)
+                g_converter_reset (pv->inflater);
+
+              /* Only now can we check the decompressed text */
+              if (pv->message_opcode == 0x01 &&
+                  !g_utf8_validate ((gchar *)pv->message_data->data, pv->message_data->len, NULL))
+                {
+                  g_message ("received invalid non-UTF8 text data");
+                  discard_message (self);
+                  bad_data_error_and_close (self);
+                  return;
+                }
+              else if (pv->message_opcode != 0x01 && pv->message_opcode != 0x02)
+                {
+                  g_debug ("received unknown data frame: %d", (gint)pv->message_opcode);
+                  g_byte_array_set_size (pv->message_data, 0);
+                }
+            }
+
           /* Always null terminate, as a convenience */
           g_byte_array_append (pv->message_data, (guchar *)"\0", 1);
 
@@ -822,6 +1141,7 @@ process_contents_rfc6455 (WebSocketConnection *self,
           message = g_byte_array_free_to_bytes (pv->message_data);
           pv->message_data = NULL;
           pv->message_opcode = 0;
+          pv->message_compressed = FALSE;
           g_debug ("message: delivering %d with %d length",
                    (int)opcode, (int)g_bytes_get_size (message));
           g_signal_emit (self, signals[MESSAGE], 0, (int)opcode, message);
@@ -830,6 +1150,174 @@ process_contents_rfc6455 (WebSocketConnection *self,
     }
 }
 
+static void
+deliver_partial_rfc6455 (WebSocketConnection *self,
+                         const guint8 *data,
+                         gsize len,
+                         gboolean final)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  GByteArray *buffer;
+  GBytes *message;
+  const gchar *end;
+  guint8 opcode;
+  gsize rest;
+
+  opcode = pv->stream_opcode;
+  if (final)
+    pv->stream_opcode = 0;
+
+  if (pv->stream_discard)
+    return;
+
+  if (opcode != 0x01 && opcode != 0x02)
+    {
+      g_debug ("received unknown data frame: %d", (gint)opcode);
+      return;
+    }
+
+  buffer = g_byte_array_sized_new (pv->stream_utf8_len + len + 1);
+  g_byte_array_append (buffer, pv->stream_utf8, pv->stream_utf8_len);
+  g_byte_array_append (buffer, data, len);
+  pv->stream_utf8_len = 0;
+
+  /* A character may be split between fragments, hold it back until the rest arrives */
+  if (opcode == 0x01 && !g_utf8_validate ((gchar *)buffer->data, buffer->len, &end))
+    {
+      rest = buffer->len - (end - (gchar *)buffer->data);
+      if (!final && rest < sizeof (pv->stream_utf8) &&
+          g_utf8_get_char_validated (end, rest) == (gunichar)-2)
+        {
+          memcpy (pv->stream_utf8, end, rest);
+          pv->stream_utf8_len = rest;
+          buffer->len -= rest;
+        }
+      else
+        {
+          g_message ("received invalid non-UTF8 text data");
+          g_byte_array_unref (buffer);
+          pv->stream_discard = TRUE;
+          pv->stream_opcode = 0;
+          bad_data_error_and_close (self);
+          return;
+        }
+    }
+
+  if (buffer->len == 0 && !final)
+    {
+      g_byte_array_unref (buffer);
+      return;
+    }
+
+  /* Null terminate as a convenience, just like complete messages */
+  g_byte_array_append (buffer, (guchar *)"\0", 1);
+  buffer->len--;
+
+  message = g_byte_array_free_to_bytes (buffer);
+  g_debug ("message: delivering partial %d with %d length%s",
+           (int)opcode, (int)g_bytes_get_size (message), final ? ", final" : "");
+  g_signal_emit (self, signals[PARTIAL_MESSAGE], 0, (int)opcode, message, final);
+  g_bytes_unref (message);
+}
+
+static void update_input_throttle (WebSocketConnection *self);
+
+static gboolean
+process_stream_rfc6455 (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  gboolean final;
+  guint8 *data;
+  gsize len;
+  gsize i;
+
+  len = MIN (pv->incoming->len, pv->stream_remaining);
+
+  /* Wait for a reasonable amount, unless it completes the frame */
+  if (len < pv->stream_remaining && len < STREAM_CHUNK)
+    return FALSE; /* need more data */
+
+  data = pv->incoming->data;
+  if (pv->stream_masked)
+    {
+      for (i = 0; i < len; i++)
+        data[i] ^= pv->stream_mask[(pv->stream_offset + i) & 3];
+    }
+
+  pv->stream_remaining -= len;
+  pv->stream_offset += len;
+  pv->stream_frame = (pv->stream_remaining > 0);
+  final = pv->stream_fin && !pv->stream_frame;
+
+  deliver_partial_rfc6455 (self, data, len, final);
+
+  /* The next message may not need to wait */
+  if (final && pv->throttled)
+    update_input_throttle (self);
+
+  g_byte_array_remove_range (pv->incoming, 0, len);
+  return TRUE;
+}
+
+static gboolean
+begin_stream_rfc6455 (WebSocketConnection *self,
+                      gboolean fin,
+                      guint8 opcode,
+                      gboolean masked,
+                      guint64 payload_len,
+                      gsize at)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+
+  if (masked)
+    {
+      if (pv->incoming->len < at + 4)
+        return FALSE; /* need more data */
+      memcpy (pv->stream_mask, pv->incoming->data + at, 4);
+      at += 4;
+    }
+
+  /* Anything wrong with the frame, and we just skip past its contents */
+  pv->stream_discard = TRUE;
+
+  if (pv->close_received)
+    {
+      g_message ("received message after close was received");
+    }
+  else if (opcode && pv->stream_opcode)
+    {
+      g_message ("received out of order initial message fragment");
+      protocol_error_and_close (self);
+    }
+  else if (!opcode && !pv->stream_opcode)
+    {
+      g_message ("received out of order message fragment");
+      protocol_error_and_close (self);
+    }
+  else
+    {
+      if (opcode)
+        {
+          pv->stream_opcode = opcode;
+          pv->stream_utf8_len = 0;
+        }
+      pv->stream_discard = FALSE;
+      g_debug ("received streamed frame %d with %d payload", (int)opcode, (int)payload_len);
+    }
+
+  pv->stream_frame = TRUE;
+  pv->stream_fin = fin;
+  pv->stream_masked = masked;
+  pv->stream_remaining = payload_len;
+  pv->stream_offset = 0;
+
+  if (pv->throttled)
+    update_input_throttle (self);
+
+  g_byte_array_remove_range (pv->incoming, 0, at);
+  return TRUE;
+}
+
 static gboolean
 process_frame_rfc6455 (WebSocketConnection *self)
 {
@@ -840,10 +1328,15 @@ process_frame_rfc6455 (WebSocketConnection *self)
   gboolean fin;
   gboolean control;
   gboolean masked;
+  guint8 rsv;
   guint8 opcode;
   gsize len;
   gsize at;
 
+  /* In the middle of a frame that is being streamed */
+  if (self->pv->stream_frame)
+    return process_stream_rfc6455 (self);
+
   len = self->pv->incoming->len;
   if (len < 2)
     return FALSE; /* need more data */
@@ -851,6 +1344,7 @@ process_frame_rfc6455 (WebSocketConnection *self)
   header = self->pv->incoming->data;
   fin = ((header[0] & 0x80) != 0);
   control = header[0] & 0x08;
+  rsv = header[0] & 0x70;
   opcode = header[0] & 0x0f;
   masked = ((header[1] & 0x80) != 0);
 
@@ -882,6 +1376,11 @@ process_frame_rfc6455 (WebSocketConnection *self)
       break;
     }
 
+  /* Messages that are fragmented or too large to hold are streamed, if requested */
+  if (self->pv->streaming && !control && rsv == 0 && !self->pv->message_data &&
+      (!fin || !opcode || payload_len >= MAX_PAYLOAD || self->pv->stream_opcode))
+    return begin_stream_rfc6455 (self, fin, opcode, masked, payload_len, at);
+
   /* Safety valve */
   if (payload_len >= MAX_PAYLOAD)
     {
@@ -910,7 +1409,7 @@ process_frame_rfc6455 (WebSocketConnection *self)
    * Note that now that we've unmasked, we've modified the buffer, we can
    * only return below via discarding or processing the message
    */
-  process_contents_rfc6455 (self, control, fin, opcode, payload, payload_len);
+  process_contents_rfc6455 (self, control, fin, rsv, opcode, payload, payload_len);
 
   /* Move past the parsed frame */
   g_byte_array_remove_range (self->pv->incoming, 0, at + payload_len);
@@ -986,7 +1485,7 @@ on_web_socket_input (GObject *pollable_stream,
 
       pv->incoming->len = len + count;
     }
-  while (count > 0);
+  while (count > 0 && pv->incoming->len < MAX_INCOMING);
 
   process_incoming (self);
 
@@ -1019,6 +1518,69 @@ start_input (WebSocketConnection *self)
   g_source_attach (pv->input_source, pv->main_context);
 }
 
+/*
+ * In streaming mode back pressure only holds up a message that is being
+ * streamed. Everything else, including pings and other control frames,
+ * is still read while the controlling flow is under pressure.
+ */
+static void
+update_input_throttle (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  gboolean throttle;
+
+  throttle = pv->throttled && (!pv->streaming || pv->stream_opcode != 0);
+
+  if (throttle)
+    {
+      if (pv->io_open && pv->input_source != NULL)
+        {
+          g_debug ("applying back pressure in web socket");
+          stop_input (self);
+        }
+    }
+  else
+    {
+      if (pv->io_open && pv->input_source == NULL)
+        {
+          g_debug ("relieving back pressure in web socket");
+          start_input (self);
+        }
+    }
+}
+
+static Frame *
+take_lane_frame (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  GByteArray *bytes;
+  const guint8 *data;
+  Frame *frame;
+  gsize amount;
+  gsize len;
+
+  frame = cockpit_fair_queue_pop (pv->lanes, NULL);
+  if (frame == NULL)
+    return NULL;
+
+  g_assert (frame->amount <= pv->lanes_amount);
+  pv->lanes_amount -= frame->amount;
+
+  /* Compressed in the same order as it goes on the wire */
+  if (frame->deflate)
+    {
+      data = g_bytes_get_data (frame->data, &len);
+      bytes = build_frame_rfc6455 (self, frame->deflate, TRUE, NULL, 0, data, len, &amount);
+      g_assert (len <= pv->output_queued);
+      pv->output_queued = pv->output_queued - len + bytes->len;
+      g_bytes_unref (frame->data);
+      frame->data = g_byte_array_free_to_bytes (bytes);
+      frame->deflate = 0;
+    }
+
+  return frame;
+}
+
 static gboolean
 on_web_socket_output (GObject *pollable_stream,
                       gpointer user_data)
@@ -1032,8 +1594,17 @@ on_web_socket_output (GObject *pollable_stream,
   gssize count;
   gsize len;
 
+  before = pv->output_queued;
   frame = g_queue_peek_head (&pv->outgoing);
 
+  /* Take the next frame from the lanes, in their fair order */
+  if (frame == NULL)
+    {
+      frame = take_lane_frame (self);
+      if (frame)
+        g_queue_push_head (&pv->outgoing, frame);
+    }
+
   /* No more frames to send */
   if (frame == NULL)
     {
@@ -1064,8 +1635,6 @@ on_web_socket_output (GObject *pollable_stream,
         }
     }
 
-  before = pv->output_queued;
-
   frame->sent += count;
   if (frame->sent >= len)
     {
@@ -1113,12 +1682,36 @@ start_output (WebSocketConnection *self)
   g_source_attach (pv->output_source, pv->main_context);
 }
 
+static void
+flush_lanes (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  Frame *frame;
+
+  while ((frame = take_lane_frame (self)) != NULL)
+    g_queue_push_tail (&pv->outgoing, frame);
+  g_assert (pv->lanes_amount == 0);
+}
+
 void
 _web_socket_connection_queue (WebSocketConnection *self,
                               WebSocketQueueFlags flags,
                               gpointer data,
                               gsize len,
                               gsize amount)
+{
+  queue_frame (self, flags, NULL, COCKPIT_FAIR_QUEUE_DEFAULT_WEIGHT, 0, data, len, amount);
+}
+
+static void
+queue_frame (WebSocketConnection *self,
+             WebSocketQueueFlags flags,
+             const gchar *lane,
+             guint weight,
+             guint8 deflate,
+             gpointer data,
+             gsize len,
+             gsize amount)
 {
   WebSocketConnectionPrivate *pv = self->pv;
   gsize before;
@@ -1127,13 +1720,14 @@ _web_socket_connection_queue (WebSocketConnection *self,
 
   g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
   g_return_if_fail (pv->close_sent == FALSE);
-  g_return_if_fail (data != NULL);
-  g_return_if_fail (len > 0);
+  g_return_if_fail (deflate || data != NULL);
+  g_return_if_fail (deflate || len > 0);
 
   frame = g_slice_new0 (Frame);
   frame->data = g_bytes_new_take (data, len);
   frame->amount = amount;
   frame->last = (flags & WEB_SOCKET_QUEUE_LAST) ? TRUE : FALSE;
+  frame->deflate = deflate;
 
   /* If urgent put at front of queue */
   if (flags & WEB_SOCKET_QUEUE_URGENT)
@@ -1155,10 +1749,22 @@ _web_socket_connection_queue (WebSocketConnection *self,
           g_queue_push_head (&pv->outgoing, frame);
         }
     }
-  else
+  else if (flags & WEB_SOCKET_QUEUE_LAST)
     {
+      /* The last frame goes after everything else */
+      flush_lanes (self);
       g_queue_push_tail (&pv->outgoing, frame);
     }
+  else
+    {
+      /*
+       * Everything else takes turns in lanes, which get drained as
+       * the output becomes writable, so that a busy lane doesn't hold
+       * up the others. Frames without a lane share the default one.
+       */
+      cockpit_fair_queue_push (pv->lanes, lane, weight, frame, len, TRUE);
+      pv->lanes_amount += amount;
+    }
 
   before = pv->output_queued;
   g_return_if_fail (G_MAXSIZE - len > pv->output_queued);
@@ -1305,6 +1911,18 @@ web_socket_connection_get_property (GObject *object,
       g_value_set_object (value, web_socket_connection_get_io_stream (self));
       break;
 
+    case PROP_COMPRESSION:
+      g_value_set_boolean (value, self->pv->compression);
+      break;
+
+    case PROP_COMPRESSION_THRESHOLD:
+      g_value_set_uint (value, self->pv->compression_threshold);
+      break;
+
+    case PROP_STREAMING:
+      g_value_set_boolean (value, self->pv->streaming);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -1335,6 +1953,19 @@ web_socket_connection_set_property (GObject *object,
         _web_socket_connection_take_io_stream (self, io_stream);
       break;
 
+    case PROP_COMPRESSION:
+      g_return_if_fail (pv->handshake_done == FALSE);
+      pv->compression = g_value_get_boolean (value);
+      break;
+
+    case PROP_COMPRESSION_THRESHOLD:
+      pv->compression_threshold = g_value_get_uint (value);
+      break;
+
+    case PROP_STREAMING:
+      pv->streaming = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -1371,6 +2002,8 @@ web_socket_connection_finalize (GObject *object)
     g_byte_array_free (pv->incoming, TRUE);
   while (!g_queue_is_empty (&pv->outgoing))
     frame_free (g_queue_pop_head (&pv->outgoing));
+  cockpit_fair_queue_free (pv->lanes);
+  pv->lanes_amount = 0;
   pv->output_queued = 0;
 
   g_clear_object (&pv->io_stream);
@@ -1384,6 +2017,8 @@ web_socket_connection_finalize (GObject *object)
     g_source_unref (pv->start_idle);
   if (pv->message_data)
     g_byte_array_free (pv->message_data, TRUE);
+  g_clear_object (&pv->deflater);
+  g_clear_object (&pv->inflater);
 
   G_OBJECT_CLASS (web_socket_connection_parent_class)->finalize (object);
 }
@@ -1461,6 +2096,42 @@ web_socket_connection_class_init (WebSocketConnectionClass *klass)
                                    g_param_spec_object ("io-stream", "IO Stream", "Underlying io stream", G_TYPE_IO_STREAM,
                                                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * WebSocketConnection:compression:
+   *
+   * Whether to negotiate the permessage-deflate extension with the
+   * peer. Must be set before the handshake takes place.
+   */
+  g_object_class_install_property (gobject_class, PROP_COMPRESSION,
+                                   g_param_spec_boolean ("compression", "Compression", "Negotiate message compression", FALSE,
+                                                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:compression-threshold:
+   *
+   * Messages smaller than this many bytes are sent without compression,
+   * even when the peer has agreed to it.
+   */
+  g_object_class_install_property (gobject_class, PROP_COMPRESSION_THRESHOLD,
+                                   g_param_spec_uint ("compression-threshold", "Compression threshold",
+                                                      "Smallest message to compress",
+                                                      0, G_MAXUINT, DEFAULT_COMPRESSION_THRESHOLD,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:streaming:
+   *
+   * Deliver fragmented messages, and those too large to hold in memory,
+   * through the #WebSocketConnection::partial-message signal as they
+   * arrive. Other messages still use #WebSocketConnection::message.
+   *
+   * Back pressure from cockpit_flow_throttle() then only stops input
+   * while such a message is being streamed.
+   */
+  g_object_class_install_property (gobject_class, PROP_STREAMING,
+                                   g_param_spec_boolean ("streaming", "Streaming", "Deliver large messages in pieces", FALSE,
+                                                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   /**
    * WebSocketConnection::open:
    * @self: the WebSocket
@@ -1496,6 +2167,24 @@ web_socket_connection_class_init (WebSocketConnectionClass *klass)
                                    NULL, NULL, g_cclosure_marshal_generic,
                                    G_TYPE_NONE, 2, G_TYPE_INT, G_TYPE_BYTES);
 
+  /**
+   * WebSocketConnection::partial-message:
+   * @self: the WebSocket
+   * @type: the type of message contents
+   * @message: the next piece of the message data
+   * @final: whether this is the last piece of the message
+   *
+   * Emitted in streaming mode for each piece of a fragmented or large
+   * message. The pieces are not fragment boundaries, and may be empty
+   * when @final is set. Text is only split between whole characters.
+   */
+  signals[PARTIAL_MESSAGE] = g_signal_new ("partial-message",
+                                           WEB_SOCKET_TYPE_CONNECTION,
+                                           G_SIGNAL_RUN_FIRST,
+                                           G_STRUCT_OFFSET (WebSocketConnectionClass, partial_message),
+                                           NULL, NULL, g_cclosure_marshal_generic,
+                                           G_TYPE_NONE, 3, G_TYPE_INT, G_TYPE_BYTES, G_TYPE_BOOLEAN);
+
   /**
    * WebSocketConnection::error:
    * @self: the WebSocket
@@ -1635,7 +2324,7 @@ web_socket_connection_get_buffered_amount (WebSocketConnection *self)
       amount += frame->amount;
     }
 
-  return amount;
+  return amount + self->pv->lanes_amount;
 }
 
 /**
@@ -1715,6 +2404,32 @@ web_socket_connection_send (WebSocketConnection *self,
                             WebSocketDataType type,
                             GBytes *prefix,
                             GBytes *message)
+{
+  web_socket_connection_send_lane (self, type, prefix, message, NULL, COCKPIT_FAIR_QUEUE_DEFAULT_WEIGHT);
+}
+
+/**
+ * web_socket_connection_send_lane:
+ * @self: the WebSocket
+ * @type: the data type of message
+ * @prefix: (allow-none): an optional prefix prepended to the message
+ * @message: the message contents
+ * @lane: (allow-none): the lane to send in, or NULL for the default
+ * @weight: the share of the connection for the lane
+ *
+ * Like web_socket_connection_send(), but queue the message in a lane.
+ * Messages in the same lane are sent in order. When several lanes
+ * have messages queued they take turns, each sending an amount of
+ * data in proportion to its @weight. Messages sent without a lane
+ * have a weight of 4.
+ */
+void
+web_socket_connection_send_lane (WebSocketConnection *self,
+                                 WebSocketDataType type,
+                                 GBytes *prefix,
+                                 GBytes *message,
+                                 const gchar *lane,
+                                 guint weight)
 {
   gconstpointer pref = NULL;
   gsize prefix_len = 0;
@@ -1754,7 +2469,7 @@ web_socket_connection_send (WebSocketConnection *self,
       return;
     }
 
-  send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode,
+  send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, lane, weight, opcode,
                                  pref, prefix_len, payload, payload_len);
 
   g_object_notify (G_OBJECT (self), "buffered-amount");
@@ -1798,6 +2513,9 @@ web_socket_connection_close (WebSocketConnection *self,
       flags = 0;
       if (self->pv->server_side && self->pv->close_received)
         flags |= WEB_SOCKET_QUEUE_LAST;
+
+      /* The close frame goes after all queued messages */
+      flush_lanes (self);
       send_close_rfc6455 (self, flags, code, data);
       close_io_after_timeout (self);
     }
@@ -1813,22 +2531,9 @@ on_throttle_pressure (GObject *object,
                       gpointer user_data)
 {
   WebSocketConnection *self = WEB_SOCKET_CONNECTION (user_data);
-  if (throttle)
-    {
-      if (self->pv->io_open && self->pv->input_source != NULL)
-        {
-          g_debug ("applying back pressure in web socket");
-          stop_input (self);
-        }
-    }
-  else
-    {
-      if (self->pv->io_open && self->pv->input_source == NULL)
-        {
-          g_debug ("relieving back pressure in web socket");
-          start_input (self);
-        }
-    }
+
+  self->pv->throttled = throttle;
+  update_input_throttle (self);
 }
 
 static void
@@ -1842,6 +2547,7 @@ web_socket_connection_throttle (CockpitFlow *flow,
       g_signal_handler_disconnect (self->pv->pressure, self->pv->pressure_sig);
       g_object_remove_weak_pointer (G_OBJECT (self->pv->pressure), (gpointer *)&self->pv->pressure);
       self->pv->pressure = NULL;
+      self->pv->throttled = FALSE;
     }
 
   if (controlling)
@@ -1917,6 +2623,277 @@ _web_socket_connection_choose_protocol (WebSocketConnection *self,
   return chosen;
 }
 
+/*
+ * Parse one extension offer or response, like "permessage-deflate;
+ * server_no_context_takeover; server_max_window_bits=10". Parameters
+ * without a value map to an empty string.
+ */
+static GHashTable *
+parse_extension (const gchar *offer,
+                 gchar **name)
+{
+  GHashTable *params;
+  gboolean valid = TRUE;
+  gchar **parts;
+  gchar *key;
+  gchar *val;
+  gchar *eq;
+  gsize len;
+  gint i;
+
+  params = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  parts = g_strsplit (offer, ";", -1);
+
+  for (i = 1; valid && parts[0] && parts[i]; i++)
+    {
+      val = "";
+      eq = strchr (parts[i], '=');
+      if (eq)
+        {
+          *eq = '\0';
+          val = g_strstrip (eq + 1);
+
+          /* Values may be quoted */
+          len = strlen (val);
+          if (len >= 2 && val[0] == '"' && val[len - 1] == '"')
+            {
+              val[len - 1] = '\0';
+              val++;
+            }
+        }
+
+      key = g_strstrip (parts[i]);
+      if (key[0] == '\0' || g_hash_table_contains (params, key))
+        valid = FALSE;
+      else
+        g_hash_table_insert (params, g_strdup (key), g_strdup (val));
+    }
+
+  if (valid && parts[0])
+    {
+      *name = g_strdup (g_strstrip (parts[0]));
+    }
+  else
+    {
+      g_hash_table_unref (params);
+      params = NULL;
+    }
+
+  g_strfreev (parts);
+  return params;
+}
+
+static gboolean
+parse_window_bits (const gchar *value,
+                   guint *bits)
+{
+  gsize len = strlen (value);
+
+  if (len == 0 || len > 2 || strspn (value, "0123456789") != len)
+    return FALSE;
+
+  *bits = atoi (value);
+  return *bits >= 8 && *bits <= 15;
+}
+
+static gboolean
+lookup_flag (GHashTable *params,
+             const gchar *name,
+             gboolean *flag,
+             guint *seen)
+{
+  const gchar *val = g_hash_table_lookup (params, name);
+
+  if (!val)
+    return TRUE;
+
+  (*seen)++;
+  *flag = TRUE;
+
+  /* These take no value */
+  return val[0] == '\0';
+}
+
+static void
+enable_compression (WebSocketConnection *self,
+                    gboolean deflater_reset,
+                    gboolean inflater_reset)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+
+  /*
+   * Raw deflate streams, as zlib headers are not sent. Both converters
+   * use the largest window of 15 bits.
+   */
+  pv->deflater = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+  pv->inflater = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+  pv->deflater_reset = deflater_reset;
+  pv->inflater_reset = inflater_reset;
+}
+
+/*
+ * Server side: pick the first permessage-deflate offer from the client
+ * that we can satisfy, and return the Sec-WebSocket-Extensions response
+ * for it. Returns NULL when none is acceptable, or compression is off.
+ */
+gchar *
+_web_socket_connection_choose_extensions (WebSocketConnection *self,
+                                          const gchar *value)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  GString *response = NULL;
+  gboolean server_reset;
+  gboolean client_reset;
+  gboolean acceptable;
+  GHashTable *params;
+  const gchar *val;
+  gchar **offers;
+  gchar *name;
+  guint seen;
+  guint bits;
+  gint i;
+
+  g_return_val_if_fail (pv->deflater == NULL, NULL);
+
+  if (!pv->compression || !value)
+    return NULL;
+
+  /* The client lists its offers in order of preference */
+  offers = g_strsplit (value, ",", -1);
+  for (i = 0; response == NULL && offers[i] != NULL; i++)
+    {
+      params = parse_extension (offers[i], &name);
+      if (!params)
+        continue;
+
+      if (g_str_equal (name, "permessage-deflate"))
+        {
+          response = g_string_new ("permessage-deflate");
+          server_reset = client_reset = FALSE;
+          seen = 0;
+
+          acceptable = lookup_flag (params, "server_no_context_takeover", &server_reset, &seen) &&
+                       lookup_flag (params, "client_no_context_takeover", &client_reset, &seen);
+          if (server_reset)
+            g_string_append (response, "; server_no_context_takeover");
+          if (client_reset)
+            g_string_append (response, "; client_no_context_takeover");
+
+          /* Our compressor can't use a smaller window */
+          val = g_hash_table_lookup (params, "server_max_window_bits");
+          if (val)
+            {
+              seen++;
+              if (!parse_window_bits (val, &bits) || bits != 15)
+                acceptable = FALSE;
+              g_string_append (response, "; server_max_window_bits=15");
+            }
+
+          /* The client may use any window, we can always inflate it */
+          val = g_hash_table_lookup (params, "client_max_window_bits");
+          if (val)
+            {
+              seen++;
+              if (val[0] && !parse_window_bits (val, &bits))
+                acceptable = FALSE;
+            }
+
+          if (acceptable && seen == g_hash_table_size (params))
+            {
+              enable_compression (self, server_reset, client_reset);
+            }
+          else
+            {
+              g_string_free (response, TRUE);
+              response = NULL;
+            }
+        }
+
+      g_hash_table_unref (params);
+      g_free (name);
+    }
+  g_strfreev (offers);
+
+  if (!response)
+    {
+      g_debug ("declined Sec-WebSocket-Extensions: %s", value);
+      return NULL;
+    }
+
+  g_debug ("agreed on extension: %s", response->str);
+  return g_string_free (response, FALSE);
+}
+
+/*
+ * Client side: the Sec-WebSocket-Extensions header to send, if any.
+ */
+gchar *
+_web_socket_connection_offer_extensions (WebSocketConnection *self)
+{
+  if (!self->pv->compression)
+    return NULL;
+  return g_strdup ("permessage-deflate");
+}
+
+/*
+ * Client side: check the response from the server against our offer.
+ */
+gboolean
+_web_socket_connection_accept_extensions (WebSocketConnection *self,
+                                          const gchar *value)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  gboolean server_reset = FALSE;
+  gboolean client_reset = FALSE;
+  gboolean acceptable = FALSE;
+  GHashTable *params = NULL;
+  const gchar *val;
+  gchar *name = NULL;
+  guint seen = 0;
+  guint bits;
+
+  g_return_val_if_fail (pv->deflater == NULL, FALSE);
+
+  /* Server declined, or didn't understand our offer */
+  if (!value || value[0] == '\0')
+    return TRUE;
+
+  /* We only ever offer one extension */
+  if (pv->compression && !strchr (value, ','))
+    params = parse_extension (value, &name);
+
+  if (params && g_str_equal (name, "permessage-deflate"))
+    {
+      acceptable = lookup_flag (params, "server_no_context_takeover", &server_reset, &seen) &&
+                   lookup_flag (params, "client_no_context_takeover", &client_reset, &seen);
+
+      val = g_hash_table_lookup (params, "server_max_window_bits");
+      if (val)
+        {
+          seen++;
+          if (!parse_window_bits (val, &bits))
+            acceptable = FALSE;
+        }
+
+      /* We didn't offer client_max_window_bits, so the server can't send it */
+      if (acceptable && seen == g_hash_table_size (params))
+        enable_compression (self, client_reset, server_reset);
+      else
+        acceptable = FALSE;
+    }
+
+  if (params)
+    g_hash_table_unref (params);
+  g_free (name);
+
+  if (acceptable)
+    g_debug ("agreed on extension: %s", value);
+  else
+    g_message ("received invalid or unsupported Sec-WebSocket-Extensions: %s", value);
+
+  return acceptable;
+}
+
 GMainContext *
 _web_socket_connection_get_main_context (WebSocketConnection *self)
 {
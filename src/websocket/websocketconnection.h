@@ -61,6 +61,11 @@ struct _WebSocketConnectionClass
                              WebSocketDataType type,
                              GBytes *message);
 
+  void      (* partial_message) (WebSocketConnection *self,
+                                 WebSocketDataType type,
+                                 GBytes *message,
+                                 gboolean final);
+
   gboolean  (* error)       (WebSocketConnection *self,
                              GError *error);
 
@@ -90,6 +95,13 @@ void            web_socket_connection_send                (WebSocketConnection *
                                                            GBytes *prefix,
                                                            GBytes *payload);
 
+void            web_socket_connection_send_lane           (WebSocketConnection *self,
+                                                           WebSocketDataType type,
+                                                           GBytes *prefix,
+                                                           GBytes *payload,
+                                                           const gchar *lane,
+                                                           guint weight);
+
 void            web_socket_connection_close               (WebSocketConnection *self,
                                                            gushort code,
                                                            const gchar *data);
@@ -72,6 +72,14 @@ gboolean         _web_socket_connection_choose_protocol   (WebSocketConnection *
                                                            const gchar **protocols,
                                                            const gchar *value);
 
+gchar *          _web_socket_connection_choose_extensions (WebSocketConnection *self,
+                                                           const gchar *value);
+
+gchar *          _web_socket_connection_offer_extensions  (WebSocketConnection *self);
+
+gboolean         _web_socket_connection_accept_extensions (WebSocketConnection *self,
+                                                           const gchar *value);
+
 gchar *          _web_socket_complete_accept_key_rfc6455  (const gchar *key);
 
 G_END_DECLS
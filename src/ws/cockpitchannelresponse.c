@@ -505,6 +505,16 @@ is_resource_a_package_file (const gchar *path)
   return path && path[0] && strchr (path + 1, '/') != NULL;
 }
 
+/* A compressed response carries the weak form of the ETag */
+static gboolean
+etag_matches (const gchar *if_none_match,
+              const gchar *quoted_etag)
+{
+  if (if_none_match && g_str_has_prefix (if_none_match, "W/"))
+    if_none_match += 2;
+  return g_strcmp0 (if_none_match, quoted_etag) == 0;
+}
+
 static gboolean
 parse_host_and_etag (CockpitWebService *service,
                      GHashTable *headers,
@@ -606,7 +616,7 @@ cockpit_channel_response_serve (CockpitWebService *service,
       pragma = g_hash_table_lookup (in_headers, "Pragma");
 
       if ((!pragma || !strstr (pragma, "no-cache")) &&
-           g_strcmp0 (g_hash_table_lookup (in_headers, "If-None-Match"), quoted_etag) == 0)
+           etag_matches (g_hash_table_lookup (in_headers, "If-None-Match"), quoted_etag))
         {
           cockpit_web_response_headers (response, 304, "Not Modified", 0, "ETag", quoted_etag, NULL);
           cockpit_web_response_complete (response);
@@ -616,6 +626,7 @@ cockpit_channel_response_serve (CockpitWebService *service,
     }
 
   cockpit_web_response_set_cache_type (response, cache_type);
+  cockpit_web_response_set_compress (response, in_headers);
   object = cockpit_transport_build_json ("command", "open",
                                          "payload", "http-stream1",
                                          "internal", "packages",
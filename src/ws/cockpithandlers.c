@@ -40,6 +40,7 @@
 #include <glib/gi18n.h>
 
 #include <string.h>
+#include <sys/stat.h>
 
 /* For overriding during tests */
 const gchar *cockpit_ws_shell_component = "/shell/index.html";
@@ -391,6 +392,95 @@ build_environment (GHashTable *os_release)
   return g_byte_array_free_to_bytes (buffer);
 }
 
+/*
+ * The static parts of the login page are the same for every request,
+ * and may have been decompressed. Keep them around, but check each
+ * time that the file chosen hasn't changed on disk.
+ *
+ * Like the rest of cockpit-ws, only used from the main thread.
+ */
+
+#define STATIC_CACHE_MAXIMUM 32
+
+typedef struct {
+  GBytes *bytes;
+  gchar *actual;
+  struct stat st;
+} StaticEntry;
+
+static GHashTable *static_cache;
+
+static void
+static_entry_free (gpointer data)
+{
+  StaticEntry *entry = data;
+  g_bytes_unref (entry->bytes);
+  g_free (entry->actual);
+  g_free (entry);
+}
+
+static gboolean
+static_entry_valid (StaticEntry *entry)
+{
+  struct stat st;
+
+  return stat (entry->actual, &st) == 0 &&
+         st.st_dev == entry->st.st_dev &&
+         st.st_ino == entry->st.st_ino &&
+         st.st_size == entry->st.st_size &&
+         st.st_mtim.tv_sec == entry->st.st_mtim.tv_sec &&
+         st.st_mtim.tv_nsec == entry->st.st_mtim.tv_nsec;
+}
+
+static GBytes *
+load_static (const gchar *path,
+             const gchar *language,
+             GError **error)
+{
+  StaticEntry *entry;
+  GBytes *bytes;
+  gchar *actual = NULL;
+  gchar *key;
+
+  if (!static_cache)
+    static_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, static_entry_free);
+
+  key = g_strdup_printf ("%s\n%s", path, language ? language : "");
+  entry = g_hash_table_lookup (static_cache, key);
+  if (entry && static_entry_valid (entry))
+    {
+      g_free (key);
+      return g_bytes_ref (entry->bytes);
+    }
+
+  bytes = cockpit_web_response_negotiation (path, NULL, language, &actual, error);
+  if (!bytes || !actual)
+    {
+      g_hash_table_remove (static_cache, key);
+      g_free (actual);
+      g_free (key);
+      return bytes;
+    }
+
+  if (g_hash_table_size (static_cache) >= STATIC_CACHE_MAXIMUM)
+    g_hash_table_remove_all (static_cache);
+
+  entry = g_new0 (StaticEntry, 1);
+  if (stat (actual, &entry->st) < 0)
+    {
+      /* Gone already, just don't cache it */
+      g_free (actual);
+      g_free (entry);
+      g_free (key);
+      return bytes;
+    }
+
+  entry->bytes = g_bytes_ref (bytes);
+  entry->actual = actual;
+  g_hash_table_replace (static_cache, key, entry);
+  return bytes;
+}
+
 static void
 send_login_html (CockpitWebResponse *response,
                  CockpitHandlerData *ws,
@@ -406,7 +496,6 @@ send_login_html (CockpitWebResponse *response,
   GBytes *bytes;
 
   GBytes *url_bytes = NULL;
-  CockpitWebFilter *filter2 = NULL;
   const gchar *url_root = NULL;
   const gchar *accept = NULL;
   gchar *content_security_policy = NULL;
@@ -416,14 +505,8 @@ send_login_html (CockpitWebResponse *response,
   gchar *language = NULL;
   gchar **languages = NULL;
   GBytes *po_bytes;
-  CockpitWebFilter *filter3 = NULL;
-
-  environment = build_environment (ws->os_release);
-  filter = cockpit_web_inject_new (marker, environment, 1);
-  g_bytes_unref (environment);
-  cockpit_web_response_add_filter (response, filter);
-  g_object_unref (filter);
 
+  /* All the injected content goes through a single filter, in one pass */
   url_root = cockpit_web_response_get_url_root (response);
   if (url_root)
     base = g_strdup_printf ("<base href=\"%s/\">", url_root);
@@ -431,10 +514,12 @@ send_login_html (CockpitWebResponse *response,
     base = g_strdup ("<base href=\"/\">");
 
   url_bytes = g_bytes_new_take (base, strlen(base));
-  filter2 = cockpit_web_inject_new (marker, url_bytes, 1);
+  filter = cockpit_web_inject_new (marker, url_bytes, 1);
   g_bytes_unref (url_bytes);
-  cockpit_web_response_add_filter (response, filter2);
-  g_object_unref (filter2);
+
+  environment = build_environment (ws->os_release);
+  cockpit_web_inject_add (COCKPIT_WEB_INJECT (filter), marker, environment, 1);
+  g_bytes_unref (environment);
 
   cockpit_web_response_set_cache_type (response, COCKPIT_WEB_RESPONSE_NO_CACHE);
 
@@ -448,7 +533,7 @@ send_login_html (CockpitWebResponse *response,
           language = languages[0];
         }
 
-      po_bytes = cockpit_web_response_negotiation (ws->login_po_js, NULL, language, NULL, &error);
+      po_bytes = load_static (ws->login_po_js, language, &error);
       if (error)
         {
           g_message ("%s", error->message);
@@ -456,14 +541,15 @@ send_login_html (CockpitWebResponse *response,
         }
       else if (po_bytes)
         {
-          filter3 = cockpit_web_inject_new (po_marker, po_bytes, 1);
+          cockpit_web_inject_add (COCKPIT_WEB_INJECT (filter), po_marker, po_bytes, 1);
           g_bytes_unref (po_bytes);
-          cockpit_web_response_add_filter (response, filter3);
-          g_object_unref (filter3);
         }
     }
 
-  bytes = cockpit_web_response_negotiation (ws->login_html, NULL, NULL, NULL, &error);
+  cockpit_web_response_add_filter (response, filter);
+  g_object_unref (filter);
+
+  bytes = load_static (ws->login_html, NULL, &error);
   if (error)
     {
       g_message ("%s", error->message);
@@ -32,9 +32,11 @@
 
 #include "common/cockpitauthorize.h"
 #include "common/cockpitconf.h"
+#include "common/cockpitflow.h"
 #include "common/cockpithex.h"
 #include "common/cockpitjson.h"
 #include "common/cockpitmemory.h"
+#include "common/cockpitpipetransport.h"
 #include "common/cockpitsystem.h"
 #include "common/cockpitwebresponse.h"
 #include "common/cockpitwebserver.h"
@@ -51,6 +53,17 @@ const gchar *cockpit_ws_default_protocol_header = NULL;
 
 guint cockpit_ws_ping_interval = 5;
 
+/* The largest message we assemble from pieces, same as WebSocketConnection */
+#define MAX_PARTIAL_MESSAGE 128 * 1024
+
+/* Payloads where message boundaries don't matter, so large messages can be split */
+static const gchar *stream_payloads[] = {
+  "stream",
+  "fsreplace1",
+  "http-stream2",
+  NULL
+};
+
 /* ----------------------------------------------------------------------------
  * Web Socket Info
  */
@@ -59,7 +72,13 @@ typedef struct {
   gchar *id;
   WebSocketConnection *connection;
   GHashTable *channels;
+  GHashTable *streams;
+  GHashTable *priorities;
   JsonObject *init_received;
+
+  /* A message arriving in pieces, and where it's being streamed to */
+  GByteArray *partial;
+  gchar *partial_channel;
 } CockpitSocket;
 
 typedef struct {
@@ -72,7 +91,12 @@ static void
 cockpit_socket_free (gpointer data)
 {
   CockpitSocket *socket = data;
+  g_hash_table_unref (socket->streams);
+  g_hash_table_unref (socket->priorities);
   g_hash_table_unref (socket->channels);
+  if (socket->partial)
+    g_byte_array_unref (socket->partial);
+  g_free (socket->partial_channel);
   if (socket->init_received)
     json_object_unref (socket->init_received);
   g_object_unref (socket->connection);
@@ -113,6 +137,8 @@ cockpit_socket_remove_channel (CockpitSockets *sockets,
 {
   g_debug ("%s remove channel %s for socket", socket->id, channel);
   g_hash_table_remove (sockets->by_channel, channel);
+  g_hash_table_remove (socket->streams, channel);
+  g_hash_table_remove (socket->priorities, channel);
   g_hash_table_remove (socket->channels, channel);
 }
 
@@ -120,17 +146,38 @@ static void
 cockpit_socket_add_channel (CockpitSockets *sockets,
                             CockpitSocket *socket,
                             const gchar *channel,
-                            WebSocketDataType data_type)
+                            WebSocketDataType data_type,
+                            gboolean stream,
+                            CockpitPriority priority)
 {
   gchar *chan;
 
   chan = g_strdup (channel);
   g_hash_table_insert (sockets->by_channel, chan, socket);
   g_hash_table_replace (socket->channels, chan, GINT_TO_POINTER (data_type));
+  if (stream)
+    g_hash_table_add (socket->streams, chan);
+  if (priority != COCKPIT_PRIORITY_NORMAL)
+    g_hash_table_replace (socket->priorities, chan, GINT_TO_POINTER (priority));
 
   g_debug ("%s added channel %s to socket", socket->id, channel);
 }
 
+/* Channels with other than normal priority are sent in their own lane */
+static const gchar *
+cockpit_socket_lookup_lane (CockpitSocket *socket,
+                            const gchar *channel,
+                            guint *weight)
+{
+  const gchar *lane = NULL;
+  gpointer value;
+
+  *weight = COCKPIT_PRIORITY_NORMAL;
+  if (g_hash_table_lookup_extended (socket->priorities, channel, (gpointer *)&lane, &value))
+    *weight = GPOINTER_TO_INT (value);
+  return lane;
+}
+
 static CockpitSocket *
 cockpit_socket_track (CockpitSockets *sockets,
                       WebSocketConnection *connection)
@@ -141,6 +188,8 @@ cockpit_socket_track (CockpitSockets *sockets,
   socket->id = g_strdup_printf ("%u:", sockets->next_socket_id++);
   socket->connection = g_object_ref (connection);
   socket->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  socket->streams = g_hash_table_new (g_str_hash, g_str_equal);
+  socket->priorities = g_hash_table_new (g_str_hash, g_str_equal);
 
   g_debug ("%s new socket", socket->id);
 
@@ -162,6 +211,8 @@ cockpit_socket_destroy (CockpitSockets *sockets,
   g_hash_table_iter_init (&iter, socket->channels);
   while (g_hash_table_iter_next (&iter, (gpointer *)&chan, NULL))
     g_hash_table_remove (sockets->by_channel, chan);
+  g_hash_table_remove_all (socket->streams);
+  g_hash_table_remove_all (socket->priorities);
   g_hash_table_remove_all (socket->channels);
 
   /* This owns the socket */
@@ -691,6 +742,8 @@ on_transport_control (CockpitTransport *transport,
   CockpitSocket *socket = NULL;
   gboolean valid = FALSE;
   gboolean forward;
+  gchar *lane = NULL;
+  guint weight;
 
   if (!channel)
     {
@@ -723,6 +776,10 @@ on_transport_control (CockpitTransport *transport,
     {
       socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
 
+      /* Control messages stay in order with the channel data, even "close" */
+      if (socket)
+        lane = g_strdup (cockpit_socket_lookup_lane (socket, channel, &weight));
+
       /* Usually all control messages with a channel are forwarded */
       forward = TRUE;
 
@@ -740,10 +797,12 @@ on_transport_control (CockpitTransport *transport,
           /* Forward this message to the right websocket */
           if (socket && web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
             {
-              web_socket_connection_send (socket->connection, WEB_SOCKET_DATA_TEXT,
-                                          self->control_prefix, payload);
+              web_socket_connection_send_lane (socket->connection, WEB_SOCKET_DATA_TEXT,
+                                               self->control_prefix, payload, lane, weight);
             }
         }
+
+      g_free (lane);
     }
 
   if (!valid)
@@ -763,8 +822,10 @@ on_transport_recv (CockpitTransport *transport,
   CockpitWebService *self = user_data;
   WebSocketDataType data_type;
   CockpitSocket *socket;
+  const gchar *lane;
   gchar *string;
   GBytes *prefix;
+  guint weight;
 
   if (!channel)
     return FALSE;
@@ -776,7 +837,8 @@ on_transport_recv (CockpitTransport *transport,
       string = g_strdup_printf ("%s\n", channel);
       prefix = g_bytes_new_take (string, strlen (string));
       data_type = GPOINTER_TO_INT (g_hash_table_lookup (socket->channels, channel));
-      web_socket_connection_send (socket->connection, data_type, prefix, payload);
+      lane = cockpit_socket_lookup_lane (socket, channel, &weight);
+      web_socket_connection_send_lane (socket->connection, data_type, prefix, payload, lane, weight);
       g_bytes_unref (prefix);
       return TRUE;
     }
@@ -906,6 +968,8 @@ process_and_relay_open (CockpitWebService *self,
                         JsonObject *options)
 {
   WebSocketDataType data_type = WEB_SOCKET_DATA_TEXT;
+  const gchar *payload_type;
+  gboolean stream = FALSE;
   GBytes *payload;
 
   if (self->closing)
@@ -929,8 +993,14 @@ process_and_relay_open (CockpitWebService *self,
   if (!cockpit_web_service_parse_binary (options, &data_type))
     return FALSE;
 
+  if (cockpit_json_get_string (options, "payload", NULL, &payload_type) && payload_type)
+    stream = g_strv_contains (stream_payloads, payload_type);
+
   if (socket)
-    cockpit_socket_add_channel (&self->sockets, socket, channel, data_type);
+    {
+      cockpit_socket_add_channel (&self->sockets, socket, channel, data_type, stream,
+                                  cockpit_transport_parse_priority (options));
+    }
 
   if (!self->sent_done)
     {
@@ -1107,6 +1177,90 @@ on_web_socket_message (WebSocketConnection *connection,
     }
 }
 
+static void
+relay_partial_message (CockpitWebService *self,
+                       const gchar *channel,
+                       gconstpointer data,
+                       gsize length)
+{
+  GBytes *payload;
+
+  if (length == 0 || self->closing || self->sent_done)
+    return;
+
+  payload = g_bytes_new (data, length);
+  cockpit_transport_send (self->transport, channel, payload);
+  g_bytes_unref (payload);
+}
+
+static void
+on_web_socket_partial_message (WebSocketConnection *connection,
+                               WebSocketDataType type,
+                               GBytes *message,
+                               gboolean final,
+                               CockpitWebService *self)
+{
+  CockpitSocket *socket;
+  const guint8 *data;
+  const guint8 *line;
+  GBytes *complete;
+  gsize length;
+  gsize offset;
+
+  socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
+  g_return_if_fail (socket != NULL);
+
+  data = g_bytes_get_data (message, &length);
+
+  /* Already sending this message to a channel, as it arrives */
+  if (socket->partial_channel)
+    {
+      relay_partial_message (self, socket->partial_channel, data, length);
+      if (final)
+        g_clear_pointer (&socket->partial_channel, g_free);
+      return;
+    }
+
+  if (!socket->partial)
+    socket->partial = g_byte_array_new ();
+  g_byte_array_append (socket->partial, data, length);
+
+  /*
+   * Once we know the channel, the rest of a message for a stream can be
+   * sent on in separate frames. Anything else has to be assembled, for
+   * example control messages or JSON.
+   */
+  line = memchr (socket->partial->data, '\n', socket->partial->len);
+  if (line && line != socket->partial->data && !final)
+    {
+      offset = line - socket->partial->data;
+      socket->partial_channel = g_strndup ((gchar *)socket->partial->data, offset);
+      if (g_hash_table_contains (socket->streams, socket->partial_channel))
+        {
+          relay_partial_message (self, socket->partial_channel, line + 1, socket->partial->len - (offset + 1));
+          g_clear_pointer (&socket->partial, g_byte_array_unref);
+          return;
+        }
+      g_clear_pointer (&socket->partial_channel, g_free);
+    }
+
+  if (socket->partial->len > MAX_PARTIAL_MESSAGE)
+    {
+      g_message ("%s: received message too large to assemble", socket->id);
+      g_clear_pointer (&socket->partial, g_byte_array_unref);
+      web_socket_connection_close (connection, WEB_SOCKET_CLOSE_TOO_BIG, "message-too-large");
+      return;
+    }
+
+  if (final)
+    {
+      complete = g_byte_array_free_to_bytes (socket->partial);
+      socket->partial = NULL;
+      on_web_socket_message (connection, type, complete, self);
+      g_bytes_unref (complete);
+    }
+}
+
 static void
 on_web_socket_open (WebSocketConnection *connection,
                     CockpitWebService *self)
@@ -1150,6 +1304,8 @@ on_web_socket_open (WebSocketConnection *connection,
 
   g_signal_connect (connection, "message",
                     G_CALLBACK (on_web_socket_message), self);
+  g_signal_connect (connection, "partial-message",
+                    G_CALLBACK (on_web_socket_partial_message), self);
 }
 
 static gboolean
@@ -1311,6 +1467,7 @@ cockpit_web_service_create_socket (const gchar **protocols,
   gchar *origin = NULL;
   gchar *defaults[2];
   gboolean is_https;
+  guint threshold;
   gchar *url;
 
   g_return_val_if_fail (path != NULL, NULL);
@@ -1351,6 +1508,16 @@ cockpit_web_service_create_socket (const gchar **protocols,
 
   connection = web_socket_server_new_for_stream (url, origins, protocols,
                                                  io_stream, headers, input_buffer);
+
+  /* The handshake happens later, from the main loop */
+  if (cockpit_conf_bool ("WebService", "WebSocketCompression", FALSE))
+    {
+      g_object_get (connection, "compression-threshold", &threshold, NULL);
+      threshold = cockpit_conf_uint ("WebService", "WebSocketCompressionThreshold",
+                                     threshold, G_MAXUINT, 0);
+      g_object_set (connection, "compression", TRUE, "compression-threshold", threshold, NULL);
+    }
+
   g_free (allocated);
   g_free (url);
   g_free (origin);
@@ -1388,6 +1555,18 @@ cockpit_web_service_socket (CockpitWebService *self,
   g_signal_connect (connection, "closing", G_CALLBACK (on_web_socket_closing), self);
   g_signal_connect (connection, "close", G_CALLBACK (on_web_socket_close), self);
 
+  /*
+   * Large uploads are passed on to the bridge in pieces, and we stop
+   * reading such an upload from the browser while the bridge falls
+   * behind. Other messages, and pings, are still read meanwhile.
+   */
+  g_object_set (connection, "streaming", TRUE, NULL);
+  if (COCKPIT_IS_PIPE_TRANSPORT (self->transport))
+    {
+      cockpit_flow_throttle (COCKPIT_FLOW (connection),
+                             COCKPIT_FLOW (cockpit_pipe_transport_get_pipe (COCKPIT_PIPE_TRANSPORT (self->transport))));
+    }
+
   cockpit_socket_track (&self->sockets, connection);
   g_object_unref (connection);
 
@@ -643,8 +643,8 @@ test_resource_checksum (TestResourceCase *tc,
 }
 
 static void
-test_resource_not_modified (TestResourceCase *tc,
-                            gconstpointer data)
+assert_not_modified (TestResourceCase *tc,
+                     const gchar *if_none_match)
 {
   CockpitWebResponse *response;
   GError *error = NULL;
@@ -656,8 +656,7 @@ test_resource_not_modified (TestResourceCase *tc,
 
   request_checksum (tc);
 
-  g_hash_table_insert (tc->headers, g_strdup ("If-None-Match"),
-                       g_strdup ("\"" CHECKSUM "-c\""));
+  g_hash_table_insert (tc->headers, g_strdup ("If-None-Match"), g_strdup (if_none_match));
 
   response = cockpit_web_response_new (tc->io, "/unused", "/unused", NULL, tc->headers, COCKPIT_WEB_RESPONSE_NONE);
   cockpit_channel_response_serve (tc->service, tc->headers, response,
@@ -677,6 +676,21 @@ test_resource_not_modified (TestResourceCase *tc,
   g_object_unref (response);
 }
 
+static void
+test_resource_not_modified (TestResourceCase *tc,
+                            gconstpointer data)
+{
+  assert_not_modified (tc, "\"" CHECKSUM "-c\"");
+}
+
+static void
+test_resource_not_modified_weak (TestResourceCase *tc,
+                                 gconstpointer data)
+{
+  /* What a client got along with a compressed response */
+  assert_not_modified (tc, "W/\"" CHECKSUM "-c\"");
+}
+
 static void
 test_resource_not_modified_new_language (TestResourceCase *tc,
                                          gconstpointer data)
@@ -1118,6 +1132,8 @@ main (int argc,
               setup_resource, test_resource_checksum, teardown_resource);
   g_test_add ("/web-channel/resource/not-modified", TestResourceCase, &checksum_fixture,
               setup_resource, test_resource_not_modified, teardown_resource);
+  g_test_add ("/web-channel/resource/not-modified-weak", TestResourceCase, &checksum_fixture,
+              setup_resource, test_resource_not_modified_weak, teardown_resource);
   g_test_add ("/web-channel/resource/not-modified-new-language", TestResourceCase, &checksum_fixture,
               setup_resource, test_resource_not_modified_new_language, teardown_resource);
   g_test_add ("/web-channel/resource/not-modified-cookie-language", TestResourceCase, &checksum_fixture,
@@ -38,6 +38,7 @@
 
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 
 /* Mock override from cockpitconf.c */
 extern const gchar *cockpit_config_file;
@@ -596,6 +597,113 @@ test_echo_large (TestCase *test,
   close_client_and_stop_web_service (test, ws, service);
 }
 
+typedef struct {
+  gsize echoed;
+  gboolean pong;
+} StreamEchoes;
+
+static void
+on_message_count_echoes (WebSocketConnection *ws,
+                         WebSocketDataType type,
+                         GBytes *message,
+                         gpointer user_data)
+{
+  StreamEchoes *echoes = user_data;
+  const gchar *data;
+  const gchar *line;
+  gsize length;
+
+  data = g_bytes_get_data (message, &length);
+  line = memchr (data, '\n', length);
+  g_assert (line != NULL);
+
+  /* Control messages have an empty channel */
+  if (line == data)
+    {
+      if (g_strstr_len (data, length, "\"pong\""))
+        echoes->pong = TRUE;
+    }
+  else
+    {
+      echoes->echoed += length - (line + 1 - data);
+    }
+}
+
+static gboolean
+on_timeout_set_flag (gpointer data)
+{
+  gboolean *flag = data;
+  *flag = TRUE;
+  return FALSE;
+}
+
+static void
+test_stream_throttle (TestCase *test,
+                      gconstpointer data)
+{
+  const gsize echo_size = 100 * 1000;
+  const gsize stream_size = 4 * 1024 * 1024;
+  StreamEchoes echoes = { 0, };
+  WebSocketConnection *ws;
+  CockpitWebService *service;
+  CockpitPipe *pipe;
+  gboolean waited = FALSE;
+  GBytes *message;
+  gchar *contents;
+  gsize queued;
+  guint i;
+
+  start_web_service_and_create_client (test, data, &ws, &service);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (ws) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert (web_socket_connection_get_ready_state (ws) == WEB_SOCKET_STATE_OPEN);
+  g_signal_connect (ws, "message", G_CALLBACK (on_message_count_echoes), &echoes);
+
+  send_control_message (ws, "init", NULL, BUILD_INTS, "version", 1, NULL);
+  send_control_message (ws, "open", "e", "payload", "echo", NULL);
+  send_control_message (ws, "open", "s", "payload", "stream", NULL);
+
+  /* The bridge stops reading, so everything sent to it queues up */
+  pipe = cockpit_pipe_transport_get_pipe (COCKPIT_PIPE_TRANSPORT (test->mock_bridge));
+  g_assert_cmpint (kill (test->mock_bridge_pid, SIGSTOP), ==, 0);
+
+  /* Plain messages and pings are still read, while the pipe is under pressure */
+  contents = g_strnfill (echo_size, '?');
+  contents[0] = 'e'; /* channel */
+  contents[1] = '\n';
+  message = g_bytes_new_take (contents, echo_size);
+  for (i = 0; i < 12; i++)
+    web_socket_connection_send (ws, WEB_SOCKET_DATA_TEXT, NULL, message);
+  g_bytes_unref (message);
+
+  send_control_message (ws, "ping", NULL, NULL);
+  WAIT_UNTIL (echoes.pong);
+  queued = cockpit_pipe_get_queued (pipe);
+  g_assert_cmpuint (queued, >=, 1024 * 1024);
+
+  /* But only a little of a large message for a stream gets read */
+  contents = g_strnfill (stream_size, '!');
+  contents[0] = 's'; /* channel */
+  contents[1] = '\n';
+  message = g_bytes_new_take (contents, stream_size);
+  web_socket_connection_send (ws, WEB_SOCKET_DATA_TEXT, NULL, message);
+  g_bytes_unref (message);
+
+  g_timeout_add (500, on_timeout_set_flag, &waited);
+  WAIT_UNTIL (waited);
+
+  if (g_test_perf ())
+    g_test_minimized_result (cockpit_pipe_get_queued (pipe) - queued, "stream queued %" G_GSIZE_FORMAT " bytes",
+                             cockpit_pipe_get_queued (pipe) - queued);
+  g_assert_cmpuint (cockpit_pipe_get_queued (pipe), <, queued + 512 * 1024);
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (ws), >, 1024 * 1024);
+
+  /* Once the bridge catches up, the rest of the message goes through */
+  g_assert_cmpint (kill (test->mock_bridge_pid, SIGCONT), ==, 0);
+  WAIT_UNTIL (echoes.echoed == 12 * (echo_size - 2) + (stream_size - 2));
+
+  close_client_and_stop_web_service (test, ws, service);
+}
+
 static void
 test_close_error (TestCase *test,
                   gconstpointer data)
@@ -1314,6 +1422,8 @@ main (int argc,
               &fixture_rfc6455, setup_for_socket,
               test_echo_large, teardown_for_socket);
 
+  g_test_add ("/web-service/stream-throttle", TestCase, NULL,
+              setup_for_socket, test_stream_throttle, teardown_for_socket);
   g_test_add ("/web-service/null-creds", TestCase, NULL,
               setup_for_socket, test_socket_null_creds, teardown_for_socket);
   g_test_add ("/web-service/no-init", TestCase, NULL,